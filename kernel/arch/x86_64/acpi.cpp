@@ -0,0 +1,229 @@
+#include <string.h>
+#include "acpi.h"
+#include "mmu.h"
+
+Acpi acpi;
+
+namespace {
+
+#pragma pack(push, 1)
+struct Rsdp {
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision; // 2 and up have the extended fields
+    uint32_t rsdt_address;
+    // revision 2
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+};
+
+struct Madt {
+    AcpiHeader header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    // followed by variable length entries
+};
+
+struct MadtEntry {
+    enum Type: uint8_t {
+        LocalApic = 0,
+        IoApic = 1,
+        InterruptSourceOverride = 2,
+        LapicAddressOverride = 5,
+        LocalX2Apic = 9,
+    };
+    uint8_t type;
+    uint8_t length;
+};
+
+struct MadtLocalApic {
+    MadtEntry entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+};
+
+struct MadtLocalX2Apic {
+    MadtEntry entry;
+    uint16_t reserved;
+    uint32_t apic_id;
+    uint32_t flags;
+    uint32_t processor_uid;
+};
+
+struct MadtIoApic {
+    MadtEntry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+};
+
+struct MadtInterruptSourceOverride {
+    MadtEntry entry;
+    uint8_t bus; // 0, ISA
+    uint8_t source; // the irq
+    uint32_t gsi;
+    uint16_t flags;
+};
+
+struct MadtLapicAddressOverride {
+    MadtEntry entry;
+    uint16_t reserved;
+    uint64_t address;
+};
+struct Mcfg {
+    AcpiHeader header;
+    uint64_t reserved;
+    // followed by allocation entries
+};
+
+struct McfgAllocation {
+    uint64_t base;
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+};
+#pragma pack(pop)
+
+constexpr uint32_t madt_enabled = 1 << 0;
+constexpr uint32_t madt_online_capable = 1 << 1;
+
+bool checksum_ok(const void* data, size_t length) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += static_cast<const uint8_t*>(data)[i];
+    }
+    return sum == 0;
+}
+
+// the RSDP sits on a 16 byte boundary
+const Rsdp* scan_rsdp(uint64_t begin, uint64_t end) {
+    for (uint64_t p = begin; p + sizeof(Rsdp) <= end; p += 16) {
+        auto rsdp = static_cast<const Rsdp*>(ptl(p));
+        if (!memcmp(rsdp->signature, "RSD PTR ", 8) && checksum_ok(rsdp, 20)) {
+            return rsdp;
+        }
+    }
+    return nullptr;
+}
+
+}
+
+bool Acpi::init() {
+    // first KiB of the EBDA, then the BIOS read only area
+    uint64_t const ebda = uint64_t(*static_cast<const uint16_t*>(ptl(0x40e))) << 4;
+    const Rsdp* rsdp = ebda ? scan_rsdp(ebda, ebda + 0x400) : nullptr;
+    if (!rsdp) {
+        rsdp = scan_rsdp(0xe0000, 0x100000);
+    }
+    if (!rsdp) {
+        return false;
+    }
+    if (rsdp->revision >= 2 && rsdp->xsdt_address && checksum_ok(rsdp, rsdp->length)) {
+        root = rsdp->xsdt_address;
+        extended = true;
+    } else {
+        root = rsdp->rsdt_address;
+    }
+    return true;
+}
+
+const AcpiHeader* Acpi::find(const char* signature) {
+    if (!root) {
+        return nullptr;
+    }
+    auto sdt = static_cast<const AcpiHeader*>(ptl(root));
+    unsigned const pointer_size = extended ? 8 : 4;
+    unsigned const count = (sdt->length - sizeof(AcpiHeader)) / pointer_size;
+    auto entries = reinterpret_cast<const uint8_t*>(sdt + 1);
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t address = 0;
+        memcpy(&address, entries + i * pointer_size, pointer_size);
+        auto table = static_cast<const AcpiHeader*>(ptl(address));
+        if (!memcmp(table->signature, signature, 4) && checksum_ok(table, table->length)) {
+            return table;
+        }
+    }
+    return nullptr;
+}
+
+bool Acpi::parse_madt(MadtInfo& info) {
+    auto madt = reinterpret_cast<const Madt*>(find("APIC"));
+    if (!madt) {
+        return false;
+    }
+    info.lapic_address = madt->lapic_address;
+    info.cpu_count = 0;
+    info.ioapic_count = 0;
+    info.override_count = 0;
+    auto p = reinterpret_cast<const uint8_t*>(madt + 1);
+    auto const end = reinterpret_cast<const uint8_t*>(madt) + madt->header.length;
+    while (p + sizeof(MadtEntry) <= end) {
+        auto entry = reinterpret_cast<const MadtEntry*>(p);
+        if (entry->length < sizeof(MadtEntry)) {
+            break;
+        }
+        uint32_t apic_id = ~0u;
+        switch (entry->type) {
+        case MadtEntry::LocalApic: {
+            auto lapic = reinterpret_cast<const MadtLocalApic*>(entry);
+            if (lapic->flags & (madt_enabled | madt_online_capable)) {
+                apic_id = lapic->apic_id;
+            }
+            break;
+        }
+        case MadtEntry::LocalX2Apic: {
+            // we drive the apic in xAPIC mode, only 8 bit ids are reachable
+            auto x2apic = reinterpret_cast<const MadtLocalX2Apic*>(entry);
+            if ((x2apic->flags & (madt_enabled | madt_online_capable)) && x2apic->apic_id < 0xff) {
+                apic_id = x2apic->apic_id;
+            }
+            break;
+        }
+        case MadtEntry::IoApic: {
+            auto ioapic = reinterpret_cast<const MadtIoApic*>(entry);
+            if (info.ioapic_count < MadtInfo::max_ioapics) {
+                info.ioapics[info.ioapic_count++] = {ioapic->address, ioapic->gsi_base, ioapic->id};
+            }
+            break;
+        }
+        case MadtEntry::InterruptSourceOverride: {
+            auto source = reinterpret_cast<const MadtInterruptSourceOverride*>(entry);
+            if (source->bus == 0 && info.override_count < MadtInfo::max_overrides) {
+                info.overrides[info.override_count++] = {source->source, source->gsi, source->flags};
+            }
+            break;
+        }
+        case MadtEntry::LapicAddressOverride:
+            info.lapic_address = reinterpret_cast<const MadtLapicAddressOverride*>(entry)->address;
+            break;
+        }
+        if (apic_id != ~0u && info.cpu_count < MAX_CPUS) {
+            info.apic_ids[info.cpu_count++] = apic_id;
+        }
+        p += entry->length;
+    }
+    return true;
+}
+
+bool Acpi::parse_mcfg(McfgInfo& info) {
+    auto mcfg = reinterpret_cast<const Mcfg*>(find("MCFG"));
+    if (!mcfg) {
+        return false;
+    }
+    info.count = 0;
+    auto allocation = reinterpret_cast<const McfgAllocation*>(mcfg + 1);
+    auto const end = reinterpret_cast<const McfgAllocation*>(reinterpret_cast<const uint8_t*>(mcfg) + mcfg->header.length);
+    for (; allocation + 1 <= end && info.count < McfgInfo::max_regions; allocation++) {
+        if (allocation->start_bus > allocation->end_bus) {
+            continue;
+        }
+        info.regions[info.count++] = {allocation->base, allocation->segment, allocation->start_bus, allocation->end_bus};
+    }
+    return info.count > 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#include "cpu.h"
+
+// Just enough ACPI to find the processors, the interrupt controllers and
+// the PCIe configuration space: RSDP, RSDT/XSDT, MADT and MCFG.
+// Tables are read through the linear map, so this must run after the
+// linear map covers the first 4G.
+
+#pragma pack(push, 1)
+struct AcpiHeader {
+    char signature[4];
+    uint32_t length; // of the whole table, header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+};
+#pragma pack(pop)
+
+struct IoApicInfo {
+    uint64_t address; // physical, of the registers
+    uint32_t gsi_base; // global system interrupt of its first input
+    uint8_t id;
+};
+
+// an ISA irq not wired to the IO APIC input with its number, or not edge
+// triggered active high
+struct IsaOverride {
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags; // MPS INTI flags: polarity in bits 0-1, trigger mode in 2-3
+};
+
+// what the MADT says about interrupt controllers
+struct MadtInfo {
+    static constexpr unsigned max_ioapics = 8;
+    static constexpr unsigned max_overrides = 16;
+    uint64_t lapic_address;
+    unsigned cpu_count;
+    uint32_t apic_ids[MAX_CPUS]; // usable processors, the bootstrap one included
+    unsigned ioapic_count;
+    IoApicInfo ioapics[max_ioapics];
+    unsigned override_count;
+    IsaOverride overrides[max_overrides];
+};
+
+// what the MCFG says about PCIe enhanced configuration (ECAM) windows:
+// the configuration space of bus b starts at base + (b << 20)
+struct EcamRegion {
+    uint64_t base; // physical, where bus 0 would be
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+};
+
+struct McfgInfo {
+    static constexpr unsigned max_regions = 8;
+    unsigned count;
+    EcamRegion regions[max_regions];
+};
+
+class Acpi {
+public:
+    // look for the RSDP in the BIOS areas, false if there's no ACPI
+    bool init();
+    // table with the given signature, nullptr if missing or corrupted
+    const AcpiHeader* find(const char* signature);
+    bool parse_madt(MadtInfo& info);
+    // false if there's no MCFG: no ECAM, configuration space through ports
+    bool parse_mcfg(McfgInfo& info);
+
+private:
+    uint64_t root = 0; // physical address of the RSDT or XSDT
+    bool extended = false; // root is an XSDT, 64 bit pointers
+};
+
+extern Acpi acpi;
@@ -0,0 +1,76 @@
+#include "apic.h"
+#include "mmu.h"
+#include "cpu.h"
+
+LocalApic lapic;
+
+namespace {
+constexpr uint32_t svr_enable = 1 << 8;
+constexpr uint32_t icr_delivery_pending = 1 << 12;
+constexpr uint32_t lvt_masked = 1 << 16;
+constexpr uint32_t lvt_tsc_deadline = 2 << 17;
+constexpr uint32_t divide_by_16 = 3;
+constexpr uint32_t MSR_TSC_DEADLINE = 0x6e0;
+}
+
+void LocalApic::init(uint64_t physical_address) {
+    base = static_cast<uint8_t*>(ptl(physical_address));
+}
+
+void LocalApic::enable() {
+    write(SpuriousVector, svr_enable | spurious_vector);
+}
+
+void LocalApic::send_ipi(uint32_t apic_id, uint32_t command) {
+    write(InterruptCommandHigh, apic_id << 24);
+    // writing the low dword sends it
+    write(InterruptCommandLow, command);
+    while (read(InterruptCommandLow) & icr_delivery_pending) {
+        asm volatile("pause");
+    }
+}
+
+void LocalApic::init_timer(uint8_t vector) {
+    deadline_mode = cpuid(1).ecx & (1 << 24);
+    if (deadline_mode) {
+        write(LvtTimer, vector | lvt_tsc_deadline);
+        // the LVT write has to land before the first deadline is armed
+        asm volatile("mfence" : : : "memory");
+        return;
+    }
+    write(TimerDivide, divide_by_16);
+    if (!ticks_per_tsc) {
+        // all cpus run their timers at the same rate, measure it once
+        write(LvtTimer, vector | lvt_masked);
+        write(TimerInitialCount, ~0u);
+        uint64_t const start = rdtsc();
+        while (rdtsc() - start < 10000000) {
+            asm volatile("pause");
+        }
+        uint32_t const ticks = ~0u - read(TimerCurrentCount);
+        uint64_t const elapsed = rdtsc() - start;
+        write(TimerInitialCount, 0);
+        ticks_per_tsc = (uint64_t{ticks} << 32) / elapsed;
+    }
+    write(LvtTimer, vector);
+}
+
+void LocalApic::arm_timer(uint64_t deadline) {
+    if (deadline_mode) {
+        // 0 would disarm it
+        wrmsr(MSR_TSC_DEADLINE, deadline ? deadline : 1);
+        return;
+    }
+    uint64_t const now = rdtsc();
+    uint64_t const ticks = deadline > now ? static_cast<uint64_t>(static_cast<unsigned __int128>(deadline - now) * ticks_per_tsc >> 32) : 0;
+    // 0 stops the countdown, a long wait just takes a few rounds
+    write(TimerInitialCount, ticks < 1 ? 1 : ticks > ~0u ? ~0u : ticks);
+}
+
+void LocalApic::disarm_timer() {
+    if (deadline_mode) {
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    } else {
+        write(TimerInitialCount, 0);
+    }
+}
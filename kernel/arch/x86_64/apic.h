@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+
+// Local APIC, in xAPIC (memory mapped) mode. Registers are reached
+// through the linear map: the MTRRs make that range uncacheable.
+class LocalApic {
+public:
+    enum Register: uint32_t {
+        Id = 0x20,
+        Eoi = 0xb0,
+        SpuriousVector = 0xf0,
+        ErrorStatus = 0x280,
+        InterruptCommandLow = 0x300,
+        InterruptCommandHigh = 0x310,
+        LvtTimer = 0x320,
+        TimerInitialCount = 0x380,
+        TimerCurrentCount = 0x390,
+        TimerDivide = 0x3e0,
+    };
+    static constexpr uint8_t spurious_vector = 0xff;
+
+    // physical address of the registers, from the MADT
+    void init(uint64_t physical_address);
+    // software enable the apic of the calling cpu
+    void enable();
+    uint32_t id() { return read(Id) >> 24; }
+    void eoi() { write(Eoi, 0); }
+    // send an interprocessor interrupt, command is the low ICR dword
+    void send_ipi(uint32_t apic_id, uint32_t command);
+    bool present() { return base != nullptr; }
+
+    // The timer, one shot. TSC-deadline mode when the cpu has it, otherwise
+    // a countdown at a rate measured against the TSC on the first call.
+    // Every cpu calls it for its own apic
+    void init_timer(uint8_t vector);
+    // interrupt when the TSC reaches deadline (right away if it's past)
+    void arm_timer(uint64_t deadline);
+    void disarm_timer();
+    bool tsc_deadline() { return deadline_mode; }
+
+    uint32_t read(Register reg) {
+        return *reinterpret_cast<volatile uint32_t*>(base + reg);
+    }
+    void write(Register reg, uint32_t value) {
+        *reinterpret_cast<volatile uint32_t*>(base + reg) = value;
+    }
+
+private:
+    uint8_t* base = nullptr;
+    bool deadline_mode = false;
+    uint64_t ticks_per_tsc = 0; // countdown ticks per TSC tick, fixed point 32.32
+};
+
+extern LocalApic lapic;
@@ -1,5 +1,9 @@
 #include "../../console.hpp"
+#include <string.h>
 #include <kernel/tty.h>
+#include "serial.h"
+#include "mmu.h"
+#include "../../printk.hpp"
 
 Console console;
 
@@ -72,7 +76,7 @@ void Console::moveCursor(int x, int y)
 void Console::moveCursor(uint16_t pos)
 {
     setCursor(pos);
-    updateCursor();
+    flush();
 }
 
 void Console::updateCursor()
@@ -103,20 +107,118 @@ void Console::updateCursor()
         :
         : "X"(cursorPosition)
         : "cc", "%rax", "%rbx", "%rdx");
+    shownCursor = cursorPosition;
+}
+
+void Console::flush()
+{
+    flushMirror();
+    if (view != shownView)
+    {
+        markDirty(0, screen_height - 1);
+        shownView = view;
+    }
+    // dirty rows are contiguous in the ring unless it wraps: one or two copies
+    for (int row = dirtyFirst; row <= dirtyLast;)
+    {
+        int first = (top - view + row) & (scrollback_lines - 1);
+        int count = dirtyLast - row + 1;
+        if (count > scrollback_lines - first)
+        {
+            count = scrollback_lines - first;
+        }
+        memcpy(vram_base_address() + row * screen_width, lines[first], count * sizeof(lines[0]));
+        row += count;
+    }
+    dirtyFirst = screen_height;
+    dirtyLast = 0;
+    if (cursorPosition != shownCursor)
+    {
+        updateCursor();
+    }
+}
+
+void Console::scrollView(int count)
+{
+    int target = view + count;
+    view = target < 0 ? 0 : target > history ? history : target;
+    flush();
+}
+
+void Console::clearLine(int row)
+{
+    VGACell blank;
+    blank.character = ' ';
+    blank.pen = pen;
+    auto cells = line(row);
+    for (int i = 0; i < screen_width; i++)
+    {
+        cells[i] = blank;
+    }
+    markDirty(row, row);
+}
+
+void Console::scroll()
+{
+    top = (top + 1) & (scrollback_lines - 1);
+    if (history < scrollback_lines - screen_height)
+    {
+        history++;
+    }
+    clearLine(screen_height - 1);
+    markDirty(0, screen_height - 1);
 }
 
 void Console::outChar(char c)
 {
-    auto &cell = cellAt(cursorPosition);
+    int row = cursorPosition / screen_width;
+    auto &cell = line(row)[cursorPosition % screen_width];
     cell.character = c;
     cell.pen = pen;
-    setCursor(cursorPosition + 1);
+    markDirty(row, row);
+    mirrorChar(c);
+    // new output brings the view back to the bottom
+    view = 0;
+    if (cursorPosition % screen_width == screen_width - 1)
+    {
+        carriageReturn();
+        lineFeed();
+    }
+    else
+    {
+        cursorPosition++;
+    }
 }
 
 void Console::lineFeed()
 {
-    setCursor(cursorPosition + screen_width);
+    view = 0;
+    if (cursorPosition + screen_width >= buffer_size)
+    {
+        scroll();
+    }
+    else
+    {
+        cursorPosition += screen_width;
+    }
+}
+void Console::newLine()
+{
+    mirrorChar('\r');
+    mirrorChar('\n');
+    carriageReturn();
+    lineFeed();
+}
+
+void Console::flushMirror()
+{
+    if (mirrorLength)
+    {
+        mirror(mirrorBuffer, mirrorLength);
+        mirrorLength = 0;
+    }
 }
+
 void Console::carriageReturn()
 {
     setCursor(cursorPosition - cursorPosition % screen_width);
@@ -126,20 +228,25 @@ void Console::writeData(char const *c, size_t length)
 {
     while (length--)
     {
-        switch (char out = *c)
+        switch (char out = *c++)
         {
         case '\n':
-            carriageReturn();
-            lineFeed();
+            newLine();
             break;
         default:
             outChar(out);
         }
     }
-    updateCursor();
+    flush();
 }
 
 void Console::writeString(char const *c)
+{
+    putString(c);
+    flush();
+}
+
+void Console::putString(char const *c)
 {
     char out;
     while (out = *c++)
@@ -147,14 +254,12 @@ void Console::writeString(char const *c)
         switch (out)
         {
         case '\n':
-            carriageReturn();
-            lineFeed();
+            newLine();
             break;
         default:
             outChar(out);
         }
     }
-    updateCursor();
 }
 
 void Console::writeChar(char c)
@@ -162,139 +267,82 @@ void Console::writeChar(char c)
     switch (c)
     {
     case '\n':
-        carriageReturn();
-        lineFeed();
+        newLine();
         break;
     default:
         outChar(c);
     }
-    updateCursor();
+    flush();
 }
 
 void Console::writeNumber(int64_t number, int minWidth, int base)
 {
-    // allocate a buffer large enough.
-    char buffer[65] = {0};
-    // remember to write minus for negative numbers
+    char buffer[24];
+    char *end = buffer + sizeof(buffer);
     bool negative = number < 0;
-    if (negative)
+    char *cursor = format::format_unsigned(end, negative ? -static_cast<uint64_t>(number) : number, base);
+    while (end - cursor < minWidth)
     {
-        number = -number;
-    }
-    // fill in buffer, from the right
-    char *cursor = buffer + 64;
-    while (number > 0)
-    {
-        auto value = number % base;
-        number = number / base;
-        if (value > 9)
-        {
-            *(--cursor) = 'a' + value - 10;
-        }
-        else
-        {
-            *(--cursor) = '0' + value;
-        }
+        *--cursor = '0';
     }
-    while (cursor - buffer + minWidth > 64)
+    if (negative)
     {
-        *--cursor = '0';
+        *--cursor = '-';
     }
-    writeString(cursor);
+    writeData(cursor, end - cursor);
 }
 
-const char *Console::_printf(const char *format, char const *arg)
+void Console::sink(void *console, const char *data, size_t length)
 {
-    while (char out = *format++)
-    {
-        switch (out)
-        {
-        case '\n':
-            carriageReturn();
-            lineFeed();
-            break;
-        case '%':
-            switch (char control = *format++)
-            {
-            case '%':
-                outChar('%');
-                break;
-            case 's':
-                writeString(arg);
-                return format;
-            default:
-                outChar(out);
-                outChar(control);
-                return format;
-            }
-            break;
-        default:
-            outChar(out);
-        }
-    }
-    return format - 1;
+    static_cast<Console *>(console)->writeData(data, length);
 }
 
-const char *Console::_printf(const char *format, int64_t arg)
+void Console::print(const char *str, const format::Segment *segments, int count, const format::Arg *args)
 {
-    while (char out = *format++)
-    {
-        switch (out)
-        {
-        case '\n':
-            carriageReturn();
-            lineFeed();
-            break;
-        case '%':
-            int minWidth;
-            minWidth = 0;
-            char control;
-            control = *format++;
-            while (control >= '0' && control <= '9')
-            {
-                minWidth *= 10;
-                minWidth += control - '0';
-                control = *format++;
-            }
-
-            switch (control)
-            {
-            case '%':
-                outChar('%');
-                break;
-            case 'd':
-                writeNumber(arg, minWidth ? minWidth : 1);
-                return format;
-            case 'x':
-                writeNumber(arg, minWidth ? minWidth : 1, 16);
-                return format;
-            default:
-                outChar(out);
-                outChar(control);
-                return format;
-            }
-            break;
-        default:
-            outChar(out);
-        }
-    }
-    return format - 1;
+    format::Output out{sink, this};
+    format::format_segments(out, str, segments, count, args);
+    out.flush();
+}
+
+void Console::vprintf(const char *format, const format::Arg *args, int count)
+{
+    format::Output out{sink, this};
+    format::format_runtime(out, format, args, count);
+    out.flush();
 }
 
 void Console::initialize()
 {
     cursorPosition = 0;
+    shownCursor = buffer_size; // not known, update at the first flush
     pen = 0x7;
+    top = 0;
+    history = 0;
+    view = shownView = 0;
+    dirtyFirst = screen_height;
+    dirtyLast = 0;
+    mirror = nullptr;
+    mirrorLength = 0;
+    // the boot tables map the linear window with 1gb pages, not every cpu
+    // has those: identity until the kernel vspace is set up
+    vram = reinterpret_cast<VGACell*>(0xb8000ull);
+    // start from what the bootloader left on screen
+    memcpy(lines, vram_base_address(), buffer_size * sizeof(VGACell));
+}
+
+void Console::useLinearMap()
+{
+    vram = static_cast<VGACell*>(ptl(0xb8000));
 }
 
 void Console::clearScreen()
 {
-    auto range_begin = reinterpret_cast<uint64_t *>(vram_base_address());
-    auto range_end = range_begin + (buffer_size / 4);
-    for (auto i = range_begin; i < range_end; i++)
+    for (int row = 0; row < screen_height; row++)
     {
-        *i = 0;
+        clearLine(row);
     }
+    view = 0;
+    flush();
 }
 
 void
@@ -312,3 +360,9 @@ void terminal_write(const char* data, size_t size) {
 void terminal_writestring(const char* data) {
     console.writeString(data);
 }
+
+void terminal_flush() {
+    printk_drain();
+    console.flush();
+    com1.drain();
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include <cstdint>
+
+// upper bound on the number of processors we keep per-cpu state for
+constexpr unsigned MAX_CPUS = 64;
+
+// Per-cpu data, reached through the GS base (IA32_GS_BASE) while running in
+// the kernel. IA32_KERNEL_GS_BASE holds the user value, so that entry points
+// coming from user space only need a swapgs. Offsets are used from asm.
+struct PerCpu {
+    PerCpu* self; // %gs:0
+    unsigned index; // %gs:8, in [0, MAX_CPUS)
+    uint32_t apic_id;
+    uint64_t kernel_stack; // %gs:16, top of the running thread's kernel stack
+    uint64_t user_rsp; // %gs:24, scratch for the syscall entry
+    bool online;
+};
+static_assert(__builtin_offsetof(PerCpu, index) == 8 && __builtin_offsetof(PerCpu, kernel_stack) == 16 &&
+    __builtin_offsetof(PerCpu, user_rsp) == 24, "PerCpu offsets are used from asm");
+
+extern PerCpu per_cpu[MAX_CPUS];
+
+inline PerCpu* this_cpu() {
+    PerCpu* cpu;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// index of the executing processor
+inline unsigned cpu_index() {
+    unsigned index;
+    asm volatile("movl %%gs:8, %0" : "=r"(index));
+    return index;
+}
+
+struct CpuidResult {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+};
+
+inline CpuidResult cpuid(uint32_t leaf, uint32_t subleaf = 0) {
+    CpuidResult r;
+    asm volatile("cpuid"
+        : "=a"(r.eax), "=b"(r.ebx), "=c"(r.ecx), "=d"(r.edx)
+        : "a"(leaf), "c"(subleaf));
+    return r;
+}
+
+// 1gb pages in the PDPT (extended leaf 0x80000001, edx bit 26)
+inline bool cpu_has_pdpe1gb() {
+    return cpuid(0x80000000).eax >= 0x80000001 && (cpuid(0x80000001).edx & (1 << 26));
+}
+
+// process context identifiers (leaf 1, ecx bit 17)
+inline bool cpu_has_pcid() {
+    return cpuid(1).ecx & (1 << 17);
+}
+
+// invpcid instruction (leaf 7, ebx bit 10)
+inline bool cpu_has_invpcid() {
+    return cpuid(0).eax >= 7 && (cpuid(7).ebx & (1 << 10));
+}
+
+constexpr uint32_t MSR_EFER = 0xc0000080;
+constexpr uint32_t MSR_STAR = 0xc0000081;
+constexpr uint32_t MSR_LSTAR = 0xc0000082;
+constexpr uint32_t MSR_SFMASK = 0xc0000084;
+constexpr uint32_t MSR_GS_BASE = 0xc0000101;
+constexpr uint32_t MSR_KERNEL_GS_BASE = 0xc0000102;
+
+inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return (uint64_t{hi} << 32) | lo;
+}
+
+inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"(uint32_t(value)), "d"(uint32_t(value >> 32)) : "memory");
+}
+
+constexpr uint64_t CR4_PGE = 1ull << 7;
+constexpr uint64_t CR4_PCIDE = 1ull << 17;
+
+inline uint64_t read_cr4() {
+    uint64_t value;
+    asm volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+inline void write_cr4(uint64_t value) {
+    asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+inline uint64_t read_cr3() {
+    uint64_t value;
+    asm volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+enum class InvpcidType: uint64_t {
+    Address = 0, // one address in one pcid
+    Context = 1, // everything in one pcid, except globals
+    All = 2, // everything, including globals
+    AllButGlobal = 3, // every pcid, except globals
+};
+
+inline void invpcid(InvpcidType type, uint64_t pcid, uint64_t address = 0) {
+    struct {
+        uint64_t pcid;
+        uint64_t address;
+    } descriptor = {pcid, address};
+    asm volatile("invpcid %0, %1" : : "m"(descriptor), "r"(static_cast<uint64_t>(type)) : "memory");
+}
+
+inline uint8_t inb(uint16_t port) {
+    uint8_t value;
+    asm volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+inline void outb(uint16_t port, uint8_t value) {
+    asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+inline uint16_t inw(uint16_t port) {
+    uint16_t value;
+    asm volatile("inw %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+inline void outw(uint16_t port, uint16_t value) {
+    asm volatile("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    asm volatile("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+inline void outl(uint16_t port, uint32_t value) {
+    asm volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (uint64_t{hi} << 32) | lo;
+}
+
+// keeps interrupts disabled on this cpu for the lifetime of the scope,
+// restoring the previous state afterwards. Per-cpu data is only safe to
+// touch while holding one of these.
+class IrqGuard {
+    uint64_t flags;
+public:
+    IrqGuard() {
+        asm volatile(R"(
+            pushfq
+            popq %0
+            cli
+        )" : "=r"(flags) : : "memory");
+    }
+    ~IrqGuard() {
+        if (flags & (1 << 9)) {
+            asm volatile("sti" : : : "memory");
+        }
+    }
+    IrqGuard(const IrqGuard&) = delete;
+    IrqGuard& operator = (const IrqGuard&) = delete;
+};
@@ -0,0 +1,169 @@
+#include <new>
+#include <string.h>
+#include "fpu.h"
+#include "../../slab.hpp"
+#include "../../printk.hpp"
+
+namespace {
+
+enum class SaveMode: uint8_t {
+    FxSave,
+    XSave,
+    XSaveOpt,
+    XSaves,
+};
+const char* const mode_names[] = {"fxsave", "xsave", "xsaveopt", "xsaves"};
+
+// XCR0 components
+constexpr uint64_t XSTATE_X87 = 1 << 0;
+constexpr uint64_t XSTATE_SSE = 1 << 1;
+constexpr uint64_t XSTATE_AVX = 1 << 2;
+constexpr uint64_t XSTATE_AVX512 = 7 << 5; // opmask, upper halves of zmm0-15, zmm16-31
+
+constexpr uint64_t CR4_OSXSAVE = 1ull << 18;
+constexpr uint32_t MSR_XSS = 0xda0;
+constexpr uint16_t FCW_INIT = 0x37f;
+constexpr uint32_t MXCSR_INIT = 0x1f80;
+constexpr size_t legacy_size = 512; // FXSAVE area, and start of the XSAVE one
+constexpr size_t header_size = 64;
+
+SaveMode mode = SaveMode::FxSave;
+uint64_t xcr0;
+bool has_xinuse; // xgetbv 1
+size_t state_size = legacy_size;
+alignas(kernel::SlabCache) unsigned char cache_storage[sizeof(kernel::SlabCache)];
+kernel::SlabCache* state_cache;
+// registers after reset, restoring it is how state gets reinitialized
+alignas(64) unsigned char init_state[legacy_size + header_size];
+
+uint64_t xgetbv(uint32_t index) {
+    uint32_t lo, hi;
+    asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return (uint64_t{hi} << 32) | lo;
+}
+
+void xsetbv(uint32_t index, uint64_t value) {
+    asm volatile("xsetbv" : : "c"(index), "a"(uint32_t(value)), "d"(uint32_t(value >> 32)));
+}
+
+void enable_xsave() {
+    if (mode == SaveMode::FxSave) {
+        return;
+    }
+    write_cr4(read_cr4() | CR4_OSXSAVE);
+    xsetbv(0, xcr0);
+    if (mode == SaveMode::XSaves) {
+        // no supervisor components
+        wrmsr(MSR_XSS, 0);
+    }
+}
+
+}
+
+void fpu_init() {
+    bool const xsave = cpuid(1).ecx & (1 << 26);
+    if (xsave && cpuid(0).eax >= 0xd) {
+        auto const leaf = cpuid(0xd, 0);
+        uint64_t const supported = leaf.eax | uint64_t{leaf.edx} << 32;
+        xcr0 = XSTATE_X87 | XSTATE_SSE;
+        if ((cpuid(1).ecx & (1 << 28)) && (supported & XSTATE_AVX)) {
+            xcr0 |= XSTATE_AVX;
+            // AVX-512 only as a whole, and only on top of AVX
+            if (cpuid(0).eax >= 7 && (cpuid(7).ebx & (1 << 16)) && (supported & XSTATE_AVX512) == XSTATE_AVX512) {
+                xcr0 |= XSTATE_AVX512;
+            }
+        }
+        auto const extensions = cpuid(0xd, 1).eax;
+        mode = extensions & (1 << 3) ? SaveMode::XSaves : extensions & (1 << 0) ? SaveMode::XSaveOpt : SaveMode::XSave;
+        has_xinuse = extensions & (1 << 2);
+        enable_xsave();
+        // ebx of subleaf 0 is for the standard format and the XCR0 just set,
+        // subleaf 1 for the compacted one
+        state_size = mode == SaveMode::XSaves ? cpuid(0xd, 1).ebx : cpuid(0xd, 0).ebx;
+    }
+
+    // zeroes everywhere but the control words. With XSTATE_BV clear every
+    // component comes out of XRSTOR in its initial state
+    *reinterpret_cast<uint16_t*>(init_state) = FCW_INIT;
+    *reinterpret_cast<uint32_t*>(init_state + 24) = MXCSR_INIT;
+    if (mode == SaveMode::XSaves) {
+        // XCOMP_BV: compacted format
+        *reinterpret_cast<uint64_t*>(init_state + legacy_size + 8) = 1ull << 63 | xcr0;
+    }
+
+    state_cache = new (cache_storage) kernel::SlabCache("fpu state", state_size, 64);
+    fpu_init_cpu();
+    printk(LogLevel::Info, "FPU: %s, components %x, %d byte state areas\n",
+        mode_names[static_cast<int>(mode)], xcr0 ? xcr0 : XSTATE_X87 | XSTATE_SSE, state_size);
+}
+
+void fpu_init_cpu() {
+    enable_xsave();
+    fpu_restore_init();
+}
+
+void* fpu_alloc_state() {
+    return state_cache->alloc();
+}
+
+void fpu_free_state(void* state) {
+    state_cache->free(state);
+}
+
+void fpu_save(void* state) {
+    uint32_t const lo = uint32_t(xcr0), hi = uint32_t(xcr0 >> 32);
+    switch (mode) {
+    case SaveMode::FxSave:
+        asm volatile("fxsave64 (%0)" : : "r"(state) : "memory");
+        break;
+    case SaveMode::XSave:
+        asm volatile("xsave64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+        break;
+    case SaveMode::XSaveOpt:
+        asm volatile("xsaveopt64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+        break;
+    case SaveMode::XSaves:
+        asm volatile("xsaves64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+        break;
+    }
+}
+
+void fpu_restore(void* state) {
+    uint32_t const lo = uint32_t(xcr0), hi = uint32_t(xcr0 >> 32);
+    switch (mode) {
+    case SaveMode::FxSave:
+        asm volatile("fxrstor64 (%0)" : : "r"(state) : "memory");
+        break;
+    case SaveMode::XSave:
+    case SaveMode::XSaveOpt:
+        asm volatile("xrstor64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+        break;
+    case SaveMode::XSaves:
+        asm volatile("xrstors64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+        break;
+    }
+}
+
+void fpu_restore_init() {
+    fpu_restore(init_state);
+}
+
+bool fpu_in_init_state() {
+    return has_xinuse && !(xgetbv(1) & xcr0);
+}
+
+void fpu_save_controls(FpuControls& controls) {
+    asm volatile("stmxcsr %0; fnstcw %1" : "=m"(controls.mxcsr), "=m"(controls.fcw));
+}
+
+void fpu_restore_controls(const FpuControls& controls) {
+    fpu_restore_init();
+    // the usual values are already there, and loading them would mark the
+    // state in use
+    if (controls.mxcsr != MXCSR_INIT) {
+        asm volatile("ldmxcsr %0" : : "m"(controls.mxcsr));
+    }
+    if (controls.fcw != FCW_INIT) {
+        asm volatile("fldcw %0" : : "m"(controls.fcw));
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include "cpu.h"
+
+// Extended register state: x87, SSE, AVX and AVX-512, whatever the cpu has.
+//
+// The kernel is built with SSE, but threads only switch inside schedule(),
+// a function call: by the ABI no vector register survives it, so a switch
+// normally saves nothing but the control words of user threads. Only a thread preempted at an arbitrary point
+// (and, later, one running user code) has live vector state. Even then a
+// thread whose registers are in their initial state (XINUSE, xgetbv 1) is
+// just marked as such, and gets fresh registers when it resumes.
+//
+// State areas come from a slab cache sized at boot from CPUID leaf 0xd,
+// and are saved with the best the cpu has: XSAVES (compacted, init and
+// modified optimizations), XSAVEOPT, XSAVE, or FXSAVE without XSAVE.
+
+// set up the bootstrap processor and the state area cache. Needs the frame allocator
+void fpu_init();
+// XCR0 and friends on an application processor
+void fpu_init_cpu();
+
+// a state area, nullptr if out of memory
+void* fpu_alloc_state();
+void fpu_free_state(void* state);
+void fpu_save(void* state);
+void fpu_restore(void* state);
+// registers in their initial state, as after reset
+void fpu_restore_init();
+// true if no state component is in use, i.e. there's nothing worth saving.
+// Always false when the cpu can't tell
+bool fpu_in_init_state();
+
+// MXCSR and the x87 control word: callee-saved by the ABI, unlike the
+// registers, so they have to survive a switch in a function call too
+struct FpuControls {
+    uint32_t mxcsr;
+    uint16_t fcw;
+};
+void fpu_save_controls(FpuControls& controls);
+// registers in their initial state, but for the control words
+void fpu_restore_controls(const FpuControls& controls);
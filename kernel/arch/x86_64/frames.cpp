@@ -0,0 +1,325 @@
+#include <string.h>
+#include "frames.h"
+#include "mmu.h"
+#include "multiboot.h"
+#include "../../printk.hpp"
+
+FrameAllocator frame_allocator;
+
+// half-open physical address range
+struct PhysRange {
+    uint64_t begin;
+    uint64_t end;
+};
+
+struct PhysRangeList {
+    static constexpr int capacity = 64;
+    PhysRange ranges[capacity];
+    int count = 0;
+
+    // false if the list is full
+    bool add(uint64_t begin, uint64_t end) {
+        if (begin >= end) {
+            return true;
+        }
+        if (count == capacity) {
+            return false;
+        }
+        // keep the list sorted by start address, it's tiny
+        int i = count++;
+        for (; i > 0 && ranges[i - 1].begin > begin; i--) {
+            ranges[i] = ranges[i - 1];
+        }
+        ranges[i] = {begin, end};
+        return true;
+    }
+
+    // add, or when the list is full grow the closest range to cover
+    // [begin, end) too: for reserved memory, where losing what lies in
+    // between beats handing out frames that are in use. Ranges may overlap
+    // then, which subtract_from doesn't mind. False if it had to grow one
+    bool cover(uint64_t begin, uint64_t end) {
+        if (add(begin, end)) {
+            return true;
+        }
+        int i = 0;
+        while (i < count && ranges[i].begin <= begin) {
+            i++;
+        }
+        // growing the one before keeps the order, so does growing the one
+        // after: begin is past the start of those before it
+        PhysRange* closest;
+        if (i == 0) {
+            closest = &ranges[0];
+        } else if (i == count) {
+            closest = &ranges[count - 1];
+        } else {
+            uint64_t const gap_before = ranges[i - 1].end >= begin ? 0 : begin - ranges[i - 1].end;
+            uint64_t const gap_after = ranges[i].begin <= end ? 0 : ranges[i].begin - end;
+            closest = gap_before <= gap_after ? &ranges[i - 1] : &ranges[i];
+        }
+        closest->begin = begin < closest->begin ? begin : closest->begin;
+        closest->end = end > closest->end ? end : closest->end;
+        return false;
+    }
+
+    // calls fn for each piece of [begin, end) not covered by this list
+    template<typename F>
+    void subtract_from(uint64_t begin, uint64_t end, F fn) {
+        for (int i = 0; i < count && begin < end; i++) {
+            auto &r = ranges[i];
+            if (r.end <= begin) {
+                continue;
+            }
+            if (r.begin >= end) {
+                break;
+            }
+            if (r.begin > begin) {
+                fn(begin, r.begin);
+            }
+            if (r.end > begin) {
+                begin = r.end;
+            }
+        }
+        if (begin < end) {
+            fn(begin, end);
+        }
+    }
+};
+
+static inline uint64_t frame_floor(uint64_t addr) {
+    return addr & ~(FrameAllocator::frame_size - 1);
+}
+static inline uint64_t frame_ceil(uint64_t addr) {
+    return frame_floor(addr + FrameAllocator::frame_size - 1);
+}
+
+// memory layout from the bootloader, kept around until all of it is in the free lists
+static PhysRangeList usable;
+static PhysRangeList reserved;
+
+// a usable range that doesn't fit is lost memory, a reserved one that
+// doesn't fit reserves more than it should: neither goes unnoticed
+static void add_usable(uint64_t begin, uint64_t end) {
+    if (!usable.add(begin, end)) {
+        printk(LogLevel::Warning, "More than %d usable memory ranges, %x-%x ignored\n",
+            PhysRangeList::capacity, begin, end);
+    }
+}
+static void add_reserved(uint64_t begin, uint64_t end) {
+    if (!reserved.cover(begin, end)) {
+        printk(LogLevel::Warning, "More than %d reserved memory ranges, %x-%x reserved with its neighbour\n",
+            PhysRangeList::capacity, begin, end);
+    }
+}
+
+void FrameAllocator::init(uint64_t multiboot_info, uint64_t linear_limit) {
+    auto info = static_cast<MultibootInfo*>(ptl(multiboot_info));
+
+    if (info->flags & MultibootInfo::MemoryMap) {
+        auto entry = static_cast<MultibootMmapEntry*>(ptl(info->mmap_addr));
+        auto mmap_end = static_cast<uint8_t*>(ptl(info->mmap_addr + info->mmap_length));
+        for (; reinterpret_cast<uint8_t*>(entry) < mmap_end; entry = entry->next()) {
+            if (entry->type != MultibootMmapEntry::Available) {
+                continue;
+            }
+            // we can't touch anything the linear map doesn't cover
+            uint64_t end = entry->addr + entry->len;
+            if (end > MAX_PHYSADDR + 1) {
+                end = MAX_PHYSADDR + 1;
+            }
+            add_usable(frame_ceil(entry->addr), frame_floor(end));
+        }
+        add_reserved(frame_floor(info->mmap_addr), frame_ceil(info->mmap_addr + info->mmap_length));
+    } else if (info->flags & MultibootInfo::Memory) {
+        // mem_upper is the amount of contiguous KiB starting at 1mb
+        add_usable(0x100000, frame_floor(0x100000 + uint64_t{info->mem_upper} * 1024));
+    }
+
+    // real mode memory, bootstrap code, boot page tables and stack, and the kernel image
+    add_reserved(0, frame_ceil(ktp(&KERNEL_VIRTUAL_BASE_END)));
+    // whatever the bootloader handed over, we might still need it
+    add_reserved(frame_floor(multiboot_info), frame_ceil(multiboot_info + sizeof(MultibootInfo)));
+    if (info->flags & MultibootInfo::CommandLine) {
+        add_reserved(frame_floor(info->cmdline), frame_floor(info->cmdline) + frame_size);
+    }
+    if (info->flags & MultibootInfo::Modules) {
+        auto modules = static_cast<MultibootModule*>(ptl(info->mods_addr));
+        add_reserved(frame_floor(info->mods_addr), frame_ceil(info->mods_addr + info->mods_count * sizeof(MultibootModule)));
+        for (uint32_t i = 0; i < info->mods_count; i++) {
+            add_reserved(frame_floor(modules[i].mod_start), frame_ceil(modules[i].mod_end));
+            add_reserved(frame_floor(modules[i].string), frame_floor(modules[i].string) + frame_size);
+        }
+    }
+
+    uint64_t highest = 0;
+    for (int i = 0; i < usable.count; i++) {
+        if (usable.ranges[i].end > highest) {
+            highest = usable.ranges[i].end;
+        }
+    }
+    frame_count = highest / frame_size;
+
+    // the state and share arrays go into the first free hole large enough to hold them
+    uint64_t const shares_offset = (frame_count + 7) & ~7ull;
+    uint64_t const state_size = frame_ceil(shares_offset + frame_count * sizeof(uint32_t));
+    uint64_t state_addr = 0;
+    for (int i = 0; i < usable.count && !state_addr; i++) {
+        reserved.subtract_from(usable.ranges[i].begin, usable.ranges[i].end, [&](uint64_t begin, uint64_t end) {
+            if (!state_addr && end - begin >= state_size && begin + state_size <= linear_limit) {
+                state_addr = begin;
+            }
+        });
+    }
+    if (!state_addr) {
+        printk(LogLevel::Error, "No room for the frame allocator metadata, physical memory unavailable\n");
+        frame_count = 0;
+        return;
+    }
+    add_reserved(state_addr, state_addr + state_size);
+    frame_state = static_cast<uint8_t*>(ptl(state_addr));
+    frame_shares = reinterpret_cast<uint32_t*>(frame_state + shares_offset);
+    memset(frame_state, 0, state_size);
+
+    for (auto &head: free_lists) {
+        head.next = head.prev = &head;
+    }
+    extend(linear_limit);
+    printk(LogLevel::Info, "Physical memory up to %x, %d KiB used for frame metadata\n",
+        top(), state_size >> 10);
+}
+
+void FrameAllocator::extend(uint64_t linear_limit) {
+    if (linear_limit <= populated_limit || !frame_state) {
+        return;
+    }
+    LockGuard guard(lock);
+    for (int i = 0; i < usable.count; i++) {
+        uint64_t begin = usable.ranges[i].begin;
+        uint64_t end = usable.ranges[i].end;
+        begin = begin < populated_limit ? populated_limit : begin;
+        end = end > linear_limit ? linear_limit : end;
+        reserved.subtract_from(begin, end, [this](uint64_t begin, uint64_t end) {
+            add_range(begin, end);
+        });
+    }
+    populated_limit = linear_limit;
+}
+
+void FrameAllocator::add_range(uint64_t begin, uint64_t end) {
+    uint64_t pfn = begin / frame_size;
+    uint64_t const end_pfn = end / frame_size;
+    usable_count += end_pfn - pfn;
+    while (pfn < end_pfn) {
+        // largest naturally aligned block that fits in what's left
+        int order = pfn ? __builtin_ctzll(pfn) : max_order;
+        if (order > max_order) {
+            order = max_order;
+        }
+        while (pfn + (1ull << order) > end_pfn) {
+            order--;
+        }
+        // go through free so that blocks coalesce with adjacent ranges
+        free_locked(pfn, order);
+        pfn += 1ull << order;
+    }
+}
+
+void FrameAllocator::push(uint64_t pfn, int order) {
+    auto node = static_cast<FreeBlock*>(ptl(pfn * frame_size));
+    auto &head = free_lists[order];
+    node->next = head.next;
+    node->prev = &head;
+    head.next->prev = node;
+    head.next = node;
+    frame_state[pfn] = state_free | order;
+    nonempty |= 1u << order;
+}
+
+void FrameAllocator::unlink(uint64_t pfn, int order) {
+    auto node = static_cast<FreeBlock*>(ptl(pfn * frame_size));
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    auto &head = free_lists[order];
+    if (head.next == &head) {
+        nonempty &= ~(1u << order);
+    }
+    frame_state[pfn] = order;
+}
+
+uint64_t FrameAllocator::alloc(int order) {
+    if (order < 0 || order > max_order) {
+        return 0;
+    }
+    LockGuard guard(lock);
+    // smallest order with a free block, no list scanning
+    uint32_t candidates = nonempty & ~((1u << order) - 1);
+    if (!candidates) {
+        return 0;
+    }
+    int current = __builtin_ctz(candidates);
+    uint64_t pfn = ltp(free_lists[current].next) / frame_size;
+    unlink(pfn, current);
+    // give back the upper halves we don't need
+    while (current > order) {
+        current--;
+        push(pfn + (1ull << current), current);
+    }
+    frame_state[pfn] = order;
+    free_count -= 1ull << order;
+    return pfn * frame_size;
+}
+
+void FrameAllocator::free(uint64_t physaddr, int order) {
+    LockGuard guard(lock);
+    free_locked(physaddr / frame_size, order);
+}
+
+void FrameAllocator::free_locked(uint64_t pfn, int order) {
+    free_count += 1ull << order;
+    frame_state[pfn] = 0;
+    while (order < max_order) {
+        uint64_t buddy = pfn ^ (1ull << order);
+        if (buddy >= frame_count || frame_state[buddy] != (state_free | order)) {
+            break;
+        }
+        unlink(buddy, order);
+        frame_state[buddy] = 0;
+        pfn &= ~(1ull << order);
+        order++;
+    }
+    push(pfn, order);
+}
+
+int FrameAllocator::order_of(uint64_t physaddr) {
+    return frame_state[physaddr / frame_size] & state_order;
+}
+
+void FrameAllocator::set_slab(uint64_t physaddr) {
+    frame_state[physaddr / frame_size] |= state_slab;
+}
+
+bool FrameAllocator::is_slab(uint64_t physaddr) {
+    uint64_t pfn = physaddr / frame_size;
+    return pfn < frame_count && (frame_state[pfn] & (state_free | state_slab)) == state_slab;
+}
+
+void FrameAllocator::share(uint64_t physaddr) {
+    __atomic_fetch_add(&frame_shares[physaddr / frame_size], 1, __ATOMIC_RELAXED);
+}
+
+bool FrameAllocator::shared(uint64_t physaddr) {
+    return __atomic_load_n(&frame_shares[physaddr / frame_size], __ATOMIC_ACQUIRE);
+}
+
+void FrameAllocator::release(uint64_t physaddr) {
+    auto &shares = frame_shares[physaddr / frame_size];
+    uint32_t count = __atomic_load_n(&shares, __ATOMIC_ACQUIRE);
+    do {
+        if (!count) {
+            // the last owner, nobody can share it anymore
+            free(physaddr);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&shares, &count, count - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
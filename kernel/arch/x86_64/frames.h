@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "spinlock.h"
+
+// Physical memory allocator. A binary buddy system over 4k frames:
+// a block of order n is 2^n frames, aligned to its own size, so that
+// order 0 is a small page and order 9 is a 2mb page.
+// Free blocks are kept in one list per order, threaded through the
+// free memory itself (accessed from the linear map), so the metadata is
+// one byte of state per frame, plus a share count for copy-on-write.
+class FrameAllocator {
+public:
+    static constexpr uint64_t frame_size = 0x1000;
+    static constexpr int order_4k = 0;
+    static constexpr int order_2m = 9;
+    static constexpr int order_1g = 18;
+    static constexpr int max_order = order_1g;
+
+    // build free lists from the multiboot memory map. Only memory below
+    // linear_limit is used, since free blocks are written through the linear map.
+    void init(uint64_t multiboot_info, uint64_t linear_limit);
+    // the linear map grew, hand out memory up to the new limit
+    void extend(uint64_t linear_limit);
+    // end of the highest usable physical memory range
+    uint64_t top() { return frame_count * frame_size; }
+    // physical address of a block of 2^order frames, 0 if out of memory
+    uint64_t alloc(int order = order_4k);
+    void free(uint64_t physaddr, int order = order_4k);
+    // order the block starting at physaddr was allocated with
+    int order_of(uint64_t physaddr);
+    // tag an allocated block as a slab, so that the slab allocator can
+    // tell its own memory apart from large allocations
+    void set_slab(uint64_t physaddr);
+    bool is_slab(uint64_t physaddr);
+    // Frames mapped copy-on-write by several address spaces. A frame
+    // starts with a single owner, share() adds one, release() drops one
+    // and frees the frame with the last. Single frames only
+    void share(uint64_t physaddr);
+    bool shared(uint64_t physaddr);
+    void release(uint64_t physaddr);
+
+    uint64_t free_frames() { return free_count; }
+    uint64_t total_frames() { return usable_count; }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+        FreeBlock* prev;
+    };
+    // frame_state values
+    static constexpr uint8_t state_free = 0x80;
+    static constexpr uint8_t state_slab = 0x40;
+    static constexpr uint8_t state_order = 0x1f;
+
+    void push(uint64_t pfn, int order);
+    void unlink(uint64_t pfn, int order);
+    void free_locked(uint64_t pfn, int order);
+    void add_range(uint64_t begin, uint64_t end);
+
+    FreeBlock free_lists[max_order + 1] = {}; // list heads, in the kernel image
+    uint32_t nonempty = 0; // bit n set if free_lists[n] is not empty
+    uint8_t* frame_state = nullptr; // per frame: state_free/state_slab | order on block heads
+    uint32_t* frame_shares = nullptr; // per frame: owners beyond the first
+    uint64_t frame_count = 0;
+    uint64_t free_count = 0;
+    uint64_t usable_count = 0;
+    uint64_t populated_limit = 0; // memory below this has been added to the free lists
+    Spinlock lock;
+};
+
+extern FrameAllocator frame_allocator;
@@ -0,0 +1,83 @@
+#include "gdt.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "frames.h"
+
+namespace {
+
+#pragma pack(push, 1)
+struct Tss {
+    uint32_t reserved0;
+    uint64_t rsp[3]; // stack for interrupts coming from ring n
+    uint64_t reserved1;
+    uint64_t ist[7]; // ist[n - 1] is IST n
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+};
+#pragma pack(pop)
+static_assert(sizeof(Tss) == 104, "TSS layout");
+
+struct alignas(64) CpuTables {
+    uint64_t gdt[8];
+    Tss tss;
+};
+
+CpuTables cpu_tables[MAX_CPUS];
+
+constexpr int ist_stack_order = 2; // 16k
+
+}
+
+void gdt_init_cpu() {
+    auto &tables = cpu_tables[cpu_index()];
+    auto &tss = tables.tss;
+    tss.rsp[0] = this_cpu()->kernel_stack;
+    int const ists[] = {IST_NMI, IST_DOUBLE_FAULT, IST_MACHINE_CHECK};
+    for (int ist: ists) {
+        if (!tss.ist[ist - 1]) {
+            uint64_t const stack = frame_allocator.alloc(ist_stack_order);
+            tss.ist[ist - 1] = stack ? reinterpret_cast<uint64_t>(ptl(stack)) + (FrameAllocator::frame_size << ist_stack_order) : 0;
+        }
+    }
+    tss.iomap_base = sizeof(Tss); // no io permission bitmap
+
+    uint64_t const base = reinterpret_cast<uint64_t>(&tss);
+    tables.gdt[0] = 0;
+    tables.gdt[KERNEL_CS / 8] = 0x00af9a000000ffff; // 64 bit code
+    tables.gdt[KERNEL_DS / 8] = 0x00cf92000000ffff; // data
+    tables.gdt[USER_CS32 / 8] = 0;
+    tables.gdt[USER_DS / 8] = 0x00cff2000000ffff; // data, dpl 3
+    tables.gdt[USER_CS / 8] = 0x00affa000000ffff; // 64 bit code, dpl 3
+    // 16 byte system descriptor: available 64 bit TSS
+    tables.gdt[TSS_SELECTOR / 8] = (sizeof(Tss) - 1) | (base & 0xffffff) << 16 | 0x89ull << 40 | (base >> 24 & 0xff) << 56;
+    tables.gdt[TSS_SELECTOR / 8 + 1] = base >> 32;
+
+    struct __attribute__((packed)) {
+        uint16_t limit;
+        uint64_t base;
+    } const pointer = {sizeof(tables.gdt) - 1, reinterpret_cast<uint64_t>(tables.gdt)};
+    // loading fs and gs clears their base, keep ours
+    uint64_t const gs_base = rdmsr(MSR_GS_BASE);
+    asm volatile(R"(
+        lgdt %0
+        pushq %1
+        leaq 1f(%%rip), %%rax
+        pushq %%rax
+        lretq
+    1:
+        movw %w2, %%ax
+        movw %%ax, %%ds
+        movw %%ax, %%es
+        movw %%ax, %%ss
+        xorl %%eax, %%eax
+        movw %%ax, %%fs
+        movw %%ax, %%gs
+        ltr %w3
+    )" : : "m"(pointer), "i"(uint64_t{KERNEL_CS}), "r"(KERNEL_DS), "r"(TSS_SELECTOR) : "rax", "memory");
+    wrmsr(MSR_GS_BASE, gs_base);
+}
+
+void gdt_set_kernel_stack(uint64_t top) {
+    cpu_tables[cpu_index()].tss.rsp[0] = top;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+
+// Per-cpu GDT and TSS. The boot GDT in multiboot.s has no TSS, and every
+// cpu needs its own for its IST stacks.
+//
+// The order of the segments is the one SYSCALL and SYSRET expect (see
+// syscall.h): kernel code and data, then a 32 bit user code slot (unused,
+// left null), user data and 64 bit user code.
+constexpr uint16_t KERNEL_CS = 0x08;
+constexpr uint16_t KERNEL_DS = 0x10;
+constexpr uint16_t USER_CS32 = 0x18;
+constexpr uint16_t USER_DS = 0x20 | 3;
+constexpr uint16_t USER_CS = 0x28 | 3;
+constexpr uint16_t TSS_SELECTOR = 0x30;
+
+// interrupt stack table slots, see idt.cpp
+constexpr int IST_NMI = 1;
+constexpr int IST_DOUBLE_FAULT = 2;
+constexpr int IST_MACHINE_CHECK = 3;
+
+// build and load the GDT and TSS of the calling cpu, allocating its IST
+// stacks. Needs the frame allocator. Keeps the GS base
+void gdt_init_cpu();
+// stack the cpu switches to when an interrupt comes from user mode: the top
+// of the kernel stack of the thread about to run
+void gdt_set_kernel_stack(uint64_t top);
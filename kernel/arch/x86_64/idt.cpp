@@ -0,0 +1,183 @@
+#include <kernel/tty.h>
+#include "idt.h"
+#include "gdt.h"
+#include "apic.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "../../console.hpp"
+#include "../../printk.hpp"
+#include "../../sched.hpp"
+
+extern "C" {
+    extern const char interrupt_stubs[];
+    void interrupt_dispatch(InterruptFrame* frame);
+}
+
+namespace {
+
+struct Gate {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t ist;
+    uint8_t type; // present, dpl, interrupt gate
+    uint16_t offset_middle;
+    uint32_t offset_high;
+    uint32_t reserved;
+};
+static_assert(sizeof(Gate) == 16, "IDT gate layout");
+
+struct Handler {
+    InterruptHandler function;
+    void* context;
+};
+
+constexpr int histogram_buckets = 32;
+
+struct VectorStats {
+    uint64_t count;
+    uint64_t histogram[histogram_buckets]; // handlers that took [2^n, 2^(n+1)) cycles
+};
+
+alignas(64) Gate idt[256];
+Handler handlers[256];
+VectorStats stats[256];
+Spinlock vectors_lock; // vector allocation
+
+const char* const exception_names[32] = {
+    "divide error", "debug", "NMI", "breakpoint", "overflow", "bound range", "invalid opcode",
+    "device not available", "double fault", "coprocessor segment overrun", "invalid TSS",
+    "segment not present", "stack fault", "general protection", "page fault", "reserved",
+    "x87 error", "alignment check", "machine check", "SIMD error", "virtualization",
+    "control protection",
+};
+
+void load_idt() {
+    struct __attribute__((packed)) {
+        uint16_t limit;
+        uint64_t base;
+    } const pointer = {sizeof(idt) - 1, reinterpret_cast<uint64_t>(idt)};
+    asm volatile("lidt %0" : : "m"(pointer));
+}
+
+}
+
+[[noreturn]] void fatal_exception(InterruptFrame& frame) {
+    uint64_t cr2;
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+    auto const name = frame.vector < 32 && exception_names[frame.vector] ? exception_names[frame.vector] : "unexpected interrupt";
+    printk(LogLevel::Error, "cpu %d: %s at %p, error %x, cr2 %p\n", cpu_index(), name,
+        reinterpret_cast<void*>(frame.rip), frame.error, reinterpret_cast<void*>(cr2));
+    printk(LogLevel::Error, "vector %d, rsp %p, rflags %x\n", frame.vector, reinterpret_cast<void*>(frame.rsp), frame.rflags);
+    terminal_flush();
+    for (;;) {
+        asm volatile("cli; hlt");
+    }
+}
+
+namespace {
+
+// masked or not, the PIC can raise spurious interrupts: keep them off the
+// exception vectors
+void disable_pic() {
+    outb(0x20, 0x11); // ICW1: init, ICW4 follows
+    outb(0xa0, 0x11);
+    outb(0x21, VECTOR_PIC_BASE); // ICW2: vector base
+    outb(0xa1, VECTOR_PIC_BASE + 8);
+    outb(0x21, 4); // ICW3: slave on irq 2
+    outb(0xa1, 2);
+    outb(0x21, 1); // ICW4: 8086 mode
+    outb(0xa1, 1);
+    outb(0x21, 0xff); // mask everything
+    outb(0xa1, 0xff);
+}
+
+}
+
+extern "C" void interrupt_dispatch(InterruptFrame* frame) {
+    uint64_t const start = rdtsc();
+    uint8_t const vector = frame->vector;
+    auto const function = __atomic_load_n(&handlers[vector].function, __ATOMIC_ACQUIRE);
+    if (function) {
+        function(*frame, handlers[vector].context);
+    } else if ((frame->cs & 3) && vector < 32 && vector != VECTOR_NMI &&
+            vector != VECTOR_DOUBLE_FAULT && vector != VECTOR_MACHINE_CHECK) {
+        // the fault of the user thread, not of the kernel: it goes, the
+        // cpu keeps running. As page_fault does
+        printk(LogLevel::Error, "thread %s: %s at %p, error %x. Killed\n", kernel::Thread::current()->name,
+            exception_names[vector] ? exception_names[vector] : "exception", reinterpret_cast<void*>(frame->rip), frame->error);
+        kernel::exit();
+    } else {
+        fatal_exception(*frame);
+    }
+    uint64_t const cycles = rdtsc() - start;
+    auto &vector_stats = stats[vector];
+    int const bucket = 63 - __builtin_clzll(cycles | 1);
+    __atomic_fetch_add(&vector_stats.count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&vector_stats.histogram[bucket < histogram_buckets ? bucket : histogram_buckets - 1], 1, __ATOMIC_RELAXED);
+    if (vector >= 32) {
+        kernel::preempt();
+    }
+}
+
+void idt_init() {
+    for (int vector = 0; vector < 256; vector++) {
+        uint64_t const address = reinterpret_cast<uint64_t>(interrupt_stubs) + vector * 16;
+        auto &gate = idt[vector];
+        gate.offset_low = address & 0xffff;
+        gate.selector = KERNEL_CS;
+        gate.ist = vector == VECTOR_NMI ? IST_NMI : vector == VECTOR_DOUBLE_FAULT ? IST_DOUBLE_FAULT :
+            vector == VECTOR_MACHINE_CHECK ? IST_MACHINE_CHECK : 0;
+        gate.type = 0x8e; // present, dpl 0, 64 bit interrupt gate
+        gate.offset_middle = address >> 16 & 0xffff;
+        gate.offset_high = address >> 32;
+    }
+    // spurious interrupts need no EOI
+    interrupt_attach(VECTOR_SPURIOUS, [](InterruptFrame&, void*) {});
+    for (int irq = 0; irq < 16; irq++) {
+        interrupt_attach(VECTOR_PIC_BASE + irq, [](InterruptFrame&, void*) {});
+    }
+    disable_pic();
+    idt_init_cpu();
+}
+
+void idt_init_cpu() {
+    gdt_init_cpu();
+    load_idt();
+}
+
+void interrupt_attach(uint8_t vector, InterruptHandler handler, void* context) {
+    // context first: a dispatch that sees the new handler sees its context
+    __atomic_store_n(&handlers[vector].context, context, __ATOMIC_RELAXED);
+    __atomic_store_n(&handlers[vector].function, handler, __ATOMIC_RELEASE);
+}
+
+void interrupt_detach(uint8_t vector) {
+    __atomic_store_n(&handlers[vector].function, InterruptHandler{}, __ATOMIC_RELEASE);
+}
+
+uint8_t interrupt_alloc_vector(InterruptHandler handler, void* context) {
+    LockGuard guard(vectors_lock);
+    for (int vector = VECTOR_FIRST_DYNAMIC; vector < VECTOR_FIXED; vector++) {
+        if (!handlers[vector].function) {
+            interrupt_attach(vector, handler, context);
+            return vector;
+        }
+    }
+    return 0;
+}
+
+void interrupt_dump_stats() {
+    for (int vector = 0; vector < 256; vector++) {
+        auto const &vector_stats = stats[vector];
+        if (!vector_stats.count) {
+            continue;
+        }
+        console.printf("vector %d: %d interrupts, cycles:", vector, vector_stats.count);
+        for (int bucket = 0; bucket < histogram_buckets; bucket++) {
+            if (vector_stats.histogram[bucket]) {
+                console.printf(" %u+ %d", 1u << bucket, vector_stats.histogram[bucket]);
+            }
+        }
+        console.printf("\n");
+    }
+}
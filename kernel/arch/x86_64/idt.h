@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+
+// Interrupt descriptor table and dispatch. Every vector has an entry stub
+// (interrupts.s) that saves the caller saved registers and calls
+// interrupt_dispatch, which runs the handler attached to the vector and
+// accounts the cycles it took. Exceptions without a handler are fatal in
+// kernel mode, and kill the thread in user mode.
+// NMI, double fault and machine check run on their own IST stacks.
+//
+// Handlers run with interrupts off. Those of interrupts coming from the
+// local APIC send the EOI themselves. After a hardware interrupt the
+// interrupted thread may be preempted (see sched.hpp).
+
+// what the stubs push, lowest address first
+struct InterruptFrame {
+    uint64_t xmm[32]; // xmm0-15
+    uint64_t r11, r10, r9, r8, rdi, rsi, rdx, rcx, rax;
+    uint64_t vector;
+    uint64_t error; // 0 for vectors without one
+    // pushed by the cpu
+    uint64_t rip, cs, rflags, rsp, ss;
+};
+
+using InterruptHandler = void (*)(InterruptFrame& frame, void* context);
+
+enum: uint8_t {
+    VECTOR_DIVIDE_ERROR = 0,
+    VECTOR_NMI = 2,
+    VECTOR_BREAKPOINT = 3,
+    VECTOR_INVALID_OPCODE = 6,
+    VECTOR_DEVICE_NOT_AVAILABLE = 7,
+    VECTOR_DOUBLE_FAULT = 8,
+    VECTOR_GENERAL_PROTECTION = 13,
+    VECTOR_PAGE_FAULT = 14,
+    VECTOR_MACHINE_CHECK = 18,
+    // the legacy PIC is remapped here, and masked
+    VECTOR_PIC_BASE = 0x20,
+    // interrupt_alloc_vector hands out vectors from here up to VECTOR_FIXED
+    VECTOR_FIRST_DYNAMIC = 0x30,
+    // vectors from here on are reserved for the kernel
+    VECTOR_FIXED = 0xe0,
+    VECTOR_TIMER = 0xf0, // local APIC timer
+    VECTOR_RESCHEDULE = 0xf1, // IPI: there's work for a halted cpu
+    VECTOR_TLB_SHOOTDOWN = 0xf2, // IPI: flush the TLB, see mmu.cpp
+    VECTOR_SPURIOUS = 0xff,
+};
+
+// build the IDT, load it on the bootstrap processor along with its GDT
+// and TSS, and mask the legacy PIC
+void idt_init();
+// GDT, TSS and IDT of an application processor
+void idt_init_cpu();
+
+// attach a handler to a vector, replacing what was there. A handler being
+// detached may still run on another cpu for a while
+void interrupt_attach(uint8_t vector, InterruptHandler handler, void* context = nullptr);
+void interrupt_detach(uint8_t vector);
+// a free vector in [VECTOR_FIRST_DYNAMIC, VECTOR_FIXED), with the handler
+// attached. 0 if none is left
+uint8_t interrupt_alloc_vector(InterruptHandler handler, void* context = nullptr);
+
+// print what we know about an exception nothing could handle, and stop the cpu
+[[noreturn]] void fatal_exception(InterruptFrame& frame);
+
+// count and handler cycles (log2 buckets) of every vector that fired
+void interrupt_dump_stats();
@@ -0,0 +1,147 @@
+.section .text
+.code64
+
+# Interrupt entry stubs, 16 bytes each, vector n at interrupt_stubs + 16 * n.
+# Each one pushes a dummy error code when the cpu doesn't push one, and the
+# vector number, then goes to interrupt_common. That saves only what a call
+# to C++ may clobber: the caller saved general purpose registers and
+# xmm0-15 (the kernel doesn't use AVX or x87). The rest the handlers
+# preserve by themselves. The layout is InterruptFrame in idt.h.
+.global interrupt_stubs
+.balign 16
+interrupt_stubs:
+.set vector, 0
+.rept 256
+    .balign 16
+    .if !(vector == 8 || (vector >= 10 && vector <= 14) || vector == 17 || vector == 21 || vector == 29 || vector == 30)
+    pushq $0
+    .endif
+    pushq $vector
+    .if vector == 2 || vector == 8 || vector == 18
+    jmp interrupt_paranoid # the IST ones: NMI, double fault, machine check
+    .else
+    jmp interrupt_common
+    .endif
+    .set vector, vector + 1
+.endr
+.global interrupt_stubs_end
+interrupt_stubs_end:
+
+.macro save_registers
+    push %rax
+    push %rcx
+    push %rdx
+    push %rsi
+    push %rdi
+    push %r8
+    push %r9
+    push %r10
+    push %r11
+.endm
+
+.macro save_vector_registers
+    sub $256, %rsp
+    movaps %xmm0, 0x00(%rsp)
+    movaps %xmm1, 0x10(%rsp)
+    movaps %xmm2, 0x20(%rsp)
+    movaps %xmm3, 0x30(%rsp)
+    movaps %xmm4, 0x40(%rsp)
+    movaps %xmm5, 0x50(%rsp)
+    movaps %xmm6, 0x60(%rsp)
+    movaps %xmm7, 0x70(%rsp)
+    movaps %xmm8, 0x80(%rsp)
+    movaps %xmm9, 0x90(%rsp)
+    movaps %xmm10, 0xa0(%rsp)
+    movaps %xmm11, 0xb0(%rsp)
+    movaps %xmm12, 0xc0(%rsp)
+    movaps %xmm13, 0xd0(%rsp)
+    movaps %xmm14, 0xe0(%rsp)
+    movaps %xmm15, 0xf0(%rsp)
+.endm
+
+.macro restore_vector_registers
+    movaps 0x00(%rsp), %xmm0
+    movaps 0x10(%rsp), %xmm1
+    movaps 0x20(%rsp), %xmm2
+    movaps 0x30(%rsp), %xmm3
+    movaps 0x40(%rsp), %xmm4
+    movaps 0x50(%rsp), %xmm5
+    movaps 0x60(%rsp), %xmm6
+    movaps 0x70(%rsp), %xmm7
+    movaps 0x80(%rsp), %xmm8
+    movaps 0x90(%rsp), %xmm9
+    movaps 0xa0(%rsp), %xmm10
+    movaps 0xb0(%rsp), %xmm11
+    movaps 0xc0(%rsp), %xmm12
+    movaps 0xd0(%rsp), %xmm13
+    movaps 0xe0(%rsp), %xmm14
+    movaps 0xf0(%rsp), %xmm15
+    add $256, %rsp
+.endm
+
+.macro restore_registers
+    pop %r11
+    pop %r10
+    pop %r9
+    pop %r8
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %rcx
+    pop %rax
+    add $16, %rsp # vector and error code
+.endm
+
+.type interrupt_common, @function
+interrupt_common:
+    save_registers
+    # from user space: swap in the kernel GS base. cs is above 9 registers,
+    # the vector, the error code and rip
+    testb $3, 96(%rsp)
+    jz 1f
+    swapgs
+1:  save_vector_registers
+    # the cpu aligned the stack to 16 before pushing its 5 words: with the
+    # 2 + 9 + 32 words pushed since, it is aligned for the call
+    mov %rsp, %rdi
+    cld
+    call interrupt_dispatch
+    restore_vector_registers
+    testb $3, 96(%rsp)
+    jz 2f
+    swapgs
+2:  restore_registers
+    iretq
+.size interrupt_common, . - interrupt_common
+
+# NMIs and machine checks can come anywhere, also in kernel code between a
+# swapgs and the sysretq or iretq after it: there cs says kernel but the
+# user GS base is loaded. So the GS base itself decides. Ours are kernel
+# addresses, user space can't set one of those. Whether we swapped is kept
+# below the frame, to swap back on the way out.
+.type interrupt_paranoid, @function
+interrupt_paranoid:
+    save_registers
+    mov $0xc0000101, %ecx # MSR_GS_BASE
+    rdmsr
+    xor %ecx, %ecx
+    test %edx, %edx
+    js 1f
+    swapgs
+    mov $1, %ecx
+1:  save_vector_registers
+    # two more words, still aligned for the call
+    sub $8, %rsp
+    push %rcx
+    lea 16(%rsp), %rdi
+    cld
+    call interrupt_dispatch
+    pop %rcx
+    add $8, %rsp
+    restore_vector_registers
+    test %ecx, %ecx
+    jz 2f
+    swapgs
+2:  restore_registers
+    iretq
+.size interrupt_paranoid, . - interrupt_paranoid
@@ -0,0 +1,97 @@
+#include "ioapic.h"
+#include "mmu.h"
+#include "../../printk.hpp"
+
+IoApic ioapic;
+
+namespace {
+// registers: select with the first, read and write through the window
+constexpr unsigned reg_select = 0;
+constexpr unsigned reg_window = 0x10 / sizeof(uint32_t);
+constexpr uint32_t ioapic_version = 1; // max redirection entry in bits 16-23
+constexpr uint32_t redirection_table = 0x10; // two registers per input
+
+constexpr uint32_t redirection_active_low = 1 << 13;
+constexpr uint32_t redirection_level = 1 << 15;
+constexpr uint32_t redirection_masked = 1 << 16;
+
+// MPS INTI flags. ISA default is edge triggered, active high
+constexpr uint16_t inti_polarity_mask = 3;
+constexpr uint16_t inti_active_low = 3;
+constexpr uint16_t inti_trigger_mask = 3 << 2;
+constexpr uint16_t inti_level = 3 << 2;
+}
+
+uint32_t IoApic::read(Chip& chip, uint32_t reg) {
+    chip.base[reg_select] = reg;
+    return chip.base[reg_window];
+}
+
+void IoApic::write(Chip& chip, uint32_t reg, uint32_t value) {
+    chip.base[reg_select] = reg;
+    chip.base[reg_window] = value;
+}
+
+bool IoApic::init() {
+    if (!acpi.parse_madt(madt) || !madt.ioapic_count) {
+        printk(LogLevel::Warning, "no IO APIC, legacy device interrupts unavailable\n");
+        return false;
+    }
+    LockGuard guard(lock);
+    for (unsigned i = 0; i < madt.ioapic_count; i++) {
+        auto &chip = chips[count++];
+        chip.base = static_cast<volatile uint32_t*>(ptl(madt.ioapics[i].address));
+        chip.gsi_base = madt.ioapics[i].gsi_base;
+        chip.inputs = ((read(chip, ioapic_version) >> 16) & 0xff) + 1;
+        for (unsigned input = 0; input < chip.inputs; input++) {
+            write(chip, redirection_table + 2 * input, redirection_masked);
+        }
+        printk(LogLevel::Info, "IO APIC %d: %d inputs from gsi %d\n", madt.ioapics[i].id, chip.inputs, chip.gsi_base);
+    }
+    return true;
+}
+
+IoApic::Chip* IoApic::find(uint32_t gsi, unsigned& input) {
+    for (unsigned i = 0; i < count; i++) {
+        if (gsi >= chips[i].gsi_base && gsi - chips[i].gsi_base < chips[i].inputs) {
+            input = gsi - chips[i].gsi_base;
+            return &chips[i];
+        }
+    }
+    return nullptr;
+}
+
+uint32_t IoApic::isa_gsi(uint8_t irq, uint16_t& flags) {
+    for (unsigned i = 0; i < madt.override_count; i++) {
+        if (madt.overrides[i].irq == irq) {
+            flags = madt.overrides[i].flags;
+            return madt.overrides[i].gsi;
+        }
+    }
+    flags = 0;
+    return irq;
+}
+
+bool IoApic::route_isa(uint8_t irq, uint8_t vector, uint32_t apic_id) {
+    uint16_t flags;
+    unsigned input;
+    auto const chip = find(isa_gsi(irq, flags), input);
+    if (!chip) {
+        return false;
+    }
+    // fixed delivery, physical destination
+    uint32_t low = vector;
+    if ((flags & inti_polarity_mask) == inti_active_low) {
+        low |= redirection_active_low;
+    }
+    if ((flags & inti_trigger_mask) == inti_level) {
+        low |= redirection_level;
+    }
+    LockGuard guard(lock);
+    // masked while the destination changes, then the vector unmasks it
+    write(*chip, redirection_table + 2 * input, redirection_masked);
+    write(*chip, redirection_table + 2 * input + 1, apic_id << 24);
+    write(*chip, redirection_table + 2 * input, low);
+    return true;
+}
+
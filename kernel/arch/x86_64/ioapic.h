@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+#include "acpi.h"
+#include "spinlock.h"
+
+// IO APICs, for the interrupts of legacy devices (the serial port) now that
+// the PIC is masked. PCI devices use MSI-X instead, see pci.h. Registers
+// are reached through the linear map, like those of the local APIC. Every
+// input starts masked; route unmasks the ones somebody handles.
+class IoApic {
+public:
+    // find the IO APICs in the MADT and mask all their inputs. After
+    // smp_init (the linear map covers them and ACPI is found). False if
+    // there are none
+    bool init();
+    // deliver ISA irq as vector to the local APIC apic_id, honoring the
+    // MADT overrides, and unmask it. Handlers send the EOI to the local
+    // APIC. False if no IO APIC has that input
+    bool route_isa(uint8_t irq, uint8_t vector, uint32_t apic_id);
+
+private:
+    struct Chip {
+        volatile uint32_t* base;
+        uint32_t gsi_base;
+        unsigned inputs;
+    };
+    // the chip and input of a global system interrupt, nullptr if none has it
+    Chip* find(uint32_t gsi, unsigned& input);
+    // gsi and MPS INTI flags of an ISA irq
+    uint32_t isa_gsi(uint8_t irq, uint16_t& flags);
+    uint32_t read(Chip& chip, uint32_t reg);
+    void write(Chip& chip, uint32_t reg, uint32_t value);
+
+    MadtInfo madt = {};
+    Chip chips[MadtInfo::max_ioapics] = {};
+    unsigned count = 0;
+    Spinlock lock; // the register select/window pair takes two accesses
+};
+
+extern IoApic ioapic;
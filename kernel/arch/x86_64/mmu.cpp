@@ -1,16 +1,13 @@
+#include <cstddef>
+#include <string.h>
 #include "mmu.h"
-
-// symbols from linker. We only need their address
-extern "C" {
-    extern uint8_t BOOTSTRAP_END;
-    extern uint8_t KERNEL_VIRTUAL_BASE;
-    extern uint8_t KERNEL_VIRTUAL_BASE_END;
-}
-
-constexpr uint8_t L1LSB = 12;
-constexpr uint8_t L2LSB = 21;
-constexpr uint8_t L3LSB = 30;
-constexpr uint8_t L4LSB = 39;
+#include "frames.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "apic.h"
+#include "idt.h"
+#include "../../printk.hpp"
+#include "../../sched.hpp"
 
 // Virtual address resolution
 // 0-11 -> linear
@@ -29,129 +26,1415 @@ constexpr uint8_t L4LSB = 39;
 // 0xffffffc0 00000000 - 0xffffffff ffffffff  entry 511
 // we use entry 511 for kernel code and data
 
-static MMU::PML4T* kernel_space; // a pointer to L4 table in linear space
-static MMU::PML4T kernel_space_l4; // maps EVERYTHING
-static MMU::PDPT kernel_space_l3; // maps the uppest 512GB of virtual space
+// Fixed part of the kernel address space. The compiler builds these tables
+// (see build_kernel_tables) and _start loads them into cr3 before paging is
+// turned on, so they are both the boot tables and the final kernel tables.
+// Physical addresses aren't known at compile time, so entries pointing to
+// another of these tables hold its offset in KernelTables, and kernel image
+// pages hold their offset from the load address. Those entries are marked
+// with one of the available bits, and _start relocates them using the list
+// in kernel_table_fixups.
+struct alignas(0x1000) KernelTables {
+    MMU::PML4T l4; // maps EVERYTHING
+    MMU::PDPT kernel_l3; // maps the uppest 512GB of virtual space
+    // these define mappings for virtual addresses from kernel_virtual_base to the end of address space
+    MMU::PDT kernel_l2[2]; // each entry maps 2M, each table maps 1G, total 2G
+    MMU::PDPT linear_l3; // 1gb pages, patched at runtime if they're not supported
+    // Temporary mapping of the first 2mb, where the bootstrap code runs. Also used to write into VGA.
+    MMU::PDPT lowmem_l3;
+    MMU::PDT lowmem_l2;
+};
 
-// these define mappings for virtual addresses from kernel_virtual_base to the end of address space
-static MMU::PDT kernel_space_l2[2]; // each entry maps 2M, each table maps 1G, total 2G
+struct KernelTableFixups {
+    uint32_t count;
+    uint32_t entries[31]; // index of the entry, counting 8 byte words from the start of KernelTables
+};
 
-constexpr uint64_t MAX_PHYSADDR = (1ull<<L4LSB) - 1;
-// linear address mapped from this pointer
-const void* linear_address_base = reinterpret_cast<void*>(0xffff800000000000ull);
+// available bits marking entries to relocate. Keep in sync with _start
+constexpr int FIXUP_TABLES = 0; // add the physical address of KernelTables
+constexpr int FIXUP_IMAGE = 1; // add the physical load address of the kernel
 
-static MMU::PDPT linear_space_l3;
-static MMU::PDT linear_space_l2[512]; // each entry maps 2M, each table maps 1G, total 512G
+// must match linker.ld
+constexpr uint64_t KERNEL_VIRTUAL_BASE_ADDR = 0xffffffff80000000ull;
+// the linker checks the kernel image fits in here
+constexpr int KERNEL_IMAGE_PAGES = 8;
 
-// from linear address space to physical address
-inline uint64_t ltp(void* linearAddress) {
-    return  reinterpret_cast<uint64_t>(linearAddress) & MAX_PHYSADDR;
-}
-// from physical address to linear mapped address
-inline void* ptl(uint64_t physical_address) {
-    return  ((char*)linear_address_base) + (physical_address & MAX_PHYSADDR);
+template<typename Entry>
+constexpr Entry table_link(size_t offset) {
+    Entry entry{};
+    entry.set_addr(offset);
+    entry.present() = true;
+    entry.writable() = true;
+    entry.available(FIXUP_TABLES) = true;
+    return entry;
 }
 
-// extern const uint64_t kernel_vtp_offset;
-inline uint64_t ktp(uint64_t ptr) {
-    uint64_t const kernel_virtual_base = reinterpret_cast<uint64_t>(&KERNEL_VIRTUAL_BASE);
-    uint64_t const kernel_physaddr = reinterpret_cast<uint64_t>(&BOOTSTRAP_END);
-    //const uint64_t kernel_vtp_offset = kernel_virtual_base - kernel_physaddr;
-    return uint64_t{ptr - kernel_virtual_base + kernel_physaddr};
-}
-inline uint64_t ktp(void* ptr) {
-    return ktp(reinterpret_cast<uint64_t>(ptr));
-};
-
-void MMU::init_kernel_vspace() {
-    // we assume (for virtual to real address mapping) to be in bootstrap space:
-    // - first 2mb+ of memory mapped linearly
-    // - kernel located physically from kernel_physaddr to and mapped from
-    // kernel_virtual_base to kernel_virtual_base_end
-
-    uint64_t const kernel_virtual_base = reinterpret_cast<uint64_t>(&KERNEL_VIRTUAL_BASE);
-    uint64_t const kernel_virtual_base_end = reinterpret_cast<uint64_t>(&KERNEL_VIRTUAL_BASE_END);
+constexpr KernelTables build_kernel_tables() {
+    KernelTables t{};
 
     // map kernel memory in 2mb pages
-    for (auto addr = kernel_virtual_base; addr< kernel_virtual_base_end; addr+= 1<<L2LSB) {
-        auto &l2entry = kernel_space_l2[(addr >> L3LSB) & 1].entries[(addr >> L2LSB) & 511];
+    for (int i = 0; i < KERNEL_IMAGE_PAGES; i++) {
+        auto &l2entry = t.kernel_l2[0].entries[((KERNEL_VIRTUAL_BASE_ADDR >> L2LSB) & 511) + i];
         l2entry.pagesize() = true;
-        l2entry.set_addr(ktp(addr));
+        l2entry.set_addr(uint64_t(i) << L2LSB);
         l2entry.present() = true;
         // this contains kernel stack, should be writable.
         l2entry.writable() = true;
+        // the same in every address space, keep it in the TLB across switches
+        l2entry.global() = true;
+        l2entry.available(FIXUP_IMAGE) = true;
     }
-    for (auto addr = kernel_virtual_base; addr< kernel_virtual_base_end; addr+= 1<<L3LSB) {
-        auto &l3entry = kernel_space_l3.entries[(addr >> L3LSB) & 511];
-        l3entry.set_addr(ktp(&kernel_space_l2[(addr >> L3LSB) & 1]));
-        l3entry.present() = true;
-        l3entry.writable() = true;
+    for (int i = 0; i < 2; i++) {
+        t.kernel_l3.entries[((KERNEL_VIRTUAL_BASE_ADDR >> L3LSB) & 511) + i] =
+            table_link<MMU::PDPTE>(offsetof(KernelTables, kernel_l2) + i * sizeof(MMU::PDT));
     }
-    
+
     // map 512 gb of physical memory linearly
     for (int i = 0; i < 512; i++) {
-        for (int j = 0; j < 512; j++) {
-            auto &l2entry = linear_space_l2[i].entries[j];
-            l2entry.pagesize() = true;
-            l2entry.set_addr((i<<L3LSB) + (j<<L2LSB));
-            l2entry.present() = true;
-            l2entry.writable() = true;
-            l2entry.execute_disable() = true;
-        }
-        auto &l3entry = linear_space_l3.entries[i];
-        l3entry.set_addr(ktp(&linear_space_l2[i]));
+        auto &l3entry = t.linear_l3.entries[i];
+        l3entry.pagesize() = true;
+        l3entry.set_addr(uint64_t(i) << L3LSB);
         l3entry.present() = true;
         l3entry.writable() = true;
+        l3entry.global() = true;
         l3entry.execute_disable() = true;
     }
-    // Temporary mapping to write into VGA. We will map VGA to a better address once this works
-    {
-        static MMU::PDT kernel_lowmeml2;
-        static MMU::PDPT kernel_lowmeml3;
-
-        auto &l4 = kernel_space_l4.entries[0];
-        auto &l3 = kernel_lowmeml3.entries[0];
-        auto &l2 = kernel_lowmeml2.entries[0];
-        l4.set_addr(ktp(&kernel_lowmeml3));
-        l3.set_addr(ktp(&kernel_lowmeml2));
-        l2.set_addr(0);
-        l2.pagesize() = true;
-        l2.present() = true;
-        l2.writable() = true;
-        l3.present() = true;
-        l3.writable() = true;
-        l4.present() = true;
-        l4.writable() = true;
-    }
-    
-    auto & l4linearentry = kernel_space_l4.entries[256];
-    auto & l4kernelentry = kernel_space_l4.entries[511];
-    l4linearentry.set_addr(ktp(&linear_space_l3));
-    l4linearentry.present() = true;
-    l4linearentry.writable() = true;
-    l4kernelentry.set_addr(ktp(&kernel_space_l3));
-    l4kernelentry.present() = true;
-    l4kernelentry.writable() = true;
+
+    auto &l2 = t.lowmem_l2.entries[0];
+    l2.set_addr(0);
+    l2.pagesize() = true;
+    l2.present() = true;
+    l2.writable() = true;
+    t.lowmem_l3.entries[0] = table_link<MMU::PDPTE>(offsetof(KernelTables, lowmem_l2));
+
+    t.l4.entries[0] = table_link<MMU::PML4E>(offsetof(KernelTables, lowmem_l3));
+    t.l4.entries[256] = table_link<MMU::PML4E>(offsetof(KernelTables, linear_l3));
+    t.l4.entries[511] = table_link<MMU::PML4E>(offsetof(KernelTables, kernel_l3));
+    return t;
+}
+
+template<typename Table>
+constexpr void find_fixups(KernelTableFixups &fixups, Table &table, size_t offset) {
+    for (uint32_t i = 0; i < 512; i++) {
+        auto &entry = table.entries[i];
+        if (entry.available(FIXUP_TABLES) || entry.available(FIXUP_IMAGE)) {
+            // out of bounds here is a compile error, make the array bigger
+            fixups.entries[fixups.count++] = offset / 8 + i;
+        }
+    }
+}
+
+constexpr KernelTableFixups build_kernel_table_fixups() {
+    KernelTables t = build_kernel_tables();
+    KernelTableFixups fixups{};
+    find_fixups(fixups, t.l4, offsetof(KernelTables, l4));
+    find_fixups(fixups, t.kernel_l3, offsetof(KernelTables, kernel_l3));
+    find_fixups(fixups, t.kernel_l2[0], offsetof(KernelTables, kernel_l2));
+    find_fixups(fixups, t.kernel_l2[1], offsetof(KernelTables, kernel_l2) + sizeof(MMU::PDT));
+    find_fixups(fixups, t.linear_l3, offsetof(KernelTables, linear_l3));
+    find_fixups(fixups, t.lowmem_l3, offsetof(KernelTables, lowmem_l3));
+    find_fixups(fixups, t.lowmem_l2, offsetof(KernelTables, lowmem_l2));
+    return fixups;
+}
+
+// both are constant initialized, and end up in .data
+extern "C" {
+    KernelTables kernel_tables = build_kernel_tables();
+    KernelTableFixups kernel_table_fixups = build_kernel_table_fixups();
+}
+
+static MMU::PML4T* kernel_space; // a pointer to L4 table in linear space
+static MMU::PML4T &kernel_space_l4 = kernel_tables.l4;
+static MMU::PDPT &kernel_space_l3 = kernel_tables.kernel_l3;
+static MMU::PDT (&kernel_space_l2)[2] = kernel_tables.kernel_l2;
+
+// Linear map of physical memory. With 1gb pages the PDPT maps all of it
+// directly. Otherwise each gigabyte needs its own PDT of 2mb pages: the
+// first one is static, so that the frame allocator can start, the others
+// are allocated as the window is extended (see map_linear).
+static MMU::PDPT &linear_space_l3 = kernel_tables.linear_l3;
+static MMU::PDT linear_space_low_l2; // 2mb pages for the first 1G, when 1gb pages aren't available
+static bool gigabyte_pages; // cpu supports 1gb pages
+static unsigned linear_gigabytes; // how many PDPT entries of the linear map are populated
+
+// Device memory gets a window of its own in the kernel half, the 512gb of
+// PML4 entry 257. Its PDPT is in the image and linked from the start, so
+// that every address space shares it. Handed out bottom up, never reused
+constexpr uint64_t device_window = 0xffff808000000000ull;
+constexpr uint64_t device_window_size = 1ull << 39;
+static MMU::PDPT device_space_l3;
+static Spinlock device_lock;
+static uint64_t device_next = device_window;
+
+constexpr uint32_t MSR_PAT = 0x277;
+constexpr uint64_t PAT_WRITE_COMBINING = 0x01;
+
+// PAT entry 1 becomes write-combining (see MapFlags). Nothing used it as
+// write-through before, every cpu does the same before its first mapping
+static void init_pat() {
+    wrmsr(MSR_PAT, (rdmsr(MSR_PAT) & ~(0xffull << 8)) | PAT_WRITE_COMBINING << 8);
+}
+
+// PCIDs. The kernel vspace always uses PCID 0, other address spaces get an
+// asid on their first switch. Asids aren't reused until all of them have
+// been handed out: then the generation number changes, every cpu flushes
+// its whole TLB, and address spaces get a new asid on their next switch.
+static bool pcid_enabled;
+static bool invpcid_supported;
+static Spinlock asid_lock;
+static uint64_t asid_generation = 1;
+static uint64_t asid_bitmap[4096 / 64];
+static uint64_t cpu_asid_generation[MAX_CPUS]; // last generation each cpu flushed for
+constexpr uint64_t CR3_NOFLUSH = 1ull << 63;
+
+// fill a PDT with the 2mb pages of the linear map for the given gigabyte
+static void fill_linear_l2(MMU::PDT &table, uint64_t gigabyte) {
+    for (int j = 0; j < 512; j++) {
+        auto &l2entry = table.entries[j];
+        l2entry.pagesize() = true;
+        l2entry.set_addr((gigabyte << L3LSB) + (uint64_t(j) << L2LSB));
+        l2entry.present() = true;
+        l2entry.writable() = true;
+        l2entry.global() = true;
+        l2entry.execute_disable() = true;
+    }
+}
+
+void MMU::init_kernel_vspace() {
+    // _start already loaded kernel_tables, so we are running in the kernel
+    // address space. What is left is what depends on the machine.
+    uint64_t const start = rdtsc();
+
+    // the image mapping is as big as the largest kernel we allow, trim it
+    uint64_t const kernel_virtual_base = reinterpret_cast<uint64_t>(&KERNEL_VIRTUAL_BASE);
+    uint64_t const kernel_virtual_base_end = reinterpret_cast<uint64_t>(&KERNEL_VIRTUAL_BASE_END);
+    for (auto addr = kernel_virtual_base_end; addr < kernel_virtual_base + (KERNEL_IMAGE_PAGES << L2LSB); addr += 1 << L2LSB) {
+        kernel_space_l2[(addr >> L3LSB) & 1].entries[(addr >> L2LSB) & 511].reset();
+    }
+
+    gigabyte_pages = cpu_has_pdpe1gb();
+    if (gigabyte_pages) {
+        // all 512gb are already there, in 1gb pages
+        linear_gigabytes = 512;
+    } else {
+        // Those 1gb pages are invalid on this cpu. Nobody touched them (that
+        // would fault), so they aren't cached either. Map the first gigabyte
+        // with 2mb pages, the rest comes once we have an allocator
+        for (auto &l3entry: linear_space_l3.entries) {
+            l3entry.reset();
+        }
+        fill_linear_l2(linear_space_low_l2, 0);
+        auto &l3entry = linear_space_l3.entries[0];
+        l3entry.set_addr(ktp(&linear_space_low_l2));
+        l3entry.present() = true;
+        l3entry.writable() = true;
+        l3entry.execute_disable() = true;
+        linear_gigabytes = 1;
+    }
+    // this used to be 512 static PDTs, 2mb worth of tables and 262144 entries
+    printk(LogLevel::Info, "Linear map: %s pages, %dG mapped with %d KiB of PDTs instead of 2048, set up in %d cycles\n",
+        gigabyte_pages ? "1gb" : "2mb", linear_gigabytes, gigabyte_pages ? 0 : 4, rdtsc() - start);
+
+    auto &device_entry = kernel_space_l4.entries[(device_window >> L4LSB) & 511];
+    device_entry.set_addr(ktp(&device_space_l3));
+    device_entry.present() = true;
+    device_entry.writable() = true;
+    init_pat();
+
     // save the linear space pointer to PML4T into kernel_space, for future reference
     uint64_t l4physaddr = ktp(&kernel_space_l4);
     kernel_space = static_cast<MMU::PML4T*>(ptl(l4physaddr));
-    // switch to new address space
-    // kernel_space->switchTo();
+
+    // turning on PGE flushes the whole TLB, including what we trimmed above
+    write_cr4(read_cr4() | CR4_PGE);
+    invpcid_supported = cpu_has_invpcid();
+    // for good: the application processors copy it, and switching it off
+    // under them would leave them with PCIDs nobody flushes
+    if (cpu_has_pcid()) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_enabled = true;
+        asid_bitmap[0] |= 1; // PCID 0 belongs to the kernel vspace
+    }
+    printk(LogLevel::Info, "TLB: global kernel pages, PCID %s, INVPCID %s\n",
+        pcid_enabled ? "on" : "off", invpcid_supported ? "on" : "off");
+}
+
+void MMU::init_cpu() {
+    // same TLB and PAT setup as the bootstrap processor got in init_kernel_vspace
+    init_pat();
+    uint64_t const cr4 = read_cr4() | CR4_PGE;
+    write_cr4(pcid_enabled ? cr4 | CR4_PCIDE : cr4);
+}
+
+bool MMU::uses_pcid() {
+    return pcid_enabled;
+}
+
+// drop every non global translation, for every PCID
+static void flush_all_contexts() {
+    if (invpcid_supported) {
+        invpcid(InvpcidType::AllButGlobal, 0);
+    } else {
+        // toggling PGE drops everything
+        uint64_t const cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    }
+}
+
+// TLB shootdown: before unmapRange returns, the other cpus drop whatever
+// they may cache for the address space (all of them for the kernel half,
+// or with PCIDs, where inactive spaces stay cached). One shootdown at a
+// time: a cpu waiting for its turn serves the current one meanwhile, so
+// two cpus flushing at once with interrupts off don't wait on each other.
+static bool shootdown_ready;
+static struct {
+    Spinlock lock;
+    uint64_t pending; // cpus yet to flush
+} shootdown;
+static MMU::PML4T* cpu_space[MAX_CPUS]; // what each cpu has in cr3
+
+static void serve_shootdown() {
+    uint64_t const bit = 1ull << cpu_index();
+    if (__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) & bit) {
+        // toggling PGE drops everything, for every PCID
+        uint64_t const cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+        __atomic_fetch_and(&shootdown.pending, ~bit, __ATOMIC_RELEASE);
+    }
 }
-void MMU::PML4T::switchTo() {
+
+static void remote_flush(MMU::PML4T* space, bool kernel) {
+    if (!__atomic_load_n(&shootdown_ready, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    IrqGuard irq;
+    unsigned const self = cpu_index();
+    // the new entries are visible before we look at who may hold old ones
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t targets = 0;
+    for (unsigned cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu != self && __atomic_load_n(&per_cpu[cpu].online, __ATOMIC_RELAXED) &&
+                (kernel || pcid_enabled || __atomic_load_n(&cpu_space[cpu], __ATOMIC_RELAXED) == space)) {
+            targets |= 1ull << cpu;
+        }
+    }
+    if (!targets) {
+        return;
+    }
+    while (!shootdown.lock.try_lock()) {
+        serve_shootdown();
+        asm volatile("pause");
+    }
+    __atomic_store_n(&shootdown.pending, targets, __ATOMIC_RELEASE);
+    for (uint64_t mask = targets; mask; mask &= mask - 1) {
+        lapic.send_ipi(per_cpu[__builtin_ctzll(mask)].apic_id, VECTOR_TLB_SHOOTDOWN);
+    }
+    while (__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    shootdown.lock.unlock();
+}
+
+void MMU::init_smp() {
+    interrupt_attach(VECTOR_TLB_SHOOTDOWN, [](InterruptFrame&, void*) {
+        serve_shootdown();
+        lapic.eoi();
+    });
+    __atomic_store_n(&shootdown_ready, true, __ATOMIC_RELEASE);
+}
+
+static uint64_t assign_context(MMU::PML4T* space) {
+    LockGuard guard(asid_lock);
+    if ((space->context >> 12) == asid_generation) {
+        return space->context;
+    }
+    for (int round = 0; round < 2; round++) {
+        for (unsigned word = 0; word < 4096 / 64; word++) {
+            if (~asid_bitmap[word]) {
+                unsigned bit = __builtin_ctzll(~asid_bitmap[word]);
+                asid_bitmap[word] |= 1ull << bit;
+                __atomic_store_n(&space->context, asid_generation << 12 | (word * 64 + bit), __ATOMIC_RELAXED);
+                return space->context;
+            }
+        }
+        // out of asids, start a new generation
+        for (auto &word: asid_bitmap) {
+            word = 0;
+        }
+        asid_bitmap[0] = 1;
+        __atomic_store_n(&asid_generation, asid_generation + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+void MMU::PML4T::switchTo(bool keep_tlb) {
     uint64_t physAddr = ltp(this);
+    if (pcid_enabled) {
+        IrqGuard irq;
+        uint64_t const generation = __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE);
+        uint64_t asid = 0;
+        if (this != kernel_space) {
+            uint64_t ctx = __atomic_load_n(&context, __ATOMIC_RELAXED);
+            if ((ctx >> 12) != generation) {
+                ctx = assign_context(this);
+            }
+            asid = ctx & 0xfff;
+        }
+        auto &seen = cpu_asid_generation[cpu_index()];
+        if (seen != __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE)) {
+            // asids got recycled, whatever we cached for them is someone else's
+            flush_all_contexts();
+            seen = asid_generation;
+        }
+        physAddr |= asid;
+        if (!__atomic_exchange_n(&tlb_stale, false, __ATOMIC_ACQ_REL) && keep_tlb) {
+            physAddr |= CR3_NOFLUSH;
+        }
+    }
     asm(R"(
         mov %0,%%cr3
     )"
         :
-        : "r"(physAddr) );
+        : "r"(physAddr) : "memory");
+    __atomic_store_n(&cpu_space[cpu_index()], this, __ATOMIC_RELAXED);
+}
+
+void* MMU::map_device(uint64_t paddr, uint64_t len, uint64_t caching) {
+    uint64_t const offset = paddr & (page_size(1) - 1);
+    uint64_t const base = paddr - offset;
+    uint64_t const size = (len + offset + page_size(1) - 1) & ~(page_size(1) - 1);
+    // same offset in a 2mb page as the device memory, so that big BARs
+    // get big pages
+    uint64_t const align = size >= page_size(2) ? page_size(2) : page_size(1);
+    uint64_t const skew = base & (align - 1);
+    uint64_t v;
+    {
+        LockGuard guard(device_lock);
+        v = ((device_next - skew + align - 1) & ~(align - 1)) + skew;
+        if (!size || size > device_window + device_window_size - v) {
+            return nullptr;
+        }
+        device_next = v + size;
+    }
+    uint64_t const flags = Writable | Global | NoExecute | (caching & Uncacheable);
+    if (kernel_space->mapRange(reinterpret_cast<void*>(v), base, size, flags) != MapResult::Ok) {
+        return nullptr;
+    }
+    return reinterpret_cast<void*>(v + offset);
+}
+
+MMU::PML4T* MMU::create_vspace() {
+    auto space = new PML4T;
+    if (!space) {
+        return nullptr;
+    }
+    // kernel half is shared: same PDPTs
+    for (int i = 256; i < 512; i++) {
+        space->entries[i] = kernel_space->entries[i];
+    }
+    return space;
+}
+
+void MMU::destroy_vspace(PML4T* space) {
+    if (space == kernel_space || space->active()) {
+        return;
+    }
+    space->unmapRange(nullptr, 1ull << 47);
+    // its asid is retired until the next generation
+    delete space;
 }
 
 MMU::PML4T* MMU::get_kernel_vspace() {
     return kernel_space;
 }
 
+MMU::PML4T* MMU::get_current_vspace() {
+    return static_cast<PML4T*>(ptl(read_cr3() & PageEntry<4>::address_bits));
+}
+
 MMU::PDPTE MMU::get_kernel_vmap() {
     uint64_t addr = reinterpret_cast<uint64_t>(&KERNEL_VIRTUAL_BASE);
     return kernel_space_l3.entries[(addr >> L3LSB) & 511];
-}
\ No newline at end of file
+}
+uint64_t MMU::linear_limit() {
+    return uint64_t(linear_gigabytes) << L3LSB;
+}
+
+void MMU::map_linear(uint64_t limit) {
+    if (limit > MAX_PHYSADDR + 1) {
+        limit = MAX_PHYSADDR + 1;
+    }
+    unsigned const gigabytes = (limit + (1ull << L3LSB) - 1) >> L3LSB;
+    unsigned const tables_before = linear_gigabytes;
+    uint64_t const start = rdtsc();
+    while (linear_gigabytes < gigabytes) {
+        auto table = new PDT;
+        if (!table) {
+            break;
+        }
+        fill_linear_l2(*table, linear_gigabytes);
+        // not present entries are never cached by the tlb, no need to flush
+        auto &l3entry = linear_space_l3.entries[linear_gigabytes];
+        l3entry.set_addr(ltp(table));
+        l3entry.present() = true;
+        l3entry.writable() = true;
+        l3entry.execute_disable() = true;
+        linear_gigabytes++;
+    }
+    if (linear_gigabytes != tables_before) {
+        printk(LogLevel::Info, "Linear map extended to %dG with %d KiB of page tables in %d cycles\n",
+            linear_gigabytes, (linear_gigabytes - tables_before) * sizeof(PDT) >> 10, rdtsc() - start);
+    }
+}
+
+// Page table walking.
+// Levels are numbered like in the Intel manuals: 4 is the PML4T, 1 the PT.
+template<int level> struct Level;
+template<> struct Level<1> { using Table = MMU::PT; using Entry = MMU::PTE; };
+template<> struct Level<2> { using Table = MMU::PDT; using Entry = MMU::PDE; };
+template<> struct Level<3> { using Table = MMU::PDPT; using Entry = MMU::PDPTE; };
+template<> struct Level<4> { using Table = MMU::PML4T; using Entry = MMU::PML4E; };
+
+constexpr unsigned table_index(uint64_t vaddr, int level) {
+    return (vaddr >> (L1LSB + 9 * (level - 1))) & 511;
+}
+
+// a leaf maps memory, as opposed to pointing at the next table
+template<int level>
+static bool is_leaf(typename Level<level>::Entry &entry) {
+    return level == 1 || (level < 4 && entry.pagesize());
+}
+
+template<int level>
+static typename Level<level - 1>::Table* next_table(typename Level<level>::Entry &entry) {
+    return static_cast<typename Level<level - 1>::Table*>(ptl(entry.get_addr()));
+}
+
+// Collects what has to be invalidated and does it all at once. A handful
+// of invlpg are cheaper than refilling the whole TLB, past that it's the
+// other way around. Frames that were mapped are given back after the
+// flush, when no cpu can write to them anymore, and page tables that were
+// unlinked are freed then too: until the shootdown a page walker, or a
+// paging-structure cache, may still follow the old link.
+class TlbBatch {
+    static constexpr unsigned max_pages = 32;
+    MMU::PML4T* const space;
+    bool const kernel; // the changes are in the kernel half, shared by all address spaces
+    uint64_t pages[max_pages];
+    unsigned count = 0;
+    bool overflow = false;
+    bool global = false;
+    bool nonglobal = false;
+    uint64_t released[max_pages];
+    unsigned released_count = 0;
+    void* tables[max_pages]; // from their slab cache
+    unsigned table_count = 0;
+
+    void flush_local() {
+        if (overflow) {
+            uint64_t const cr4 = read_cr4();
+            if (global) {
+                // toggling PGE drops global entries too
+                write_cr4(cr4 & ~CR4_PGE);
+                write_cr4(cr4);
+            } else {
+                asm volatile("mov %0, %%cr3" : : "r"(read_cr3() | (pcid_enabled ? CR3_NOFLUSH : 0)) : "memory");
+                if (pcid_enabled) {
+                    // with the no-flush bit cr3 reload keeps everything, be explicit
+                    invpcid_supported ? invpcid(InvpcidType::Context, read_cr3() & 0xfff) : flush_all_contexts();
+                }
+            }
+        } else {
+            // invlpg also drops global entries for the address
+            for (unsigned i = 0; i < count; i++) {
+                asm volatile("invlpg (%0)" : : "r"(pages[i]) : "memory");
+            }
+        }
+    }
+public:
+    TlbBatch(MMU::PML4T* space, bool kernel): space{space}, kernel{kernel} {}
+    void add(uint64_t vaddr, uint64_t flags) {
+        // invlpg on any address of a large page drops the whole page
+        if (flags & MMU::Global) {
+            global = true;
+        } else {
+            nonglobal = true;
+        }
+        if (count == max_pages) {
+            overflow = true;
+        } else {
+            pages[count++] = vaddr;
+        }
+    }
+    // a whole table of mappings went away: invlpg of one address drops
+    // the paging-structure caches, but only that page of the TLB
+    void add_table() {
+        nonglobal = true;
+        global = global || kernel; // kernel half entries may be global
+        overflow = true;
+    }
+    // an anonymous frame that was unmapped
+    void release(uint64_t paddr) {
+        if (released_count == max_pages) {
+            // nothing says the batch covers the pages these frames were
+            // mapped at: without a full flush they'd be freed with live
+            // TLB entries
+            flush_all();
+        }
+        released[released_count++] = paddr;
+    }
+    // a page table that is no longer linked anywhere
+    void free_table(void* table) {
+        if (table_count == max_pages) {
+            // the unlinked tables are only covered by what's added after
+            // them: drop everything instead
+            flush_all();
+        }
+        tables[table_count++] = table;
+    }
+    void flush() {
+        if (count || overflow) {
+            flush_tlbs();
+        }
+        for (unsigned i = 0; i < released_count; i++) {
+            frame_allocator.release(released[i]);
+        }
+        released_count = 0;
+        for (unsigned i = 0; i < table_count; i++) {
+            kernel::SlabCache::owner(tables[i])->free(tables[i]);
+        }
+        table_count = 0;
+    }
+private:
+    void flush_all() {
+        add_table();
+        flush();
+    }
+    void flush_tlbs() {
+        if (kernel) {
+            flush_local();
+            // other PCIDs may cache non global kernel entries, or the tables we freed
+            if (pcid_enabled && nonglobal) {
+                flush_all_contexts();
+            }
+        } else if (space->active()) {
+            flush_local();
+        } else if (pcid_enabled) {
+            // the TLB may still hold entries of this address space, under its asid
+            uint64_t const ctx = __atomic_load_n(&space->context, __ATOMIC_RELAXED);
+            if (!ctx) {
+                // never ran, nothing cached
+            } else if (invpcid_supported && (ctx >> 12) == asid_generation) {
+                if (overflow) {
+                    invpcid(InvpcidType::Context, ctx & 0xfff);
+                } else {
+                    for (unsigned i = 0; i < count; i++) {
+                        invpcid(InvpcidType::Address, ctx & 0xfff, pages[i]);
+                    }
+                }
+            } else {
+                space->tlb_stale = true;
+            }
+        }
+        remote_flush(space, kernel);
+        count = 0;
+        overflow = global = nonglobal = false;
+    }
+};
+
+// flags of a leaf entry that make up the mapping attributes
+constexpr uint64_t attribute_bits = MMU::Writable | MMU::User | MMU::WriteThrough |
+    MMU::CacheDisable | MMU::Global | MMU::NoExecute;
+// and those of small pages, where the software bits mean something (in the
+// kernel tables they mark entries to relocate)
+constexpr uint64_t software_bits = MMU::Anonymous | MMU::CopyOnWrite;
+constexpr uint64_t page_bits = attribute_bits | software_bits;
+
+template<int level>
+constexpr uint64_t leaf_bits = level == 1 ? page_bits : attribute_bits;
+
+template<int level>
+static void make_leaf(typename Level<level>::Entry &entry, uint64_t paddr, uint64_t flags) {
+    typename Level<level>::Entry leaf{flags & leaf_bits<level>};
+    if (level > 1) {
+        leaf.pagesize() = true;
+    }
+    leaf.set_addr(paddr);
+    leaf.present() = true;
+    entry = leaf;
+}
+
+// intermediate entries are permissive, the leaves decide
+template<int level>
+static void make_link(typename Level<level>::Entry &entry, void* table, uint64_t flags) {
+    typename Level<level>::Entry link{};
+    link.set_addr(ltp(table));
+    link.present() = true;
+    link.writable() = true;
+    link.user_accessible() = !!(flags & MMU::User);
+    entry = link;
+}
+
+// a table the caller already unlinked, and those below it, freed along
+// with the anonymous frames they map once the batch is flushed
+template<int level>
+static void free_table(typename Level<level>::Table* table, TlbBatch &tlb) {
+    for (auto &entry: table->entries) {
+        if (!entry.present()) {
+            continue;
+        }
+        if (!is_leaf<level>(entry)) {
+            if constexpr (level > 1) {
+                free_table<level - 1>(next_table<level>(entry), tlb);
+            }
+        } else if (level == 1 && (entry.data & MMU::Anonymous)) {
+            tlb.release(entry.get_addr());
+        }
+    }
+    // tables in the kernel image are not ours to free
+    if (kernel::SlabCache::owner(table) == &Level<level>::Table::cache()) {
+        tlb.free_table(table);
+    }
+}
+
+// A table whose entries map 512 contiguous pages with the same attributes
+// can be replaced by one page of the next level.
+template<int level>
+static bool promotable(typename Level<level>::Table* table, uint64_t &paddr, uint64_t &flags) {
+    auto &first = table->entries[0];
+    if (!first.present() || !is_leaf<level>(first)) {
+        return false;
+    }
+    paddr = first.get_addr();
+    flags = first.data & leaf_bits<level>;
+    // anonymous frames are released one by one
+    if (flags & ~attribute_bits) {
+        return false;
+    }
+    if (paddr & (MMU::page_size(level + 1) - 1)) {
+        return false;
+    }
+    for (unsigned i = 1; i < 512; i++) {
+        auto &entry = table->entries[i];
+        if (!entry.present() || !is_leaf<level>(entry) ||
+            entry.get_addr() != paddr + i * MMU::page_size(level) ||
+            (entry.data & leaf_bits<level>) != flags) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<int level>
+static MMU::MapResult map_in(typename Level<level>::Table* table, uint64_t &vaddr, uint64_t &paddr, uint64_t &len, uint64_t flags, TlbBatch &tlb) {
+    bool const huge_ok = (level < 3 || (level == 3 && gigabyte_pages)) && !(flags & software_bits);
+    for (unsigned index = table_index(vaddr, level); len && index < 512; index++) {
+        auto &entry = table->entries[index];
+        if constexpr (level == 1) {
+            if (entry.present()) {
+                return MMU::MapResult::AlreadyMapped;
+            }
+            make_leaf<level>(entry, paddr, flags);
+            vaddr += MMU::page_size(level);
+            paddr += MMU::page_size(level);
+            len -= MMU::page_size(level);
+        } else {
+            uint64_t const span = level < 4 ? MMU::page_size(level) : 0;
+            if (level < 4 && huge_ok && !entry.present() && !((vaddr | paddr) & (span - 1)) && len >= span) {
+                make_leaf<level>(entry, paddr, flags);
+                vaddr += span;
+                paddr += span;
+                len -= span;
+                continue;
+            }
+            if (entry.present() && is_leaf<level>(entry)) {
+                return MMU::MapResult::AlreadyMapped;
+            }
+            if (!entry.present()) {
+                auto child = new typename Level<level - 1>::Table;
+                if (!child) {
+                    return MMU::MapResult::NoMemory;
+                }
+                make_link<level>(entry, child, flags);
+            } else if (flags & MMU::User) {
+                entry.user_accessible() = true;
+            }
+            auto child = next_table<level>(entry);
+            uint64_t const child_vaddr = vaddr;
+            auto result = map_in<level - 1>(child, vaddr, paddr, len, flags, tlb);
+            if (result != MMU::MapResult::Ok) {
+                return result;
+            }
+            // the table may now describe a single larger page
+            uint64_t leaf_paddr, leaf_flags;
+            if (level < 4 && huge_ok && promotable<level - 1>(child, leaf_paddr, leaf_flags)) {
+                make_leaf<level>(entry, leaf_paddr, leaf_flags);
+                tlb.add(child_vaddr & ~(span - 1), leaf_flags);
+                free_table<level - 1>(child, tlb);
+            }
+        }
+    }
+    return MMU::MapResult::Ok;
+}
+
+template<int level>
+static void unmap_in(typename Level<level>::Table* table, uint64_t &vaddr, uint64_t &len, TlbBatch &tlb) {
+    uint64_t const span = level < 4 ? MMU::page_size(level) : 1ull << L4LSB;
+    for (unsigned index = table_index(vaddr, level); len && index < 512; index++) {
+        auto &entry = table->entries[index];
+        uint64_t const offset = vaddr & (span - 1);
+        uint64_t const chunk = span - offset < len ? span - offset : len;
+        bool const whole = !offset && chunk == span;
+        if (entry.present() && is_leaf<level>(entry)) {
+            tlb.add(vaddr, entry.data);
+            if (level == 1 && (entry.data & MMU::Anonymous)) {
+                tlb.release(entry.get_addr());
+            }
+            if constexpr (level > 1) {
+                if (!whole) {
+                    // only part of a large page goes away: split it into
+                    // pages of the next level, then unmap from those
+                    auto child = new typename Level<level - 1>::Table;
+                    if (child) {
+                        uint64_t const base = entry.get_addr();
+                        uint64_t const flags = entry.data & attribute_bits;
+                        for (unsigned i = 0; i < 512; i++) {
+                            make_leaf<level - 1>(child->entries[i], base + i * MMU::page_size(level - 1), flags);
+                        }
+                        make_link<level>(entry, child, flags);
+                        uint64_t child_len = chunk;
+                        unmap_in<level - 1>(child, vaddr, child_len, tlb);
+                        len -= chunk;
+                        continue;
+                    }
+                    // can't split, drop all of it rather than leave memory mapped
+                }
+            }
+            entry.reset();
+        } else if (entry.present()) {
+            if constexpr (level > 1) {
+                if (whole) {
+                    auto const child = next_table<level>(entry);
+                    entry.reset();
+                    tlb.add_table();
+                    free_table<level - 1>(child, tlb);
+                } else {
+                    uint64_t child_len = chunk;
+                    unmap_in<level - 1>(next_table<level>(entry), vaddr, child_len, tlb);
+                    len -= chunk;
+                    continue;
+                }
+            }
+        }
+        vaddr += chunk;
+        len -= chunk;
+    }
+}
+
+// Holds the lock of an address space, with interrupts off. The holder may
+// be waiting for this cpu to answer a shootdown, so serve it while waiting,
+// like remote_flush does.
+static void lock_serving(Spinlock& lock) {
+    while (!lock.try_lock()) {
+        serve_shootdown();
+        asm volatile("pause");
+    }
+}
+
+class SpaceGuard {
+    IrqGuard irq;
+    Spinlock& lock;
+public:
+    SpaceGuard(MMU::PML4T* space): lock{space->lock} {
+        lock_serving(lock);
+    }
+    ~SpaceGuard() {
+        lock.unlock();
+    }
+    SpaceGuard(const SpaceGuard&) = delete;
+    SpaceGuard& operator = (const SpaceGuard&) = delete;
+};
+
+// The same for two spaces, locked in address order so that two cpus
+// locking the same pair can't each wait for the other. A space given twice
+// is locked once.
+class SpacePairGuard {
+    IrqGuard irq;
+    Spinlock& first;
+    Spinlock* const second;
+public:
+    SpacePairGuard(MMU::PML4T* a, MMU::PML4T* b):
+        first{(a < b ? a : b)->lock}, second{a == b ? nullptr : &(a < b ? b : a)->lock} {
+        lock_serving(first);
+        if (second) {
+            lock_serving(*second);
+        }
+    }
+    ~SpacePairGuard() {
+        if (second) {
+            second->unlock();
+        }
+        first.unlock();
+    }
+    SpacePairGuard(const SpacePairGuard&) = delete;
+    SpacePairGuard& operator = (const SpacePairGuard&) = delete;
+};
+
+// the user half, where vmas keeps track of the mappings
+constexpr bool user_range(uint64_t vaddr, uint64_t len) {
+    return vaddr < 1ull << 47 && len <= (1ull << 47) - vaddr;
+}
+
+MMU::MapResult MMU::PML4T::mapRange(void* vaddr, uint64_t paddr, uint64_t len, uint64_t flags) {
+    uint64_t v = reinterpret_cast<uint64_t>(vaddr);
+    if ((v | paddr | len) & (page_size(1) - 1)) {
+        return MapResult::NoTable;
+    }
+    SpaceGuard guard(this);
+    if (user_range(v, len)) {
+        if (vmas.overlaps(v, v + len)) {
+            return MapResult::AlreadyMapped;
+        }
+        // first, so that a failure past this point leaves nothing unaccounted
+        if (!vmas.insert({v, v + len, flags & page_bits})) {
+            return MapResult::NoMemory;
+        }
+    }
+    TlbBatch tlb(this, v >> 63);
+    auto result = map_in<4>(this, v, paddr, len, flags, tlb);
+    // only promotions replace live entries
+    tlb.flush();
+    return result;
+}
+
+void MMU::PML4T::unmapRange(void* vaddr, uint64_t len) {
+    uint64_t v = reinterpret_cast<uint64_t>(vaddr) & ~(page_size(1) - 1);
+    SpaceGuard guard(this);
+    if (user_range(v, len)) {
+        vmas.remove(v, v + len);
+    }
+    TlbBatch tlb(this, v >> 63);
+    unmap_in<4>(this, v, len, tlb);
+    tlb.flush();
+}
+
+bool MMU::PML4T::rangeFree(void* vaddr, uint64_t len) {
+    uint64_t const v = reinterpret_cast<uint64_t>(vaddr);
+    return !vmas.overlaps(v, v + len);
+}
+
+MMU::MapResult MMU::PML4T::mapTable(void* vaddr, uint64_t paddr, int level) {
+    uint64_t v = reinterpret_cast<uint64_t>(vaddr);
+    if (level < 1 || level > 3) {
+        return MapResult::NoTable;
+    }
+    // walk down to the table that holds the entry for the new one
+    PageEntry<4>* table = reinterpret_cast<PageEntry<4>*>(entries);
+    for (int current = 4; current > level + 1; current--) {
+        auto &entry = table[table_index(v, current)];
+        if (!entry.present() || (current < 4 && entry.pagesize())) {
+            return MapResult::NoTable;
+        }
+        table = static_cast<PageEntry<4>*>(ptl(entry.get_addr()));
+    }
+    auto &entry = table[table_index(v, level + 1)];
+    if (entry.present()) {
+        return MapResult::AlreadyMapped;
+    }
+    entry.reset();
+    entry.set_addr(paddr);
+    entry.present() = true;
+    entry.writable() = true;
+    return MapResult::Ok;
+}
+
+MMU::MapResult MMU::PML4T::mapPage(void* vaddr, uint64_t paddr, int level, uint64_t flags) {
+    uint64_t v = reinterpret_cast<uint64_t>(vaddr);
+    if (level < 1 || level > 3 || ((v | paddr) & (page_size(level) - 1))) {
+        return MapResult::NoTable;
+    }
+    PageEntry<4>* table = reinterpret_cast<PageEntry<4>*>(entries);
+    for (int current = 4; current > level; current--) {
+        auto &entry = table[table_index(v, current)];
+        if (!entry.present()) {
+            return MapResult::NoTable;
+        }
+        if (current < 4 && entry.pagesize()) {
+            return MapResult::AlreadyMapped;
+        }
+        table = static_cast<PageEntry<4>*>(ptl(entry.get_addr()));
+    }
+    auto &entry = table[table_index(v, level)];
+    if (entry.present()) {
+        return MapResult::AlreadyMapped;
+    }
+    // same bits at every level, except that pagesize is PAT in a PTE
+    entry.data = flags & attribute_bits;
+    if (level > 1) {
+        entry.pagesize() = true;
+    }
+    entry.data |= paddr;
+    entry.present() = true;
+    return MapResult::Ok;
+}
+
+uint64_t MMU::PML4T::translate(void* vaddr, int* level, uint64_t* flags) {
+    uint64_t v = reinterpret_cast<uint64_t>(vaddr);
+    PageEntry<4>* table = reinterpret_cast<PageEntry<4>*>(entries);
+    for (int current = 4; current > 0; current--) {
+        auto &entry = table[table_index(v, current)];
+        if (!entry.present()) {
+            break;
+        }
+        if (current == 1 || (current < 4 && entry.pagesize())) {
+            if (level) {
+                *level = current;
+            }
+            if (flags) {
+                *flags = entry.data & (current == 1 ? page_bits : attribute_bits);
+            }
+            uint64_t const size = page_size(current);
+            return (entry.data & PageEntry<4>::address_bits & ~(size - 1)) | (v & (size - 1));
+        }
+        table = static_cast<PageEntry<4>*>(ptl(entry.get_addr()));
+    }
+    if (level) {
+        *level = 0;
+    }
+    return 0;
+}
+
+bool MMU::PML4T::active() {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return (cr3 & PageEntry<4>::address_bits) == ltp(this);
+}
+
+// Demand paging. Anonymous memory is only a range in vmas until touched:
+// a read fault maps the zero frame read-only, a write fault gives the page
+// a zeroed frame of its own. mapOnFault ranges map their backing frames
+// the same way, read-only, copied on write when writable. Pages shared by
+// clone_vspace are read-only and CopyOnWrite in every space: the first
+// write copies the frame, unless the others dropped it meanwhile.
+static uint64_t zero_frame;
+static MMU::FaultStats stats;
+
+// the last page stays unmapped, see USER_TOP in syscall.h
+constexpr uint64_t user_top = (1ull << 47) - 0x1000;
+
+MMU::MapResult MMU::PML4T::mapAnonymous(void* vaddr, uint64_t len, uint64_t flags) {
+    uint64_t v = reinterpret_cast<uint64_t>(vaddr);
+    if (((v | len) & (page_size(1) - 1)) || !len || !(flags & User) || !user_range(v, len)) {
+        return MapResult::NoTable;
+    }
+    SpaceGuard guard(this);
+    if (vmas.overlaps(v, v + len)) {
+        return MapResult::AlreadyMapped;
+    }
+    return vmas.insert({v, v + len, (flags & attribute_bits & ~Global) | Anonymous}) ? MapResult::Ok : MapResult::NoMemory;
+}
+
+MMU::MapResult MMU::PML4T::mapOnFault(void* vaddr, uint64_t paddr, uint64_t len, uint64_t flags) {
+    uint64_t v = reinterpret_cast<uint64_t>(vaddr);
+    if (((v | paddr | len) & (page_size(1) - 1)) || !len || !paddr || !(flags & User) || !user_range(v, len)) {
+        return MapResult::NoTable;
+    }
+    SpaceGuard guard(this);
+    if (vmas.overlaps(v, v + len)) {
+        return MapResult::AlreadyMapped;
+    }
+    return vmas.insert({v, v + len, flags & attribute_bits & ~Global, paddr}) ? MapResult::Ok : MapResult::NoMemory;
+}
+
+void* MMU::PML4T::reserveAnonymous(uint64_t len, uint64_t flags) {
+    if ((len & (page_size(1) - 1)) || !len || !(flags & User)) {
+        return nullptr;
+    }
+    SpaceGuard guard(this);
+    // page 0 stays unmapped, for null pointers
+    uint64_t const v = vmas.find_gap(len, page_size(1), user_top);
+    if (!v || !vmas.insert({v, v + len, (flags & attribute_bits & ~Global) | Anonymous})) {
+        return nullptr;
+    }
+    return reinterpret_cast<void*>(v);
+}
+
+enum class Fault {
+    Resolved,
+    Spurious,
+    Bad,
+    NoMemory,
+};
+
+static Fault demand_zero(MMU::PTE &entry, bool write, uint64_t flags) {
+    if (!write) {
+        // reads share the zero frame until the first write
+        make_leaf<1>(entry, zero_frame, (flags & MMU::Writable) ? (flags & ~MMU::Writable) | MMU::CopyOnWrite : flags);
+        __atomic_fetch_add(&stats.zero_maps, 1, __ATOMIC_RELAXED);
+        return Fault::Resolved;
+    }
+    if (!(flags & MMU::Writable)) {
+        return Fault::Bad;
+    }
+    uint64_t const frame = frame_allocator.alloc();
+    if (!frame) {
+        return Fault::NoMemory;
+    }
+    memset(ptl(frame), 0, MMU::page_size(1));
+    make_leaf<1>(entry, frame, flags | MMU::Anonymous);
+    __atomic_fetch_add(&stats.zero_fills, 1, __ATOMIC_RELAXED);
+    return Fault::Resolved;
+}
+
+static Fault copy_on_write(MMU::PTE &entry, uint64_t vaddr, TlbBatch &tlb) {
+    uint64_t const old = entry.get_addr();
+    uint64_t const flags = (entry.data & attribute_bits) | MMU::Writable | MMU::Anonymous;
+    bool const anonymous = entry.data & MMU::Anonymous;
+    if (anonymous && !frame_allocator.shared(old)) {
+        // the other spaces are done with it. Only clone_vspace shares it
+        // again, under our lock. Going from read-only to writable needs no
+        // flush, a stale entry faults once more
+        make_leaf<1>(entry, old, flags);
+        __atomic_fetch_add(&stats.reuses, 1, __ATOMIC_RELAXED);
+        return Fault::Resolved;
+    }
+    uint64_t const frame = frame_allocator.alloc();
+    if (!frame) {
+        return Fault::NoMemory;
+    }
+    if (old == zero_frame) {
+        memset(ptl(frame), 0, MMU::page_size(1));
+    } else {
+        // anonymous, or a frame nobody owns (an initrd file page)
+        memcpy(ptl(frame), ptl(old), MMU::page_size(1));
+    }
+    make_leaf<1>(entry, frame, flags);
+    // other threads of the space may still read the old frame
+    tlb.add(vaddr, flags);
+    if (anonymous) {
+        tlb.release(old);
+    }
+    __atomic_fetch_add(&stats.copies, 1, __ATOMIC_RELAXED);
+    return Fault::Resolved;
+}
+
+// the page of a mapOnFault mapping: its own frame, never written. A write
+// copies it straight away
+static Fault map_backed(MMU::PTE &entry, const kernel::Vma &vma, uint64_t vaddr, bool write, TlbBatch &tlb) {
+    uint64_t const flags = vma.flags & attribute_bits;
+    if (write && !(flags & MMU::Writable)) {
+        return Fault::Bad;
+    }
+    uint64_t const frame = vma.backing + ((vaddr & ~(MMU::page_size(1) - 1)) - vma.start);
+    make_leaf<1>(entry, frame, (flags & MMU::Writable) ? (flags & ~MMU::Writable) | MMU::CopyOnWrite : flags);
+    __atomic_fetch_add(&stats.backed_maps, 1, __ATOMIC_RELAXED);
+    return write ? copy_on_write(entry, vaddr, tlb) : Fault::Resolved;
+}
+
+// vma: the mapping vaddr is in if its pages come with the faults
+// (anonymous or backed), nullptr otherwise
+template<int level>
+static Fault resolve(typename Level<level>::Table* table, uint64_t vaddr, bool write, bool fetch,
+        const kernel::Vma* vma, TlbBatch &tlb) {
+    auto &entry = table->entries[table_index(vaddr, level)];
+    if (!entry.present()) {
+        if (!vma) {
+            return Fault::Bad;
+        }
+        if constexpr (level == 1) {
+            if (fetch && (vma->flags & MMU::NoExecute)) {
+                return Fault::Bad;
+            }
+            if (vma->backing) {
+                return map_backed(entry, *vma, vaddr, write, tlb);
+            }
+            return demand_zero(entry, write, vma->flags & attribute_bits);
+        } else {
+            auto child = new typename Level<level - 1>::Table;
+            if (!child) {
+                return Fault::NoMemory;
+            }
+            make_link<level>(entry, child, vma->flags);
+        }
+    }
+    if (!entry.user_accessible()) {
+        return Fault::Bad;
+    }
+    if constexpr (level > 1) {
+        if (!is_leaf<level>(entry)) {
+            return resolve<level - 1>(next_table<level>(entry), vaddr, write, fetch, vma, tlb);
+        }
+    }
+    if (fetch && entry.execute_disable()) {
+        return Fault::Bad;
+    }
+    if (!write || entry.writable()) {
+        return Fault::Spurious;
+    }
+    if constexpr (level == 1) {
+        if (entry.data & MMU::CopyOnWrite) {
+            return copy_on_write(entry, vaddr, tlb);
+        }
+    }
+    return Fault::Bad;
+}
+
+static Fault fault_in(MMU::PML4T* space, uint64_t vaddr, bool write, bool fetch) {
+    if (vaddr >> L4LSB >= 256 || space == kernel_space || !zero_frame) {
+        return Fault::Bad;
+    }
+    // looked up without the lock, taken only for the page tables
+    kernel::Vma vma;
+    uint64_t const version = space->vmas.version();
+    bool found = space->vmas.find(vaddr, vma);
+    Fault result;
+    {
+        SpaceGuard guard(space);
+        if (space->vmas.version() != version) {
+            found = space->vmas.find(vaddr, vma);
+        }
+        TlbBatch tlb(space, false);
+        bool const on_demand = found && ((vma.flags & MMU::Anonymous) || vma.backing);
+        result = resolve<4>(space, vaddr, write, fetch, on_demand ? &vma : nullptr, tlb);
+        tlb.flush();
+    }
+    if (result == Fault::Spurious) {
+        __atomic_fetch_add(&stats.spurious, 1, __ATOMIC_RELAXED);
+    } else if (result != Fault::Resolved) {
+        __atomic_fetch_add(&stats.bad, 1, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+bool MMU::PML4T::faultIn(void* vaddr, bool write) {
+    auto const result = fault_in(this, reinterpret_cast<uint64_t>(vaddr), write, false);
+    return result == Fault::Resolved || result == Fault::Spurious;
+}
+
+MMU::MapResult MMU::PML4T::moveRange(void* vaddr, uint64_t len, PML4T* target, void* target_addr) {
+    uint64_t const source = reinterpret_cast<uint64_t>(vaddr);
+    uint64_t const dest = reinterpret_cast<uint64_t>(target_addr);
+    if (((source | dest | len) & (page_size(1) - 1)) || !len || !user_range(source, len) || !user_range(dest, len) ||
+        this == kernel_space || target == kernel_space || !zero_frame) {
+        return MapResult::NoTable;
+    }
+    SpacePairGuard guard(this, target);
+    if (target->vmas.overlaps(dest, dest + len)) {
+        return MapResult::AlreadyMapped;
+    }
+    // the target gets it all as one mapping, so it has to look like one
+    kernel::Vma vma;
+    if (!vmas.find(source, vma)) {
+        return MapResult::NoTable;
+    }
+    uint64_t const flags = vma.flags & page_bits & ~Global;
+    while (vma.end < source + len) {
+        if (!vmas.find(vma.end, vma) || (vma.flags & page_bits & ~Global) != flags) {
+            return MapResult::NoTable;
+        }
+    }
+    // first, so that a failure past this point leaves nothing unaccounted
+    if (!target->vmas.insert({dest, dest + len, flags})) {
+        return MapResult::NoMemory;
+    }
+    TlbBatch source_tlb(this, false);
+    TlbBatch target_tlb(target, false);
+    auto result = MapResult::Ok;
+    // the physical runs behind the source, as large as its pages allow
+    for (uint64_t done = 0; done < len;) {
+        uint64_t const v = source + done;
+        if (v < vma.start || v >= vma.end) {
+            vmas.find(v, vma);
+        }
+        // demand zero memory nobody touched moves as the zero frame
+        bool const on_demand = (vma.flags & Anonymous) || vma.backing;
+        auto const fault = resolve<4>(this, v, false, false, on_demand ? &vma : nullptr, source_tlb);
+        int level;
+        uint64_t page_flags;
+        uint64_t const paddr = translate(reinterpret_cast<void*>(v), &level, &page_flags);
+        if ((fault != Fault::Resolved && fault != Fault::Spurious) || !level) {
+            result = fault == Fault::NoMemory ? MapResult::NoMemory : MapResult::NoTable;
+            break;
+        }
+        uint64_t const size = page_size(level);
+        uint64_t chunk = size - (v & (size - 1));
+        chunk = chunk < len - done ? chunk : len - done;
+        // the target's share, taken before the frame is reachable from there
+        bool const anonymous = page_flags & Anonymous;
+        if (anonymous) {
+            frame_allocator.share(paddr);
+        }
+        uint64_t to = dest + done, from = paddr, left = chunk;
+        result = map_in<4>(target, to, from, left, page_flags & ~Global, target_tlb);
+        if (result != MapResult::Ok) {
+            // anonymous frames are single pages: this one didn't make it
+            if (anonymous) {
+                frame_allocator.release(paddr);
+            }
+            break;
+        }
+        done += chunk;
+    }
+    uint64_t v = result == MapResult::Ok ? source : dest;
+    uint64_t left = len;
+    if (result == MapResult::Ok) {
+        // the source's shares go with its mappings
+        vmas.remove(source, source + len);
+        unmap_in<4>(this, v, left, source_tlb);
+    } else {
+        // everything in the range is ours, it was free under the lock
+        target->vmas.remove(dest, dest + len);
+        unmap_in<4>(target, v, left, target_tlb);
+    }
+    source_tlb.flush();
+    target_tlb.flush();
+    return result;
+}
+
+// page fault error code bits
+constexpr uint64_t PF_WRITE = 1 << 1;
+constexpr uint64_t PF_USER = 1 << 2;
+constexpr uint64_t PF_RESERVED = 1 << 3;
+constexpr uint64_t PF_FETCH = 1 << 4;
+
+static void page_fault(InterruptFrame& frame, void*) {
+    uint64_t cr2;
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+    // a reserved bit set means broken page tables, nothing to resolve
+    if (!(frame.error & PF_RESERVED)) {
+        auto const result = fault_in(MMU().get_current_vspace(), cr2, frame.error & PF_WRITE, frame.error & PF_FETCH);
+        if (result == Fault::Resolved || result == Fault::Spurious) {
+            return;
+        }
+    }
+    if (!(frame.error & PF_USER)) {
+        fatal_exception(frame);
+    }
+    printk(LogLevel::Error, "thread %s: page fault at %p, error %x, cr2 %p. Killed\n", kernel::Thread::current()->name,
+        reinterpret_cast<void*>(frame.rip), frame.error, reinterpret_cast<void*>(cr2));
+    kernel::exit();
+}
+
+void MMU::init_faults() {
+    zero_frame = frame_allocator.alloc();
+    if (!zero_frame) {
+        printk(LogLevel::Error, "No zero frame, demand paging unavailable\n");
+        return;
+    }
+    memset(ptl(zero_frame), 0, page_size(1));
+    interrupt_attach(VECTOR_PAGE_FAULT, page_fault);
+}
+
+MMU::FaultStats MMU::fault_stats() {
+    FaultStats copy;
+    copy.zero_maps = __atomic_load_n(&stats.zero_maps, __ATOMIC_RELAXED);
+    copy.zero_fills = __atomic_load_n(&stats.zero_fills, __ATOMIC_RELAXED);
+    copy.copies = __atomic_load_n(&stats.copies, __ATOMIC_RELAXED);
+    copy.reuses = __atomic_load_n(&stats.reuses, __ATOMIC_RELAXED);
+    copy.backed_maps = __atomic_load_n(&stats.backed_maps, __ATOMIC_RELAXED);
+    copy.spurious = __atomic_load_n(&stats.spurious, __ATOMIC_RELAXED);
+    copy.bad = __atomic_load_n(&stats.bad, __ATOMIC_RELAXED);
+    return copy;
+}
+
+// copy the entries of source into target, a new table. Anonymous frames
+// get one more owner, and both sides lose write access to them
+template<int level>
+static bool clone_table(typename Level<level>::Table* source, typename Level<level>::Table* target,
+        uint64_t vaddr, TlbBatch &tlb) {
+    uint64_t const span = level < 4 ? MMU::page_size(level) : 1ull << L4LSB;
+    // the kernel half is shared, create_vspace set it up
+    unsigned const count = level == 4 ? 256 : 512;
+    for (unsigned index = 0; index < count; index++, vaddr += span) {
+        auto &entry = source->entries[index];
+        if (entry.present() && !is_leaf<level>(entry)) {
+            if constexpr (level > 1) {
+                auto child = new typename Level<level - 1>::Table;
+                if (!child) {
+                    return false;
+                }
+                make_link<level>(target->entries[index], child, entry.data);
+                if (!clone_table<level - 1>(next_table<level>(entry), child, vaddr, tlb)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (level == 1 && entry.present() && (entry.data & MMU::Anonymous)) {
+            frame_allocator.share(entry.get_addr());
+            if (entry.writable()) {
+                entry.writable() = false;
+                entry.data |= MMU::CopyOnWrite;
+                tlb.add(vaddr, entry.data);
+            }
+        }
+        // everything else as it is
+        target->entries[index].data = entry.data;
+    }
+    return true;
+}
+
+MMU::PML4T* MMU::clone_vspace(PML4T* source) {
+    auto space = create_vspace();
+    if (!space) {
+        return nullptr;
+    }
+    bool done;
+    {
+        SpaceGuard guard(source);
+        TlbBatch tlb(source, false);
+        // nobody else knows the new space yet, no need for its lock
+        done = space->vmas.copy(source->vmas) && clone_table<4>(source, space, 0, tlb);
+        tlb.flush();
+    }
+    if (!done) {
+        // what was cloned so far is released like any other mapping
+        destroy_vspace(space);
+        return nullptr;
+    }
+    return space;
+}
+
+template<int level>
+static void count_usage(typename Level<level>::Table* table, MMU::Usage &usage) {
+    uint64_t const pages = MMU::page_size(level) / MMU::page_size(1);
+    unsigned const count = level == 4 ? 256 : 512;
+    for (unsigned index = 0; index < count; index++) {
+        auto &entry = table->entries[index];
+        if (!entry.present()) {
+            continue;
+        }
+        if constexpr (level > 1) {
+            if (!is_leaf<level>(entry)) {
+                count_usage<level - 1>(next_table<level>(entry), usage);
+                continue;
+            }
+        }
+        usage.resident += pages;
+        if (level == 1 && entry.get_addr() == zero_frame) {
+            usage.zero++;
+        } else if (level == 1 && (entry.data & MMU::Anonymous) && frame_allocator.shared(entry.get_addr())) {
+            usage.shared++;
+        }
+        if (entry.accessed()) {
+            usage.accessed += pages;
+        }
+        if (entry.page_dirty()) {
+            usage.dirty += pages;
+        }
+    }
+}
+
+MMU::Usage MMU::PML4T::usage() {
+    Usage usage{};
+    SpaceGuard guard(this);
+    vmas.for_each([&usage](const kernel::Vma& vma) {
+        if (vma.flags & Anonymous) {
+            usage.reserved += (vma.end - vma.start) / page_size(1);
+        }
+    });
+    count_usage<4>(this, usage);
+    return usage;
+}
@@ -1,8 +1,46 @@
-
+#pragma once
 #include <cstdint>
+#include "../../slab.hpp"
+#include "../../vma.hpp"
+#include "spinlock.h"
+
+// symbols from linker. We only need their address
+extern "C" {
+    extern uint8_t BOOTSTRAP_END;
+    extern uint8_t KERNEL_VIRTUAL_BASE;
+    extern uint8_t KERNEL_VIRTUAL_BASE_END;
+}
+
+constexpr uint8_t L1LSB = 12;
+constexpr uint8_t L2LSB = 21;
+constexpr uint8_t L3LSB = 30;
+constexpr uint8_t L4LSB = 39;
+
+constexpr uint64_t MAX_PHYSADDR = (1ull<<L4LSB) - 1;
+// linear address mapped from this pointer
+const void* const linear_address_base = reinterpret_cast<void*>(0xffff800000000000ull);
+
+// from linear address space to physical address
+inline uint64_t ltp(void* linearAddress) {
+    return  reinterpret_cast<uint64_t>(linearAddress) & MAX_PHYSADDR;
+}
+// from physical address to linear mapped address
+inline void* ptl(uint64_t physical_address) {
+    return  ((char*)linear_address_base) + (physical_address & MAX_PHYSADDR);
+}
+
+// from kernel image address to physical address
+inline uint64_t ktp(uint64_t ptr) {
+    uint64_t const kernel_virtual_base = reinterpret_cast<uint64_t>(&KERNEL_VIRTUAL_BASE);
+    uint64_t const kernel_physaddr = reinterpret_cast<uint64_t>(&BOOTSTRAP_END);
+    return uint64_t{ptr - kernel_virtual_base + kernel_physaddr};
+}
+inline uint64_t ktp(void* ptr) {
+    return ktp(reinterpret_cast<uint64_t>(ptr));
+};
 
 template<typename T, typename W>
-inline T andnot(T val, W mask) {
+constexpr T andnot(T val, W mask) {
     T _mask = mask;
     val |= _mask;
     val ^= _mask;
@@ -17,31 +55,38 @@ class MMU {
     struct alignas(8) PageEntry {
         uint64_t data = 0;
 
-        void reset() {
+        constexpr PageEntry() = default;
+        constexpr PageEntry(uint64_t raw): data{raw} {}
+
+        constexpr void reset() {
             data = 0;
         }
 
-        void set_addr (uint64_t addr) {
+        // bits 12-51 may hold an address, the rest are flags
+        static constexpr uint64_t address_bits = 0x000ffffffffff000ull;
+
+        constexpr uint64_t address_mask() {
             uint64_t lsb = 1ull;
             lsb <<= (pagesize()?level * 9:9) + 3;
-            data %= lsb;
-            data |= (addr / lsb) * lsb;
+            return andnot(address_bits, lsb - 1);
         }
-        uint64_t get_addr() {
-            uint64_t lsb = 1ull;
-            lsb <<= (pagesize()?level * 9:9) + 3;
-            return (data / lsb) * lsb;
+        constexpr void set_addr (uint64_t addr) {
+            uint64_t mask = address_mask();
+            data = andnot(data, mask) | (addr & mask);
+        }
+        constexpr uint64_t get_addr() {
+            return data & address_mask();
         }
 
         struct BitReference {
-            BitReference(uint64_t &fieldref, int shift): ref{fieldref},mask{1ull<<shift} {}
+            constexpr BitReference(uint64_t &fieldref, int shift): ref{fieldref},mask{1ull<<shift} {}
 
-            BitReference& operator = (bool value) {
+            constexpr BitReference& operator = (bool value) {
                 ref = value ? ref | mask : andnot(ref,mask);
                 return *this;
             }
 
-            operator bool () {
+            constexpr operator bool () {
                 return !! (ref & mask);
             }
         private:
@@ -50,71 +95,79 @@ class MMU {
         };
 
         // pt pp
-        auto present () {
+        constexpr auto present() {
             return BitReference(data, 0);
         }
 
         // pt pp
-        auto writable() {
+        constexpr auto writable() {
             return BitReference(data, 1);
         }
 
         // pt pp
-        auto user_accessible() {
+        constexpr auto user_accessible() {
             return BitReference(data, 2);
         }
 
         // pt pp
-        auto page_writethrough() {
+        constexpr auto page_writethrough() {
             return BitReference(data, 3);
         }
 
         // pt pp
-        auto page_disablecache() {
+        constexpr auto page_disablecache() {
             return BitReference(data, 4);
         }
 
         // pt pp
-        auto accessed() {
+        constexpr auto accessed() {
             return BitReference(data, 5);
         }
 
         // pp
-        auto page_dirty() {
+        constexpr auto page_dirty() {
             return BitReference(data, 6);
         }
 
         // pt pp
-        auto pagesize() {
+        constexpr auto pagesize() {
             return BitReference(data, 7);
         }
 
         // pp
-        auto global() {
+        constexpr auto global() {
             return BitReference(data, 8);
         }
 
         // pp
-        auto pat() {
+        constexpr auto pat() {
             if (level == 1)
                 return BitReference(data, 7);
             else
                 return BitReference(data, 12);
         }
 
+        // 9-11 ignored by the cpu, available to software
+        constexpr auto available(int bit) {
+            return BitReference(data, 9 + bit);
+        }
+
         // 59-62 protection key (TODO)
 
-        auto execute_disable() {
+        constexpr auto execute_disable() {
             return BitReference(data, 63);
         }
     };
 
 public:
     struct PML4E: public PageEntry<4> {
+        using PageEntry::PageEntry;
     };
     struct PDPTE: public PageEntry<3> {
+        using PageEntry::PageEntry;
     };
     struct PDE: public PageEntry<2> {
+        using PageEntry::PageEntry;
         uint64_t translate(void* pointer) {
             uintptr_t uintp = reinterpret_cast<uint64_t>(pointer);
             uint64_t base = get_addr();
@@ -122,6 +175,7 @@ public:
         }
     };
     struct PTE: public PageEntry<1> {
+        using PageEntry::PageEntry;
         uint64_t translate(void* pointer) {
             uintptr_t uintp = reinterpret_cast<uint64_t>(pointer);
             uint64_t base = get_addr();
@@ -129,35 +183,173 @@ public:
         }
     };
 
-    struct alignas(0x1000) PT {
+    // tables created at runtime come from their own slab caches
+    struct alignas(0x1000) PT: kernel::SlabObject<PT> {
+        static constexpr const char* slab_name = "mmu-pt";
         PTE entries[512];
     };
 
-    struct alignas(0x1000) PDT {
+    struct alignas(0x1000) PDT: kernel::SlabObject<PDT> {
+        static constexpr const char* slab_name = "mmu-pdt";
         PDE entries[512];
     };
 
-    struct alignas(0x1000) PDPT {
+    struct alignas(0x1000) PDPT: kernel::SlabObject<PDPT> {
+        static constexpr const char* slab_name = "mmu-pdpt";
         PDPTE entries[512];
     };
 
     enum class MapResult {
         Ok = 0,
         AlreadyMapped = -1,
-        NoTable = -2
+        NoTable = -2,
+        NoMemory = -3
+    };
+
+    // attributes of a mapping, same bit positions as in PageEntry
+    enum MapFlags: uint64_t {
+        Writable = 1ull << 1,
+        User = 1ull << 2,
+        WriteThrough = 1ull << 3,
+        CacheDisable = 1ull << 4,
+        Global = 1ull << 8,
+        NoExecute = 1ull << 63,
+        // caching, for device memory. PWT alone selects PAT entry 1, which
+        // we turn from write-through into write-combining; PWT and PCD
+        // select entry 3, uncacheable whatever the MTRRs say
+        WriteCombining = WriteThrough,
+        Uncacheable = WriteThrough | CacheDisable,
+        // software bits, for user small pages only. Anonymous: the frame
+        // belongs to the address space, it's released with the mapping and
+        // shared copy-on-write by clone_vspace. CopyOnWrite: writable, kept
+        // read-only until the shared frame behind it is copied
+        Anonymous = 1ull << 9,
+        CopyOnWrite = 1ull << 10,
+    };
+
+    // page fault handling, for all address spaces
+    struct FaultStats {
+        uint64_t zero_maps; // reads of demand zero memory, given the zero frame
+        uint64_t zero_fills; // first writes to demand zero memory
+        uint64_t copies; // copy-on-write faults that copied the frame
+        uint64_t reuses; // copy-on-write faults on a frame nobody else had anymore
+        uint64_t backed_maps; // first touches of pages mapped with mapOnFault
+        uint64_t spurious; // already resolved, by another cpu or a stale TLB entry
+        uint64_t bad; // accesses that weren't allowed
     };
 
-    struct alignas(0x1000) PML4T {
+    // what the user half of an address space takes, read from its leaves
+    struct Usage {
+        uint64_t reserved; // 4k pages of anonymous memory, touched or not
+        uint64_t resident; // 4k pages mapped
+        uint64_t zero; // mapped to the zero frame
+        uint64_t shared; // anonymous frames other spaces map copy-on-write
+        uint64_t accessed; // pages the cpu marked accessed
+        uint64_t dirty; // and dirty
+    };
+
+    // size of the pages mapped by an entry of a level 1 (PT) to 3 (PDPT) table
+    static constexpr uint64_t page_size(int level) {
+        return 1ull << (L1LSB + 9 * (level - 1));
+    }
+
+    struct alignas(0x1000) PML4T: kernel::SlabObject<PML4T> {
+        static constexpr const char* slab_name = "mmu-pml4t";
         PML4E entries[512];
+        // PCID bookkeeping, past the 4k the cpu looks at
+        uint64_t context = 0; // asid generation << 12 | asid, 0 until first switched to
+        bool tlb_stale = false; // mappings changed while inactive and couldn't be invalidated
+        Spinlock lock; // page table changes, and writers of vmas
+        // what the user half maps, and how. Filled by mapRange, mapAnonymous
+        // and mapOnFault
+        kernel::VmaTree vmas;
         // will fail horribly if the target address space doesn't have
-        // the same stack mapped in the same address
-        void switchTo();
-        MapResult mapTable(void* vaddr, int paddr, int level);
-        MapResult mapPage(void* vaddr, int paddr, int level);
+        // the same stack mapped in the same address.
+        // Doesn't flush the TLB when PCIDs are supported, unless keep_tlb
+        // is false: then what this cpu cached for the space goes, as it
+        // would without PCIDs.
+        void switchTo(bool keep_tlb = true);
+        // install the table at paddr as the level `level` table (1 for a PT,
+        // up to 3 for a PDPT) covering vaddr. The tables above it must exist.
+        MapResult mapTable(void* vaddr, uint64_t paddr, int level);
+        // map a single page of page_size(level) at vaddr. The tables above it must exist.
+        MapResult mapPage(void* vaddr, uint64_t paddr, int level, uint64_t flags = Writable);
+        // map [vaddr, vaddr + len) to [paddr, paddr + len) using the largest
+        // pages alignment allows, allocating tables as needed. Fully
+        // populated page tables are replaced by the next larger page.
+        // In the user half the range must be free in vmas, it's added there.
+        MapResult mapRange(void* vaddr, uint64_t paddr, uint64_t len, uint64_t flags = Writable);
+        // remove any mapping in [vaddr, vaddr + len), from vmas too, splitting large pages
+        // that straddle the edges. The TLB is flushed once, at the end, on
+        // every cpu that may cache the range: don't hold a lock other cpus
+        // may be spinning on, they'd never answer.
+        void unmapRange(void* vaddr, uint64_t len);
+        // reserve [vaddr, vaddr + len) as anonymous memory, zero filled on
+        // demand. Only vmas changes, page tables come with the faults: reads
+        // map the shared zero frame, the first write to a page gives it a
+        // frame of its own
+        MapResult mapAnonymous(void* vaddr, uint64_t len, uint64_t flags = Writable | User);
+        // map [vaddr, vaddr + len) to [paddr, paddr + len) on demand, a page
+        // at a time as they are touched, for memory nobody owns and that
+        // must not change (initrd files). Read-only, and copy-on-write when
+        // flags has Writable: writes go to private anonymous copies
+        MapResult mapOnFault(void* vaddr, uint64_t paddr, uint64_t len, uint64_t flags = User);
+        // the same at the lowest free range of the user half that fits,
+        // nullptr if there's none or memory ran out
+        void* reserveAnonymous(uint64_t len, uint64_t flags = Writable | User);
+        // nothing in vmas overlaps [vaddr, vaddr + len)
+        bool rangeFree(void* vaddr, uint64_t len);
+        // do what the page fault handler would for an access at vaddr, so
+        // that the kernel can use the page through its physical address.
+        // False if the access isn't allowed or memory ran out
+        bool faultIn(void* vaddr, bool write);
+        // move the pages at [vaddr, vaddr + len), mapped all through with
+        // the same flags, to [target_addr, target_addr + len) in target,
+        // where nothing may be mapped: the frames change hands, nothing is
+        // copied. Both spaces stay locked meanwhile, so all of it moves or
+        // none of it does
+        MapResult moveRange(void* vaddr, uint64_t len, PML4T* target, void* target_addr);
+        Usage usage();
+        // physical address vaddr is mapped to, 0 if it isn't. level gets the
+        // level of the entry mapping it, flags its MapFlags.
+        uint64_t translate(void* vaddr, int* level = nullptr, uint64_t* flags = nullptr);
+        // is this the address space the cpu is using?
+        bool active();
     };
 
     void init_kernel_vspace();
+    // per-cpu part of init_kernel_vspace, for the application processors.
+    // Runs on the kernel tables, before switching to the kernel vspace
+    void init_cpu();
+    // TLB shootdowns through IPIs, before the other cpus start
+    void init_smp();
+    // PCIDs are in use, switched on at boot when the cpu has them
+    bool uses_pcid();
+    // physical addresses below this are reachable through ptl()
+    uint64_t linear_limit();
+    // extend the linear map to cover at least [0, limit). Only allocates
+    // tables when 1gb pages are not supported, otherwise everything is
+    // mapped from the start.
+    void map_linear(uint64_t limit);
     PML4T* get_kernel_vspace();
+    // the one in cr3
+    PML4T* get_current_vspace();
+    // map device memory (PCI BARs) in the kernel half, Uncacheable or
+    // WriteCombining, for good: nothing is ever unmapped. Where paddr is,
+    // nullptr if out of memory or address space
+    void* map_device(uint64_t paddr, uint64_t len, uint64_t caching = Uncacheable);
+    // a new address space, sharing the kernel half with the kernel vspace
+    PML4T* create_vspace();
+    // a copy of the user half of source, for fork: anonymous memory becomes
+    // copy-on-write in both spaces, other mappings (shared regions, device
+    // memory) are shared as they are. nullptr if out of memory
+    PML4T* clone_vspace(PML4T* source);
+    // frees the tables of the user half of the address space, its anonymous
+    // memory, and the space itself
+    void destroy_vspace(PML4T* space);
+    // the #PF handler and the zero frame, once frames can be allocated
+    void init_faults();
+    FaultStats fault_stats();
     PDPTE get_kernel_vmap();
 
     // the stack used to call this function is expected to be mapped to the same address
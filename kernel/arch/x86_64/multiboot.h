@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+
+// Structures handed over by a multiboot (version 1) compliant bootloader.
+// All addresses in here are physical, and only 32 bits wide.
+
+constexpr uint32_t MULTIBOOT_BOOTLOADER_MAGIC = 0x2BADB002;
+
+#pragma pack(push, 1)
+struct MultibootInfo {
+    enum Flags: uint32_t {
+        Memory = 1<<0,
+        BootDevice = 1<<1,
+        CommandLine = 1<<2,
+        Modules = 1<<3,
+        MemoryMap = 1<<6,
+    };
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+};
+
+struct MultibootMmapEntry {
+    enum Type: uint32_t {
+        Available = 1,
+        Reserved = 2,
+        AcpiReclaimable = 3,
+        AcpiNvs = 4,
+        BadRam = 5,
+    };
+    // size of the entry, not counting this field
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+
+    // entries have variable size, so we can't just index an array
+    MultibootMmapEntry* next() {
+        return reinterpret_cast<MultibootMmapEntry*>(reinterpret_cast<uint8_t*>(this) + size + sizeof(size));
+    }
+};
+
+struct MultibootModule {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;
+    uint32_t reserved;
+};
+#pragma pack(pop)
@@ -63,6 +63,7 @@ _start:
     # check if cpu can run 64bit code
     mov $0x80000001, %eax
     cpuid
+    mov %edx, %ebp # extended features, for EFER below
     and $(1<<29), %edx
     jz halt # fail!
 
@@ -77,62 +78,37 @@ _start:
     or $(1<<5), %eax
     mov %eax, %cr4
     
-    # set cr3 to point at page table root
-    mov $PML4T, %edx
+    # The kernel page tables are built at compile time (kernel_tables in
+    # mmu.cpp). Entries pointing into them or into the kernel image only hold
+    # offsets, marked with bit 9 (offset in kernel_tables) or bit 10 (offset
+    # from the kernel load address): relocate those, then use the tables
+    # straight away. Everything fits in 32 bits, there's no carry into the
+    # upper half of the entries.
+    mov $KERNEL_TABLES_PHYS, %edx
+    mov $KERNEL_TABLE_FIXUPS_PHYS, %esi
+    mov (%esi), %ecx # fixup count
+    jecxz 2f
+1:  add $4, %esi
+    mov (%esi), %eax # entry index
+    lea (%edx,%eax,8), %edi
+    mov $BOOTSTRAP_END, %ebx
+    testl $(1<<9), (%edi)
+    cmovnz %edx, %ebx
+    add %ebx, (%edi)
+    loop 1b
+2:
+    # set cr3 to point at page table root (first table in kernel_tables)
     mov %edx, %cr3
 
-    # fill in page tables, map 1:1 512 pages into PT0 = 2mb
-    #-># Not really, we just map everything into a single 2mb page, 
-    #-># so that we can throw it away when we don't need it anymore
-    xor %eax, %eax
-    mov $(0x1000), %ecx
-
-    mov %edx, %edi
-    rep stosl # memset(%edi, %eax, %ecx)
-    mov %edx, %edi
-
-    # PML4[0] = PDPT0
-    # PML4[511] = PDPT511
-        lea 0x1003(%edi), %eax
-        mov %eax, (%edi)
-        lea 0x2003(%edi), %eax
-        mov %eax, 0xff8(%edi)
-    add $0x1000, %edi
-    # PDPT0[0] = PDT0
-        lea 0x2003(%edi), %eax
-        mov %eax, (%edi)
-    add $0x1000, %edi
-    # PDPT511[510] = PDT-1
-        lea 0x2003(%edi), %eax
-        mov %eax, 0xff0(%edi)
-    add $0x1000, %edi
-    # PD0[0] = 0x83, the bootstrap map
-        mov $0x83, %eax
-        mov %eax, (%edi)
-    add $0x1000, %edi
-    # PD-1[0] = 0x200083, the kernel map
-        add $BOOTSTRAP_END, %eax
-        mov %eax, (%edi)
-    # PD-1[1] maps the following 2mb, where the kernel page structures are supposedly located
-        add $0x200000, %eax
-        mov %eax, 0x8(%edi)
-    # PD-1[2] let's also map 2 more megabytes, to be safe.
-        add $0x200000, %eax
-        mov %eax, 0x10(%edi)
-
-#    mov $512, %ecx
-#    movl $3, %ebx
-#setEntry:
-#    mov %ebx, (%edi)
-#    add $0x1000, %ebx
-#    add $0x8, %edi
-#    loop setEntry
-    
-    # switch to 64bit mode with EFER.LME
+    # switch to 64bit mode with EFER.LME. The kernel tables use execute
+    # disable bits, those need EFER.NXE (when the cpu has it)
     mov $0xC0000080, %ecx
     rdmsr
     or $(1<<8), %eax
-    wrmsr
+    test $(1<<20), %ebp
+    jz 3f
+    or $(1<<11), %eax
+3:  wrmsr
     
     # enable paging, and protected mode (should not be necessary)
     mov %cr0, %eax
@@ -163,10 +139,16 @@ _start64:
     mov $YEAH64, %rcx
     mov $240, %rdx
     call _printat
+    # parameters on rdi, rsi, rdx, rcx
+    # _start left the multiboot magic and info address on the stack, 32 bits each
+    movl 4(%rsp), %edi # multiboot info structure (physical address)
+    movl (%rsp), %esi # multiboot magic
+    # off the boot stack: it is in low memory, user vspaces don't map it.
+    # The top of bsp_stack (smp.cpp) is 16-byte aligned, as the ABI wants at call sites
+    movabs $(bsp_stack + 0x10000), %rsp # BSP_STACK_SIZE
     # call does not support an immediate of 64bit size. To allow relocation, we move the address to a register first
     movabs $_cstart, %rax
     call *%rax
-    # parameters on rdi, rsi, rdx, rcx
     # go back in 32bit mode
     movq $(1<<31 | 1<<0), %rbx
     not %rbx
@@ -237,21 +219,3 @@ _enableSSE:
 stack_bottom: # label identifying stack bottom
 .skip 0x100000 # 1mb of stack
 stack_top:
-.align 4096
-# Temporary page tables, needed to switch to 64bit mode. Memory manager will
-# eventually take over and clear this. The table needs to identity map the
-# first megabyte of RAM, where bootstrap code and data reside, to ensure
-# continuity of the bootstrap process, also it needs to map the kernel code,
-# loaded to the second megabyte of ram by the bootloader, into the address
-# space the kernel was linked into (as of now, 0xc0000000)
-PML4T:
-.skip 0x1000
-# PDPT0:
-.skip 0x1000
-# PDPT511:
-.skip 0x1000
-# PDT0: # pdt0[0] should map 1:1 the first 2mb of memory. The 64bit pointer value should be is 0x83
-.skip 0x1000
-# PDT-1: # pdt-1[0] should map the second 2mb of memory. The 64bit pointer should be 0x83 + 0x200000 = 0x200083
-.skip 0x1000
-table_end:
@@ -0,0 +1,396 @@
+#include "pci.h"
+#include "acpi.h"
+#include "../../printk.hpp"
+
+Pci pci;
+
+namespace {
+
+// configuration space registers, type 0 and 1 headers
+constexpr uint16_t REG_VENDOR_ID = 0x00;
+constexpr uint16_t REG_DEVICE_ID = 0x02;
+constexpr uint16_t REG_COMMAND = 0x04;
+constexpr uint16_t REG_STATUS = 0x06;
+constexpr uint16_t REG_REVISION = 0x08;
+constexpr uint16_t REG_HEADER_TYPE = 0x0e;
+constexpr uint16_t REG_BAR0 = 0x10;
+constexpr uint16_t REG_SECONDARY_BUS = 0x19; // type 1
+constexpr uint16_t REG_CAPABILITIES = 0x34;
+
+constexpr uint16_t COMMAND_IO = 1 << 0;
+constexpr uint16_t COMMAND_MEMORY = 1 << 1;
+constexpr uint16_t COMMAND_BUS_MASTER = 1 << 2;
+constexpr uint16_t COMMAND_INTX_DISABLE = 1 << 10;
+constexpr uint16_t STATUS_CAPABILITIES = 1 << 4;
+constexpr uint8_t HEADER_MULTI_FUNCTION = 0x80;
+constexpr uint8_t HEADER_BRIDGE = 1;
+constexpr uint8_t CLASS_BRIDGE = 0x06; // host, ISA, PCI-to-PCI...
+
+constexpr uint32_t BAR_IO = 1 << 0;
+constexpr uint32_t BAR_64BIT = 2 << 1;
+constexpr uint32_t BAR_PREFETCHABLE = 1 << 3;
+
+constexpr uint8_t CAPABILITY_MSIX = 0x11;
+// MSI-X capability, from its offset
+constexpr uint16_t MSIX_CONTROL = 2;
+constexpr uint16_t MSIX_TABLE = 4;
+constexpr uint16_t MSIX_CONTROL_ENABLE = 1 << 15;
+constexpr uint16_t MSIX_CONTROL_MASK_ALL = 1 << 14;
+// table entries, in dwords
+constexpr unsigned MSIX_ENTRY_DWORDS = 4;
+constexpr unsigned MSIX_ADDRESS_LOW = 0;
+constexpr unsigned MSIX_ADDRESS_HIGH = 1;
+constexpr unsigned MSIX_DATA = 2;
+constexpr unsigned MSIX_VECTOR_CONTROL = 3;
+constexpr uint32_t MSIX_VECTOR_MASKED = 1 << 0;
+// physical destination, fixed delivery, edge triggered: the apic id in
+// bits 19:12 of the address, the vector in the data
+constexpr uint32_t MSI_ADDRESS_BASE = 0xfee00000;
+
+constexpr uint16_t CONFIG_ADDRESS_PORT = 0xcf8;
+constexpr uint16_t CONFIG_DATA_PORT = 0xcfc;
+
+}
+
+volatile uint8_t* Pci::ecam(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset) {
+    for (unsigned i = 0; i < mcfg.count; i++) {
+        auto const &region = mcfg.regions[i];
+        if (region.segment == segment && bus >= region.start_bus && bus <= region.end_bus) {
+            uint64_t const address = region.base + (uint64_t{bus} << 20 | uint64_t{slot} << 15 | uint64_t{function} << 12 | offset);
+            return static_cast<volatile uint8_t*>(ptl(address));
+        }
+    }
+    return nullptr;
+}
+
+uint32_t Pci::read(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, int size) {
+    if (use_ecam) {
+        auto const p = ecam(segment, bus, slot, function, offset);
+        if (!p) {
+            return ~0u;
+        }
+        switch (size) {
+        case 1: return *p;
+        case 2: return *reinterpret_cast<volatile uint16_t*>(p);
+        default: return *reinterpret_cast<volatile uint32_t*>(p);
+        }
+    }
+    if (segment || offset >= 256) {
+        return ~0u;
+    }
+    LockGuard guard(port_lock);
+    outl(CONFIG_ADDRESS_PORT, 1u << 31 | uint32_t{bus} << 16 | uint32_t{slot} << 11 | uint32_t{function} << 8 | (offset & 0xfc));
+    uint16_t const port = CONFIG_DATA_PORT + (offset & 3);
+    switch (size) {
+    case 1: return inb(port);
+    case 2: return inw(port);
+    default: return inl(port);
+    }
+}
+
+void Pci::write(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, int size, uint32_t value) {
+    if (use_ecam) {
+        auto const p = ecam(segment, bus, slot, function, offset);
+        if (!p) {
+            return;
+        }
+        switch (size) {
+        case 1: *p = value; break;
+        case 2: *reinterpret_cast<volatile uint16_t*>(p) = value; break;
+        default: *reinterpret_cast<volatile uint32_t*>(p) = value; break;
+        }
+        return;
+    }
+    if (segment || offset >= 256) {
+        return;
+    }
+    LockGuard guard(port_lock);
+    outl(CONFIG_ADDRESS_PORT, 1u << 31 | uint32_t{bus} << 16 | uint32_t{slot} << 11 | uint32_t{function} << 8 | (offset & 0xfc));
+    // narrow writes, so that the rest of the dword (write-one-to-clear
+    // status bits...) isn't written back
+    uint16_t const port = CONFIG_DATA_PORT + (offset & 3);
+    switch (size) {
+    case 1: outb(port, value); break;
+    case 2: outw(port, value); break;
+    default: outl(port, value); break;
+    }
+}
+
+uint8_t Pci::read8(const PciDevice& device, uint16_t offset) {
+    return read(device.segment, device.bus, device.slot, device.function, offset, 1);
+}
+
+uint16_t Pci::read16(const PciDevice& device, uint16_t offset) {
+    return read(device.segment, device.bus, device.slot, device.function, offset, 2);
+}
+
+uint32_t Pci::read32(const PciDevice& device, uint16_t offset) {
+    return read(device.segment, device.bus, device.slot, device.function, offset, 4);
+}
+
+void Pci::write16(const PciDevice& device, uint16_t offset, uint16_t value) {
+    write(device.segment, device.bus, device.slot, device.function, offset, 2, value);
+}
+
+void Pci::write32(const PciDevice& device, uint16_t offset, uint32_t value) {
+    write(device.segment, device.bus, device.slot, device.function, offset, 4, value);
+}
+
+uint8_t Pci::find_capability(const PciDevice& device, uint8_t id) {
+    if (!(read16(device, REG_STATUS) & STATUS_CAPABILITIES)) {
+        return 0;
+    }
+    uint8_t offset = read8(device, REG_CAPABILITIES) & 0xfc;
+    // 48 capabilities fill the space after the header, more means a loop
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        if (read8(device, offset) == id) {
+            return offset;
+        }
+        offset = read8(device, offset + 1) & 0xfc;
+    }
+    return 0;
+}
+
+// write all ones and see which address bits stick, with decoding off
+// meanwhile so that the device doesn't answer at the probe address.
+// Not on bridges: with their decoding off, whatever is behind them is cut
+// off too, host bridges included (and the memory we run from with them).
+// No driver here uses their BARs
+void Pci::size_bars(PciDevice& device) {
+    if (device.header_type != 0 || device.class_code == CLASS_BRIDGE) {
+        return;
+    }
+    constexpr unsigned bars = 6;
+    uint16_t const command = read16(device, REG_COMMAND);
+    write16(device, REG_COMMAND, command & ~(COMMAND_IO | COMMAND_MEMORY));
+    for (unsigned i = 0; i < bars; i++) {
+        uint16_t const reg = REG_BAR0 + 4 * i;
+        uint32_t const low = read32(device, reg);
+        write32(device, reg, ~0u);
+        uint32_t const low_mask = read32(device, reg);
+        write32(device, reg, low);
+        auto &bar = device.bars[i];
+        if (low & BAR_IO) {
+            bar.io = true;
+            bar.address = low & ~3u;
+            bar.size = (~(low_mask & ~3u) + 1) & 0xffff;
+            continue;
+        }
+        bar.prefetchable = low & BAR_PREFETCHABLE;
+        bar.address = low & ~0xfu;
+        uint64_t mask = uint64_t{low_mask & ~0xfu} | ~0ull << 32;
+        bool implemented = low_mask & ~0xfu;
+        if ((low & 6) == BAR_64BIT && i + 1 < bars) {
+            uint32_t const high = read32(device, reg + 4);
+            write32(device, reg + 4, ~0u);
+            uint32_t const high_mask = read32(device, reg + 4);
+            write32(device, reg + 4, high);
+            bar.address |= uint64_t{high} << 32;
+            mask = uint64_t{high_mask} << 32 | (low_mask & ~0xfu);
+            implemented = mask;
+            // the upper half is no BAR of its own
+            i++;
+        }
+        bar.size = implemented ? ~mask + 1 : 0;
+    }
+    write16(device, REG_COMMAND, command);
+}
+
+void Pci::add_function(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t function) {
+    if (count == max_devices) {
+        printk(LogLevel::Warning, "pci: more than %d functions, %x:%x.%d ignored\n", max_devices, bus, slot, function);
+        return;
+    }
+    auto &device = devices[count++];
+    device.segment = segment;
+    device.bus = bus;
+    device.slot = slot;
+    device.function = function;
+    device.vendor_id = read(segment, bus, slot, function, REG_VENDOR_ID, 2);
+    device.device_id = read(segment, bus, slot, function, REG_DEVICE_ID, 2);
+    uint32_t const class_revision = read(segment, bus, slot, function, REG_REVISION, 4);
+    device.revision = class_revision;
+    device.prog_if = class_revision >> 8;
+    device.subclass = class_revision >> 16;
+    device.class_code = class_revision >> 24;
+    device.header_type = read(segment, bus, slot, function, REG_HEADER_TYPE, 1) & ~HEADER_MULTI_FUNCTION;
+    size_bars(device);
+    device.msix = find_capability(device, CAPABILITY_MSIX);
+    printk(LogLevel::Info, "pci %x:%x.%d %x:%x\n", bus, slot, function, device.vendor_id, device.device_id);
+    if (device.header_type == HEADER_BRIDGE) {
+        uint8_t const secondary = read(segment, bus, slot, function, REG_SECONDARY_BUS, 1);
+        if (secondary > bus) {
+            scan_bus(segment, secondary);
+        }
+    }
+}
+
+void Pci::scan_bus(uint16_t segment, uint8_t bus) {
+    // a misconfigured bridge could send us around in circles
+    if (scanned[bus / 64] & 1ull << (bus % 64)) {
+        return;
+    }
+    scanned[bus / 64] |= 1ull << (bus % 64);
+    for (uint8_t slot = 0; slot < 32; slot++) {
+        if (read(segment, bus, slot, 0, REG_VENDOR_ID, 2) == 0xffff) {
+            continue;
+        }
+        bool const multi_function = read(segment, bus, slot, 0, REG_HEADER_TYPE, 1) & HEADER_MULTI_FUNCTION;
+        for (uint8_t function = 0; function < (multi_function ? 8 : 1); function++) {
+            if (read(segment, bus, slot, function, REG_VENDOR_ID, 2) != 0xffff) {
+                add_function(segment, bus, slot, function);
+            }
+        }
+    }
+}
+
+bool Pci::init() {
+    uint64_t const start = rdtsc();
+    use_ecam = acpi.init() && acpi.parse_mcfg(mcfg);
+    if (use_ecam) {
+        // the windows are usually below 4G, already in the linear map
+        MMU mmu;
+        for (unsigned i = 0; i < mcfg.count; i++) {
+            auto const &region = mcfg.regions[i];
+            uint64_t const end = region.base + ((uint64_t{region.end_bus} + 1) << 20);
+            if (end > mmu.linear_limit()) {
+                mmu.map_linear(end);
+            }
+        }
+    } else {
+        // is there anything answering on the ports at all
+        outl(CONFIG_ADDRESS_PORT, 1u << 31);
+        if (inl(CONFIG_ADDRESS_PORT) != 1u << 31) {
+            printk(LogLevel::Warning, "pci: no configuration space\n");
+            return false;
+        }
+    }
+    auto const walk = [this](uint16_t segment, uint8_t bus) {
+        for (auto &word: scanned) {
+            word = 0;
+        }
+        // a multi-function host bridge at 0:0 has one host controller per
+        // function, function n for bus n
+        if (bus == 0 && (read(segment, 0, 0, 0, REG_HEADER_TYPE, 1) & HEADER_MULTI_FUNCTION)) {
+            for (uint8_t function = 0; function < 8; function++) {
+                if (read(segment, 0, 0, function, REG_VENDOR_ID, 2) != 0xffff) {
+                    scan_bus(segment, function);
+                }
+            }
+        } else {
+            scan_bus(segment, bus);
+        }
+    };
+    if (use_ecam) {
+        for (unsigned i = 0; i < mcfg.count; i++) {
+            walk(mcfg.regions[i].segment, mcfg.regions[i].start_bus);
+        }
+    } else {
+        walk(0, 0);
+    }
+    printk(LogLevel::Info, "pci: %d functions through %s, enumerated in %d cycles\n", count,
+        use_ecam ? "ECAM" : "ports 0xcf8/0xcfc", rdtsc() - start);
+    return true;
+}
+
+PciDevice* Pci::find(uint16_t vendor_id, uint16_t device_id, PciDevice* after) {
+    for (unsigned i = after ? after - devices + 1 : 0; i < count; i++) {
+        if (devices[i].vendor_id == vendor_id && devices[i].device_id == device_id) {
+            return &devices[i];
+        }
+    }
+    return nullptr;
+}
+
+PciDevice* Pci::find_class(uint8_t class_code, uint8_t subclass, PciDevice* after) {
+    for (unsigned i = after ? after - devices + 1 : 0; i < count; i++) {
+        if (devices[i].class_code == class_code && devices[i].subclass == subclass) {
+            return &devices[i];
+        }
+    }
+    return nullptr;
+}
+
+void Pci::enable(const PciDevice& device) {
+    write16(device, REG_COMMAND, read16(device, REG_COMMAND) | COMMAND_MEMORY | COMMAND_BUS_MASTER);
+}
+
+void* Pci::map_bar(const PciDevice& device, unsigned bar, uint64_t caching) {
+    if (bar >= 6 || device.bars[bar].io || !device.bars[bar].size) {
+        return nullptr;
+    }
+    if (caching == MMU::WriteCombining && !device.bars[bar].prefetchable) {
+        // reads of registers may have side effects, writes must not be merged
+        caching = MMU::Uncacheable;
+    }
+    return MMU().map_device(device.bars[bar].address, device.bars[bar].size, caching);
+}
+
+bool Pci::msix_enable(PciDevice& device) {
+    if (!device.msix) {
+        return false;
+    }
+    if (device.msix_table) {
+        return true;
+    }
+    uint16_t const control = read16(device, device.msix + MSIX_CONTROL);
+    uint32_t const table = read32(device, device.msix + MSIX_TABLE);
+    unsigned const entries = (control & 0x7ff) + 1;
+    uint64_t const offset = table & ~7u;
+    unsigned const bir = table & 7;
+    if (bir >= 6 || device.bars[bir].io || offset + entries * MSIX_ENTRY_DWORDS * 4 > device.bars[bir].size) {
+        printk(LogLevel::Warning, "pci %x:%x.%d: bad MSI-X table\n", device.bus, device.slot, device.function);
+        return false;
+    }
+    auto const &bar = device.bars[bir];
+    auto const mapped = static_cast<volatile uint32_t*>(MMU().map_device(bar.address + offset, entries * MSIX_ENTRY_DWORDS * 4));
+    if (!mapped) {
+        return false;
+    }
+    // everything masked before the entries hold anything sensible
+    write16(device, device.msix + MSIX_CONTROL, control | MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASK_ALL);
+    enable(device);
+    write16(device, REG_COMMAND, read16(device, REG_COMMAND) | COMMAND_INTX_DISABLE);
+    for (unsigned i = 0; i < entries; i++) {
+        mapped[i * MSIX_ENTRY_DWORDS + MSIX_VECTOR_CONTROL] = MSIX_VECTOR_MASKED;
+    }
+    write16(device, device.msix + MSIX_CONTROL, (control | MSIX_CONTROL_ENABLE) & ~MSIX_CONTROL_MASK_ALL);
+    device.msix_table = mapped;
+    device.msix_entries = entries;
+    return true;
+}
+
+void Pci::msix_mask(PciDevice& device, unsigned entry, bool masked) {
+    if (!device.msix_table || entry >= device.msix_entries) {
+        return;
+    }
+    volatile uint32_t* const slot = device.msix_table + entry * MSIX_ENTRY_DWORDS;
+    slot[MSIX_VECTOR_CONTROL] = masked ? slot[MSIX_VECTOR_CONTROL] | MSIX_VECTOR_MASKED : slot[MSIX_VECTOR_CONTROL] & ~MSIX_VECTOR_MASKED;
+}
+
+bool Pci::msix_route(PciDevice& device, unsigned entry, unsigned cpu, uint8_t vector) {
+    if (!device.msix_table || entry >= device.msix_entries || cpu >= MAX_CPUS ||
+            !__atomic_load_n(&per_cpu[cpu].online, __ATOMIC_ACQUIRE) || vector < VECTOR_FIRST_DYNAMIC) {
+        return false;
+    }
+    volatile uint32_t* const slot = device.msix_table + entry * MSIX_ENTRY_DWORDS;
+    // never half updated while unmasked: a message could go anywhere
+    msix_mask(device, entry, true);
+    slot[MSIX_ADDRESS_LOW] = MSI_ADDRESS_BASE | per_cpu[cpu].apic_id << 12;
+    slot[MSIX_ADDRESS_HIGH] = 0;
+    slot[MSIX_DATA] = vector;
+    msix_mask(device, entry, false);
+    return true;
+}
+
+uint8_t Pci::msix_attach(PciDevice& device, unsigned entry, unsigned cpu, InterruptHandler handler, void* context) {
+    if (!device.msix_table || entry >= device.msix_entries) {
+        return 0;
+    }
+    uint8_t const vector = interrupt_alloc_vector(handler, context);
+    if (vector && !msix_route(device, entry, cpu, vector)) {
+        interrupt_detach(vector);
+        return 0;
+    }
+    return vector;
+}
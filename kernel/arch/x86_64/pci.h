@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include "acpi.h"
+#include "idt.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+// PCI and PCIe devices. Configuration space is read through the ECAM
+// windows the ACPI MCFG lists, in the linear map (the MTRRs make them
+// uncacheable, as they do for the local APIC), or through ports 0xcf8 and
+// 0xcfc on machines without an MCFG, which only reach the first 256 bytes
+// of each function. init walks the buses once, following bridges, and keeps
+// what it found along with the size of every BAR.
+//
+// Interrupts come through MSI-X: every entry of a device's table (one per
+// queue, usually) gets its own vector and goes to the cpu we pick, and can
+// be moved to another one later. Handlers send the EOI themselves, like
+// every handler of an interrupt coming through the local APIC.
+
+struct PciBar {
+    uint64_t address; // physical, or the first port of io BARs
+    uint64_t size; // 0 if not implemented, or on a bridge (not sized)
+    bool io;
+    bool prefetchable;
+};
+
+struct PciDevice {
+    uint16_t segment;
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint8_t header_type; // without the multi-function bit
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t revision;
+    PciBar bars[6];
+    uint8_t msix; // offset of the MSI-X capability, 0 if there's none
+    uint16_t msix_entries;
+    volatile uint32_t* msix_table; // once msix_enable mapped it
+};
+
+class Pci {
+public:
+    static constexpr unsigned max_devices = 256;
+
+    // find the configuration space and enumerate the devices. After
+    // smp_init, with the frame allocator up. False if there's no PCI
+    bool init();
+    unsigned device_count() { return count; }
+    PciDevice& device(unsigned index) { return devices[index]; }
+    // the next device with these ids, or of this class, after `after`
+    // (nullptr to start from the first one)
+    PciDevice* find(uint16_t vendor_id, uint16_t device_id, PciDevice* after = nullptr);
+    PciDevice* find_class(uint8_t class_code, uint8_t subclass, PciDevice* after = nullptr);
+
+    // configuration space. offset is aligned to the size; past 256 it
+    // needs ECAM, reads give all ones without
+    uint8_t read8(const PciDevice& device, uint16_t offset);
+    uint16_t read16(const PciDevice& device, uint16_t offset);
+    uint32_t read32(const PciDevice& device, uint16_t offset);
+    void write16(const PciDevice& device, uint16_t offset, uint16_t value);
+    void write32(const PciDevice& device, uint16_t offset, uint32_t value);
+
+    // turn on memory decoding and bus mastering (DMA, and MSIs)
+    void enable(const PciDevice& device);
+    // map a memory BAR in the kernel half. Registers want Uncacheable;
+    // WriteCombining is for prefetchable BARs only (frame buffers and the
+    // like). nullptr for io BARs, or if mapping failed
+    void* map_bar(const PciDevice& device, unsigned bar, uint64_t caching = MMU::Uncacheable);
+
+    // map the MSI-X table with every entry masked, and switch the device
+    // from INTx to MSI-X. False if the device has no MSI-X
+    bool msix_enable(PciDevice& device);
+    // a vector with handler attached, delivered to cpu when entry fires,
+    // and the entry unmasked. 0 if there's no such entry or online cpu, or
+    // no vector left
+    uint8_t msix_attach(PciDevice& device, unsigned entry, unsigned cpu, InterruptHandler handler, void* context = nullptr);
+    // deliver entry as vector to cpu from now on, and unmask it
+    bool msix_route(PciDevice& device, unsigned entry, unsigned cpu, uint8_t vector);
+    void msix_mask(PciDevice& device, unsigned entry, bool masked);
+
+private:
+    // where (segment, bus, slot, function) is in an ECAM window, nullptr
+    // if it isn't in one
+    volatile uint8_t* ecam(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset);
+    uint32_t read(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, int size);
+    void write(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t function, uint16_t offset, int size, uint32_t value);
+    void scan_bus(uint16_t segment, uint8_t bus);
+    void add_function(uint16_t segment, uint8_t bus, uint8_t slot, uint8_t function);
+    void size_bars(PciDevice& device);
+    uint8_t find_capability(const PciDevice& device, uint8_t id);
+
+    McfgInfo mcfg = {};
+    bool use_ecam = false;
+    Spinlock port_lock; // 0xcf8 and 0xcfc take two accesses
+    uint64_t scanned[256 / 64] = {}; // buses of the segment being walked
+    PciDevice devices[max_devices] = {};
+    unsigned count = 0;
+};
+
+extern Pci pci;
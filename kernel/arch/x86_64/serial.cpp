@@ -0,0 +1,135 @@
+#include <string.h>
+#include "serial.h"
+#include "cpu.h"
+#include "apic.h"
+#include "ioapic.h"
+
+SerialPort com1{0x3f8, 4};
+
+namespace {
+// registers, offsets from the base port
+enum Register: uint16_t {
+    THR = 0, // transmit holding (write)
+    DLL = 0, // divisor latch low, when LCR_DLAB is set
+    IER = 1, // interrupt enable
+    DLM = 1, // divisor latch high, when LCR_DLAB is set
+    IIR = 2, // interrupt identification (read)
+    FCR = 2, // fifo control (write)
+    LCR = 3, // line control
+    MCR = 4, // modem control
+    LSR = 5, // line status
+    SCR = 7, // scratch
+};
+constexpr uint8_t IER_THRE = 1 << 1;
+constexpr uint8_t FCR_ENABLE = 1 << 0;
+constexpr uint8_t FCR_CLEAR = 3 << 1; // both fifos
+constexpr uint8_t LCR_8N1 = 0x03;
+constexpr uint8_t LCR_DLAB = 1 << 7;
+constexpr uint8_t MCR_DTR_RTS_OUT2 = 0x0b; // OUT2 gates the irq line on PCs
+constexpr uint8_t LSR_THRE = 1 << 5;
+}
+
+bool SerialPort::init() {
+    // nothing there if the scratch register doesn't hold a value
+    outb(base + SCR, 0x5a);
+    if (inb(base + SCR) != 0x5a) {
+        return false;
+    }
+    outb(base + IER, 0);
+    outb(base + LCR, LCR_DLAB);
+    outb(base + DLL, 1); // 115200 / 1
+    outb(base + DLM, 0);
+    outb(base + LCR, LCR_8N1);
+    outb(base + FCR, FCR_ENABLE | FCR_CLEAR);
+    outb(base + MCR, MCR_DTR_RTS_OUT2);
+    __atomic_store_n(&present, true, __ATOMIC_RELEASE);
+    poll();
+    return true;
+}
+
+size_t SerialPort::write(const char* data, size_t length) {
+    size_t fits;
+    {
+        // an interrupt handler logging between reserve and publish would wait forever
+        IrqGuard irq;
+        uint64_t start = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        do {
+            uint64_t const space = ring_size - (start - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+            fits = length < space ? length : space;
+        } while (fits && !__atomic_compare_exchange_n(&head, &start, start + fits, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        if (fits) {
+            size_t const offset = start & (ring_size - 1);
+            size_t const first = fits < ring_size - offset ? fits : ring_size - offset;
+            memcpy(ring + offset, data, first);
+            memcpy(ring, data + first, fits - first);
+            // earlier reservations publish first, they are only copying
+            while (__atomic_load_n(&committed, __ATOMIC_ACQUIRE) != start) {
+                asm volatile("pause");
+            }
+            __atomic_store_n(&committed, start + fits, __ATOMIC_RELEASE);
+        }
+    }
+    if (fits < length) {
+        __atomic_add_fetch(&dropped_bytes, length - fits, __ATOMIC_RELAXED);
+    }
+    poll();
+    return fits;
+}
+
+void SerialPort::poll() {
+    if (!__atomic_load_n(&present, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    // if another cpu is draining, it looks once more for us: the THR empty
+    // interrupt that brought us here was acknowledged already, and won't
+    // come back for bytes nobody sends
+    __atomic_store_n(&pending, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) && !__atomic_exchange_n(&draining, 1, __ATOMIC_SEQ_CST)) {
+        while (__atomic_exchange_n(&pending, 0, __ATOMIC_ACQUIRE)) {
+            if (inb(base + LSR) & LSR_THRE) {
+                // the FIFO is empty: it takes fifo_size bytes without waiting
+                uint64_t t = tail;
+                uint64_t const end = __atomic_load_n(&committed, __ATOMIC_ACQUIRE);
+                for (unsigned burst = 0; t != end && burst < fifo_size; t++, burst++) {
+                    outb(base + THR, ring[t & (ring_size - 1)]);
+                }
+                __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+            }
+        }
+        // a poll that found us draining until here set pending again
+        __atomic_store_n(&draining, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+void SerialPort::interrupt(InterruptFrame&, void* port) {
+    auto const self = static_cast<SerialPort*>(port);
+    // reading IIR acknowledges THR empty, if there's nothing left to send
+    inb(self->base + IIR);
+    self->poll();
+    lapic.eoi();
+}
+
+bool SerialPort::enableInterrupts() {
+    if (!__atomic_load_n(&present, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    uint8_t const vector = interrupt_alloc_vector(interrupt, this);
+    if (!vector) {
+        return false;
+    }
+    if (!ioapic.route_isa(irq, vector, lapic.id())) {
+        interrupt_detach(vector);
+        return false;
+    }
+    outb(base + IER, IER_THRE);
+    return true;
+}
+
+void SerialPort::drain() {
+    while (__atomic_load_n(&present, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&committed, __ATOMIC_ACQUIRE)) {
+        poll();
+        asm volatile("pause");
+    }
+}
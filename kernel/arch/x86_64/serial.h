@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "idt.h"
+
+// 16550 UART, transmit side only. Writers copy into a lock-free ring and
+// never wait for the device: the ring is moved to the FIFO 16 bytes at a
+// time, from the THR empty interrupt once that is enabled, and by the
+// writers themselves (polling) until then. What doesn't fit in the ring
+// is dropped, and counted.
+class SerialPort {
+public:
+    static constexpr size_t ring_size = 0x4000; // power of two
+    static constexpr unsigned fifo_size = 16;
+
+    constexpr SerialPort(uint16_t base, uint8_t irq): base{base}, irq{irq} {}
+
+    // 115200 8N1, FIFOs on. False if there's no UART at base.
+    // Bytes written before this are kept and sent afterwards
+    bool init();
+    // queue bytes, returns how many fit
+    size_t write(const char* data, size_t length);
+    // move a burst from the ring to the FIFO, if the transmitter is empty
+    void poll();
+    // let the THR empty interrupt drain the ring from now on, delivered to
+    // the calling cpu through the IO APIC. After ioapic.init. False if
+    // there's no vector or IO APIC input for it
+    bool enableInterrupts();
+    // spin until everything queued has been sent (panic, halt)
+    void drain();
+    uint64_t dropped() { return dropped_bytes; }
+
+private:
+    static void interrupt(InterruptFrame& frame, void* port);
+
+    const uint16_t base;
+    const uint8_t irq; // ISA irq
+    bool present = false;
+    char ring[ring_size] = {};
+    // writers reserve space moving head, copy, then publish moving
+    // committed, in reservation order
+    uint64_t head = 0;
+    uint64_t committed = 0;
+    uint64_t tail = 0; // everything before this has gone to the FIFO
+    uint32_t draining = 0; // one cpu at a time feeds the FIFO
+    uint32_t pending = 0; // a poll since the drainer last looked
+    uint64_t dropped_bytes = 0;
+};
+
+extern SerialPort com1;
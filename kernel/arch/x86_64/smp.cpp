@@ -0,0 +1,152 @@
+#include <string.h>
+#include "smp.h"
+#include "acpi.h"
+#include "apic.h"
+#include "mmu.h"
+#include "frames.h"
+#include "fpu.h"
+#include "idt.h"
+#include "syscall.h"
+#include "../../printk.hpp"
+#include "../../sched.hpp"
+#include "../../timer.hpp"
+
+PerCpu per_cpu[MAX_CPUS];
+// mapped in every vspace, the idle thread of the bsp runs on it with
+// whatever vspace the thread before it left loaded
+extern "C" alignas(16) char bsp_stack[BSP_STACK_SIZE];
+alignas(16) char bsp_stack[BSP_STACK_SIZE];
+
+extern "C" {
+    extern const char trampoline_start[], trampoline_end[];
+    extern const char trampoline_cr3[], trampoline_efer[], trampoline_stack[], trampoline_entry[], trampoline_cpu[];
+    [[noreturn]] void _apstart(PerCpu* cpu);
+}
+
+namespace {
+
+unsigned online_count = 1;
+
+constexpr int stack_order = 2; // 16k kernel stacks
+constexpr uint64_t EFER_LME = 1 << 8;
+constexpr uint64_t EFER_NXE = 1 << 11;
+
+// interprocessor interrupt commands (ICR low dword)
+constexpr uint32_t ipi_init = 0x500 | 1 << 14; // INIT, level assert
+constexpr uint32_t ipi_startup = 0x600 | 1 << 14; // STARTUP, vector is the start page
+
+// no timer is calibrated this early: a write to the POST port takes about a
+// microsecond on anything we'd run on, which is good enough to wait for
+// the cpus to wake up
+void io_delay(unsigned microseconds) {
+    while (microseconds--) {
+        outb(0x80, 0);
+    }
+}
+
+// trampoline variable, in the copy below 1mb
+template<typename T>
+T& trampoline_data(const char* symbol) {
+    return *static_cast<T*>(ptl(TRAMPOLINE_BASE + (symbol - trampoline_start)));
+}
+
+// INIT-SIPI-SIPI, then wait for the cpu to say it's up
+bool start_cpu(PerCpu& cpu) {
+    lapic.send_ipi(cpu.apic_id, ipi_init);
+    io_delay(10000);
+    for (int i = 0; i < 2 && !__atomic_load_n(&cpu.online, __ATOMIC_ACQUIRE); i++) {
+        lapic.send_ipi(cpu.apic_id, ipi_startup | TRAMPOLINE_BASE >> 12);
+        io_delay(200);
+    }
+    for (int i = 0; i < 100000; i++) {
+        if (__atomic_load_n(&cpu.online, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+        io_delay(1);
+    }
+    return false;
+}
+
+}
+
+void smp_init_bsp() {
+    auto &bsp = per_cpu[0];
+    bsp.self = &bsp;
+    bsp.index = 0;
+    bsp.online = true;
+    bsp.kernel_stack = reinterpret_cast<uint64_t>(bsp_stack) + BSP_STACK_SIZE;
+    wrmsr(MSR_GS_BASE, reinterpret_cast<uint64_t>(&bsp));
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void smp_init() {
+    static MadtInfo madt;
+    if (!acpi.init() || !acpi.parse_madt(madt)) {
+        printk(LogLevel::Warning, "no ACPI MADT, running on the bootstrap processor only\n");
+        return;
+    }
+    lapic.init(madt.lapic_address);
+    lapic.enable();
+    per_cpu[0].apic_id = lapic.id();
+    kernel::timer_init_cpu();
+
+    memcpy(ptl(TRAMPOLINE_BASE), trampoline_start, trampoline_end - trampoline_start);
+    MMU mmu;
+    mmu.init_smp();
+    trampoline_data<uint64_t>(trampoline_cr3) = ltp(mmu.get_kernel_vspace());
+    trampoline_data<uint64_t>(trampoline_efer) = rdmsr(MSR_EFER) & (EFER_LME | EFER_NXE);
+    trampoline_data<uint64_t>(trampoline_entry) = reinterpret_cast<uint64_t>(_apstart);
+
+    uint64_t const start = rdtsc();
+    unsigned next = 1;
+    for (unsigned i = 0; i < madt.cpu_count && next < MAX_CPUS; i++) {
+        if (madt.apic_ids[i] == per_cpu[0].apic_id) {
+            continue;
+        }
+        uint64_t const stack = frame_allocator.alloc(stack_order);
+        if (!stack) {
+            printk(LogLevel::Warning, "no memory for the stack of cpu %d\n", next);
+            break;
+        }
+        // the stack and the per-cpu slot stay taken even if the cpu doesn't
+        // answer: it may still come up later and use them
+        auto &cpu = per_cpu[next++];
+        cpu.self = &cpu;
+        cpu.index = static_cast<unsigned>(&cpu - per_cpu);
+        cpu.apic_id = madt.apic_ids[i];
+        cpu.kernel_stack = reinterpret_cast<uint64_t>(ptl(stack)) + (FrameAllocator::frame_size << stack_order);
+        trampoline_data<uint64_t>(trampoline_stack) = cpu.kernel_stack;
+        trampoline_data<PerCpu*>(trampoline_cpu) = &cpu;
+        if (!start_cpu(cpu)) {
+            // it may still be on its way through the trampoline, and would
+            // read the stack and slot of the next cpu if we rewrote them
+            printk(LogLevel::Warning, "cpu %d (apic id %d) didn't start, not starting the others\n", cpu.index, cpu.apic_id);
+            break;
+        }
+        online_count++;
+    }
+    printk(LogLevel::Info, "%d of %d cpus online, started in %d cycles\n", online_count, madt.cpu_count, rdtsc() - start);
+}
+
+unsigned smp_cpu_count() {
+    return online_count;
+}
+
+// application processors come here from the trampoline, on their own stack
+extern "C" void _apstart(PerCpu* cpu) {
+    wrmsr(MSR_GS_BASE, reinterpret_cast<uint64_t>(cpu));
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+    MMU mmu;
+    mmu.init_cpu();
+    mmu.get_kernel_vspace()->switchTo();
+    fpu_init_cpu();
+    idt_init_cpu();
+    syscall_init_cpu();
+    lapic.enable();
+    kernel::timer_init_cpu();
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    printk(LogLevel::Info, "cpu %d online, apic id %d\n", cpu->index, cpu->apic_id);
+    kernel::sched_init_cpu();
+    asm volatile("sti");
+    kernel::sched_idle();
+}
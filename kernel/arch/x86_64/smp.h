@@ -0,0 +1,19 @@
+#pragma once
+#include "cpu.h"
+
+// where the application processors start, must match trampoline.s
+constexpr uint64_t TRAMPOLINE_BASE = 0x8000;
+// the stack of the bootstrap processor, in the kernel image: _start64 moves
+// off the boot stack onto it before calling _cstart, as the boot stack is
+// low memory that only the kernel vspace maps. Must match multiboot.s
+constexpr uint64_t BSP_STACK_SIZE = 0x10000;
+
+// per-cpu data of the bootstrap processor, and GS pointing at it. Must
+// come before anything calling cpu_index()
+void smp_init_bsp();
+// find the other processors in the ACPI MADT and start them. Needs the
+// linear map to cover the local APIC and the ACPI tables, and the frame
+// allocator.
+void smp_init();
+// processors that came up, the bootstrap one included
+unsigned smp_cpu_count();
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include "cpu.h"
+
+// test-and-test-and-set lock. Spins on a plain load so that waiting cpus
+// don't keep bouncing the cache line around
+class Spinlock {
+    uint32_t locked = 0;
+public:
+    void lock() {
+        while (__atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked, __ATOMIC_RELAXED)) {
+                asm volatile("pause");
+            }
+        }
+    }
+    bool try_lock() {
+        return !__atomic_exchange_n(&locked, 1, __ATOMIC_ACQUIRE);
+    }
+    void unlock() {
+        __atomic_store_n(&locked, 0, __ATOMIC_RELEASE);
+    }
+};
+
+// holds a lock for the lifetime of the scope, with interrupts off: an
+// interrupt handler on the same cpu could otherwise spin on it forever
+class LockGuard {
+    IrqGuard irq;
+    Spinlock& lock;
+public:
+    LockGuard(Spinlock& l): lock{l} {
+        lock.lock();
+    }
+    ~LockGuard() {
+        lock.unlock();
+    }
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator = (const LockGuard&) = delete;
+};
@@ -0,0 +1,27 @@
+.section .text
+.code64
+
+# void context_switch(uint64_t* save_rsp, uint64_t rsp)
+# Saves the callee saved registers on the current stack, stores the stack
+# pointer in *save_rsp, and resumes the context saved on the stack at rsp.
+# Everything else is clobbered by the call anyway, as far as the caller
+# knows. A new context is six zeroed registers and a return address.
+.global context_switch
+.type context_switch, @function
+context_switch:
+    push %rbp
+    push %rbx
+    push %r12
+    push %r13
+    push %r14
+    push %r15
+    mov %rsp, (%rdi)
+    mov %rsi, %rsp
+    pop %r15
+    pop %r14
+    pop %r13
+    pop %r12
+    pop %rbx
+    pop %rbp
+    ret
+.size context_switch, . - context_switch
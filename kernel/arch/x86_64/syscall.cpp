@@ -0,0 +1,31 @@
+#include "syscall.h"
+#include "gdt.h"
+#include "cpu.h"
+
+extern "C" void syscall_entry();
+
+namespace {
+
+constexpr uint64_t EFER_SCE = 1 << 0;
+
+// cleared on entry: interrupts until the kernel stack is set up, trap,
+// direction and alignment check (no AC games), nested task
+constexpr uint64_t RFLAGS_TF = 1 << 8;
+constexpr uint64_t RFLAGS_IF = 1 << 9;
+constexpr uint64_t RFLAGS_DF = 1 << 10;
+constexpr uint64_t RFLAGS_NT = 1 << 14;
+constexpr uint64_t RFLAGS_AC = 1 << 18;
+
+}
+
+void syscall_init_cpu() {
+    // SYSCALL loads cs from STAR[47:32] and ss from the next selector.
+    // SYSRET to 64 bit code loads cs from STAR[63:48] + 16 and ss from
+    // STAR[63:48] + 8, both with rpl 3
+    static_assert(KERNEL_DS == KERNEL_CS + 8, "SYSCALL segment layout");
+    static_assert((USER_DS & ~3) == USER_CS32 + 8 && (USER_CS & ~3) == USER_CS32 + 16, "SYSRET segment layout");
+    wrmsr(MSR_STAR, uint64_t{USER_CS32} << 48 | uint64_t{KERNEL_CS} << 32);
+    wrmsr(MSR_LSTAR, reinterpret_cast<uint64_t>(syscall_entry));
+    wrmsr(MSR_SFMASK, RFLAGS_TF | RFLAGS_IF | RFLAGS_DF | RFLAGS_NT | RFLAGS_AC);
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+}
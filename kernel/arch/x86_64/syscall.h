@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+
+// User mode entry and exit. User code calls the kernel with SYSCALL:
+// the number in rax, arguments in rdi, rsi, rdx, r10, r8 and r9, results
+// back in the same registers. Like a function call, rcx, r11 and the
+// vector registers are clobbered. Other registers are preserved.
+//
+// The entry (syscall.s) swaps in the kernel GS, moves to the kernel stack
+// of the thread, saves the argument registers as a SyscallFrame and calls
+// syscall_dispatch with interrupts on. The handler may rewrite the frame:
+// that's what user space gets back. The return is SYSRET.
+
+// lowest address first
+struct SyscallFrame {
+    uint64_t rax, rdi, rsi, rdx, r10, r8, r9;
+    uint64_t rip; // rcx
+    uint64_t rflags; // r11
+    uint64_t rsp;
+};
+
+// user addresses are below this. The last page of the lower half stays
+// unmapped: a SYSCALL there would return to a non-canonical rip, and
+// SYSRET would fault in ring 0 with the user's stack
+constexpr uint64_t USER_TOP = 0x00007ffffffff000ull;
+
+// STAR, LSTAR and SFMASK of the calling cpu
+void syscall_init_cpu();
+
+extern "C" {
+    // implemented by the kernel
+    void syscall_dispatch(SyscallFrame* frame);
+    // drop to user mode at rip with stack rsp, all other registers zeroed
+    [[noreturn]] void user_enter(uint64_t rip, uint64_t rsp);
+}
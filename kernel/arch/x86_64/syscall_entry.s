@@ -0,0 +1,87 @@
+.section .text
+.code64
+
+# SYSCALL lands here with interrupts off, the user rip in rcx and rflags in
+# r11, still on the user stack and with the user GS. The kernel stack is
+# the one of the running thread, kept in %gs:16 by the scheduler.
+# The layout of what's pushed is SyscallFrame in syscall.h.
+.global syscall_entry
+.type syscall_entry, @function
+syscall_entry:
+    swapgs
+    mov %rsp, %gs:24
+    mov %gs:16, %rsp
+    pushq %gs:24
+    push %r11
+    push %rcx
+    push %r9
+    push %r8
+    push %r10
+    push %rdx
+    push %rsi
+    push %rdi
+    push %rax
+    # 10 words from a 16 byte aligned top: aligned for the call
+    mov %rsp, %rdi
+    sti
+    call syscall_dispatch
+    cli
+    # the kernel is built with SSE: whatever it left in the vector registers
+    # must not reach user space. The ABI has them clobbered by syscalls, and
+    # the kernel doesn't touch the AVX upper halves, so clearing these is enough
+    pxor %xmm0, %xmm0
+    pxor %xmm1, %xmm1
+    pxor %xmm2, %xmm2
+    pxor %xmm3, %xmm3
+    pxor %xmm4, %xmm4
+    pxor %xmm5, %xmm5
+    pxor %xmm6, %xmm6
+    pxor %xmm7, %xmm7
+    pxor %xmm8, %xmm8
+    pxor %xmm9, %xmm9
+    pxor %xmm10, %xmm10
+    pxor %xmm11, %xmm11
+    pxor %xmm12, %xmm12
+    pxor %xmm13, %xmm13
+    pxor %xmm14, %xmm14
+    pxor %xmm15, %xmm15
+    pop %rax
+    pop %rdi
+    pop %rsi
+    pop %rdx
+    pop %r10
+    pop %r8
+    pop %r9
+    pop %rcx
+    pop %r11
+    # nothing may interrupt us between here and sysret: we're on the
+    # user stack with the user GS (NMIs run on their own stack)
+    pop %rsp
+    swapgs
+    sysretq
+.size syscall_entry, . - syscall_entry
+
+# void user_enter(uint64_t rip, uint64_t rsp)
+.global user_enter
+.type user_enter, @function
+user_enter:
+    cli
+    mov %rdi, %rcx
+    mov $0x202, %r11 # IF, and the always set bit
+    mov %rsi, %rsp
+    xor %eax, %eax
+    xor %edx, %edx
+    xor %esi, %esi
+    xor %edi, %edi
+    xor %ebx, %ebx
+    xor %ebp, %ebp
+    xor %r8d, %r8d
+    xor %r9d, %r9d
+    xor %r10d, %r10d
+    xor %r12d, %r12d
+    xor %r13d, %r13d
+    xor %r14d, %r14d
+    xor %r15d, %r15d
+    swapgs
+    sysretq
+.size user_enter, . - user_enter
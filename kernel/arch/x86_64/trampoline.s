@@ -0,0 +1,90 @@
+# Application processor startup code. smp_init copies it to
+# TRAMPOLINE_BASE (below 1mb, page aligned) and fills in the data at the
+# end. The startup IPI gets the cpu here in real mode, with cs:ip =
+# TRAMPOLINE_BASE >> 4 : 0. It goes through protected mode straight into
+# long mode on the kernel page tables, which also map the first 2mb where
+# this runs, then calls trampoline_entry(trampoline_cpu) on its own stack.
+# Code and data are linked in the kernel image but run from the copy, so
+# addresses are computed as offsets from trampoline_start.
+.set TRAMPOLINE_BASE, 0x8000
+
+.section .rodata.trampoline, "a"
+.code16
+.global trampoline_start
+trampoline_start:
+    cli
+    cld
+    xor %ax, %ax
+    mov %ax, %ds
+    lgdtl (TRAMPOLINE_BASE + trampoline_gdt_pointer - trampoline_start)
+    mov %cr0, %eax
+    or $1, %eax # protected mode
+    mov %eax, %cr0
+    ljmpl $0x10, $(TRAMPOLINE_BASE + trampoline_32 - trampoline_start)
+
+.code32
+trampoline_32:
+    mov $0x18, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    mov %ax, %ss
+    # PAE, PGE, OSFXSR and OSXMMEXCPT, like the bootstrap processor
+    mov $(1<<5 | 1<<7 | 1<<9 | 1<<10), %eax
+    mov %eax, %cr4
+    mov (TRAMPOLINE_BASE + trampoline_cr3 - trampoline_start), %eax
+    mov %eax, %cr3
+    # EFER.LME (and NXE), as the bootstrap processor has them
+    mov $0xC0000080, %ecx
+    rdmsr
+    or (TRAMPOLINE_BASE + trampoline_efer - trampoline_start), %eax
+    wrmsr
+    # paging, protected mode, MP, ET and NE: x87 errors as exceptions
+    mov $(1<<31 | 1<<5 | 1<<4 | 1<<1 | 1<<0), %eax
+    mov %eax, %cr0
+    ljmp $0x08, $(TRAMPOLINE_BASE + trampoline_64 - trampoline_start)
+
+.code64
+trampoline_64:
+    mov (TRAMPOLINE_BASE + trampoline_stack - trampoline_start), %rsp
+    mov (TRAMPOLINE_BASE + trampoline_cpu - trampoline_start), %rdi
+    mov (TRAMPOLINE_BASE + trampoline_entry - trampoline_start), %rax
+    call *%rax
+1:  cli
+    hlt
+    jmp 1b
+
+# same layout as GDT64 in multiboot.s
+.align 8
+trampoline_gdt:
+    .quad 0
+    .quad 0x00af9a000000ffff # 64 bit code
+    .quad 0x00cf9a000000ffff # 32 bit code
+    .quad 0x00cf92000000ffff # data
+trampoline_gdt_end:
+.align 4
+    .short 0
+trampoline_gdt_pointer:
+    .short trampoline_gdt_end - trampoline_gdt - 1
+    .long TRAMPOLINE_BASE + trampoline_gdt - trampoline_start
+
+# filled in by smp_init for each processor
+.align 8
+.global trampoline_cr3
+trampoline_cr3:
+    .quad 0
+.global trampoline_efer
+trampoline_efer:
+    .quad 0
+.global trampoline_stack
+trampoline_stack:
+    .quad 0
+.global trampoline_entry
+trampoline_entry:
+    .quad 0
+.global trampoline_cpu
+trampoline_cpu:
+    .quad 0
+.global trampoline_end
+trampoline_end:
@@ -0,0 +1,74 @@
+#include "tsc.h"
+#include "cpu.h"
+#include "../../printk.hpp"
+
+namespace {
+
+uint64_t frequency;
+uint64_t base; // TSC at ktime 0
+// ktime = (tsc - base) * ns_mult >> 32, and back with tsc_mult
+uint64_t ns_mult;
+uint64_t tsc_mult;
+
+constexpr uint64_t pit_hz = 1193182;
+
+// TSC ticks in 10ms of PIT channel 2, in mode 0 (OUT goes high at terminal
+// count, which port 0x61 shows in bit 5). The channel 2 gate is bit 0 of
+// port 0x61, the speaker bit 1
+uint64_t pit_calibrate() {
+    constexpr uint16_t count = pit_hz / 100;
+    uint8_t const port61 = inb(0x61) & ~0x03;
+    outb(0x61, port61);
+    outb(0x43, 0xb0); // channel 2, low then high byte, mode 0
+    outb(0x42, count & 0xff);
+    outb(0x42, count >> 8);
+    outb(0x61, port61 | 0x01); // gate on: counting starts
+    uint64_t const start = rdtsc();
+    while (!(inb(0x61) & 0x20)) {
+    }
+    uint64_t const cycles = rdtsc() - start;
+    outb(0x61, port61);
+    return cycles * 100;
+}
+
+}
+
+void tsc_init() {
+    auto const max_leaf = cpuid(0).eax;
+    if (max_leaf >= 0x15) {
+        // TSC/crystal ratio in ebx/eax, crystal frequency in ecx (0 if not reported)
+        auto const leaf = cpuid(0x15);
+        if (leaf.eax && leaf.ebx && leaf.ecx) {
+            frequency = uint64_t{leaf.ecx} * leaf.ebx / leaf.eax;
+        }
+    }
+    const char* source = "CPUID";
+    if (!frequency) {
+        // median of three, an SMI or a slow port read can spoil one
+        uint64_t samples[3];
+        for (auto &sample: samples) {
+            sample = pit_calibrate();
+        }
+        auto const lo = samples[0] < samples[1] ? samples[0] : samples[1];
+        auto const hi = samples[0] < samples[1] ? samples[1] : samples[0];
+        frequency = samples[2] < lo ? lo : samples[2] > hi ? hi : samples[2];
+        source = "PIT";
+    }
+    ns_mult = (uint64_t{1000000000} << 32) / frequency;
+    tsc_mult = static_cast<uint64_t>((static_cast<unsigned __int128>(frequency) << 32) / 1000000000);
+    base = rdtsc();
+    bool const invariant = cpuid(0x80000000).eax >= 0x80000007 && (cpuid(0x80000007).edx & (1 << 8));
+    printk(LogLevel::Info, "TSC: %d kHz (%s)%s\n", frequency / 1000, source, invariant ? "" : ", not invariant");
+}
+
+uint64_t tsc_hz() {
+    return frequency;
+}
+
+uint64_t ktime_ns() {
+    return static_cast<uint64_t>(static_cast<unsigned __int128>(rdtsc() - base) * ns_mult >> 32);
+}
+
+uint64_t ktime_to_tsc(uint64_t ns) {
+    return base + static_cast<uint64_t>(static_cast<unsigned __int128>(ns) * tsc_mult >> 32);
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <cstdint>
+
+// Time from the TSC. Assumes an invariant TSC, synchronized across cpus
+// (any cpu from the last decade, and QEMU/KVM); tsc_init says so if the
+// cpu doesn't claim it.
+
+// find the TSC frequency: CPUID leaf 0x15 when it's complete, the PIT otherwise
+void tsc_init();
+uint64_t tsc_hz();
+// nanoseconds since tsc_init
+uint64_t ktime_ns();
+// TSC value at the given ktime_ns()
+uint64_t ktime_to_tsc(uint64_t ns);
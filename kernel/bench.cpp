@@ -0,0 +1,523 @@
+#include <string.h>
+#include <kernel/syscall.h>
+#include "bench.hpp"
+#include "console.hpp"
+#include "sched.hpp"
+#include "ipc.hpp"
+#include "futex.hpp"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/frames.h"
+#include "arch/x86_64/smp.h"
+#include "arch/x86_64/idt.h"
+
+namespace {
+
+struct {
+    MMU::PML4T* space;
+    void* base;
+    int pages;
+    int rounds;
+    bool done;
+} vspace_bench;
+
+// on a thread of its own: its stack is in the linear map, which every
+// vspace has, unlike the low memory the boot code ran on. Interrupts are
+// off while the other vspace is loaded, so the scheduler can't switch us
+// away (or to another cpu) in the middle of a round trip. PCIDs stay on,
+// the other cpus rely on them: the pass without them drops what this cpu
+// cached on each switch, which is what a switch costs without PCIDs
+void vspace_task(void*) {
+    MMU mmu;
+    auto const kernel_space = mmu.get_kernel_vspace();
+    auto const &bench = vspace_bench;
+    if (!mmu.uses_pcid()) {
+        console.printf("bench: vspace switch: no PCID support\n");
+    }
+    for (int pass = mmu.uses_pcid() ? 0 : 1; pass < 2; pass++) {
+        bool const pcid = pass == 0;
+        uint64_t cycles;
+        {
+            IrqGuard irq;
+            uint64_t const start = rdtsc();
+            for (int i = 0; i < bench.rounds; i++) {
+                bench.space->switchTo(pcid);
+                for (int p = 0; p < bench.pages; p++) {
+                    static_cast<volatile uint64_t*>(bench.base)[p * 512];
+                }
+                kernel_space->switchTo(pcid);
+            }
+            cycles = rdtsc() - start;
+        }
+        console.printf("bench: vspace switch round trip, %d pages touched, PCID %s: %d cycles\n",
+            bench.pages, pcid ? "on" : "off", cycles / bench.rounds);
+    }
+    __atomic_store_n(&vspace_bench.done, true, __ATOMIC_RELEASE);
+}
+
+}
+
+void bench_vspace_switch(MMU& mmu) {
+    constexpr int order = 5;
+    void* const base = reinterpret_cast<void*>(0x400000);
+
+    auto space = mmu.create_vspace();
+    uint64_t const frames = frame_allocator.alloc(order);
+    if (!space || !frames) {
+        console.printf("bench: vspace switch: out of memory\n");
+        return;
+    }
+    space->mapRange(base, frames, (1 << order) * FrameAllocator::frame_size);
+
+    vspace_bench = {space, base, 1 << order, 1000, false};
+    if (!kernel::Thread::spawn("bench vspace", vspace_task, nullptr)) {
+        console.printf("bench: vspace switch: out of memory\n");
+    } else {
+        // we are the idle thread of this cpu, see bench_scheduler
+        while (!__atomic_load_n(&vspace_bench.done, __ATOMIC_ACQUIRE)) {
+            kernel::yield();
+            asm volatile("pause");
+        }
+    }
+
+    mmu.destroy_vspace(space);
+    frame_allocator.free(frames, order);
+}
+
+void bench_memory_routines() {
+    constexpr int rounds = 1000;
+    uint64_t const frames = frame_allocator.alloc(1);
+    if (!frames) {
+        console.printf("bench: memory routines: out of memory\n");
+        return;
+    }
+    auto const src = static_cast<uint8_t*>(ptl(frames));
+    auto const dst = src + FrameAllocator::frame_size;
+    size_t const sizes[] = {24, 256, FrameAllocator::frame_size};
+    for (size_t size: sizes) {
+        uint64_t start = rdtsc();
+        for (int i = 0; i < rounds; i++) {
+            memset(dst, i, size);
+            asm volatile("" : : "r"(dst) : "memory");
+        }
+        uint64_t const set = (rdtsc() - start) / rounds;
+        start = rdtsc();
+        for (int i = 0; i < rounds; i++) {
+            memcpy(dst, src, size);
+            asm volatile("" : : "r"(dst) : "memory");
+        }
+        console.printf("bench: %d bytes: memset %d cycles, memcpy %d cycles\n",
+            size, set, (rdtsc() - start) / rounds);
+    }
+    frame_allocator.free(frames, 1);
+}
+
+namespace {
+
+constexpr int sched_tasks = 512;
+constexpr int task_chunks = 64;
+
+struct {
+    uint64_t busy; // cycles spent in tasks, summed over all cpus
+    uint64_t done;
+    uint64_t driver_woken;
+    uint64_t driver_latency;
+} sched_bench;
+
+void driver_task(void*) {
+    sched_bench.driver_latency = rdtsc() - sched_bench.driver_woken;
+}
+
+void sched_task(void* arg) {
+    uint64_t const start = rdtsc();
+    if (reinterpret_cast<uintptr_t>(arg) == sched_tasks / 2) {
+        sched_bench.driver_woken = rdtsc();
+        kernel::Thread::spawn("bench driver", driver_task, nullptr, kernel::Thread::Class::Driver);
+    }
+    for (int chunk = 0; chunk < task_chunks; chunk++) {
+        for (int i = 0; i < 1000; i++) {
+            asm volatile("");
+        }
+        kernel::preempt();
+    }
+    __atomic_fetch_add(&sched_bench.busy, rdtsc() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sched_bench.done, 1, __ATOMIC_RELEASE);
+}
+
+}
+
+void bench_scheduler() {
+    sched_bench = {};
+    auto const before = kernel::sched_stats();
+    uint64_t const start = rdtsc();
+    int spawned = 0;
+    for (; spawned < sched_tasks; spawned++) {
+        if (!kernel::Thread::spawn("bench task", sched_task, reinterpret_cast<void*>(uintptr_t(spawned)))) {
+            console.printf("bench: scheduler: out of memory\n");
+            break;
+        }
+    }
+    // we are the idle thread of this cpu: we only get back here when there's
+    // nothing left to run or steal
+    while (__atomic_load_n(&sched_bench.done, __ATOMIC_ACQUIRE) < uint64_t(spawned)) {
+        kernel::yield();
+        asm volatile("pause");
+    }
+    uint64_t const elapsed = rdtsc() - start;
+    auto const after = kernel::sched_stats();
+    uint64_t const parallelism = sched_bench.busy * 100 / elapsed;
+    console.printf("bench: %d threads on %d cpus in %d cycles, %d.%02d cpus busy on average, %d switches, %d steals\n",
+        spawned, smp_cpu_count(), elapsed, parallelism / 100, parallelism % 100,
+        after.switches - before.switches, after.steals - before.steals);
+    console.printf("bench: driver thread ran %d cycles after being woken\n", sched_bench.driver_latency);
+}
+
+namespace {
+constexpr uint8_t bench_vector = VECTOR_FIXED;
+uint64_t interrupt_entered;
+}
+
+void bench_interrupts() {
+    constexpr int rounds = 1000;
+    interrupt_attach(bench_vector, [](InterruptFrame&, void*) {
+        interrupt_entered = rdtsc();
+    });
+    uint64_t entry = 0, exit = 0, min_entry = ~0ull, min_exit = ~0ull;
+    for (int i = 0; i < rounds; i++) {
+        uint64_t const start = rdtsc();
+        asm volatile("int %0" : : "i"(bench_vector) : "memory");
+        uint64_t const end = rdtsc();
+        uint64_t const in = interrupt_entered - start, out = end - interrupt_entered;
+        entry += in;
+        exit += out;
+        min_entry = in < min_entry ? in : min_entry;
+        min_exit = out < min_exit ? out : min_exit;
+    }
+    interrupt_detach(bench_vector);
+    console.printf("bench: interrupt entry %d cycles (min %d), exit %d cycles (min %d)\n",
+        entry / rounds, min_entry, exit / rounds, min_exit);
+    interrupt_dump_stats();
+}
+
+// user mode side of bench_ipc, copied to a page of its own: position
+// independent. Both find the endpoint at the bottom of their stack, the
+// client then the number of calls, and leaves the cycles they took after
+// it. A zero message tells the server to exit
+asm(R"(
+    .pushsection .rodata
+    .set SYS_EXIT, 0
+    .set SYS_IPC_CALL, 2
+    .set SYS_IPC_REPLY_WAIT, 3
+    .global ipc_bench_client, ipc_bench_server, ipc_bench_end
+ipc_bench_client:
+    mov (%rsp), %r12
+    mov 8(%rsp), %r13
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    mov %rdx, %r14
+1:  mov $SYS_IPC_CALL, %eax
+    mov %r12, %rdi
+    mov %r13, %rsi
+    syscall
+    dec %r13
+    jnz 1b
+    rdtsc
+    shl $32, %rdx
+    or %rax, %rdx
+    sub %r14, %rdx
+    mov %rdx, 16(%rsp)
+    mov $SYS_IPC_CALL, %eax
+    mov %r12, %rdi
+    xor %esi, %esi
+    syscall
+    mov $SYS_EXIT, %eax
+    syscall
+ipc_bench_server:
+    mov (%rsp), %r12
+1:  mov $SYS_IPC_REPLY_WAIT, %eax
+    mov %r12, %rdi
+    syscall
+    test %rsi, %rsi
+    jnz 1b
+    mov $SYS_EXIT, %eax
+    syscall
+ipc_bench_end:
+    .popsection
+)");
+
+extern "C" const uint8_t ipc_bench_client[], ipc_bench_server[], ipc_bench_end[];
+static_assert(SYS_EXIT == 0 && SYS_IPC_CALL == 2 && SYS_IPC_REPLY_WAIT == 3, "syscall numbers in ipc_bench_client");
+
+namespace {
+
+constexpr int ipc_rounds = 10000;
+
+struct {
+    int endpoint;
+    uint64_t cycles;
+} ipc_bench;
+
+void ipc_server(void*) {
+    kernel::IpcMessage message = {};
+    do {
+        kernel::ipc_reply_wait(ipc_bench.endpoint, message);
+    } while (message.words[0]);
+}
+
+void ipc_client(void*) {
+    kernel::IpcMessage message = {};
+    uint64_t const start = rdtsc();
+    for (int i = ipc_rounds; i > 0; i--) {
+        message.words[0] = i;
+        kernel::ipc_call(ipc_bench.endpoint, message);
+    }
+    uint64_t const cycles = rdtsc() - start;
+    message.words[0] = 0;
+    kernel::ipc_call(ipc_bench.endpoint, message);
+    __atomic_store_n(&ipc_bench.cycles, cycles, __ATOMIC_RELEASE);
+}
+
+// a vspace with the user half of bench_ipc at code_base, and a stack page
+// below stack_top holding the endpoint and the calls to make
+MMU::PML4T* ipc_user_space(MMU& mmu, uint64_t code, uint64_t stack) {
+    auto space = mmu.create_vspace();
+    if (space && (space->mapRange(reinterpret_cast<void*>(0x400000), code, FrameAllocator::frame_size, MMU::User) != MMU::MapResult::Ok ||
+            space->mapRange(reinterpret_cast<void*>(0x7ff000), stack, FrameAllocator::frame_size,
+                MMU::User | MMU::Writable | MMU::NoExecute) != MMU::MapResult::Ok)) {
+        mmu.destroy_vspace(space);
+        return nullptr;
+    }
+    return space;
+}
+
+}
+
+void bench_ipc(MMU& mmu) {
+    ipc_bench.endpoint = kernel::ipc_endpoint_create();
+    if (ipc_bench.endpoint < 0) {
+        console.printf("bench: ipc: no endpoint\n");
+        return;
+    }
+    ipc_bench.cycles = 0;
+    if (!kernel::Thread::spawn("ipc server", ipc_server, nullptr) ||
+            !kernel::Thread::spawn("ipc client", ipc_client, nullptr)) {
+        console.printf("bench: ipc: out of memory\n");
+        return;
+    }
+    // we are the idle thread, see bench_scheduler
+    while (!__atomic_load_n(&ipc_bench.cycles, __ATOMIC_ACQUIRE)) {
+        kernel::yield();
+        asm volatile("pause");
+    }
+    console.printf("bench: ipc round trip between kernel threads: %d cycles\n", ipc_bench.cycles / ipc_rounds);
+
+    uint64_t const code = frame_allocator.alloc();
+    uint64_t const client_stack = frame_allocator.alloc();
+    uint64_t const server_stack = frame_allocator.alloc();
+    if (!code || !client_stack || !server_stack) {
+        console.printf("bench: ipc: out of memory\n");
+        return;
+    }
+    memcpy(ptl(code), ipc_bench_client, ipc_bench_end - ipc_bench_client);
+    auto const client_words = reinterpret_cast<volatile uint64_t*>(static_cast<uint8_t*>(ptl(client_stack)) + FrameAllocator::frame_size) - 4;
+    auto const server_words = reinterpret_cast<volatile uint64_t*>(static_cast<uint8_t*>(ptl(server_stack)) + FrameAllocator::frame_size) - 4;
+    client_words[0] = ipc_bench.endpoint;
+    server_words[0] = ipc_bench.endpoint;
+    client_words[1] = ipc_rounds;
+    client_words[2] = 0;
+    uint64_t const stack_top = 0x800000 - 4 * sizeof(uint64_t);
+    auto client_space = ipc_user_space(mmu, code, client_stack);
+    auto server_space = ipc_user_space(mmu, code, server_stack);
+    if (!client_space || !server_space ||
+            !kernel::Thread::spawn_user("ipc server", server_space, 0x400000 + (ipc_bench_server - ipc_bench_client), stack_top) ||
+            !kernel::Thread::spawn_user("ipc client", client_space, 0x400000, stack_top)) {
+        console.printf("bench: ipc: out of memory\n");
+        return;
+    }
+    while (!client_words[2]) {
+        kernel::yield();
+        asm volatile("pause");
+    }
+    console.printf("bench: ipc round trip between user threads in two vspaces: %d cycles\n", client_words[2] / ipc_rounds);
+    // the threads may still be on their way out of the vspaces: they and
+    // their pages stay, it's a few pages once per boot
+}
+
+namespace {
+
+// mutex3 of "Futexes Are Tricky": 0 free, 1 locked, 2 locked and maybe
+// contended. The kernel only sees the contended cases
+struct FutexMutex {
+    uint32_t state = 0;
+
+    void lock() {
+        uint32_t c = 0;
+        if (__atomic_compare_exchange_n(&state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        if (c != 2) {
+            c = __atomic_exchange_n(&state, 2, __ATOMIC_ACQUIRE);
+        }
+        while (c) {
+            kernel::futex_wait(&state, 2);
+            c = __atomic_exchange_n(&state, 2, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    void unlock() {
+        if (__atomic_fetch_sub(&state, 1, __ATOMIC_RELEASE) != 1) {
+            __atomic_store_n(&state, 0, __ATOMIC_RELEASE);
+            kernel::futex_wake(&state, 1);
+        }
+    }
+};
+
+constexpr int futex_ops = 200000;
+
+struct {
+    FutexMutex mutex;
+    uint64_t counter; // under mutex
+    int per_thread;
+    uint64_t done;
+} futex_bench;
+
+void futex_task(void*) {
+    for (int i = 0; i < futex_bench.per_thread; i++) {
+        futex_bench.mutex.lock();
+        futex_bench.counter++;
+        for (int j = 0; j < 20; j++) {
+            asm volatile("");
+        }
+        futex_bench.mutex.unlock();
+    }
+    __atomic_fetch_add(&futex_bench.done, 1, __ATOMIC_RELEASE);
+}
+
+}
+
+void bench_futex() {
+    unsigned const cpus = smp_cpu_count();
+    unsigned const counts[] = {1, cpus, 2 * cpus, 4 * cpus};
+    for (unsigned threads: counts) {
+        futex_bench.mutex = {};
+        futex_bench.counter = 0;
+        futex_bench.per_thread = futex_ops / threads;
+        futex_bench.done = 0;
+        auto const before = kernel::futex_stats();
+        uint64_t const start = rdtsc();
+        unsigned spawned = 0;
+        for (; spawned < threads; spawned++) {
+            if (!kernel::Thread::spawn("futex bench", futex_task, nullptr)) {
+                console.printf("bench: futex: out of memory\n");
+                break;
+            }
+        }
+        // we are the idle thread, see bench_scheduler
+        while (__atomic_load_n(&futex_bench.done, __ATOMIC_ACQUIRE) < spawned) {
+            kernel::yield();
+            asm volatile("pause");
+        }
+        uint64_t const elapsed = rdtsc() - start;
+        auto const after = kernel::futex_stats();
+        uint64_t const ops = uint64_t{spawned} * futex_bench.per_thread;
+        console.printf("bench: futex mutex, %d threads on %d cpus: %d cycles per lock/unlock, ",
+            spawned, cpus, ops ? elapsed / ops : 0);
+        console.printf("%d waits, %d wakes%s\n", after.waits - before.waits, after.wakes - before.wakes,
+            futex_bench.counter == ops ? "" : ", LOST UPDATES");
+    }
+}
+
+void bench_demand_paging(MMU& mmu) {
+    constexpr uint64_t heap_size = 1ull << 30;
+    constexpr int pages = 256;
+    uint64_t const page = MMU::page_size(1);
+    uint64_t const base = 0x40000000;
+    auto const address = [base, page](int i) {
+        return reinterpret_cast<void*>(base + i * page);
+    };
+
+    auto space = mmu.create_vspace();
+    if (!space) {
+        console.printf("bench: demand paging: out of memory\n");
+        return;
+    }
+    uint64_t start = rdtsc();
+    if (space->mapAnonymous(reinterpret_cast<void*>(base), heap_size) != MMU::MapResult::Ok) {
+        console.printf("bench: demand paging: can't reserve the heap\n");
+        mmu.destroy_vspace(space);
+        return;
+    }
+    uint64_t const reserve = rdtsc() - start;
+    uint64_t const free_before = frame_allocator.free_frames();
+    console.printf("bench: 1G anonymous heap reserved in %d cycles\n", reserve);
+
+    // first reads share the zero frame, the writes after them copy it,
+    // writes to untouched pages get a zeroed frame right away
+    start = rdtsc();
+    for (int i = 0; i < pages; i++) {
+        space->faultIn(address(i), false);
+    }
+    uint64_t const zero_map = (rdtsc() - start) / pages;
+    start = rdtsc();
+    for (int i = 0; i < pages; i++) {
+        space->faultIn(address(i), true);
+    }
+    uint64_t const zero_copy = (rdtsc() - start) / pages;
+    start = rdtsc();
+    for (int i = pages; i < 2 * pages; i++) {
+        space->faultIn(address(i), true);
+    }
+    uint64_t const zero_fill = (rdtsc() - start) / pages;
+    console.printf("bench: fault in, read %d cycles, write after read %d, first write %d\n",
+        zero_map, zero_copy, zero_fill);
+
+    start = rdtsc();
+    auto clone = mmu.clone_vspace(space);
+    uint64_t const cloning = rdtsc() - start;
+    if (clone) {
+        // the clone copies, then the original finds its frames unshared
+        start = rdtsc();
+        for (int i = 0; i < pages; i++) {
+            clone->faultIn(address(i), true);
+        }
+        uint64_t const copy = (rdtsc() - start) / pages;
+        start = rdtsc();
+        for (int i = 0; i < pages; i++) {
+            space->faultIn(address(i), true);
+        }
+        uint64_t const reuse = (rdtsc() - start) / pages;
+        auto const usage = clone->usage();
+        console.printf("bench: clone of %d pages %d cycles, copy-on-write %d cycles, reuse %d\n",
+            2 * pages, cloning, copy, reuse);
+        console.printf("bench: clone usage, %d reserved, %d resident, %d shared, %d dirty\n",
+            usage.reserved, usage.resident, usage.shared, usage.dirty);
+        mmu.destroy_vspace(clone);
+    }
+    console.printf("bench: %d frames in use for %d touched pages\n",
+        free_before - frame_allocator.free_frames(), 2 * pages);
+
+    // many small mappings, alternating flags so that they don't merge
+    constexpr int mappings = 4096;
+    start = rdtsc();
+    int reserved = 0;
+    for (; reserved < mappings; reserved++) {
+        uint64_t const flags = reserved & 1 ? MMU::User : MMU::User | MMU::Writable;
+        if (!space->reserveAnonymous(page, flags)) {
+            break;
+        }
+    }
+    uint64_t const insert = (rdtsc() - start) / (reserved ? reserved : 1);
+    int const spread = reserved ? reserved : 1;
+    kernel::Vma vma;
+    start = rdtsc();
+    for (int i = 0; i < mappings; i++) {
+        space->vmas.find(page * (1 + i * 7 % spread), vma);
+    }
+    uint64_t const lookup = (rdtsc() - start) / mappings;
+    console.printf("bench: %d mappings, %d cycles to add one, %d to look one up\n",
+        static_cast<int>(space->vmas.size()), insert, lookup);
+    mmu.destroy_vspace(space);
+    auto const stats = mmu.fault_stats();
+    console.printf("bench: faults, %d zero maps, %d zero fills, %d backed maps, %d copies, %d reuses, %d bad\n",
+        stats.zero_maps, stats.zero_fills, stats.backed_maps, stats.copies, stats.reuses, stats.bad);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "arch/x86_64/mmu.h"
+
+// Boot time micro benchmarks, run when the kernel command line has "bench".
+// They print cycles as measured by the TSC.
+
+// round trips between the kernel vspace and another one, touching a few
+// pages of the latter each time, with and without PCIDs
+void bench_vspace_switch(MMU& mmu);
+
+// memcpy and memset of whole pages and of small buffers
+void bench_memory_routines();
+
+// many short threads spawned on the bootstrap processor, spread by work
+// stealing, and how quickly a driver thread gets the cpu
+void bench_scheduler();
+
+// entry and exit latency of an interrupt with an empty handler, raised with int
+void bench_interrupts();
+
+// synchronous IPC round trips, between kernel threads and between user
+// threads in different address spaces
+void bench_ipc(MMU& mmu);
+
+// lock/unlock of a futex based mutex by 1 to 4 threads per cpu, and how
+// often contention reached the kernel
+void bench_futex();
+
+// reserving a large anonymous heap, faulting pages in (zero frame, zero
+// fill, copy-on-write after a clone), the frames it all takes, and adding
+// and looking up mappings in a space that has thousands
+void bench_demand_paging(MMU& mmu);
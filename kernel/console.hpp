@@ -1,5 +1,6 @@
 #include <cstdint>
 #include <cstddef>
+#include "format.hpp"
 
 #pragma pack(push, 1)
 struct alignas(1) VGACell
@@ -16,30 +17,79 @@ struct alignas(1) VGACell
 static_assert(sizeof(VGACell) == 2, "VGACell too big (not packed?)");
 #pragma pack(pop)
 
+// Text console. Output goes to a RAM shadow of the screen, a ring of lines
+// with some scrollback: scrolling moves the ring top, nothing gets copied.
+// Changed lines are copied to VRAM, and the hardware cursor moved, once per
+// flush() (at the end of every write call). Text can also be copied to a
+// second sink (the serial port), handed over at flush time as well.
 class Console
 {
     static int constexpr screen_width = 80;
     static int constexpr screen_height = 25;
     static int constexpr buffer_size = screen_width * screen_height;
-    static inline VGACell * vram_base_address() {
-        return reinterpret_cast<VGACell * const>(0xb8000ull);
+    static int constexpr scrollback_lines = 256; // power of two, ring indexes wrap by masking
+    VGACell * vram; // identity mapped at first, linear once useLinearMap is called
+    VGACell * vram_base_address() {
+        return vram;
     }
+    VGACell lines[scrollback_lines][screen_width];
+    uint16_t top; // ring line shown at the first screen row, when not scrolled back
+    uint16_t history; // lines above the screen that can be scrolled back to
+    uint16_t view; // how many lines the screen is scrolled back
+    uint16_t shownView; // view VRAM has
+    uint8_t dirtyFirst, dirtyLast; // screen rows to copy at the next flush, none if first > last
     uint16_t cursorPosition;
+    uint16_t shownCursor; // cursor position the hardware has
     uint8_t pen;
+    void (*mirror)(const char* data, size_t length);
+    char mirrorBuffer[128];
+    uint8_t mirrorLength;
+    void mirrorChar(char c) {
+        if (!mirror) return;
+        if (mirrorLength == sizeof(mirrorBuffer)) flushMirror();
+        mirrorBuffer[mirrorLength++] = c;
+    }
+    void flushMirror();
     void updateCursor();
     void outChar(char c);
     void lineFeed();
+    void newLine();
     void carriageReturn();
+    void scroll();
+    // write without flushing
+    void putString(char const * c);
+    void clearLine(int row);
+    VGACell* line(int row) { return lines[(top + row) & (scrollback_lines - 1)]; }
+    void markDirty(int first, int last) {
+        if (first < dirtyFirst) dirtyFirst = first;
+        if (last > dirtyLast) dirtyLast = last;
+    }
     uint16_t setCursor(uint16_t newValue) {
          return cursorPosition = (newValue % buffer_size);
     };
-    //print format string until an arg is met (or format ends), print the arg (if matching)
-    const char* _printf(const char* format, char const * arg);
-    const char* _printf(const char* format, int64_t arg);
+    static void sink(void* console, const char* data, size_t length);
 public:
     void initialize();
+    // reach VRAM through the linear map, which user vspaces have too (fatal
+    // exceptions flush the console in whatever vspace they hit). Once the
+    // linear map is usable, after MMU::init_kernel_vspace
+    void useLinearMap();
     void clearScreen();
-    VGACell& cellAt(uint16_t pos) { return (vram_base_address()[pos % buffer_size]); }
+    // shadow cell, shown after the next flush
+    VGACell& cellAt(uint16_t pos) {
+        pos %= buffer_size;
+        markDirty(pos / screen_width, pos / screen_width);
+        return line(pos / screen_width)[pos % screen_width];
+    }
+    // copy what changed to VRAM and move the hardware cursor
+    void flush();
+    // look at older lines: positive goes back, negative forward. Writes go back to the bottom
+    void scrollView(int count);
+    // also send everything written from now on to sink
+    void setMirror(void (*sink)(const char* data, size_t length)) {
+        flushMirror();
+        mirror = sink;
+    }
     void enableCursor();
     void disableCursor();
     uint16_t coordToPos(int x, int y);
@@ -51,18 +101,16 @@ public:
     void writeData(char const * c, size_t length );
     void writeNumber(int64_t number, int minWidth=1, int base = 10);
 
-    template<typename firstArg, typename ... argTypes>
-    void printf(const char* format, firstArg arg, argTypes ... args ) {
-        auto argument = _printf(format,arg);
-        printf(argument, args ...);
-    }
-
-    void printf(const char* format) {
-        while (*format) {
-            format = _printf(format, "%s");
-        }
-        updateCursor();
+    // the format is checked against the arguments at compile time, see format.hpp.
+    // Output is assembled on the stack and written at once
+    template<typename ... argTypes>
+    void printf(format::FormatFor<argTypes ...> format, argTypes ... args) {
+        format::Arg const packed[] = {format::make_arg(args) ..., format::Arg{}};
+        print(format.str, format.segments, format.count, packed);
     }
+    void print(const char* str, const format::Segment* segments, int count, const format::Arg* args);
+    // printf with a format only known at runtime
+    void vprintf(const char* format, const format::Arg* args, int count);
 };
 
 extern Console console;
\ No newline at end of file
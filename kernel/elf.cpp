@@ -0,0 +1,198 @@
+#include <string.h>
+#include "elf.hpp"
+#include "printk.hpp"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/syscall.h"
+
+namespace kernel {
+
+namespace {
+
+struct Elf64Header {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+};
+static_assert(sizeof(Elf64Header) == 64, "ELF header layout");
+
+struct Elf64ProgramHeader {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+};
+static_assert(sizeof(Elf64ProgramHeader) == 56, "ELF program header layout");
+
+constexpr uint8_t ELFCLASS64 = 2;
+constexpr uint8_t ELFDATA2LSB = 1;
+constexpr uint16_t ET_EXEC = 2;
+constexpr uint16_t EM_X86_64 = 62;
+constexpr uint32_t PT_LOAD = 1;
+constexpr uint32_t PT_DYNAMIC = 2;
+constexpr uint32_t PT_INTERP = 3;
+constexpr uint32_t PF_X = 1;
+constexpr uint32_t PF_W = 2;
+
+// stacks are demand zero, they only cost what they use
+constexpr uint64_t stack_size = 1ull << 20;
+constexpr uint64_t stack_top = USER_TOP;
+
+constexpr uint64_t page = MMU::page_size(1);
+
+constexpr uint64_t page_up(uint64_t value) {
+    return (value + page - 1) & ~(page - 1);
+}
+
+const char* check_header(const InitrdFile& file) {
+    if (file.size < sizeof(Elf64Header)) {
+        return "too small";
+    }
+    auto const header = reinterpret_cast<const Elf64Header*>(file.contents());
+    if (memcmp(header->ident, "\x7f" "ELF", 4)) {
+        return "not an ELF file";
+    }
+    if (header->ident[4] != ELFCLASS64 || header->ident[5] != ELFDATA2LSB || header->machine != EM_X86_64) {
+        return "not for x86_64";
+    }
+    if (header->type != ET_EXEC) {
+        return "not a static executable";
+    }
+    if (header->phentsize != sizeof(Elf64ProgramHeader) || header->phoff > file.size ||
+            header->phnum > (file.size - header->phoff) / sizeof(Elf64ProgramHeader)) {
+        return "bad program headers";
+    }
+    return nullptr;
+}
+
+const char* check_segment(const InitrdFile& file, const Elf64ProgramHeader& segment) {
+    if (segment.type == PT_INTERP || segment.type == PT_DYNAMIC) {
+        return "dynamically linked";
+    }
+    if (segment.type != PT_LOAD) {
+        return nullptr;
+    }
+    if (segment.filesz > segment.memsz || segment.offset > file.size || segment.filesz > file.size - segment.offset) {
+        return "segment past the end of the file";
+    }
+    // pages of the file map to pages of memory
+    if ((segment.vaddr ^ segment.offset) & (page - 1)) {
+        return "segment not page aligned";
+    }
+    if (segment.vaddr < page || segment.vaddr >= stack_top - stack_size ||
+            segment.memsz > stack_top - stack_size - segment.vaddr) {
+        return "segment outside of the user half";
+    }
+    return nullptr;
+}
+
+MMU::MapResult map_segment(MMU::PML4T* space, const InitrdFile& file, const Elf64ProgramHeader& segment) {
+    uint64_t flags = MMU::User;
+    if (segment.flags & PF_W) {
+        flags |= MMU::Writable;
+    }
+    if (!(segment.flags & PF_X)) {
+        flags |= MMU::NoExecute;
+    }
+    if (!segment.memsz) {
+        return MMU::MapResult::Ok;
+    }
+    uint64_t const start = segment.vaddr & ~(page - 1);
+    uint64_t const file_end = page_up(segment.vaddr + segment.filesz);
+    uint64_t const memory_end = page_up(segment.vaddr + segment.memsz);
+    if (file_end > start) {
+        // the file as far as the segment goes: the bytes of its last page
+        // past that are the start of .bss, they read as zero
+        InitrdFile contents = file;
+        contents.size = segment.offset + segment.filesz;
+        auto const result = initrd_map(space, reinterpret_cast<void*>(start), contents,
+            segment.offset & ~(page - 1), file_end - start, flags);
+        if (result != MMU::MapResult::Ok) {
+            return result;
+        }
+    }
+    if (memory_end > file_end) {
+        return space->mapAnonymous(reinterpret_cast<void*>(file_end), memory_end - file_end, flags);
+    }
+    return MMU::MapResult::Ok;
+}
+
+}
+
+MMU::PML4T* elf_load(MMU& mmu, const InitrdFile& file, uint64_t& entry) {
+    if (auto const error = check_header(file)) {
+        printk(LogLevel::Error, "elf: %s\n", error);
+        return nullptr;
+    }
+    auto const header = reinterpret_cast<const Elf64Header*>(file.contents());
+    auto const segments = reinterpret_cast<const Elf64ProgramHeader*>(file.contents() + header->phoff);
+    // everything is checked before the space exists
+    for (unsigned i = 0; i < header->phnum; i++) {
+        if (auto const error = check_segment(file, segments[i])) {
+            printk(LogLevel::Error, "elf: %s\n", error);
+            return nullptr;
+        }
+    }
+    auto const space = mmu.create_vspace();
+    if (!space) {
+        return nullptr;
+    }
+    for (unsigned i = 0; i < header->phnum; i++) {
+        if (segments[i].type != PT_LOAD) {
+            continue;
+        }
+        auto const result = map_segment(space, file, segments[i]);
+        if (result != MMU::MapResult::Ok) {
+            printk(LogLevel::Error, "elf: can't map segment %d at %p: %d\n", i,
+                reinterpret_cast<void*>(segments[i].vaddr), static_cast<int>(result));
+            mmu.destroy_vspace(space);
+            return nullptr;
+        }
+    }
+    entry = header->entry;
+    return space;
+}
+
+Thread* spawn_process(MMU& mmu, const InitrdFile& file, const char* name, Thread::Class klass) {
+    uint64_t const start = rdtsc();
+    uint64_t entry;
+    auto const space = elf_load(mmu, file, entry);
+    if (!space) {
+        printk(LogLevel::Error, "%s: not loaded\n", name);
+        return nullptr;
+    }
+    if (space->mapAnonymous(reinterpret_cast<void*>(stack_top - stack_size), stack_size,
+            MMU::User | MMU::Writable | MMU::NoExecute) != MMU::MapResult::Ok) {
+        printk(LogLevel::Error, "%s: no stack\n", name);
+        mmu.destroy_vspace(space);
+        return nullptr;
+    }
+    uint64_t const cycles = rdtsc() - start;
+    // before it runs: what loading put in the page tables
+    uint64_t const copied = space->usage().resident;
+    auto const thread = Thread::spawn_user(name, space, entry, stack_top, klass);
+    if (!thread) {
+        printk(LogLevel::Error, "%s: no thread\n", name);
+        mmu.destroy_vspace(space);
+        return nullptr;
+    }
+    printk(LogLevel::Info, "%s: %d KiB loaded in %d cycles, %d pages copied\n", name,
+        file.size >> 10, cycles, copied);
+    return thread;
+}
+
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+#include "initrd.hpp"
+#include "sched.hpp"
+#include "arch/x86_64/mmu.h"
+
+namespace kernel {
+
+// Loader of static ELF64 executables (ET_EXEC, x86_64), from the initrd.
+// Nothing is copied up front: segments are mapped straight from the
+// module frames and come in with the page faults, writable ones
+// copy-on-write, .bss as demand zero memory (see initrd_map). Only the
+// pages a segment shares with the file around it, at its edges, are copied
+// at load time. Each PT_LOAD gets the protection its p_flags ask for:
+// Writable only with PF_W, NoExecute without PF_X.
+
+// a new address space with the executable in it, its entry point in entry.
+// nullptr if it's not an executable we can run, or memory ran out
+MMU::PML4T* elf_load(MMU& mmu, const InitrdFile& file, uint64_t& entry);
+
+// elf_load, a stack, and a user thread starting at the entry point. name
+// must outlive the thread. nullptr on failure, after saying why
+Thread* spawn_process(MMU& mmu, const InitrdFile& file, const char* name, Thread::Class klass = Thread::Class::Normal);
+
+}
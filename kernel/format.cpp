@@ -0,0 +1,165 @@
+#include <string.h>
+#include "format.hpp"
+
+namespace format {
+
+namespace {
+// "00" "01" ... "99": two decimal digits per division
+constexpr struct DigitPairs {
+    char digits[200];
+    constexpr DigitPairs(): digits{} {
+        for (int i = 0; i < 100; i++) {
+            digits[2 * i] = '0' + i / 10;
+            digits[2 * i + 1] = '0' + i % 10;
+        }
+    }
+} digit_pairs;
+}
+
+void Output::put(const char* data, size_t count) {
+    while (count) {
+        if (length == sizeof(buffer)) {
+            flush();
+        }
+        size_t chunk = sizeof(buffer) - length < count ? sizeof(buffer) - length : count;
+        memcpy(buffer + length, data, chunk);
+        length += chunk;
+        data += chunk;
+        count -= chunk;
+    }
+}
+
+char* format_unsigned(char* end, uint64_t value, unsigned base, bool upper) {
+    char* p = end;
+    if (base == 16) {
+        const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+        do {
+            *--p = digits[value & 15];
+            value >>= 4;
+        } while (value);
+        return p;
+    }
+    while (value >= 100) {
+        unsigned pair = value % 100;
+        value /= 100;
+        p -= 2;
+        p[0] = digit_pairs.digits[2 * pair];
+        p[1] = digit_pairs.digits[2 * pair + 1];
+    }
+    if (value >= 10) {
+        p -= 2;
+        p[0] = digit_pairs.digits[2 * value];
+        p[1] = digit_pairs.digits[2 * value + 1];
+    } else {
+        *--p = '0' + value;
+    }
+    return p;
+}
+
+void format_arg(Output& out, const Spec& spec, const Arg& arg) {
+    char digits[24];
+    char* const end = digits + sizeof(digits);
+    const char* text = end;
+    size_t length = 0;
+    const char* prefix = "";
+    size_t prefix_length = 0;
+    bool zero = spec.zero && !spec.left;
+    switch (spec.conversion) {
+    case Conversion::Signed:
+        if (arg.is_signed && arg.signed_value() < 0) {
+            text = format_unsigned(end, -static_cast<uint64_t>(arg.signed_value()));
+            prefix = "-";
+            prefix_length = 1;
+        } else {
+            text = format_unsigned(end, arg.bits);
+        }
+        break;
+    case Conversion::Unsigned:
+        text = format_unsigned(end, arg.bits);
+        break;
+    case Conversion::Hex:
+    case Conversion::HexUpper:
+        text = format_unsigned(end, arg.bits, 16, spec.conversion == Conversion::HexUpper);
+        break;
+    case Conversion::Pointer:
+    {
+        char* first = format_unsigned(end, arg.bits, 16);
+        while (first > end - 16) {
+            *--first = '0';
+        }
+        text = first;
+        prefix = "0x";
+        prefix_length = 2;
+        break;
+    }
+    case Conversion::String:
+        text = arg.bits ? reinterpret_cast<const char*>(arg.bits) : "(null)";
+        length = strlen(text);
+        zero = false;
+        break;
+    case Conversion::Char:
+        digits[0] = static_cast<char>(arg.bits);
+        text = digits;
+        length = 1;
+        zero = false;
+        break;
+    case Conversion::None:
+        return;
+    }
+    if (!length) {
+        length = end - text;
+    }
+    int pad = int(spec.width) - int(prefix_length + length);
+    if (!spec.left && !zero) {
+        out.fill(' ', pad);
+    }
+    out.put(prefix, prefix_length);
+    if (zero) {
+        out.fill('0', pad);
+    }
+    out.put(text, length);
+    if (spec.left) {
+        out.fill(' ', pad);
+    }
+}
+
+void format_segments(Output& out, const char* str, const Segment* segments, int count, const Arg* args) {
+    for (int i = 0; i < count; i++) {
+        out.put(str + segments[i].offset, segments[i].length);
+        if (segments[i].spec.conversion != Conversion::None) {
+            format_arg(out, segments[i].spec, *args++);
+        }
+    }
+}
+
+void format_runtime(Output& out, const char* format, const Arg* args, int count) {
+    int arg = 0;
+    for (const char* p = format; *p;) {
+        if (*p != '%') {
+            const char* start = p;
+            while (*p && *p != '%') {
+                p++;
+            }
+            out.put(start, p - start);
+            continue;
+        }
+        Spec spec;
+        const char* end = parse_spec(p + 1, spec);
+        if (!end) {
+            out.put(*p++);
+            continue;
+        }
+        if (spec.conversion == Conversion::None) {
+            out.put('%');
+        } else if (arg < count && accepts(spec.conversion, args[arg].kind)) {
+            format_arg(out, spec, args[arg++]);
+        } else {
+            // no matching argument: show the conversion as it is
+            out.put(p, end - p);
+            arg++;
+        }
+        p = end;
+    }
+}
+
+}
@@ -0,0 +1,260 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// printf style formatting, shared by the console and the kernel log.
+//
+// Format strings given as literals are parsed at compile time: a
+// FormatString<Args...> is built by a consteval constructor that splits the
+// string into literal segments and conversions, and checks each conversion
+// against the type of the matching argument. A bad format is a compile
+// error, at runtime only the precomputed segments are walked.
+//
+// Conversions: %d %i (signed) %u (unsigned) %x %X (hex) %p (pointer,
+// 0x and 16 digits) %s (string) %c (char) and %%. Flags '-' (left align)
+// and '0' (zero fill), a width, and length modifiers (h, l, ll, z, j,
+// ignored: arguments keep their own width) are accepted.
+
+namespace format {
+
+enum class Conversion: uint8_t {
+    None, // literal text only
+    Signed,
+    Unsigned,
+    Hex,
+    HexUpper,
+    Pointer,
+    String,
+    Char,
+};
+
+struct Spec {
+    Conversion conversion = Conversion::None;
+    bool left = false;
+    bool zero = false;
+    uint8_t width = 0;
+};
+
+enum class ArgKind: uint8_t {
+    Integer,
+    String,
+    Pointer,
+};
+
+struct Arg {
+    uint64_t bits; // zero extended
+    ArgKind kind;
+    uint8_t size; // integers
+    bool is_signed; // integers
+
+    int64_t signed_value() const {
+        unsigned shift = 64 - size * 8;
+        return static_cast<int64_t>(bits << shift) >> shift;
+    }
+};
+
+// integer types are listed one by one, anything not listed can't be formatted
+template<typename T> struct ArgTraits;
+template<typename T, bool is_signed> struct IntegerTraits {
+    static constexpr ArgKind kind = ArgKind::Integer;
+    static constexpr Arg make(T value) {
+        return {static_cast<uint64_t>(value) & (~0ull >> (64 - sizeof(T) * 8)), kind, sizeof(T), is_signed};
+    }
+};
+template<> struct ArgTraits<char>: IntegerTraits<char, (char(-1) < 0)> {};
+template<> struct ArgTraits<signed char>: IntegerTraits<signed char, true> {};
+template<> struct ArgTraits<unsigned char>: IntegerTraits<unsigned char, false> {};
+template<> struct ArgTraits<short>: IntegerTraits<short, true> {};
+template<> struct ArgTraits<unsigned short>: IntegerTraits<unsigned short, false> {};
+template<> struct ArgTraits<int>: IntegerTraits<int, true> {};
+template<> struct ArgTraits<unsigned>: IntegerTraits<unsigned, false> {};
+template<> struct ArgTraits<long>: IntegerTraits<long, true> {};
+template<> struct ArgTraits<unsigned long>: IntegerTraits<unsigned long, false> {};
+template<> struct ArgTraits<long long>: IntegerTraits<long long, true> {};
+template<> struct ArgTraits<unsigned long long>: IntegerTraits<unsigned long long, false> {};
+template<> struct ArgTraits<const char*> {
+    static constexpr ArgKind kind = ArgKind::String;
+    static Arg make(const char* value) {
+        return {reinterpret_cast<uint64_t>(value), kind, 8, false};
+    }
+};
+template<> struct ArgTraits<char*>: ArgTraits<const char*> {};
+template<typename T> struct ArgTraits<T*> {
+    static constexpr ArgKind kind = ArgKind::Pointer;
+    static Arg make(const T* value) {
+        return {reinterpret_cast<uint64_t>(value), kind, 8, false};
+    }
+};
+template<typename T> struct ArgTraits<const T>: ArgTraits<T> {};
+
+// parse a conversion, p points right after the '%'. Returns where the
+// conversion ends, nullptr if it's not valid. "%%" is a None conversion
+constexpr const char* parse_spec(const char* p, Spec& spec) {
+    for (;; p++) {
+        if (*p == '-') {
+            spec.left = true;
+        } else if (*p == '0') {
+            spec.zero = true;
+        } else {
+            break;
+        }
+    }
+    unsigned width = 0;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        width = width * 10 + (*p - '0');
+        if (width > 64) {
+            return nullptr;
+        }
+    }
+    spec.width = width;
+    while (*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j') {
+        p++;
+    }
+    switch (*p) {
+    case '%': spec.conversion = Conversion::None; break;
+    case 'd': case 'i': spec.conversion = Conversion::Signed; break;
+    case 'u': spec.conversion = Conversion::Unsigned; break;
+    case 'x': spec.conversion = Conversion::Hex; break;
+    case 'X': spec.conversion = Conversion::HexUpper; break;
+    case 'p': spec.conversion = Conversion::Pointer; break;
+    case 's': spec.conversion = Conversion::String; break;
+    case 'c': spec.conversion = Conversion::Char; break;
+    default: return nullptr;
+    }
+    return p + 1;
+}
+
+constexpr bool accepts(Conversion conversion, ArgKind kind) {
+    switch (conversion) {
+    case Conversion::Signed:
+    case Conversion::Unsigned:
+    case Conversion::Hex:
+    case Conversion::HexUpper:
+    case Conversion::Char:
+        return kind == ArgKind::Integer;
+    case Conversion::Pointer:
+        return kind == ArgKind::Pointer || kind == ArgKind::String;
+    case Conversion::String:
+        return kind == ArgKind::String;
+    default:
+        return false;
+    }
+}
+
+// literal text [offset, offset + length) of the format string, followed by
+// a conversion (unless it's None) that takes the next argument
+struct Segment {
+    uint16_t offset;
+    uint16_t length;
+    Spec spec;
+};
+
+// not constexpr: calling them during constant evaluation is what makes a
+// bad format a compile error, with the function name as the message
+void bad_format_conversion();
+void format_argument_type_mismatch();
+void too_many_format_arguments();
+void too_few_format_arguments();
+void too_many_percent_escapes();
+
+template<typename T> struct type_identity { using type = T; };
+
+template<typename ... Args>
+struct FormatString {
+    static constexpr int arg_count = sizeof...(Args);
+    static constexpr int max_segments = 2 * arg_count + 4;
+
+    const char* str;
+    Segment segments[max_segments] = {};
+    int count = 0;
+
+    consteval FormatString(const char* format): str{format} {
+        constexpr ArgKind kinds[] = {ArgTraits<Args>::kind..., ArgKind::Integer};
+        int arg = 0;
+        uint16_t literal = 0;
+        uint16_t i = 0;
+        while (format[i]) {
+            if (format[i] != '%') {
+                i++;
+                continue;
+            }
+            Spec spec;
+            const char* end = parse_spec(format + i + 1, spec);
+            if (!end) {
+                bad_format_conversion();
+            }
+            if (count == max_segments) {
+                too_many_percent_escapes();
+            }
+            if (spec.conversion == Conversion::None) {
+                // "%%": the literal goes on up to the first '%'
+                segments[count++] = {literal, uint16_t(i + 1 - literal), spec};
+            } else {
+                if (arg == arg_count) {
+                    too_few_format_arguments();
+                }
+                if (!accepts(spec.conversion, kinds[arg++])) {
+                    format_argument_type_mismatch();
+                }
+                segments[count++] = {literal, uint16_t(i - literal), spec};
+            }
+            i = literal = end - format;
+        }
+        if (arg != arg_count) {
+            too_many_format_arguments();
+        }
+        if (count == max_segments) {
+            too_many_percent_escapes();
+        }
+        segments[count++] = {literal, uint16_t(i - literal), Spec{}};
+    }
+};
+
+// collects output in a buffer on the stack, handing it to the sink when
+// full and at flush(), so a printf is normally a single write
+class Output {
+    char buffer[256];
+    size_t length = 0;
+    void (*sink)(void* context, const char* data, size_t length);
+    void* context;
+public:
+    Output(void (*sink)(void*, const char*, size_t), void* context): sink{sink}, context{context} {}
+    void put(char c) {
+        if (length == sizeof(buffer)) {
+            flush();
+        }
+        buffer[length++] = c;
+    }
+    void put(const char* data, size_t count);
+    void fill(char c, int count) {
+        while (count-- > 0) {
+            put(c);
+        }
+    }
+    void flush() {
+        if (length) {
+            sink(context, buffer, length);
+            length = 0;
+        }
+    }
+};
+
+// digits of value in base 10 or 16 (upper: A-F), written right aligned
+// ending at end. Returns the first digit
+char* format_unsigned(char* end, uint64_t value, unsigned base = 10, bool upper = false);
+
+void format_arg(Output& out, const Spec& spec, const Arg& arg);
+// walk the segments FormatString computed
+void format_segments(Output& out, const char* str, const Segment* segments, int count, const Arg* args);
+// parse at runtime, args are checked against the conversions as we go
+void format_runtime(Output& out, const char* format, const Arg* args, int count);
+
+template<typename ... Args>
+using FormatFor = FormatString<typename type_identity<Args>::type ...>;
+
+template<typename T>
+Arg make_arg(T value) {
+    return ArgTraits<T>::make(value);
+}
+
+}
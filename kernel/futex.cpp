@@ -0,0 +1,242 @@
+#include <kernel/syscall.h>
+#include "futex.hpp"
+#include "sched.hpp"
+#include "timer.hpp"
+#include "arch/x86_64/mmu.h"
+#include "arch/x86_64/syscall.h"
+#include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/tsc.h"
+
+namespace kernel {
+
+namespace {
+
+struct Bucket;
+
+// on the stack of the waiting thread
+struct Waiter {
+    uint64_t key;
+    Thread* thread;
+    Waiter* next = nullptr;
+    Waiter* prev = nullptr;
+    Bucket* bucket = nullptr; // changes only under the lock of both buckets
+    bool woken = false;
+    bool timed_out = false;
+};
+
+struct alignas(64) Bucket {
+    Spinlock lock;
+    Waiter* head = nullptr;
+    Waiter* tail = nullptr;
+
+    void link(Waiter* waiter) {
+        waiter->next = nullptr;
+        waiter->prev = tail;
+        if (tail) {
+            tail->next = waiter;
+        } else {
+            head = waiter;
+        }
+        tail = waiter;
+        __atomic_store_n(&waiter->bucket, this, __ATOMIC_RELEASE);
+    }
+
+    void unlink(Waiter* waiter) {
+        if (waiter->prev) {
+            waiter->prev->next = waiter->next;
+        } else {
+            head = waiter->next;
+        }
+        if (waiter->next) {
+            waiter->next->prev = waiter->prev;
+        } else {
+            tail = waiter->prev;
+        }
+    }
+
+    // lock held. The waiter may return as soon as it sees woken, but it
+    // takes this lock on the way out: it's still there for wake()
+    void wake(Waiter* waiter) {
+        unlink(waiter);
+        __atomic_store_n(&waiter->woken, true, __ATOMIC_RELEASE);
+        waiter->thread->wake();
+    }
+};
+
+constexpr int bucket_bits = 8;
+
+Bucket buckets[1 << bucket_bits];
+FutexStats stats;
+
+Bucket& bucket_of(uint64_t key) {
+    return buckets[(key >> 2) * 0x9e3779b97f4a7c15ull >> (64 - bucket_bits)];
+}
+
+// physical address of the word, 0 if it's not mapped, not aligned, or a
+// user address the user can't access
+uint64_t key_of(const uint32_t* word) {
+    uint64_t const address = reinterpret_cast<uint64_t>(word);
+    if (address & (sizeof(uint32_t) - 1)) {
+        return 0;
+    }
+    auto const space = MMU().get_current_vspace();
+    if (address < USER_TOP) {
+        // in a writable mapping demand zero and copy-on-write pages get
+        // their own frame first: the zero frame is everybody's, and the
+        // copy at the first write would change the key. A read-only
+        // mapping keeps its frame, reading is all a wait there needs.
+        // Wakers take the same path, or they wouldn't find the key
+        Vma vma;
+        bool const writable = space->vmas.find(address, vma) && (vma.flags & MMU::Writable);
+        if (!space->faultIn(const_cast<uint32_t*>(word), writable)) {
+            return 0;
+        }
+    }
+    uint64_t flags;
+    uint64_t const key = space->translate(const_cast<uint32_t*>(word), nullptr, &flags);
+    if (address < USER_TOP && !(flags & MMU::User)) {
+        return 0;
+    }
+    return key;
+}
+
+// the word, through the linear map: can't fault, and doesn't depend on
+// which address space is loaded
+uint32_t load(uint64_t key) {
+    return __atomic_load_n(static_cast<uint32_t*>(ptl(key)), __ATOMIC_SEQ_CST);
+}
+
+// take a waiter that wasn't woken off its queue. False if it was woken
+bool remove(Waiter& waiter) {
+    for (;;) {
+        Bucket* const bucket = __atomic_load_n(&waiter.bucket, __ATOMIC_ACQUIRE);
+        LockGuard guard(bucket->lock);
+        // requeued while we took the lock
+        if (waiter.bucket != bucket) {
+            continue;
+        }
+        if (waiter.woken) {
+            return false;
+        }
+        bucket->unlink(&waiter);
+        return true;
+    }
+}
+
+// both locks, in address order
+void lock_pair(Bucket& a, Bucket& b) {
+    if (&a == &b) {
+        a.lock.lock();
+    } else if (&a < &b) {
+        a.lock.lock();
+        b.lock.lock();
+    } else {
+        b.lock.lock();
+        a.lock.lock();
+    }
+}
+
+void unlock_pair(Bucket& a, Bucket& b) {
+    a.lock.unlock();
+    if (&a != &b) {
+        b.lock.unlock();
+    }
+}
+
+}
+
+int64_t futex_wait(const uint32_t* word, uint32_t expected, uint64_t timeout_ns) {
+    uint64_t const key = key_of(word);
+    if (!key) {
+        return SYS_BAD_ADDRESS;
+    }
+    Waiter waiter{key, Thread::current()};
+    Bucket& bucket = bucket_of(key);
+    {
+        LockGuard guard(bucket.lock);
+        if (load(key) != expected) {
+            return SYS_AGAIN;
+        }
+        bucket.link(&waiter);
+    }
+    __atomic_fetch_add(&stats.waits, 1, __ATOMIC_RELAXED);
+    Timer timer{[](Timer&, void* context) {
+        auto const waiter = static_cast<Waiter*>(context);
+        __atomic_store_n(&waiter->timed_out, true, __ATOMIC_RELEASE);
+        waiter->thread->wake();
+    }, &waiter};
+    if (timeout_ns) {
+        timer.arm(ktime_ns() + timeout_ns);
+    }
+    while (!__atomic_load_n(&waiter.woken, __ATOMIC_ACQUIRE) && !__atomic_load_n(&waiter.timed_out, __ATOMIC_ACQUIRE)) {
+        block();
+    }
+    timer.cancel();
+    return remove(waiter) ? SYS_TIMED_OUT : SYS_OK;
+}
+
+int64_t futex_wake(const uint32_t* word, uint32_t count) {
+    uint64_t const key = key_of(word);
+    if (!key) {
+        return SYS_BAD_ADDRESS;
+    }
+    Bucket& bucket = bucket_of(key);
+    int64_t woken = 0;
+    LockGuard guard(bucket.lock);
+    for (Waiter* waiter = bucket.head; waiter && woken < count;) {
+        Waiter* const next = waiter->next;
+        if (waiter->key == key) {
+            bucket.wake(waiter);
+            woken++;
+        }
+        waiter = next;
+    }
+    __atomic_fetch_add(&stats.wakes, woken, __ATOMIC_RELAXED);
+    return woken;
+}
+
+int64_t futex_requeue(const uint32_t* word, uint32_t wake_count, const uint32_t* target, uint32_t requeue_count, uint32_t expected) {
+    uint64_t const key = key_of(word);
+    uint64_t const target_key = key_of(target);
+    if (!key || !target_key) {
+        return SYS_BAD_ADDRESS;
+    }
+    Bucket& from = bucket_of(key);
+    Bucket& to = bucket_of(target_key);
+    IrqGuard irq;
+    lock_pair(from, to);
+    if (load(key) != expected) {
+        unlock_pair(from, to);
+        return SYS_AGAIN;
+    }
+    uint32_t woken = 0, moved = 0;
+    for (Waiter* waiter = from.head; waiter && (woken < wake_count || moved < requeue_count);) {
+        Waiter* const next = waiter->next;
+        if (waiter->key == key) {
+            if (woken < wake_count) {
+                from.wake(waiter);
+                woken++;
+            } else {
+                from.unlink(waiter);
+                waiter->key = target_key;
+                to.link(waiter);
+                moved++;
+            }
+        }
+        waiter = next;
+    }
+    unlock_pair(from, to);
+    __atomic_fetch_add(&stats.wakes, woken, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.requeues, moved, __ATOMIC_RELAXED);
+    return woken + moved;
+}
+
+FutexStats futex_stats() {
+    return {
+        __atomic_load_n(&stats.waits, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.wakes, __ATOMIC_RELAXED),
+        __atomic_load_n(&stats.requeues, __ATOMIC_RELAXED),
+    };
+}
+
+}
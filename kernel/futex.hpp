@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+
+namespace kernel {
+
+// Futexes: sleeping on a 32 bit word, for the locks and condition
+// variables of user space (and of the kernel) that keep their state in
+// memory and only call the kernel when they have to wait or wake someone
+// up (Franke, Russell and Kirkwood; Drepper, "Futexes Are Tricky"). An
+// uncontended lock never gets here.
+//
+// Waiters are keyed by the physical address of the word, from a page walk
+// of the current address space: threads of different address spaces
+// sharing the page meet on the same futex. They hang off a hash table of
+// buckets, each with its own lock. The value check and the queueing happen
+// under that lock, as do wakeups, so none is lost in between.
+
+// sleep if *word == expected, until woken or for timeout_ns (0: no
+// timeout). SYS_OK when woken, otherwise SYS_AGAIN (the value differed),
+// SYS_TIMED_OUT or SYS_BAD_ADDRESS, as in kernel/syscall.h
+int64_t futex_wait(const uint32_t* word, uint32_t expected, uint64_t timeout_ns = 0);
+// wake up to count waiters of word, oldest first. How many, or SYS_BAD_ADDRESS
+int64_t futex_wake(const uint32_t* word, uint32_t count);
+// if *word == expected, wake up to wake_count waiters of word and move up to
+// requeue_count of the others to target: a condition variable broadcast
+// wakes one thread, and the rest queue on the mutex instead of all rushing
+// for it. How many were woken and moved, or SYS_AGAIN
+int64_t futex_requeue(const uint32_t* word, uint32_t wake_count, const uint32_t* target, uint32_t requeue_count, uint32_t expected);
+
+struct FutexStats {
+    uint64_t waits; // calls that went to sleep
+    uint64_t wakes; // waiters woken
+    uint64_t requeues; // waiters moved
+};
+FutexStats futex_stats();
+
+}
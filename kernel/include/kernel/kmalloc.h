@@ -0,0 +1,17 @@
+#ifndef _KERNEL_KMALLOC_H
+#define _KERNEL_KMALLOC_H
+ 
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* kmalloc(size_t size);
+void kfree(void* pointer);
+void kmalloc_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
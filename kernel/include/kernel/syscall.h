@@ -0,0 +1,45 @@
+#ifndef _KERNEL_SYSCALL_H
+#define _KERNEL_SYSCALL_H
+
+// System call numbers and results, shared with user space. The calling
+// convention is in arch/x86_64/syscall.h: number in rax, arguments in rdi,
+// rsi, rdx, r10, r8, r9, and the result in rax.
+
+enum {
+    // end the calling thread
+    SYS_EXIT = 0,
+    // let other threads run
+    SYS_YIELD = 1,
+    // send a message to the endpoint in rdi and wait for the reply. The
+    // message is rsi, rdx, r10, r8 and r9, the reply comes back in them
+    SYS_IPC_CALL = 2,
+    // reply to the last caller, if any, then wait for the next message on
+    // the endpoint in rdi. Reply and message in rsi, rdx, r10, r8 and r9
+    SYS_IPC_REPLY_WAIT = 3,
+    // set the bits in rsi on the notification in rdi, waking its waiter
+    SYS_NOTIFY = 4,
+    // wait until the notification in rdi has bits set, take them into rsi
+    SYS_NOTIFY_WAIT = 5,
+    // sleep while the 32 bit word at rdi holds esi, for at most rdx ns
+    // (0: no limit)
+    SYS_FUTEX_WAIT = 6,
+    // wake up to rsi waiters of the word at rdi, rax is how many
+    SYS_FUTEX_WAKE = 7,
+    // if the word at rdi holds r8d, wake up to rsi of its waiters and move
+    // up to r10 more to the word at rdx. rax is how many
+    SYS_FUTEX_REQUEUE = 8,
+};
+
+// results in rax
+enum {
+    SYS_OK = 0,
+    SYS_INVALID = -1, // no such call
+    SYS_BAD_ENDPOINT = -2,
+    SYS_PARTNER_GONE = -3, // the server exited before replying
+    SYS_BAD_NOTIFICATION = -4,
+    SYS_AGAIN = -5, // the futex didn't hold the expected value
+    SYS_TIMED_OUT = -6,
+    SYS_BAD_ADDRESS = -7,
+};
+
+#endif
@@ -6,10 +6,14 @@
 extern "C" {
 #endif
 
+// Output goes to the VGA console and, once the serial port is up, to COM1.
+// Serial output is queued and sent in the background.
 void terminal_initialize(void);
 void terminal_putchar(char c);
 void terminal_write(const char* data, size_t size);
 void terminal_writestring(const char* data);
+// wait until everything written has reached every sink
+void terminal_flush(void);
 
 #ifdef __cplusplus
 }
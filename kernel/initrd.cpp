@@ -0,0 +1,293 @@
+#include <string.h>
+#include "initrd.hpp"
+#include "printk.hpp"
+#include "arch/x86_64/frames.h"
+#include "arch/x86_64/multiboot.h"
+#include "arch/x86_64/cpu.h"
+
+namespace kernel {
+
+namespace {
+
+// ustar header, one 512 byte block. Numbers are octal text
+struct TarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6]; // "ustar\0", or "ustar " for old GNU archives
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+static_assert(sizeof(TarHeader) == 512, "tar header layout");
+
+constexpr uint64_t block_size = 512;
+
+uint64_t octal(const char* field, size_t length) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// the checksum is the byte sum of the header, counting its own field as spaces
+bool valid(const TarHeader* header) {
+    if (memcmp(header->magic, "ustar", 5)) {
+        return false;
+    }
+    auto const bytes = reinterpret_cast<const uint8_t*>(header);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < sizeof(TarHeader); i++) {
+        bool const in_checksum = i >= offsetof(TarHeader, checksum) && i < offsetof(TarHeader, checksum) + sizeof(header->checksum);
+        sum += in_checksum ? ' ' : bytes[i];
+    }
+    return sum == octal(header->checksum, sizeof(header->checksum));
+}
+
+size_t field_length(const char* field, size_t size) {
+    size_t length = 0;
+    while (length < size && field[length]) {
+        length++;
+    }
+    return length;
+}
+
+// FNV-1a
+struct PathHash {
+    uint32_t value = 2166136261u;
+    void add(const char* data, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            value = (value ^ static_cast<uint8_t>(data[i])) * 16777619u;
+        }
+    }
+};
+
+uint32_t hash_of(const InitrdFile& file) {
+    PathHash hash;
+    hash.add(file.prefix, file.prefix_length);
+    if (file.prefix_length) {
+        hash.add("/", 1);
+    }
+    hash.add(file.name, file.name_length);
+    return hash.value;
+}
+
+bool same_path(const InitrdFile& file, const char* path, size_t length) {
+    if (file.prefix_length) {
+        if (length != file.prefix_length + 1u + file.name_length || path[file.prefix_length] != '/' ||
+                memcmp(path, file.prefix, file.prefix_length)) {
+            return false;
+        }
+        path += file.prefix_length + 1;
+        length -= file.prefix_length + 1;
+    }
+    return length == file.name_length && !memcmp(path, file.name, length);
+}
+
+bool same_file(const InitrdFile& a, const InitrdFile& b) {
+    return a.prefix_length == b.prefix_length && a.name_length == b.name_length &&
+        !memcmp(a.prefix, b.prefix, a.prefix_length) && !memcmp(a.name, b.name, a.name_length);
+}
+
+// open addressing, linear probing, at most half full
+InitrdFile* table;
+uint32_t capacity; // power of two
+uint32_t count;
+
+void insert(const InitrdFile& file) {
+    for (uint32_t slot = file.hash & (capacity - 1);; slot = (slot + 1) & (capacity - 1)) {
+        if (!table[slot].name) {
+            table[slot] = file;
+            count++;
+            return;
+        }
+        // the first archive to have a path wins
+        if (table[slot].hash == file.hash && same_file(table[slot], file)) {
+            return;
+        }
+    }
+}
+
+// calls fn for each regular file of the archive at [start, end)
+template<typename F>
+void for_each_file(uint64_t start, uint64_t end, F fn) {
+    for (uint64_t offset = start; offset + block_size <= end;) {
+        auto const header = static_cast<const TarHeader*>(ptl(offset));
+        // two zero blocks close the archive, an empty name is enough for us
+        if (!header->name[0] || !valid(header)) {
+            return;
+        }
+        uint64_t const size = octal(header->size, sizeof(header->size));
+        uint64_t const data = offset + block_size;
+        if (data + size > end) {
+            return;
+        }
+        if (header->type == '0' || header->type == '\0') {
+            InitrdFile file{};
+            file.data = data;
+            file.size = size;
+            file.prefix = header->prefix;
+            file.prefix_length = field_length(header->prefix, sizeof(header->prefix));
+            file.name = header->name;
+            file.name_length = field_length(header->name, sizeof(header->name));
+            // tar -C dir . stores ./path
+            while (!file.prefix_length && file.name_length) {
+                size_t const skip = file.name[0] == '/' ? 1 :
+                    file.name_length >= 2 && file.name[0] == '.' && file.name[1] == '/' ? 2 : 0;
+                if (!skip) {
+                    break;
+                }
+                file.name += skip;
+                file.name_length -= skip;
+            }
+            if (file.name_length) {
+                file.hash = hash_of(file);
+                fn(file);
+            }
+        }
+        offset = data + (size + block_size - 1) / block_size * block_size;
+    }
+}
+
+template<typename F>
+void for_each_module(uint64_t multiboot_info, F fn) {
+    auto const info = static_cast<const MultibootInfo*>(ptl(multiboot_info));
+    if (!(info->flags & MultibootInfo::Modules)) {
+        return;
+    }
+    auto const modules = static_cast<const MultibootModule*>(ptl(info->mods_addr));
+    for (uint32_t i = 0; i < info->mods_count; i++) {
+        fn(uint64_t{modules[i].mod_start}, uint64_t{modules[i].mod_end});
+    }
+}
+
+}
+
+void initrd_init(uint64_t multiboot_info) {
+    uint64_t const start = rdtsc();
+    uint32_t files = 0;
+    uint64_t bytes = 0;
+    for_each_module(multiboot_info, [&](uint64_t begin, uint64_t end) {
+        for_each_file(begin, end, [&](const InitrdFile&) {
+            files++;
+        });
+        bytes += end - begin;
+    });
+    if (!files) {
+        return;
+    }
+    capacity = 16;
+    while (capacity < 2 * files) {
+        capacity *= 2;
+    }
+    int order = 0;
+    while ((FrameAllocator::frame_size << order) < capacity * sizeof(InitrdFile)) {
+        order++;
+    }
+    uint64_t const frames = order <= FrameAllocator::max_order ? frame_allocator.alloc(order) : 0;
+    if (!frames) {
+        printk(LogLevel::Error, "initrd: no memory for the index of %d files\n", files);
+        capacity = 0;
+        return;
+    }
+    table = static_cast<InitrdFile*>(ptl(frames));
+    memset(table, 0, capacity * sizeof(InitrdFile));
+    for_each_module(multiboot_info, [](uint64_t begin, uint64_t end) {
+        for_each_file(begin, end, insert);
+    });
+    printk(LogLevel::Info, "initrd: %d files in %d KiB of modules, indexed in %d cycles\n",
+        count, bytes >> 10, rdtsc() - start);
+}
+
+const InitrdFile* initrd_find(const char* path) {
+    if (!capacity) {
+        return nullptr;
+    }
+    while (*path == '/') {
+        path++;
+    }
+    size_t const length = strlen(path);
+    PathHash hash;
+    hash.add(path, length);
+    for (uint32_t slot = hash.value & (capacity - 1);; slot = (slot + 1) & (capacity - 1)) {
+        auto const &file = table[slot];
+        if (!file.name) {
+            return nullptr;
+        }
+        if (file.hash == hash.value && same_path(file, path, length)) {
+            return &file;
+        }
+    }
+}
+
+uint32_t initrd_count() {
+    return count;
+}
+
+const InitrdFile* initrd_next(const InitrdFile* file) {
+    for (uint32_t slot = file ? file - table + 1 : 0; slot < capacity; slot++) {
+        if (table[slot].name) {
+            return &table[slot];
+        }
+    }
+    return nullptr;
+}
+
+MMU::MapResult initrd_map(MMU::PML4T* space, void* vaddr, const InitrdFile& file,
+        uint64_t offset, uint64_t len, uint64_t flags) {
+    uint64_t const page = MMU::page_size(1);
+    uint64_t const target = reinterpret_cast<uint64_t>(vaddr);
+    if ((target | offset | len) & (page - 1)) {
+        return MMU::MapResult::NoTable;
+    }
+    for (uint64_t done = 0; done < len;) {
+        uint64_t const position = offset + done;
+        uint64_t const source = file.data + position;
+        auto const at = reinterpret_cast<void*>(target + done);
+        MMU::MapResult result;
+        uint64_t mapped = page;
+        if (!(source & (page - 1)) && position + page <= file.size) {
+            // the module's own frames, all the whole pages at once. Mapped
+            // as they are touched
+            while (done + mapped < len && position + mapped + page <= file.size) {
+                mapped += page;
+            }
+            result = space->mapOnFault(at, source, mapped, flags);
+        } else {
+            uint64_t const frame = frame_allocator.alloc();
+            if (!frame) {
+                result = MMU::MapResult::NoMemory;
+            } else {
+                auto const copy = static_cast<uint8_t*>(ptl(frame));
+                uint64_t const available = position < file.size ? file.size - position : 0;
+                uint64_t const bytes = available < page ? available : page;
+                memcpy(copy, file.contents() + position, bytes);
+                memset(copy + bytes, 0, page - bytes);
+                // released with the mapping
+                result = space->mapRange(at, frame, page, flags | MMU::Anonymous);
+                if (result != MMU::MapResult::Ok) {
+                    frame_allocator.free(frame);
+                }
+            }
+        }
+        if (result != MMU::MapResult::Ok) {
+            space->unmapRange(vaddr, done);
+            return result;
+        }
+        done += mapped;
+    }
+    return MMU::MapResult::Ok;
+}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "arch/x86_64/mmu.h"
+
+namespace kernel {
+
+// The initial ramdisk: ustar archives the bootloader loads as multiboot
+// modules (module /boot/initrd.tar in grub.cfg), read in place through the
+// linear map. Nothing is copied at boot: initrd_init walks the archives
+// once and builds a hash table of the paths, pointing into the tar headers
+// and at the file contents in the module frames.
+struct InitrdFile {
+    uint64_t data; // physical address of the contents
+    uint64_t size;
+    // the path is prefix/name, both in the tar header (ustar splits long
+    // paths in two), without "./" or "/" in front
+    const char* prefix;
+    const char* name;
+    uint16_t prefix_length;
+    uint16_t name_length;
+    uint32_t hash;
+
+    const uint8_t* contents() const {
+        return static_cast<const uint8_t*>(ptl(data));
+    }
+};
+
+// index the archives among the modules. Once, at boot, with the frame allocator up
+void initrd_init(uint64_t multiboot_info);
+// O(1). The leading '/' is optional. nullptr if there's no such file
+const InitrdFile* initrd_find(const char* path);
+uint32_t initrd_count();
+// the files, in no particular order: nullptr gives the first one, the last
+// one gives nullptr
+const InitrdFile* initrd_next(const InitrdFile* file);
+
+// Map [offset, offset + len) of a file at vaddr, both page aligned. Whole
+// pages whose contents are page aligned in the module map its frames
+// directly, when first touched (PML4T::mapOnFault): read-only, or
+// copy-on-write when flags has Writable. Other pages, and the last one
+// when the file ends inside it, get a private copy right away, zero filled
+// past the end of the file. mkinitrd.py aligns every file, so that's at
+// most one page.
+MMU::MapResult initrd_map(MMU::PML4T* space, void* vaddr, const InitrdFile& file,
+    uint64_t offset, uint64_t len, uint64_t flags);
+
+}
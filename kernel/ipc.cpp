@@ -0,0 +1,222 @@
+#include <kernel/syscall.h>
+#include "ipc.hpp"
+#include "sched.hpp"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/spinlock.h"
+
+namespace kernel {
+
+namespace {
+
+constexpr int max_endpoints = 64;
+
+struct alignas(64) Endpoint {
+    Spinlock lock;
+    bool used = false;
+    Thread* receivers = nullptr; // servers waiting for a message, last come first
+    Thread* senders = nullptr; // clients waiting for a server, in order
+    Thread* senders_tail = nullptr;
+};
+
+Endpoint endpoints[max_endpoints];
+
+constexpr int max_notifications = 256;
+
+struct alignas(64) Notification {
+    Spinlock lock;
+    bool used = false;
+    uint64_t bits = 0;
+    Thread* waiter = nullptr;
+};
+
+Notification notifications[max_notifications];
+
+Notification* notification(int id) {
+    if (id < 0 || id >= max_notifications || !__atomic_load_n(&notifications[id].used, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &notifications[id];
+}
+
+template<typename T, int count>
+int create(T (&table)[count]) {
+    for (int id = 0; id < count; id++) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&table[id].used, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+Endpoint* endpoint(int id) {
+    if (id < 0 || id >= max_endpoints || !__atomic_load_n(&endpoints[id].used, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &endpoints[id];
+}
+
+}
+
+struct Ipc {
+    // end the wait of a thread in call or reply_wait, its message is in
+    // place. Waking it is up to the caller
+    static void release(Thread* thread, int64_t status) {
+        thread->ipc.status = status;
+        __atomic_store_n(&thread->ipc.waiting, false, __ATOMIC_RELEASE);
+    }
+
+    static int64_t wait(Thread* self, IpcMessage& message) {
+        while (__atomic_load_n(&self->ipc.waiting, __ATOMIC_ACQUIRE)) {
+            block();
+        }
+        message = self->ipc.message;
+        return self->ipc.status;
+    }
+
+    static int64_t call(int id, IpcMessage& message) {
+        Endpoint* const ep = endpoint(id);
+        if (!ep) {
+            return SYS_BAD_ENDPOINT;
+        }
+        IrqGuard irq;
+        Thread* const self = Thread::current();
+        self->ipc.waiting = true;
+        ep->lock.lock();
+        Thread* const server = ep->receivers;
+        if (!server) {
+            // nobody listening: queue up, a server takes the message from us
+            self->ipc.message = message;
+            self->ipc.next = nullptr;
+            if (ep->senders_tail) {
+                ep->senders_tail->ipc.next = self;
+            } else {
+                ep->senders = self;
+            }
+            ep->senders_tail = self;
+            ep->lock.unlock();
+            return wait(self, message);
+        }
+        ep->receivers = server->ipc.next;
+        ep->lock.unlock();
+        // fast path: the server waits, the message goes in and the cpu over
+        server->ipc.message = message;
+        server->ipc.caller = self;
+        release(server, SYS_OK);
+        handoff(server);
+        return wait(self, message);
+    }
+
+    static int64_t reply_wait(int id, IpcMessage& message) {
+        Endpoint* const ep = endpoint(id);
+        if (!ep) {
+            return SYS_BAD_ENDPOINT;
+        }
+        IrqGuard irq;
+        Thread* const self = Thread::current();
+        Thread* const caller = self->ipc.caller;
+        self->ipc.caller = nullptr;
+        if (caller) {
+            caller->ipc.message = message;
+        }
+        ep->lock.lock();
+        Thread* const sender = ep->senders;
+        if (sender) {
+            // a client is queued already: take its message and keep going.
+            // The one we replied to goes through the run queues
+            ep->senders = sender->ipc.next;
+            if (!ep->senders) {
+                ep->senders_tail = nullptr;
+            }
+            ep->lock.unlock();
+            message = sender->ipc.message;
+            self->ipc.caller = sender;
+            if (caller) {
+                release(caller, SYS_OK);
+                caller->wake();
+            }
+            return SYS_OK;
+        }
+        self->ipc.waiting = true;
+        self->ipc.next = ep->receivers;
+        ep->receivers = self;
+        ep->lock.unlock();
+        if (caller) {
+            // fast path: back to the client, which is blocked waiting for us
+            release(caller, SYS_OK);
+            handoff(caller);
+        }
+        return wait(self, message);
+    }
+
+    static void thread_exit() {
+        IrqGuard irq;
+        Thread* const self = Thread::current();
+        if (Thread* const caller = self->ipc.caller) {
+            self->ipc.caller = nullptr;
+            release(caller, SYS_PARTNER_GONE);
+            caller->wake();
+        }
+    }
+};
+
+int ipc_endpoint_create() {
+    return create(endpoints);
+}
+
+int64_t ipc_call(int endpoint, IpcMessage& message) {
+    return Ipc::call(endpoint, message);
+}
+
+int64_t ipc_reply_wait(int endpoint, IpcMessage& message) {
+    return Ipc::reply_wait(endpoint, message);
+}
+
+void ipc_thread_exit() {
+    Ipc::thread_exit();
+}
+
+int ipc_notification_create() {
+    return create(notifications);
+}
+
+int64_t ipc_notify(int id, uint64_t bits) {
+    Notification* const n = notification(id);
+    if (!n) {
+        return SYS_BAD_NOTIFICATION;
+    }
+    Thread* waiter;
+    {
+        LockGuard guard(n->lock);
+        n->bits |= bits;
+        waiter = n->waiter;
+        n->waiter = nullptr;
+    }
+    if (waiter) {
+        waiter->wake();
+    }
+    return SYS_OK;
+}
+
+int64_t ipc_notify_wait(int id, uint64_t& bits) {
+    Notification* const n = notification(id);
+    if (!n) {
+        return SYS_BAD_NOTIFICATION;
+    }
+    Thread* const self = Thread::current();
+    for (;;) {
+        {
+            LockGuard guard(n->lock);
+            if (n->bits) {
+                bits = n->bits;
+                n->bits = 0;
+                return SYS_OK;
+            }
+            n->waiter = self;
+        }
+        // a signal in between leaves a wakeup pending, block returns at once
+        block();
+    }
+}
+
+}
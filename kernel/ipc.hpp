@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+
+namespace kernel {
+
+class Thread;
+
+// Synchronous IPC through endpoints, L4 style. A client calls an endpoint
+// and waits for the reply; a server replies to its last caller and waits
+// for the next message in one step. Messages are a few words, passed in
+// registers from user space (see kernel/syscall.h), never through memory.
+//
+// When the other side is already waiting, the cpu goes straight from the
+// sender to the receiver (see handoff() in sched.hpp): no run queue, no
+// scheduler decision, the receiver runs on the sender's time slice. Only
+// when nobody waits does the sender queue on the endpoint and block.
+//
+// Any thread may use any endpoint for now, there are no capabilities.
+
+constexpr int ipc_message_words = 5;
+
+struct IpcMessage {
+    uint64_t words[ipc_message_words];
+};
+
+// the part of a thread that belongs to IPC
+struct IpcState {
+    IpcMessage message = {}; // received, or waiting to be sent
+    Thread* next = nullptr; // on an endpoint queue
+    Thread* caller = nullptr; // waits for our reply
+    int64_t status = 0; // of the call, set by whoever ends the wait
+    bool waiting = false; // for a message or a reply
+};
+
+// a new endpoint, negative if all are in use
+int ipc_endpoint_create();
+// send message to the endpoint, wait for the reply in message. SYS_OK or
+// one of the errors of kernel/syscall.h
+int64_t ipc_call(int endpoint, IpcMessage& message);
+// reply with message to the last caller, if any, then wait for the next
+// message in message
+int64_t ipc_reply_wait(int endpoint, IpcMessage& message);
+// a thread is exiting: fail the call it was serving, if any
+void ipc_thread_exit();
+
+// Notifications, the doorbells of shared memory rings (see ring.hpp): a
+// word of bits that signals OR in and a wait takes out, sleeping while
+// it's zero. Bits nobody waited for are kept, no signal is lost. One
+// waiter at a time.
+int ipc_notification_create();
+int64_t ipc_notify(int notification, uint64_t bits);
+int64_t ipc_notify_wait(int notification, uint64_t& bits);
+
+}
@@ -0,0 +1,117 @@
+#include "printk.hpp"
+#include "console.hpp"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/spinlock.h"
+
+LogLevel log_level = LogLevel::Info;
+
+namespace {
+
+constexpr uint64_t ring_records = 128; // power of two
+
+// single producer (the owning cpu, interrupts off) single consumer (the drain)
+struct LogRing {
+    LogRecord records[ring_records];
+    uint64_t head; // written by the owner
+    uint64_t dropped; // written by the owner
+    alignas(64) uint64_t tail; // written by the drain
+    uint64_t reported_dropped; // written by the drain
+};
+
+LogRing rings[MAX_CPUS];
+Spinlock drain_lock;
+
+const char* const level_names[] = {"error", "warning", "info", "debug"};
+
+}
+
+void log_record(LogLevel level, const char* format, const format::Arg* args, int count) {
+    uint64_t const now = rdtsc();
+    // an interrupt handler logging on this cpu would otherwise race with us
+    IrqGuard irq;
+    auto &ring = rings[cpu_index()];
+    uint64_t const head = ring.head;
+    if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == ring_records) {
+        __atomic_store_n(&ring.dropped, ring.dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    auto &record = ring.records[head & (ring_records - 1)];
+    record.timestamp = now;
+    record.format = format;
+    record.level = level;
+    record.count = count;
+    record.types = 0;
+    for (int i = 0; i < count; i++) {
+        record.args[i] = args[i].bits;
+        record.types |= LogRecord::pack_type(args[i]) << (i * LogRecord::type_bits);
+    }
+    __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+}
+
+namespace {
+
+// records on any cpu not drained yet
+bool pending() {
+    for (auto &ring: rings) {
+        if (__atomic_load_n(&ring.tail, __ATOMIC_RELAXED) != __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the records in timestamp order, with the drain lock held
+void drain_locked() {
+    for (;;) {
+        // oldest record first, across all cpus
+        LogRing* oldest = nullptr;
+        for (auto &ring: rings) {
+            uint64_t const tail = ring.tail;
+            if (tail != __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) && (!oldest ||
+                    ring.records[tail & (ring_records - 1)].timestamp < oldest->records[oldest->tail & (ring_records - 1)].timestamp)) {
+                oldest = &ring;
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        auto const &record = oldest->records[oldest->tail & (ring_records - 1)];
+        format::Arg args[LogRecord::max_args];
+        for (int i = 0; i < record.count; i++) {
+            args[i] = record.arg(i);
+        }
+        console.printf("[%d] ", record.timestamp / 1000);
+        if (record.level != LogLevel::Info) {
+            console.printf("%s: ", level_names[static_cast<int>(record.level)]);
+        }
+        console.vprintf(record.format, args, record.count);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+    }
+    for (unsigned cpu = 0; cpu < MAX_CPUS; cpu++) {
+        auto &ring = rings[cpu];
+        uint64_t const dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+        if (dropped != ring.reported_dropped) {
+            console.printf("printk: %d records dropped on cpu %d\n", dropped - ring.reported_dropped, cpu);
+            ring.reported_dropped = dropped;
+        }
+    }
+}
+
+}
+
+void printk_drain() {
+    // pairs with the fence after unlock: either we see the lock free, or
+    // the holder sees what was committed before we got here
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    // whoever is draining already will get our records too
+    while (drain_lock.try_lock()) {
+        drain_locked();
+        drain_lock.unlock();
+        // records committed after the last look, whose drain found the
+        // lock taken: nobody else is going to print them
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!pending()) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include "format.hpp"
+
+// Kernel log. printk only copies a binary record (timestamp, level, format
+// pointer and raw arguments) into a ring owned by the calling cpu: no
+// formatting, no device access, no waiting, so it's fine from interrupt
+// handlers and hot loops. printk_drain formats the records in timestamp
+// order and writes them to the console (and from there to the serial
+// port). Idle cpus call it before halting, boot and the panic paths at
+// fixed points. When a ring is full records are dropped and counted, the
+// drain reports how many.
+//
+// Formats are the ones of Console::printf. Since formatting happens later,
+// the format and %s arguments must stay valid until drained: use literals.
+
+enum class LogLevel: uint8_t {
+    Error,
+    Warning,
+    Info,
+    Debug,
+};
+
+struct alignas(64) LogRecord {
+    static constexpr int max_args = 5;
+    static constexpr int type_bits = 5; // per argument: kind, signedness, log2 of size
+    uint64_t timestamp;
+    const char* format;
+    LogLevel level;
+    uint8_t count;
+    uint32_t types;
+    uint64_t args[max_args];
+
+    static constexpr uint32_t pack_type(const format::Arg& arg) {
+        return static_cast<uint32_t>(arg.kind) | arg.is_signed << 2 |
+            (arg.size == 8 ? 3 : arg.size == 4 ? 2 : arg.size == 2 ? 1 : 0) << 3;
+    }
+    format::Arg arg(int i) const {
+        uint32_t const type = types >> (i * type_bits);
+        return {args[i], static_cast<format::ArgKind>(type & 3), uint8_t(1 << (type >> 3 & 3)), bool(type >> 2 & 1)};
+    }
+};
+static_assert(sizeof(LogRecord) == 64, "LogRecord should fill a cache line");
+
+// records above this level are not even queued
+extern LogLevel log_level;
+
+void log_record(LogLevel level, const char* format, const format::Arg* args, int count);
+// format and print what's queued on every cpu
+void printk_drain();
+
+// the format is checked at compile time, like Console::printf
+template<typename ... argTypes>
+void printk(LogLevel level, format::FormatFor<argTypes ...> format, argTypes ... args) {
+    static_assert(sizeof...(args) <= LogRecord::max_args, "too many printk arguments");
+    if (level > log_level) {
+        return;
+    }
+    format::Arg const packed[] = {format::make_arg(args) ..., format::Arg{}};
+    log_record(level, format.str, packed, sizeof...(args));
+}
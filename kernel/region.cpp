@@ -0,0 +1,58 @@
+#include <new>
+#include <string.h>
+#include "region.hpp"
+
+namespace kernel {
+
+SharedRegion* SharedRegion::create(uint64_t size) {
+    int order = 0;
+    while ((FrameAllocator::frame_size << order) < size) {
+        order++;
+    }
+    if (order > FrameAllocator::max_order) {
+        return nullptr;
+    }
+    uint64_t const frames = frame_allocator.alloc(order);
+    if (!frames) {
+        return nullptr;
+    }
+    void* const memory = cache().alloc();
+    if (!memory) {
+        frame_allocator.free(frames, order);
+        return nullptr;
+    }
+    memset(ptl(frames), 0, FrameAllocator::frame_size << order);
+    return ::new (memory) SharedRegion(frames, order);
+}
+
+MMU::MapResult SharedRegion::map(MMU::PML4T* space, void* vaddr, uint64_t flags) {
+    if (!space->rangeFree(vaddr, size())) {
+        return MMU::MapResult::AlreadyMapped;
+    }
+    auto const result = space->mapRange(vaddr, frames, size(), flags);
+    if (result != MMU::MapResult::Ok) {
+        // mapRange stops at the first failure, undo what it did
+        space->unmapRange(vaddr, size());
+        return result;
+    }
+    __atomic_fetch_add(&references, 1, __ATOMIC_RELAXED);
+    return result;
+}
+
+void SharedRegion::unmap(MMU::PML4T* space, void* vaddr) {
+    space->unmapRange(vaddr, size());
+    release();
+}
+
+void SharedRegion::release() {
+    if (__atomic_sub_fetch(&references, 1, __ATOMIC_ACQ_REL) == 0) {
+        frame_allocator.free(frames, order);
+        delete this;
+    }
+}
+
+MMU::MapResult grant(MMU::PML4T* from, void* from_addr, MMU::PML4T* to, void* to_addr, uint64_t len) {
+    return from->moveRange(from_addr, len, to, to_addr);
+}
+
+}
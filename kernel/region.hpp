@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include "slab.hpp"
+#include "arch/x86_64/mmu.h"
+#include "arch/x86_64/frames.h"
+
+namespace kernel {
+
+// Memory shared between address spaces, for the bulk data that doesn't
+// fit in an IPC message: a block of physical frames that can be mapped at
+// any address of any number of vspaces. Producer and consumer then talk
+// through an SpscRing (ring.hpp) at the start of it, pointing at buffers
+// by their offset in the region, and ring each other's doorbell (a
+// notification, ipc.hpp) only when the other side sleeps.
+//
+// The region lives as long as it's referenced: create() returns one
+// reference, every map() takes another, unmap() and release() drop one.
+class SharedRegion: public SlabObject<SharedRegion> {
+public:
+    static constexpr const char* slab_name = "shared-region";
+
+    // size is rounded up to a power of two pages. Zero filled, nullptr if out of memory
+    static SharedRegion* create(uint64_t size);
+
+    // map the whole region at vaddr, page aligned. flags as for mapRange,
+    // plus User for user space
+    MMU::MapResult map(MMU::PML4T* space, void* vaddr, uint64_t flags);
+    void unmap(MMU::PML4T* space, void* vaddr);
+    void release();
+
+    uint64_t size() const { return FrameAllocator::frame_size << order; }
+    // where the kernel sees it, through the linear map
+    void* kernel_address() const { return ptl(frames); }
+
+private:
+    SharedRegion(uint64_t frames, int order): frames{frames}, order{order} {}
+
+    uint64_t const frames;
+    int const order;
+    uint32_t references = 1;
+};
+
+// Move the pages mapped at [from_addr, from_addr + len) in from to
+// [to_addr, to_addr + len) in to, with the same attributes: a buffer
+// changes hands with a page table update, no copy. The source range must
+// be one mapping as far as flags go, the destination range free; nothing
+// moves unless all of it could be mapped there.
+MMU::MapResult grant(MMU::PML4T* from, void* from_addr, MMU::PML4T* to, void* to_addr, uint64_t len);
+
+}
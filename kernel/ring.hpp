@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+
+namespace kernel {
+
+// Single producer, single consumer ring, laid out to live in a
+// SharedRegion and be used from both sides of it, in any address space.
+// Plain memory and atomics only: no system call unless a doorbell is due.
+//
+// Each side writes only its own cache line (the producer the tail, the
+// consumer the head) and keeps a copy of the other side's index there, so
+// that it reads the other line only when the copy says the ring is full
+// or empty (Lamport's ring with the cached indices of MCRingBuffer).
+//
+// Doorbells: a consumer that found the ring empty calls prepare_sleep()
+// and, if that says so, waits on its notification; the producer calls
+// needs_doorbell() after push() and signals only if it returns true. So a
+// consumer busy draining the ring is never notified, and one going to
+// sleep can't miss the push that should wake it.
+template<typename T, uint32_t N>
+struct SpscRing {
+    static_assert(N && !(N & (N - 1)), "ring size must be a power of two");
+
+    // producer side
+    alignas(64) uint32_t tail = 0;
+    uint32_t head_cache = 0;
+    // consumer side
+    alignas(64) uint32_t head = 0;
+    uint32_t tail_cache = 0;
+    uint32_t sleeping = 0; // the consumer waits for a doorbell
+    alignas(64) T slots[N];
+
+    bool push(const T& item) {
+        uint32_t const t = tail;
+        if (t - head_cache == N) {
+            head_cache = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+            if (t - head_cache == N) {
+                return false;
+            }
+        }
+        slots[t & (N - 1)] = item;
+        __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    bool pop(T& item) {
+        uint32_t const h = head;
+        if (h == tail_cache) {
+            tail_cache = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+            if (h == tail_cache) {
+                return false;
+            }
+        }
+        item = slots[h & (N - 1)];
+        __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // producer, after pushing: true when the consumer went to sleep and must
+    // be woken. Only one producer call sees it, until the next sleep
+    bool needs_doorbell() {
+        // the tail store before the sleeping load, pairs with prepare_sleep
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return __atomic_load_n(&sleeping, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&sleeping, 0, __ATOMIC_ACQ_REL);
+    }
+
+    // consumer, with the ring found empty: true if it may wait for the
+    // doorbell, false if something came in meanwhile
+    bool prepare_sleep() {
+        __atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) != head) {
+            // the producer may or may not have seen us: if it did, the
+            // doorbell rings for nothing, the next wait returns at once
+            __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+            return false;
+        }
+        return true;
+    }
+};
+
+// what a ring of a SharedRegion usually carries: a buffer in the region,
+// by offset since the two sides map it at different addresses
+struct RingDescriptor {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t flags;
+};
+
+}
@@ -0,0 +1,527 @@
+#include <new>
+#include "sched.hpp"
+#include "workdeque.hpp"
+#include "timer.hpp"
+#include "printk.hpp"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/mmu.h"
+#include "arch/x86_64/frames.h"
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/apic.h"
+#include "arch/x86_64/idt.h"
+#include "arch/x86_64/tsc.h"
+#include "arch/x86_64/gdt.h"
+#include "arch/x86_64/syscall.h"
+
+extern "C" void context_switch(uint64_t* save_rsp, uint64_t rsp);
+
+namespace kernel {
+
+namespace {
+
+// how long a thread runs before it's asked to make room for others
+constexpr uint64_t slice_ns = 4000000;
+// idle cpus back off up to this many pauses between rounds of stealing,
+// so that they don't keep pulling the other cpus' queues into their
+// caches. Then they halt until someone queues work
+constexpr unsigned max_idle_backoff = 1024;
+
+struct RunQueue;
+extern RunQueue run_queues[MAX_CPUS];
+
+struct alignas(64) RunQueue {
+    WorkDeque<Thread*> normal;
+    Spinlock driver_lock;
+    Thread* driver_head = nullptr; // FIFO, protected by driver_lock
+    Thread* driver_tail = nullptr;
+    Thread* current = nullptr; // nullptr until sched_init_cpu
+    Thread idle;
+    // the thread we just switched away from, taken care of by finish_switch
+    // once we're off its stack
+    Thread* previous = nullptr;
+    bool requeue_previous = false;
+    bool need_resched = false;
+    // armed only while there is someone waiting for the cpu
+    Timer slice{[](Timer&, void*) {
+        run_queues[cpu_index()].need_resched = true;
+    }};
+    uint32_t random = 0; // xorshift state, picks the first victim to steal from
+    uint64_t switches = 0;
+    uint64_t steals = 0;
+};
+
+RunQueue run_queues[MAX_CPUS];
+uint64_t halted_cpus; // bit n: cpu n is halted in sched_idle
+
+}
+
+// everything that needs Thread internals
+struct Scheduler {
+    // put a runnable thread on the queues of the calling cpu. Interrupts off
+    static void enqueue(RunQueue& rq, Thread* thread) {
+        queue(rq, thread);
+        // somebody is waiting for this cpu now
+        if (rq.current && rq.current != &rq.idle && !rq.slice.pending()) {
+            rq.slice.arm(ktime_ns() + slice_ns);
+        }
+        kick_halted_cpu();
+    }
+
+    static void queue(RunQueue& rq, Thread* thread) {
+        // no memory to grow the deque: the FIFO never needs any, the
+        // thread just jumps the queue
+        if (thread->klass == Thread::Class::Normal && rq.normal.push(thread)) {
+            return;
+        }
+        LockGuard guard(rq.driver_lock);
+        thread->next = nullptr;
+        if (rq.driver_tail) {
+            rq.driver_tail->next = thread;
+        } else {
+            rq.driver_head = thread;
+        }
+        rq.driver_tail = thread;
+        if (rq.current && rq.current->klass != Thread::Class::Driver) {
+            rq.need_resched = true;
+        }
+    }
+
+    // wake a halted cpu, if any, to steal what was just queued
+    static void kick_halted_cpu() {
+        // pairs with the fetch_or in halt(): either we see its bit, or it sees our work
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint64_t mask = __atomic_load_n(&halted_cpus, __ATOMIC_RELAXED) & ~(1ull << cpu_index());
+        while (mask) {
+            uint64_t const bit = mask & -mask;
+            if (__atomic_fetch_and(&halted_cpus, ~bit, __ATOMIC_SEQ_CST) & bit) {
+                lapic.send_ipi(per_cpu[__builtin_ctzll(bit)].apic_id, VECTOR_RESCHEDULE);
+                return;
+            }
+            mask &= ~bit;
+        }
+    }
+
+    static bool work_anywhere() {
+        for (auto &rq: run_queues) {
+            if (__atomic_load_n(&rq.current, __ATOMIC_RELAXED) &&
+                    (rq.normal.size() || __atomic_load_n(&rq.driver_head, __ATOMIC_RELAXED))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // sleep until an interrupt: the timer, or a kick from a cpu with work
+    static void halt() {
+        uint64_t const bit = 1ull << cpu_index();
+        asm volatile("cli");
+        __atomic_fetch_or(&halted_cpus, bit, __ATOMIC_SEQ_CST);
+        if (work_anywhere()) {
+            asm volatile("sti");
+        } else {
+            // sti only takes effect after hlt, an interrupt can't slip in between
+            asm volatile("sti; hlt" : : : "memory");
+        }
+        __atomic_fetch_and(&halted_cpus, ~bit, __ATOMIC_SEQ_CST);
+    }
+
+    static Thread* pop_driver(RunQueue& rq, bool wait) {
+        if (!__atomic_load_n(&rq.driver_head, __ATOMIC_RELAXED)) {
+            return nullptr;
+        }
+        if (wait) {
+            rq.driver_lock.lock();
+        } else if (!rq.driver_lock.try_lock()) {
+            return nullptr;
+        }
+        Thread* const thread = rq.driver_head;
+        if (thread) {
+            rq.driver_head = thread->next;
+            if (!rq.driver_head) {
+                rq.driver_tail = nullptr;
+            }
+        }
+        rq.driver_lock.unlock();
+        return thread;
+    }
+
+    static Thread* pick_next(RunQueue& rq) {
+        if (Thread* thread = pop_driver(rq, true)) {
+            return thread;
+        }
+        if (Thread* thread = rq.normal.take()) {
+            return thread;
+        }
+        rq.random ^= rq.random << 13;
+        rq.random ^= rq.random >> 17;
+        rq.random ^= rq.random << 5;
+        unsigned const first = rq.random % MAX_CPUS;
+        // drivers anywhere come before normal threads
+        for (int pass = 0; pass < 2; pass++) {
+            for (unsigned i = 0; i < MAX_CPUS; i++) {
+                auto &victim = run_queues[(first + i) % MAX_CPUS];
+                if (&victim == &rq || !__atomic_load_n(&victim.current, __ATOMIC_RELAXED)) {
+                    continue;
+                }
+                Thread* const thread = pass == 0 ? pop_driver(victim, false) : victim.normal.steal();
+                if (thread) {
+                    rq.steals++;
+                    return thread;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // interrupts off. requeue: the current thread stays runnable.
+    // preempted: it was interrupted at an arbitrary point, its vector
+    // registers are live. It must have a state area already
+    static void schedule(bool requeue, bool preempted = false) {
+        auto &rq = run_queues[cpu_index()];
+        Thread* const prev = rq.current;
+        rq.need_resched = false;
+        Thread* next = pick_next(rq);
+        if (!next) {
+            if (requeue || prev == &rq.idle) {
+                return;
+            }
+            next = &rq.idle;
+        }
+        if (next == &rq.idle) {
+            rq.slice.cancel();
+        } else if (rq.normal.size() || rq.driver_head || (requeue && prev != &rq.idle)) {
+            // a fresh slice, others are waiting
+            rq.slice.arm(ktime_ns() + slice_ns);
+        } else {
+            rq.slice.cancel();
+        }
+        {
+            LockGuard guard(next->lock);
+            next->state = Thread::State::Running;
+            next->on_cpu = true;
+        }
+        switch_to(rq, next, requeue, preempted);
+    }
+
+    // the second half of schedule(): next is marked running already
+    static void switch_to(RunQueue& rq, Thread* next, bool requeue, bool preempted) {
+        Thread* const prev = rq.current;
+        rq.previous = prev;
+        rq.requeue_previous = requeue;
+        rq.current = next;
+        rq.switches++;
+        if (next->stack) {
+            uint64_t const top = reinterpret_cast<uint64_t>(ptl(next->stack)) + (FrameAllocator::frame_size << Thread::stack_order);
+            this_cpu()->kernel_stack = top;
+            gdt_set_kernel_stack(top);
+        }
+        // kernel threads go back to the kernel vspace, so that a user one
+        // can be destroyed once its threads are gone
+        MMU::PML4T* const vspace = next->vspace ? next->vspace : MMU().get_kernel_vspace();
+        if (!vspace->active()) {
+            vspace->switchTo();
+        }
+        if (!preempted && prev->vspace) {
+            // a user thread in a syscall: the vector registers are clobbered
+            // by the ABI, but must not show what others left in them. The
+            // control words are callee-saved, its rounding mode stays
+            fpu_save_controls(prev->fpu_controls);
+            prev->fpu = Thread::Fpu::Controls;
+        } else if (!preempted) {
+            prev->fpu = Thread::Fpu::Dead;
+        } else if (fpu_in_init_state()) {
+            prev->fpu = Thread::Fpu::Initial;
+        } else {
+            fpu_save(prev->fpu_state);
+            prev->fpu = Thread::Fpu::Saved;
+        }
+        context_switch(&prev->saved_rsp, next->saved_rsp);
+        // back in prev, maybe on another cpu
+        finish_switch();
+        // last, so that nothing can clobber the registers before we return
+        if (prev->fpu == Thread::Fpu::Saved) {
+            fpu_restore(prev->fpu_state);
+        } else if (prev->fpu == Thread::Fpu::Initial) {
+            fpu_restore_init();
+        } else if (prev->fpu == Thread::Fpu::Controls) {
+            fpu_restore_controls(prev->fpu_controls);
+        }
+    }
+
+    // first thing after a switch, on the new thread's stack
+    static void finish_switch() {
+        auto &rq = run_queues[cpu_index()];
+        Thread* const prev = rq.previous;
+        rq.previous = nullptr;
+        prev->lock.lock();
+        prev->on_cpu = false;
+        if (prev->state == Thread::State::Dead) {
+            prev->lock.unlock();
+            frame_allocator.free(prev->stack, Thread::stack_order);
+            if (prev->fpu_state) {
+                fpu_free_state(prev->fpu_state);
+            }
+            delete prev;
+            return;
+        }
+        if (rq.requeue_previous) {
+            prev->state = Thread::State::Runnable;
+        }
+        // a blocked thread may have been woken while still on the cpu: its
+        // waker left the queueing to us
+        bool const runnable = prev->state == Thread::State::Runnable;
+        prev->lock.unlock();
+        if (runnable && prev != &rq.idle) {
+            queue(rq, prev);
+            kick_halted_cpu();
+        }
+    }
+
+    // new threads start here, from the return address spawn put on their stack
+    [[noreturn]] static void thread_start() {
+        finish_switch();
+        // schedule left interrupts off
+        asm volatile("sti");
+        Thread* const self = Thread::current();
+        if (self->vspace) {
+            fpu_restore_init();
+            user_enter(self->user_rip, self->user_rsp);
+        }
+        self->entry(self->arg);
+        kernel::exit();
+    }
+
+    static Thread* spawn(const char* name, void (*entry)(void*), void* arg, Thread::Class klass) {
+        auto thread = create(name, klass);
+        if (thread) {
+            thread->entry = entry;
+            thread->arg = arg;
+            IrqGuard irq;
+            enqueue(run_queues[cpu_index()], thread);
+        }
+        return thread;
+    }
+
+    static Thread* spawn_user(const char* name, MMU::PML4T* vspace, uint64_t rip, uint64_t rsp, Thread::Class klass) {
+        if (rip >= USER_TOP || rsp > USER_TOP) {
+            return nullptr;
+        }
+        auto thread = create(name, klass);
+        if (thread) {
+            thread->vspace = vspace;
+            thread->user_rip = rip;
+            thread->user_rsp = rsp;
+            IrqGuard irq;
+            enqueue(run_queues[cpu_index()], thread);
+        }
+        return thread;
+    }
+
+    // a thread with its stack ready for thread_start, not queued yet
+    static Thread* create(const char* name, Thread::Class klass) {
+        uint64_t const stack = frame_allocator.alloc(Thread::stack_order);
+        if (!stack) {
+            return nullptr;
+        }
+        void* const memory = Thread::cache().alloc();
+        if (!memory) {
+            frame_allocator.free(stack, Thread::stack_order);
+            return nullptr;
+        }
+        auto thread = ::new (memory) Thread(name, klass);
+        thread->stack = stack;
+        thread->state = Thread::State::Runnable;
+        thread->on_cpu = false;
+        // what context_switch pops: six callee saved registers, then the
+        // return address. thread_start sees the stack as if it was called
+        auto top = reinterpret_cast<uint64_t*>(static_cast<uint8_t*>(ptl(stack)) + (FrameAllocator::frame_size << Thread::stack_order));
+        *--top = 0;
+        *--top = reinterpret_cast<uint64_t>(thread_start);
+        for (int i = 0; i < 6; i++) {
+            *--top = 0;
+        }
+        thread->saved_rsp = reinterpret_cast<uint64_t>(top);
+        return thread;
+    }
+
+    static void wake(Thread* thread) {
+        IrqGuard irq;
+        {
+            LockGuard guard(thread->lock);
+            if (thread->state != Thread::State::Blocked) {
+                if (thread->state == Thread::State::Running) {
+                    thread->wake_pending = true;
+                }
+                return;
+            }
+            thread->state = Thread::State::Runnable;
+            if (thread->on_cpu) {
+                // still switching away, finish_switch will queue it
+                return;
+            }
+        }
+        enqueue(run_queues[cpu_index()], thread);
+    }
+
+    static void block() {
+        IrqGuard irq;
+        Thread* const self = run_queues[cpu_index()].current;
+        {
+            LockGuard guard(self->lock);
+            if (self->wake_pending) {
+                self->wake_pending = false;
+                return;
+            }
+            self->state = Thread::State::Blocked;
+        }
+        schedule(false);
+    }
+
+    static void handoff(Thread* next) {
+        IrqGuard irq;
+        auto &rq = run_queues[cpu_index()];
+        Thread* const self = rq.current;
+        bool direct = self != &rq.idle;
+        if (direct) {
+            LockGuard guard(next->lock);
+            // woken by someone else, or still on its way off another cpu:
+            // don't wait for it, the regular path gets there
+            direct = next->state == Thread::State::Blocked && !next->on_cpu;
+            if (direct) {
+                next->state = Thread::State::Running;
+                next->on_cpu = true;
+            }
+        }
+        if (!direct) {
+            wake(next);
+            block();
+            return;
+        }
+        bool requeue;
+        {
+            LockGuard guard(self->lock);
+            requeue = self->wake_pending;
+            self->wake_pending = false;
+            if (!requeue) {
+                self->state = Thread::State::Blocked;
+            }
+        }
+        // next inherits the time slice
+        switch_to(rq, next, requeue, false);
+    }
+
+    [[noreturn]] static void exit() {
+        asm volatile("cli");
+        Thread* const self = run_queues[cpu_index()].current;
+        {
+            LockGuard guard(self->lock);
+            self->state = Thread::State::Dead;
+        }
+        schedule(false);
+        __builtin_unreachable();
+    }
+
+    static void preempt() {
+        IrqGuard irq;
+        auto &rq = run_queues[cpu_index()];
+        if (!rq.need_resched) {
+            return;
+        }
+        Thread* const self = rq.current;
+        // no memory for the vector state: try again at the next preemption point
+        if (!self->fpu_state && !(self->fpu_state = fpu_alloc_state())) {
+            return;
+        }
+        schedule(self != &rq.idle, true);
+    }
+
+    static void init_cpu() {
+        interrupt_attach(VECTOR_RESCHEDULE, [](InterruptFrame&, void*) {
+            lapic.eoi();
+        });
+        IrqGuard irq;
+        auto &rq = run_queues[cpu_index()];
+        rq.random = cpu_index() * 2654435761u + 1;
+        rq.idle.state = Thread::State::Running;
+        rq.idle.on_cpu = true;
+        __atomic_store_n(&rq.current, &rq.idle, __ATOMIC_RELEASE);
+    }
+};
+
+Thread* Thread::spawn(const char* name, void (*entry)(void*), void* arg, Class klass) {
+    return Scheduler::spawn(name, entry, arg, klass);
+}
+
+Thread* Thread::spawn_user(const char* name, MMU::PML4T* vspace, uint64_t rip, uint64_t rsp, Class klass) {
+    return Scheduler::spawn_user(name, vspace, rip, rsp, klass);
+}
+
+Thread* Thread::current() {
+    IrqGuard irq;
+    return run_queues[cpu_index()].current;
+}
+
+void Thread::wake() {
+    Scheduler::wake(this);
+}
+
+void sched_init_cpu() {
+    Scheduler::init_cpu();
+}
+
+void sched_idle() {
+    unsigned backoff = 1;
+    for (;;) {
+        uint64_t const switches = run_queues[cpu_index()].switches;
+        yield();
+        if (run_queues[cpu_index()].switches != switches) {
+            backoff = 1;
+            continue;
+        }
+        if (backoff == max_idle_backoff) {
+            // nothing to run: print the log, nobody else will
+            printk_drain();
+            Scheduler::halt();
+            backoff = 1;
+            continue;
+        }
+        for (unsigned i = 0; i < backoff; i++) {
+            asm volatile("pause");
+        }
+        backoff *= 2;
+    }
+}
+
+void yield() {
+    IrqGuard irq;
+    auto &rq = run_queues[cpu_index()];
+    Scheduler::schedule(rq.current != &rq.idle);
+}
+
+void block() {
+    Scheduler::block();
+}
+
+void exit() {
+    ipc_thread_exit();
+    Scheduler::exit();
+}
+
+void preempt() {
+    Scheduler::preempt();
+}
+
+void handoff(Thread* next) {
+    Scheduler::handoff(next);
+}
+
+SchedStats sched_stats() {
+    SchedStats stats = {};
+    for (auto &rq: run_queues) {
+        stats.switches += __atomic_load_n(&rq.switches, __ATOMIC_RELAXED);
+        stats.steals += __atomic_load_n(&rq.steals, __ATOMIC_RELAXED);
+    }
+    return stats;
+}
+
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include <cstdint>
+#include "slab.hpp"
+#include "ipc.hpp"
+#include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/mmu.h"
+#include "arch/x86_64/fpu.h"
+
+namespace kernel {
+
+// Kernel threads and the scheduler.
+//
+// Every cpu has its own run queues and only ever takes work from them
+// without locks: a Chase-Lev deque of normal threads (the owner pushes and
+// takes at the bottom, last woken first, which is the one whose data is
+// still in cache) and a short FIFO of driver threads. A thread made
+// runnable goes on the queues of the cpu that woke it. Cpus with nothing to
+// do steal from the top of the other cpus' deques, starting from a random
+// one, so work spreads to idle cpus without a global queue or lock.
+//
+// Driver threads (Thread::Class::Driver) always run before normal ones, and
+// are stolen first: a woken driver waits at most for the current thread to
+// reach a preemption point, or for an idle cpu to notice it.
+//
+// Switches happen in schedule(), called by yield(), block() and exit(),
+// and by preempt() once the time slice ran out: interrupt_dispatch calls
+// it after every hardware interrupt. The slice is a timer armed only while
+// other threads wait for the cpu, a thread running alone isn't interrupted.
+// Idle cpus spin stealing for a while, then halt until a cpu that queues
+// work kicks them with an IPI.
+//
+// A switch in yield(), block() or exit() is a function call, no vector
+// register is live across it: only preempt() saves the vector state (see
+// fpu.h), in a per-thread area allocated the first time it's needed. User
+// threads get initial registers back instead, so that nothing leaks from
+// whoever ran in between, with their own MXCSR and x87 control word.
+//
+// User threads run in their own address space, switched to along with
+// them. Kernel threads run in whatever address space is loaded, they only
+// touch the kernel half.
+class Thread: public SlabObject<Thread> {
+public:
+    static constexpr const char* slab_name = "thread";
+    static constexpr int stack_order = 2; // 16k stacks
+
+    enum class Class: uint8_t {
+        Normal,
+        Driver,
+    };
+    enum class State: uint8_t {
+        Running,
+        Runnable,
+        Blocked,
+        Dead,
+    };
+
+    // a new thread, runnable on the calling cpu. nullptr if out of memory
+    static Thread* spawn(const char* name, void (*entry)(void*), void* arg, Class klass = Class::Normal);
+    // a new thread running user code at rip, on the stack at rsp, in
+    // vspace. nullptr if out of memory or the addresses are not user ones
+    static Thread* spawn_user(const char* name, MMU::PML4T* vspace, uint64_t rip, uint64_t rsp, Class klass = Class::Normal);
+    // the thread running on this cpu
+    static Thread* current();
+
+    // make a thread that is, or is about to be, blocked runnable again. If
+    // it's not blocked yet its next block() returns straight away, so a
+    // wakeup can't be lost between checking a condition and blocking.
+    void wake();
+
+    const char* const name;
+    Class const klass;
+
+    constexpr Thread(const char* name = "idle", Class klass = Class::Normal): name{name}, klass{klass} {}
+
+private:
+    friend struct Scheduler;
+    friend struct Ipc;
+
+    uint64_t saved_rsp = 0;
+    uint64_t stack = 0; // physical, 0 for the boot context of a cpu
+    void (*entry)(void*) = nullptr;
+    void* arg = nullptr;
+    Thread* next = nullptr; // driver FIFO link
+    Spinlock lock; // state, wake_pending and on_cpu
+    State state = State::Running;
+    bool wake_pending = false;
+    bool on_cpu = true; // its context isn't saved yet, nobody else may run it
+    // vector registers when switched away from
+    enum class Fpu: uint8_t {
+        Dead, // nothing to restore, by the ABI
+        Initial,
+        Controls, // initial but for fpu_controls
+        Saved, // in fpu_state
+    } fpu = Fpu::Dead;
+    FpuControls fpu_controls;
+    void* fpu_state = nullptr;
+    // user threads
+    MMU::PML4T* vspace = nullptr;
+    uint64_t user_rip = 0;
+    uint64_t user_rsp = 0;
+    IpcState ipc;
+};
+
+// the boot context of the calling cpu becomes its idle thread, which runs
+// whenever there's nothing else to do
+void sched_init_cpu();
+// steal and run threads forever, for cpus with nothing else to do. Halts
+// when there's nothing to steal
+[[noreturn]] void sched_idle();
+
+// give the cpu to another runnable thread, if any
+void yield();
+// sleep until wake()
+void block();
+// end the calling thread, failing the IPC call it was serving if any
+[[noreturn]] void exit();
+// switch if the time slice ran out or a driver thread was woken
+void preempt();
+// next->wake() then block(), but when next is blocked the cpu goes to it
+// straight away, skipping the run queues, with what's left of the time
+// slice. For synchronous IPC, where the caller waits for next anyway
+void handoff(Thread* next);
+
+// switches and steals so far, summed over all cpus
+struct SchedStats {
+    uint64_t switches;
+    uint64_t steals;
+};
+SchedStats sched_stats();
+
+}
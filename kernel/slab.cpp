@@ -0,0 +1,281 @@
+#include <kernel/kmalloc.h>
+#include "slab.hpp"
+#include "printk.hpp"
+#include "arch/x86_64/mmu.h"
+#include "arch/x86_64/frames.h"
+
+namespace kernel {
+
+SlabCache SlabCache::magazines{"magazine", sizeof(SlabCache::Magazine), 64, false};
+SlabCache* SlabCache::all_caches = nullptr;
+Spinlock SlabCache::registry_lock;
+
+void* SlabCache::alloc() {
+    if (use_magazines) {
+        IrqGuard irq;
+        auto &cpu = cpus[cpu_index()];
+        if (cpu.loaded && cpu.loaded->rounds) {
+            cpu.hits++;
+            return cpu.loaded->objects[--cpu.loaded->rounds];
+        }
+        if (cpu.previous && cpu.previous->rounds) {
+            auto swap = cpu.loaded;
+            cpu.loaded = cpu.previous;
+            cpu.previous = swap;
+            cpu.hits++;
+            return cpu.loaded->objects[--cpu.loaded->rounds];
+        }
+        cpu.misses++;
+        LockGuard guard(lock);
+        if (full_magazines) {
+            // both magazines are empty: park one, trade the other for a full one
+            if (cpu.previous) {
+                cpu.previous->next = empty_magazines;
+                empty_magazines = cpu.previous;
+            }
+            cpu.previous = cpu.loaded;
+            cpu.loaded = full_magazines;
+            full_magazines = full_magazines->next;
+            return cpu.loaded->objects[--cpu.loaded->rounds];
+        }
+        return slab_alloc_locked();
+    }
+    LockGuard guard(lock);
+    return slab_alloc_locked();
+}
+
+void SlabCache::free(void* object) {
+    if (use_magazines) {
+        IrqGuard irq;
+        auto &cpu = cpus[cpu_index()];
+        if (cpu.loaded && cpu.loaded->rounds < magazine_rounds) {
+            cpu.hits++;
+            cpu.loaded->objects[cpu.loaded->rounds++] = object;
+            return;
+        }
+        if (cpu.previous && !cpu.previous->rounds) {
+            auto swap = cpu.loaded;
+            cpu.loaded = cpu.previous;
+            cpu.previous = swap;
+            cpu.hits++;
+            cpu.loaded->objects[cpu.loaded->rounds++] = object;
+            return;
+        }
+        cpu.misses++;
+        LockGuard guard(lock);
+        Magazine* empty = empty_magazines;
+        if (empty) {
+            empty_magazines = empty->next;
+        } else {
+            empty = static_cast<Magazine*>(magazines.alloc());
+        }
+        if (empty) {
+            // both magazines are full: send one to the depot, load an empty one
+            empty->rounds = 0;
+            if (cpu.previous) {
+                cpu.previous->next = full_magazines;
+                full_magazines = cpu.previous;
+            }
+            cpu.previous = cpu.loaded;
+            cpu.loaded = empty;
+            cpu.loaded->objects[cpu.loaded->rounds++] = object;
+            return;
+        }
+        // no memory even for a magazine, give the object straight back
+        slab_free_locked(object);
+        return;
+    }
+    LockGuard guard(lock);
+    slab_free_locked(object);
+}
+
+SlabCache::Slab* SlabCache::new_slab_locked() {
+    uint64_t physaddr = frame_allocator.alloc(slab_order);
+    if (!physaddr) {
+        return nullptr;
+    }
+    frame_allocator.set_slab(physaddr);
+    auto base = static_cast<uint8_t*>(ptl(physaddr));
+    auto slab = reinterpret_cast<Slab*>(base);
+    slab->cache = this;
+    slab->inuse = 0;
+    slab->freelist = nullptr;
+    for (uint32_t i = capacity; i > 0; i--) {
+        auto object = reinterpret_cast<void**>(base + first_offset + (i - 1) * object_size);
+        *object = slab->freelist;
+        slab->freelist = object;
+    }
+    slab->prev = nullptr;
+    slab->next = partial;
+    if (partial) {
+        partial->prev = slab;
+    }
+    partial = slab;
+    slab_count++;
+    if (!registered) {
+        registered = true;
+        LockGuard registry(registry_lock);
+        next_cache = all_caches;
+        all_caches = this;
+    }
+    return slab;
+}
+
+void* SlabCache::slab_alloc_locked() {
+    Slab* slab = partial ? partial : new_slab_locked();
+    if (!slab) {
+        return nullptr;
+    }
+    auto object = static_cast<void**>(slab->freelist);
+    slab->freelist = *object;
+    slab->inuse++;
+    object_count++;
+    if (slab->inuse == capacity) {
+        // full slabs are not tracked, free() finds them from the object address
+        partial = slab->next;
+        if (partial) {
+            partial->prev = nullptr;
+        }
+    }
+    return object;
+}
+
+void SlabCache::slab_free_locked(void* object) {
+    auto slab = static_cast<Slab*>(ptl(ltp(object) & ~(slab_size - 1)));
+    if (slab->inuse == capacity) {
+        slab->prev = nullptr;
+        slab->next = partial;
+        if (partial) {
+            partial->prev = slab;
+        }
+        partial = slab;
+    }
+    *static_cast<void**>(object) = slab->freelist;
+    slab->freelist = object;
+    slab->inuse--;
+    object_count--;
+    // keep one slab around, so that alloc/free on an idle cache doesn't thrash the frame allocator
+    if (!slab->inuse && (slab->prev || slab->next)) {
+        if (slab->prev) {
+            slab->prev->next = slab->next;
+        } else {
+            partial = slab->next;
+        }
+        if (slab->next) {
+            slab->next->prev = slab->prev;
+        }
+        slab_count--;
+        frame_allocator.free(ltp(slab), slab_order);
+    }
+}
+
+SlabCache* SlabCache::owner(void* object) {
+    uint64_t base = ltp(object) & ~(slab_size - 1);
+    if (!frame_allocator.is_slab(base)) {
+        return nullptr;
+    }
+    return static_cast<Slab*>(ptl(base))->cache;
+}
+
+void SlabCache::dump_stats() {
+    LockGuard registry(registry_lock);
+    for (auto cache = all_caches; cache; cache = cache->next_cache) {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        for (auto &cpu: cache->cpus) {
+            hits += cpu.hits;
+            misses += cpu.misses;
+        }
+        // printk takes five arguments
+        printk(LogLevel::Info, "slab %s: %d bytes, %d objects in %d slabs\n",
+            cache->name, cache->object_size, cache->object_count, cache->slab_count);
+        printk(LogLevel::Info, "slab %s: %d hits %d misses\n", cache->name, hits, misses);
+    }
+}
+
+}
+
+// power of two size classes. Anything bigger goes straight to the frame allocator.
+static kernel::SlabCache kmalloc_caches[] = {
+    {"kmalloc-16", 16, 16},
+    {"kmalloc-32", 32, 32},
+    {"kmalloc-64", 64, 64},
+    {"kmalloc-128", 128, 128},
+    {"kmalloc-256", 256, 256},
+    {"kmalloc-512", 512, 512},
+    {"kmalloc-1k", 1024, 1024},
+    {"kmalloc-2k", 2048, 2048},
+    {"kmalloc-4k", 4096, 4096},
+};
+constexpr size_t kmalloc_max = 4096;
+
+static inline int size_order(size_t size, size_t unit) {
+    // smallest n such that unit << n >= size
+    size_t units = (size + unit - 1) / unit;
+    return units <= 1 ? 0 : 64 - __builtin_clzll(units - 1);
+}
+
+void* kmalloc(size_t size) {
+    if (size <= kmalloc_max) {
+        return kmalloc_caches[size_order(size, 16)].alloc();
+    }
+    uint64_t physaddr = frame_allocator.alloc(size_order(size, FrameAllocator::frame_size));
+    return physaddr ? ptl(physaddr) : nullptr;
+}
+
+void kfree(void* pointer) {
+    if (!pointer) {
+        return;
+    }
+    if (auto cache = kernel::SlabCache::owner(pointer)) {
+        cache->free(pointer);
+        return;
+    }
+    uint64_t physaddr = ltp(pointer);
+    frame_allocator.free(physaddr, frame_allocator.order_of(physaddr));
+}
+
+void kmalloc_stats() {
+    kernel::SlabCache::dump_stats();
+}
+
+// objects are aligned to their size class, so over-aligned types just need a bigger class.
+// These can't be noexcept (they'd clash with <new>) but return nullptr when
+// memory runs out: the kernel is built with -fcheck-new so new expressions
+// check for it rather than construct at address 0
+void* operator new(size_t size) {
+    return kmalloc(size);
+}
+void* operator new[](size_t size) {
+    return kmalloc(size);
+}
+void* operator new(size_t size, std::align_val_t align) {
+    return kmalloc(size < size_t(align) ? size_t(align) : size);
+}
+void* operator new[](size_t size, std::align_val_t align) {
+    return kmalloc(size < size_t(align) ? size_t(align) : size);
+}
+void operator delete(void* pointer) noexcept {
+    kfree(pointer);
+}
+void operator delete[](void* pointer) noexcept {
+    kfree(pointer);
+}
+void operator delete(void* pointer, size_t) noexcept {
+    kfree(pointer);
+}
+void operator delete[](void* pointer, size_t) noexcept {
+    kfree(pointer);
+}
+void operator delete(void* pointer, std::align_val_t) noexcept {
+    kfree(pointer);
+}
+void operator delete[](void* pointer, std::align_val_t) noexcept {
+    kfree(pointer);
+}
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept {
+    kfree(pointer);
+}
+void operator delete[](void* pointer, size_t, std::align_val_t) noexcept {
+    kfree(pointer);
+}
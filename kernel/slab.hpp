@@ -0,0 +1,116 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/cpu.h"
+
+namespace kernel {
+
+// Object cache, slab allocator with per-cpu magazines (Bonwick/Adams).
+// Objects live in 64k slabs taken from the frame allocator and accessed
+// from the linear map. Each cpu keeps two magazines (stacks of free
+// objects) in front of the cache: alloc and free only go to the shared,
+// locked layer (full/empty magazine depot, then the slabs) when both of
+// them are exhausted.
+class SlabCache {
+public:
+    static constexpr int slab_order = 4;
+    static constexpr size_t slab_size = 0x1000ull << slab_order;
+    static constexpr unsigned magazine_rounds = 30;
+
+    constexpr SlabCache(const char* name, size_t size, size_t align, bool use_magazines = true):
+        name{name},
+        object_size{round_up(size < min_object ? min_object : size, align < min_object ? min_object : align)},
+        first_offset{round_up(sizeof(Slab), align < min_object ? min_object : align)},
+        capacity{static_cast<uint32_t>((slab_size - first_offset) / object_size)},
+        use_magazines{use_magazines} {}
+
+    void* alloc();
+    void free(void* object);
+
+    // the cache an object returned by alloc() belongs to, nullptr if it's not slab memory
+    static SlabCache* owner(void* object);
+    // print hit/miss counters of every cache that has been used so far
+    static void dump_stats();
+
+    const char* const name;
+    const size_t object_size;
+
+private:
+    static constexpr size_t min_object = 16;
+    static constexpr size_t round_up(size_t value, size_t align) {
+        return (value + align - 1) / align * align;
+    }
+
+    // header at the start of every slab
+    struct Slab {
+        SlabCache* cache;
+        Slab* next;
+        Slab* prev;
+        void* freelist; // free objects, linked through their first word
+        uint32_t inuse;
+    };
+    struct Magazine {
+        Magazine* next;
+        uint32_t rounds;
+        void* objects[magazine_rounds];
+    };
+    struct alignas(64) CpuCache {
+        Magazine* loaded;
+        Magazine* previous;
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    void* slab_alloc_locked();
+    void slab_free_locked(void* object);
+    Slab* new_slab_locked();
+
+    const size_t first_offset;
+    const uint32_t capacity;
+    const bool use_magazines;
+
+    Spinlock lock;
+    // all following fields are protected by lock
+    Slab* partial = nullptr; // slabs with at least one free object
+    Magazine* full_magazines = nullptr;
+    Magazine* empty_magazines = nullptr;
+    uint64_t slab_count = 0;
+    uint64_t object_count = 0;
+    SlabCache* next_cache = nullptr; // registry of used caches
+    bool registered = false;
+
+    CpuCache cpus[MAX_CPUS] = {};
+
+    static SlabCache magazines;
+    static SlabCache* all_caches;
+    static Spinlock registry_lock;
+};
+
+// Gives T class level operator new/delete served from a cache dedicated to T.
+// T must provide a static constexpr const char* slab_name.
+template<typename T>
+struct SlabObject {
+    static SlabCache& cache() {
+        // constant initialized, no guard needed
+        static SlabCache instance{T::slab_name, sizeof(T), alignof(T)};
+        return instance;
+    }
+    // noexcept: a nullptr from the cache is how new says it's out of
+    // memory, the new expression checks for it before constructing
+    static void* operator new(size_t) noexcept {
+        return cache().alloc();
+    }
+    static void* operator new(size_t, std::align_val_t) noexcept {
+        return cache().alloc();
+    }
+    static void operator delete(void* object) {
+        cache().free(object);
+    }
+    static void operator delete(void* object, std::align_val_t) {
+        cache().free(object);
+    }
+};
+
+}
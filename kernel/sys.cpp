@@ -1,6 +1,65 @@
+#include <string.h>
+#include <kernel/kmalloc.h>
+#include <kernel/tty.h>
 #include "stub.hpp"
 #include "console.hpp"
+#include "printk.hpp"
 #include "arch/x86_64/mmu.h"
+#include "arch/x86_64/multiboot.h"
+#include "arch/x86_64/frames.h"
+#include "arch/x86_64/serial.h"
+#include "arch/x86_64/ioapic.h"
+#include "arch/x86_64/smp.h"
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/idt.h"
+#include "arch/x86_64/syscall.h"
+#include "arch/x86_64/pci.h"
+#include "sched.hpp"
+#include "timer.hpp"
+#include "bench.hpp"
+#include "initrd.hpp"
+#include "elf.hpp"
+
+// true if word appears, space separated, on the kernel command line
+static bool cmdline_has(const MultibootInfo* mbi, const char* word) {
+    if (!(mbi->flags & MultibootInfo::CommandLine)) {
+        return false;
+    }
+    size_t const len = strlen(word);
+    for (auto s = static_cast<const char*>(ptl(mbi->cmdline)); *s;) {
+        while (*s == ' ') {
+            s++;
+        }
+        auto end = s;
+        while (*end && *end != ' ') {
+            end++;
+        }
+        if (size_t(end - s) == len && !memcmp(s, word, len)) {
+            return true;
+        }
+        s = end;
+    }
+    return false;
+}
+
+// every executable under drivers/ in the initrd, as a driver process
+static void load_drivers(MMU& mmu) {
+    uint64_t const start = rdtsc();
+    unsigned loaded = 0;
+    for (auto file = kernel::initrd_next(nullptr); file; file = kernel::initrd_next(file)) {
+        if (file->prefix_length || file->name_length <= 8 || memcmp(file->name, "drivers/", 8)) {
+            continue;
+        }
+        // names shorter than their tar field end with a NUL there
+        const char* const name = file->name[file->name_length] ? "driver" : file->name;
+        if (kernel::spawn_process(mmu, *file, name, kernel::Thread::Class::Driver)) {
+            loaded++;
+        }
+    }
+    if (loaded) {
+        printk(LogLevel::Info, "%d drivers started in %d cycles\n", loaded, rdtsc() - start);
+    }
+}
 
 static inline int kmain(int argc, char const ** argv) {    
     return 0;
@@ -8,13 +67,18 @@ static inline int kmain(int argc, char const ** argv) {
 
 // entry point
 extern "C" {
-void _cstart() {
+[[noreturn]] void _cstart(uint32_t multiboot_info, uint32_t multiboot_magic) {
+    // per-cpu data first, logging and allocators index by cpu
+    smp_init_bsp();
     // notify world we are running High Level 64-bit code
     printxy("Hello from C++64!", 10, 9);
     console.initialize();
     console.disableCursor();
     console.enableCursor();
     console.moveCursor(0,0);
+    if (com1.init()) {
+        console.setMirror([](const char* data, size_t length) { com1.write(data, length); });
+    }
     init_ctors();
     for (int i = 0; i < 25; i++) {
         console.writeString("0x");
@@ -31,6 +95,8 @@ void _cstart() {
     console.printf("About to initialize the new page table structures\n");
     MMU mmu;
     mmu.init_kernel_vspace();
+    console.useLinearMap();
+    printk_drain();
     console.printf("About to switch to the new page table structures. Wish me good luck\n");
 
     mmu.get_kernel_vspace()->switchTo();
@@ -38,8 +104,53 @@ void _cstart() {
     
     // initialize proper terminal and early logging facilities
     // initialize memory manager (allocator)
-    // initialize ipc
+    if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC) {
+        console.printf("Not loaded by a multiboot bootloader (magic %x), no memory map\n", multiboot_magic);
+        // nothing to schedule without memory, and _start64 can't be returned to
+        for (;;) {
+            asm volatile("cli; hlt");
+        }
+    }
+    frame_allocator.init(multiboot_info, mmu.linear_limit());
+    // memory mapped devices we care about (apic, hpet, ...) sit below 4G
+    uint64_t const device_limit = 1ull << 32;
+    mmu.map_linear(frame_allocator.top() > device_limit ? frame_allocator.top() : device_limit);
+    frame_allocator.extend(mmu.linear_limit());
+    printk(LogLevel::Info, "%d MiB of physical memory free\n", frame_allocator.free_frames() * FrameAllocator::frame_size >> 20);
+    fpu_init();
+    idt_init();
+    syscall_init_cpu();
+    mmu.init_faults();
+    // the system suite, indexed in place
+    kernel::initrd_init(multiboot_info);
+    kernel::timer_init();
+    smp_init();
+    // legacy device interrupts: the serial port no longer waits for the
+    // next write to send what's left in its ring (without, it still polls)
+    if (ioapic.init()) {
+        com1.enableInterrupts();
+    }
+    // MSI-X targets cpus by apic id, smp_init found them
+    pci.init();
+    // from here on this is the idle thread of the bootstrap processor: it
+    // gets the cpu back only when there's nothing else to run
+    kernel::sched_init_cpu();
+    asm volatile("sti");
+    printk_drain();
+    kmalloc_stats();
+    if (cmdline_has(static_cast<const MultibootInfo*>(ptl(multiboot_info)), "bench")) {
+        bench_vspace_switch(mmu);
+        bench_memory_routines();
+        bench_scheduler();
+        bench_interrupts();
+        bench_ipc(mmu);
+        bench_futex();
+        bench_demand_paging(mmu);
+    }
     // load system suite processes (drivers)
-
+    load_drivers(mmu);
+    terminal_flush();
+    // like the application processors: idle until there's something to run
+    kernel::sched_idle();
 }
 }
@@ -0,0 +1,75 @@
+#include <kernel/syscall.h>
+#include "ipc.hpp"
+#include "futex.hpp"
+#include "sched.hpp"
+#include "arch/x86_64/syscall.h"
+
+namespace {
+
+// the message registers, in order
+kernel::IpcMessage message_from(const SyscallFrame* frame) {
+    return {{frame->rsi, frame->rdx, frame->r10, frame->r8, frame->r9}};
+}
+
+// a user pointer to a futex word, nullptr if it points into the kernel
+const uint32_t* user_word(uint64_t address) {
+    return address < USER_TOP ? reinterpret_cast<const uint32_t*>(address) : nullptr;
+}
+
+void message_to(SyscallFrame* frame, const kernel::IpcMessage& message) {
+    frame->rsi = message.words[0];
+    frame->rdx = message.words[1];
+    frame->r10 = message.words[2];
+    frame->r8 = message.words[3];
+    frame->r9 = message.words[4];
+}
+
+}
+
+extern "C" void syscall_dispatch(SyscallFrame* frame) {
+    switch (frame->rax) {
+    case SYS_EXIT:
+        kernel::exit();
+    case SYS_YIELD:
+        kernel::yield();
+        frame->rax = SYS_OK;
+        break;
+    case SYS_IPC_CALL: {
+        auto message = message_from(frame);
+        frame->rax = kernel::ipc_call(static_cast<int>(frame->rdi), message);
+        message_to(frame, message);
+        break;
+    }
+    case SYS_IPC_REPLY_WAIT: {
+        auto message = message_from(frame);
+        frame->rax = kernel::ipc_reply_wait(static_cast<int>(frame->rdi), message);
+        message_to(frame, message);
+        break;
+    }
+    case SYS_NOTIFY:
+        frame->rax = kernel::ipc_notify(static_cast<int>(frame->rdi), frame->rsi);
+        break;
+    case SYS_NOTIFY_WAIT:
+        frame->rax = kernel::ipc_notify_wait(static_cast<int>(frame->rdi), frame->rsi);
+        break;
+    case SYS_FUTEX_WAIT: {
+        auto const word = user_word(frame->rdi);
+        frame->rax = word ? kernel::futex_wait(word, static_cast<uint32_t>(frame->rsi), frame->rdx) : int64_t{SYS_BAD_ADDRESS};
+        break;
+    }
+    case SYS_FUTEX_WAKE: {
+        auto const word = user_word(frame->rdi);
+        frame->rax = word ? kernel::futex_wake(word, static_cast<uint32_t>(frame->rsi)) : int64_t{SYS_BAD_ADDRESS};
+        break;
+    }
+    case SYS_FUTEX_REQUEUE: {
+        auto const word = user_word(frame->rdi);
+        auto const target = user_word(frame->rdx);
+        frame->rax = word && target ? kernel::futex_requeue(word, static_cast<uint32_t>(frame->rsi),
+            target, static_cast<uint32_t>(frame->r10), static_cast<uint32_t>(frame->r8)) : int64_t{SYS_BAD_ADDRESS};
+        break;
+    }
+    default:
+        frame->rax = SYS_INVALID;
+    }
+}
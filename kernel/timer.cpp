@@ -0,0 +1,262 @@
+#include "timer.hpp"
+#include "sched.hpp"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/apic.h"
+#include "arch/x86_64/idt.h"
+#include "arch/x86_64/tsc.h"
+#include "printk.hpp"
+
+namespace kernel {
+
+namespace {
+constexpr int unit_shift = 10; // level 0 slots are 1024ns
+constexpr int level_bits = 6;
+constexpr int slots = 1 << level_bits;
+constexpr int levels = 6;
+constexpr uint64_t no_deadline = ~0ull;
+}
+
+class TimerWheel {
+public:
+    void arm(Timer& timer) {
+        LockGuard guard(lock);
+        place(&timer);
+        if (timer.expires < programmed) {
+            program(timer.expires);
+        }
+    }
+
+    void remove_locked(Timer* timer) {
+        int const level = timer->level_slot >> level_bits;
+        int const slot = timer->level_slot & (slots - 1);
+        if (timer->prev) {
+            timer->prev->next = timer->next;
+        } else {
+            buckets[level][slot] = timer->next;
+            if (!timer->next) {
+                occupied[level] &= ~(1ull << slot);
+            }
+        }
+        if (timer->next) {
+            timer->next->prev = timer->prev;
+        }
+        __atomic_store_n(&timer->wheel, static_cast<TimerWheel*>(nullptr), __ATOMIC_RELEASE);
+    }
+
+    // run what expired by now, then arm the apic for what comes next
+    void expire(uint64_t now_ns) {
+        Timer* expired = nullptr;
+        {
+            LockGuard guard(lock);
+            uint64_t const target = now_ns >> unit_shift;
+            for (;;) {
+                uint64_t const event = next_event();
+                if (event > target) {
+                    now = target > now ? target : now;
+                    break;
+                }
+                now = event;
+                // upper level slots that just came up are spread below
+                for (int level = levels - 1; level > 0; level--) {
+                    int const slot = (now >> (level * level_bits)) & (slots - 1);
+                    if (occupied[level] & (1ull << slot)) {
+                        Timer* timer = buckets[level][slot];
+                        buckets[level][slot] = nullptr;
+                        occupied[level] &= ~(1ull << slot);
+                        while (timer) {
+                            Timer* const next = timer->next;
+                            place(timer);
+                            timer = next;
+                        }
+                    }
+                }
+                int const slot = now & (slots - 1);
+                for (Timer* timer = buckets[0][slot]; timer;) {
+                    Timer* const next = timer->next;
+                    if (timer->expires <= now_ns) {
+                        // before it leaves the wheel: cancel() looks in that order
+                        __atomic_store_n(&timer->running, true, __ATOMIC_RELAXED);
+                        remove_locked(timer);
+                        timer->next = expired;
+                        expired = timer;
+                    }
+                    timer = next;
+                }
+                // only the slot of now can still hold timers due later
+                if (event == target) {
+                    break;
+                }
+            }
+            programmed = no_deadline;
+        }
+        while (expired) {
+            Timer* const timer = expired;
+            expired = timer->next;
+            timer->callback(*timer, timer->context);
+            __atomic_store_n(&timer->running, false, __ATOMIC_RELEASE);
+        }
+        LockGuard guard(lock);
+        uint64_t const deadline = next_deadline();
+        if (deadline != no_deadline && deadline < programmed) {
+            program(deadline);
+        }
+    }
+
+    Spinlock lock;
+
+private:
+    // link a timer in the slot its expiry falls in, relative to now
+    void place(Timer* timer) {
+        uint64_t unit = timer->expires >> unit_shift;
+        if (unit < now) {
+            unit = now;
+        }
+        int level = 0;
+        uint64_t slot_number = unit;
+        for (; level < levels; level++) {
+            slot_number = unit >> (level * level_bits);
+            if (slot_number - (now >> (level * level_bits)) < slots) {
+                break;
+            }
+        }
+        if (level == levels) {
+            // too far out: the last slot of the top level, placed again from there
+            level = levels - 1;
+            slot_number = (now >> (level * level_bits)) + slots - 1;
+        }
+        int const slot = slot_number & (slots - 1);
+        timer->level_slot = level << level_bits | slot;
+        timer->prev = nullptr;
+        timer->next = buckets[level][slot];
+        if (timer->next) {
+            timer->next->prev = timer;
+        }
+        buckets[level][slot] = timer;
+        occupied[level] |= 1ull << slot;
+        __atomic_store_n(&timer->wheel, this, __ATOMIC_RELEASE);
+    }
+
+    // in units: when the first slot in use at level comes up, ~0 if none is
+    uint64_t level_event(int level) {
+        if (!occupied[level]) {
+            return no_deadline;
+        }
+        int const shift = level * level_bits;
+        int const current = (now >> shift) & (slots - 1);
+        uint64_t const rotated = occupied[level] >> current | (current ? occupied[level] << (slots - current) : 0);
+        return ((now >> shift) + __builtin_ctzll(rotated)) << shift;
+    }
+
+    uint64_t next_event() {
+        uint64_t event = no_deadline;
+        for (int level = 0; level < levels; level++) {
+            uint64_t const e = level_event(level);
+            event = e < event ? e : event;
+        }
+        return event;
+    }
+
+    // in ns: the earliest expiry in the first level 0 slot in use, or an
+    // upper level slot coming up before that
+    uint64_t next_deadline() {
+        uint64_t deadline = no_deadline;
+        uint64_t const first = level_event(0);
+        if (first != no_deadline) {
+            for (Timer* timer = buckets[0][first & (slots - 1)]; timer; timer = timer->next) {
+                deadline = timer->expires < deadline ? timer->expires : deadline;
+            }
+        }
+        for (int level = 1; level < levels; level++) {
+            uint64_t const event = level_event(level);
+            if (event != no_deadline && (event << unit_shift) < deadline) {
+                deadline = event << unit_shift;
+            }
+        }
+        return deadline;
+    }
+
+    void program(uint64_t deadline) {
+        programmed = deadline;
+        if (lapic.present()) {
+            lapic.arm_timer(ktime_to_tsc(deadline));
+        }
+    }
+
+    uint64_t now = 0; // in units, everything before has been run
+    uint64_t programmed = no_deadline; // what the apic is armed for, in ns
+    uint64_t occupied[levels] = {};
+    Timer* buckets[levels][slots] = {};
+};
+
+namespace {
+
+TimerWheel wheels[MAX_CPUS];
+
+void timer_interrupt(InterruptFrame&, void*) {
+    lapic.eoi();
+    wheels[cpu_index()].expire(ktime_ns());
+}
+
+}
+
+void Timer::arm(uint64_t when) {
+    IrqGuard irq;
+    remove();
+    expires = when;
+    wheels[cpu_index()].arm(*this);
+}
+
+bool Timer::cancel() {
+    if (remove()) {
+        return true;
+    }
+    // it fired: the callback may still be using what the caller is about to free
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    return false;
+}
+
+bool Timer::remove() {
+    for (;;) {
+        TimerWheel* const owner = __atomic_load_n(&wheel, __ATOMIC_ACQUIRE);
+        if (!owner) {
+            return false;
+        }
+        LockGuard guard(owner->lock);
+        // it may have fired, or moved, while we took the lock
+        if (wheel == owner) {
+            owner->remove_locked(this);
+            return true;
+        }
+    }
+}
+
+void timer_init() {
+    tsc_init();
+    interrupt_attach(VECTOR_TIMER, timer_interrupt);
+}
+
+void timer_init_cpu() {
+    if (!lapic.present()) {
+        printk(LogLevel::Warning, "no local apic, timers won't fire\n");
+        return;
+    }
+    lapic.init_timer(VECTOR_TIMER);
+}
+
+void sleep_ns(uint64_t ns) {
+    uint64_t const deadline = ktime_ns() + ns;
+    Timer timer{[](Timer&, void* thread) {
+        static_cast<Thread*>(thread)->wake();
+    }, Thread::current()};
+    timer.arm(deadline);
+    // wakeups meant for something else end the block too
+    while (ktime_ns() < deadline) {
+        block();
+    }
+    timer.cancel();
+}
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+
+namespace kernel {
+
+class TimerWheel;
+
+// Kernel timers, tickless. Each cpu keeps its pending timers in a
+// hierarchical timing wheel (Varghese and Lauck): 6 levels of 64 slots,
+// slots of 1.024us at level 0 and 64 times wider at each level up, about
+// 19 hours in all (later timers wait in the last slot and are placed again
+// when it comes up). Inserting and cancelling are O(1): a slot is a doubly
+// linked list, and each level has a bitmap of the slots in use.
+//
+// There is no periodic tick: the local APIC timer is armed for the next
+// thing the wheel has to do, the earliest expiry of the first level 0
+// slot in use or the time a slot of an upper level has to be spread over
+// the levels below. Timers fire at their exact expiry, not at slot
+// boundaries, and a cpu without timers takes no timer interrupts.
+//
+// Callbacks run in the timer interrupt of the cpu that armed the timer.
+class Timer {
+public:
+    using Callback = void (*)(Timer& timer, void* context);
+
+    constexpr Timer(Callback callback = nullptr, void* context = nullptr): callback{callback}, context{context} {}
+
+    // fire once ktime_ns() reaches expires, on the calling cpu. Moves a
+    // pending timer
+    void arm(uint64_t expires);
+    // false if it wasn't pending: it already fired or was never armed.
+    // Waits for a callback running on another cpu, so that the timer can be
+    // freed afterwards. Not for the callback itself, which may re-arm the
+    // timer but not free it
+    bool cancel();
+    bool pending() const {
+        return __atomic_load_n(&wheel, __ATOMIC_ACQUIRE) != nullptr;
+    }
+
+    uint64_t expires = 0; // ktime_ns
+    Callback callback;
+    void* context;
+
+private:
+    friend class TimerWheel;
+    Timer* next = nullptr;
+    Timer* prev = nullptr;
+    TimerWheel* wheel = nullptr; // the one it's pending on
+    uint16_t level_slot = 0; // where in it: level << 6 | slot
+    bool running = false; // the callback, after it left the wheel
+
+    // cancel without waiting for the callback
+    bool remove();
+};
+
+// calibrate the clock and install the timer interrupt, before the cpus start
+void timer_init();
+// set up the apic timer of the calling cpu
+void timer_init_cpu();
+// block the calling thread for at least ns nanoseconds
+void sleep_ns(uint64_t ns);
+
+}
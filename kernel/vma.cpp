@@ -0,0 +1,427 @@
+#include <new>
+#include "vma.hpp"
+#include "arch/x86_64/cpu.h"
+
+namespace kernel {
+
+namespace {
+
+// per cpu, odd while the cpu is in a lookup
+struct alignas(64) ReaderState {
+    uint64_t sequence;
+};
+ReaderState readers[MAX_CPUS];
+
+// interrupts stay off for the whole lookup: no switch, no migration
+class ReadSection {
+    IrqGuard irq;
+    uint64_t& sequence;
+public:
+    ReadSection(): sequence{readers[cpu_index()].sequence} {
+        __atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+        // the mark is visible before we load the root
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    ~ReadSection() {
+        __atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
+    }
+    ReadSection(const ReadSection&) = delete;
+    ReadSection& operator = (const ReadSection&) = delete;
+};
+
+// wait for the lookups that may have loaded a root we replaced. Those that
+// start later find the new one
+void synchronize() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned const self = cpu_index();
+    for (unsigned cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint64_t const seen = __atomic_load_n(&readers[cpu].sequence, __ATOMIC_ACQUIRE);
+        if (cpu == self || !(seen & 1)) {
+            continue;
+        }
+        while (__atomic_load_n(&readers[cpu].sequence, __ATOMIC_ACQUIRE) == seen) {
+            asm volatile("pause");
+        }
+    }
+}
+
+}
+
+bool VmaTree::mergeable(const Vma& low, const Vma& high) {
+    if (low.end != high.start || low.flags != high.flags) {
+        return false;
+    }
+    return low.backing ? low.backing + (low.end - low.start) == high.backing : !high.backing;
+}
+
+VmaTree::Summary VmaTree::summarize(const Node* node) {
+    Summary summary{};
+    for (int i = 0; i < node->count; i++) {
+        uint64_t const start = node->leaf ? node->vmas[i].start : node->summaries[i].start;
+        uint64_t const end = node->leaf ? node->vmas[i].end : node->summaries[i].end;
+        if (i == 0) {
+            summary.start = start;
+        } else if (start - summary.end > summary.gap) {
+            summary.gap = start - summary.end;
+        }
+        if (!node->leaf && node->summaries[i].gap > summary.gap) {
+            summary.gap = node->summaries[i].gap;
+        }
+        summary.end = end;
+    }
+    return summary;
+}
+
+bool VmaTree::first_ending_after(uint64_t address, Vma& vma) const {
+    const Node* node = __atomic_load_n(&root, __ATOMIC_ACQUIRE);
+    if (!node) {
+        return false;
+    }
+    // mappings don't overlap: sorted by start, they are sorted by end too
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->count && node->summaries[i].end <= address) {
+            i++;
+        }
+        if (i == node->count) {
+            return false;
+        }
+        node = node->children[i];
+    }
+    for (int i = 0; i < node->count; i++) {
+        if (node->vmas[i].end > address) {
+            vma = node->vmas[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool VmaTree::find(uint64_t address, Vma& vma) const {
+    ReadSection section;
+    return first_ending_after(address, vma) && vma.start <= address;
+}
+
+bool VmaTree::overlaps(uint64_t start, uint64_t end) const {
+    ReadSection section;
+    Vma vma;
+    return first_ending_after(start, vma) && vma.start < end;
+}
+
+// cursor is where the hole we are looking for may start, nothing below it
+// is free. Moves past what the node maps
+uint64_t VmaTree::gap_in(const Node* node, uint64_t& cursor, uint64_t len, uint64_t high) {
+    for (int i = 0; i < node->count; i++) {
+        if (cursor >= high || high - cursor < len) {
+            return 0;
+        }
+        uint64_t const start = node->leaf ? node->vmas[i].start : node->summaries[i].start;
+        uint64_t const end = node->leaf ? node->vmas[i].end : node->summaries[i].end;
+        if (start >= cursor && start - cursor >= len) {
+            return cursor;
+        }
+        // the holes inside a child are no bigger than its gap
+        if (!node->leaf && end > cursor && node->summaries[i].gap >= len) {
+            uint64_t const found = gap_in(node->children[i], cursor, len, high);
+            if (found) {
+                return found;
+            }
+        }
+        if (end > cursor) {
+            cursor = end;
+        }
+    }
+    return 0;
+}
+
+uint64_t VmaTree::find_gap(uint64_t len, uint64_t low, uint64_t high) const {
+    if (!len || low >= high) {
+        return 0;
+    }
+    ReadSection section;
+    uint64_t cursor = low;
+    if (const Node* node = __atomic_load_n(&root, __ATOMIC_ACQUIRE)) {
+        uint64_t const found = gap_in(node, cursor, len, high);
+        if (found) {
+            return found;
+        }
+    }
+    // after the last mapping
+    return cursor < high && high - cursor >= len ? cursor : 0;
+}
+
+void VmaTree::free_node(Node* node) {
+    Node::cache().free(node);
+}
+
+void VmaTree::free_tree(Node* node) {
+    if (!node->leaf) {
+        for (int i = 0; i < node->count; i++) {
+            free_tree(node->children[i]);
+        }
+    }
+    free_node(node);
+}
+
+bool VmaTree::reserve(int nodes) {
+    while (pooled < nodes) {
+        void* const memory = Node::cache().alloc();
+        if (!memory) {
+            return false;
+        }
+        auto const node = ::new (memory) Node();
+        node->next = pool;
+        pool = node;
+        pooled++;
+    }
+    return true;
+}
+
+VmaTree::Node* VmaTree::take(bool leaf) {
+    Node* const node = pool;
+    pool = node->next;
+    pooled--;
+    node->leaf = leaf;
+    node->count = 0;
+    node->next = nullptr;
+    return node;
+}
+
+void VmaTree::retire(Node* node) {
+    node->next = retired;
+    retired = node;
+}
+
+VmaTree::Change VmaTree::insert_in(Node* node, const Vma& vma) {
+    retire(node);
+    if (node->leaf) {
+        Vma vmas[fanout + 1];
+        int n = 0;
+        for (int i = 0; i < node->count; i++) {
+            if (n == i && vma.start < node->vmas[i].start) {
+                vmas[n++] = vma;
+            }
+            vmas[n++] = node->vmas[i];
+        }
+        if (n == node->count) {
+            vmas[n++] = vma;
+        }
+        // split in halves when it doesn't fit
+        int const first_count = n <= fanout ? n : n / 2;
+        Change change{take(true), n > fanout ? take(true) : nullptr};
+        for (int i = 0; i < n; i++) {
+            Node* const target = i < first_count ? change.first : change.second;
+            target->vmas[target->count++] = vmas[i];
+        }
+        return change;
+    }
+    // the last child starting at or before it, or the first one
+    int index = 0;
+    while (index + 1 < node->count && node->summaries[index + 1].start <= vma.start) {
+        index++;
+    }
+    Change const below = insert_in(node->children[index], vma);
+    Node* children[fanout + 1];
+    Summary summaries[fanout + 1];
+    int n = 0;
+    for (int i = 0; i < node->count; i++) {
+        if (i != index) {
+            summaries[n] = node->summaries[i];
+            children[n++] = node->children[i];
+            continue;
+        }
+        summaries[n] = summarize(below.first);
+        children[n++] = below.first;
+        if (below.second) {
+            summaries[n] = summarize(below.second);
+            children[n++] = below.second;
+        }
+    }
+    int const first_count = n <= fanout ? n : n / 2;
+    Change change{take(false), n > fanout ? take(false) : nullptr};
+    for (int i = 0; i < n; i++) {
+        Node* const target = i < first_count ? change.first : change.second;
+        target->summaries[target->count] = summaries[i];
+        target->children[target->count++] = children[i];
+    }
+    return change;
+}
+
+VmaTree::Change VmaTree::erase_in(Node* node, uint64_t start) {
+    retire(node);
+    Node* replacement = nullptr;
+    if (node->leaf) {
+        if (node->count > 1) {
+            replacement = take(true);
+            for (int i = 0; i < node->count; i++) {
+                if (node->vmas[i].start != start) {
+                    replacement->vmas[replacement->count++] = node->vmas[i];
+                }
+            }
+        }
+        return {replacement, nullptr};
+    }
+    int index = 0;
+    while (index + 1 < node->count && node->summaries[index + 1].start <= start) {
+        index++;
+    }
+    Change const below = erase_in(node->children[index], start);
+    if (below.first || node->count > 1) {
+        replacement = take(false);
+        for (int i = 0; i < node->count; i++) {
+            Node* const child = i == index ? below.first : node->children[i];
+            if (child) {
+                replacement->summaries[replacement->count] = i == index ? summarize(child) : node->summaries[i];
+                replacement->children[replacement->count++] = child;
+            }
+        }
+    }
+    return {replacement, nullptr};
+}
+
+void VmaTree::publish(Node* new_root) {
+    __atomic_store_n(&root, new_root, __ATOMIC_RELEASE);
+    __atomic_store_n(&changes, changes + 1, __ATOMIC_RELEASE);
+}
+
+void VmaTree::insert_one(const Vma& vma) {
+    if (!root) {
+        Node* const leaf = take(true);
+        leaf->vmas[leaf->count++] = vma;
+        height = 1;
+        count++;
+        publish(leaf);
+        return;
+    }
+    Change const change = insert_in(root, vma);
+    Node* new_root = change.first;
+    if (change.second) {
+        new_root = take(false);
+        new_root->summaries[0] = summarize(change.first);
+        new_root->children[0] = change.first;
+        new_root->summaries[1] = summarize(change.second);
+        new_root->children[1] = change.second;
+        new_root->count = 2;
+        height++;
+    }
+    count++;
+    publish(new_root);
+}
+
+void VmaTree::erase_one(uint64_t start) {
+    Node* new_root = erase_in(root, start).first;
+    // a root with a single child is a level too many. Nobody saw it yet
+    while (new_root && !new_root->leaf && new_root->count == 1) {
+        Node* const child = new_root->children[0];
+        free_node(new_root);
+        new_root = child;
+        height--;
+    }
+    if (!new_root) {
+        height = 0;
+    }
+    count--;
+    publish(new_root);
+}
+
+void VmaTree::reclaim() {
+    if (retired) {
+        synchronize();
+        while (retired) {
+            Node* const node = retired;
+            retired = node->next;
+            free_node(node);
+        }
+    }
+    while (pool) {
+        Node* const node = pool;
+        pool = node->next;
+        free_node(node);
+    }
+    pooled = 0;
+}
+
+bool VmaTree::insert(const Vma& vma) {
+    Vma neighbour;
+    if (vma.start >= vma.end || (first_ending_after(vma.start, neighbour) && neighbour.start < vma.end)) {
+        return false;
+    }
+    if (!reserve(2 * nodes_to_erase() + nodes_to_insert())) {
+        reclaim();
+        return false;
+    }
+    Vma merged = vma;
+    // the mappings ending right where it starts and starting where it ends
+    if (merged.start && first_ending_after(merged.start - 1, neighbour) && mergeable(neighbour, merged)) {
+        erase_one(neighbour.start);
+        merged.start = neighbour.start;
+        merged.backing = neighbour.backing;
+    }
+    if (first_ending_after(merged.end, neighbour) && mergeable(merged, neighbour)) {
+        erase_one(neighbour.start);
+        merged.end = neighbour.end;
+    }
+    insert_one(merged);
+    reclaim();
+    return true;
+}
+
+bool VmaTree::remove(uint64_t start, uint64_t end) {
+    Vma vma;
+    bool ok = true;
+    while (first_ending_after(start, vma) && vma.start < end) {
+        // the mapping may be split in two
+        if (!reserve(nodes_to_erase() + 2 * nodes_to_insert() + 2)) {
+            ok = false;
+            break;
+        }
+        erase_one(vma.start);
+        if (vma.start < start) {
+            insert_one({vma.start, start, vma.flags, vma.backing});
+        }
+        if (vma.end > end) {
+            insert_one({end, vma.end, vma.flags, vma.backing ? vma.backing + (end - vma.start) : 0});
+            break;
+        }
+    }
+    reclaim();
+    return ok;
+}
+
+VmaTree::Node* VmaTree::copy_node(const Node* node) {
+    void* const memory = Node::cache().alloc();
+    if (!memory) {
+        return nullptr;
+    }
+    auto const copy = ::new (memory) Node(*node);
+    copy->next = nullptr;
+    if (node->leaf) {
+        return copy;
+    }
+    for (int i = 0; i < node->count; i++) {
+        copy->children[i] = copy_node(node->children[i]);
+        if (!copy->children[i]) {
+            // undo the children copied so far, nobody saw them
+            copy->count = i;
+            free_tree(copy);
+            return nullptr;
+        }
+    }
+    return copy;
+}
+
+bool VmaTree::copy(const VmaTree& other) {
+    if (root || !other.root) {
+        return !root;
+    }
+    Node* const copy = copy_node(other.root);
+    if (!copy) {
+        return false;
+    }
+    height = other.height;
+    count = other.count;
+    publish(copy);
+    return true;
+}
+
+}
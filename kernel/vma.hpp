@@ -0,0 +1,139 @@
+#pragma once
+#include <cstdint>
+#include "slab.hpp"
+
+namespace kernel {
+
+// A mapping of an address space: [start, end), page aligned, with its
+// MMU::MapFlags. Anonymous in the flags means demand zero memory, whose
+// pages only exist once touched. A backing address means the same for
+// memory the space doesn't own (initrd files): start is mapped to it on
+// first touch, the next page to the next frame and so on.
+struct Vma {
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags;
+    uint64_t backing = 0; // physical
+};
+
+// The mappings of an address space, indexed by address. A B+tree whose
+// nodes never change once other cpus can reach them: a writer copies the
+// path from the leaf it changes up to the root and publishes the new root,
+// so lookups take no lock and see either the old tree or the new one.
+// Replaced nodes are freed once every lookup that might still be reading
+// them is over (lookups run with interrupts off, and mark their cpu busy
+// meanwhile: RCU in miniature).
+//
+// Writers are serialized by the owner of the tree (PML4T::lock). Internal
+// nodes know, for each child, the range it covers and the largest gap
+// between the mappings inside it, so looking for room for a new mapping is
+// O(log n) like the lookups. Underfull nodes are left alone, empty ones are
+// dropped.
+class VmaTree {
+public:
+    constexpr VmaTree() = default;
+
+    // lookups, lockless
+    // the mapping that contains address
+    bool find(uint64_t address, Vma& vma) const;
+    // something mapped in [start, end)?
+    bool overlaps(uint64_t start, uint64_t end) const;
+    // lowest address in [low, high) followed by len unmapped bytes, 0 if none
+    uint64_t find_gap(uint64_t len, uint64_t low, uint64_t high) const;
+    // bumped by every change: a lookup done without the writers' lock still
+    // holds under it if this didn't move meanwhile
+    uint64_t version() const {
+        return __atomic_load_n(&changes, __ATOMIC_ACQUIRE);
+    }
+
+    // writers. False when out of memory, and for insert also when the
+    // range is taken. insert merges the new mapping with the ones it
+    // touches, if they have the same flags and backing that follows on
+    bool insert(const Vma& vma);
+    // unmap [start, end), trimming the mappings across the edges
+    bool remove(uint64_t start, uint64_t end);
+    // the same mappings as other, into an empty tree
+    bool copy(const VmaTree& other);
+    // in address order. Writers only
+    template<typename F>
+    void for_each(F fn) const {
+        if (root) {
+            walk(root, fn);
+        }
+    }
+    uint64_t size() const { return count; }
+
+private:
+    static constexpr int fanout = 16;
+    static constexpr int max_depth = 16;
+
+    // what an internal node knows of a child
+    struct Summary {
+        uint64_t start; // of the first mapping
+        uint64_t end; // of the last one
+        uint64_t gap; // largest hole between two of its mappings
+    };
+    struct Node: SlabObject<Node> {
+        static constexpr const char* slab_name = "vma-node";
+        bool leaf;
+        uint8_t count;
+        Node* next; // in the pool, or retired
+        Vma vmas[fanout]; // leaves
+        Node* children[fanout]; // internal nodes
+        Summary summaries[fanout];
+    };
+    // a changed subtree: its new root (nullptr if it's now empty), and a
+    // second node when it split
+    struct Change {
+        Node* first;
+        Node* second;
+    };
+
+    template<typename F>
+    static void walk(const Node* node, F& fn) {
+        for (int i = 0; i < node->count; i++) {
+            if (node->leaf) {
+                fn(node->vmas[i]);
+            } else {
+                walk(node->children[i], fn);
+            }
+        }
+    }
+
+    // can low and high be one mapping
+    static bool mergeable(const Vma& low, const Vma& high);
+    static Summary summarize(const Node* node);
+    static uint64_t gap_in(const Node* node, uint64_t& cursor, uint64_t len, uint64_t high);
+    static Node* copy_node(const Node* node);
+    static void free_node(Node* node);
+    // a subtree no lookup can reach
+    static void free_tree(Node* node);
+
+    // first mapping ending after address
+    bool first_ending_after(uint64_t address, Vma& vma) const;
+    // Updates take their nodes from a pool filled beforehand, so that once
+    // started they can't fail halfway. An update of one mapping needs at
+    // most this many nodes
+    int nodes_to_insert() const { return 2 * height + 1; }
+    int nodes_to_erase() const { return height; }
+    bool reserve(int nodes);
+    Node* take(bool leaf);
+    Change insert_in(Node* node, const Vma& vma);
+    Change erase_in(Node* node, uint64_t start);
+    void insert_one(const Vma& vma);
+    void erase_one(uint64_t start);
+    void publish(Node* new_root);
+    void retire(Node* node);
+    // free the replaced nodes once no lookup can see them, and the pool
+    void reclaim();
+
+    Node* root = nullptr;
+    Node* retired = nullptr;
+    Node* pool = nullptr;
+    int pooled = 0;
+    int height = 0; // 0 when empty, 1 for a single leaf
+    uint64_t count = 0;
+    uint64_t changes = 0;
+};
+
+}
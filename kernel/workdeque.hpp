@@ -0,0 +1,116 @@
+#pragma once
+#include <cstdint>
+#include <kernel/kmalloc.h>
+
+namespace kernel {
+
+// Chase-Lev work stealing deque, with the memory orderings of Lê et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP '13).
+// The owner pushes and takes at the bottom without atomic read-modify-write
+// operations, except to race a thief for the last item. Thieves steal from
+// the top with a CAS. T must be a pointer or an integer, nullptr/0 is
+// "nothing".
+//
+// The array starts inside the deque and doubles when full. A thief may
+// still be reading an old array after the owner grew it, so old arrays are
+// never freed: they add up to less than the current one.
+template<typename T, unsigned initial_capacity = 64>
+class WorkDeque {
+    static_assert((initial_capacity & (initial_capacity - 1)) == 0, "capacity must be a power of two");
+public:
+    // owner only. False if the array needed to grow and there was no memory
+    bool push(T item) {
+        int64_t const b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+        int64_t const t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+        Array* a = __atomic_load_n(&array, __ATOMIC_RELAXED);
+        if (b - t > int64_t(a->mask)) {
+            a = grow(a, t, b);
+            if (!a) {
+                return false;
+            }
+        }
+        __atomic_store_n(&a->items[b & a->mask], item, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    // owner only, last pushed first
+    T take() {
+        int64_t const b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+        Array* const a = __atomic_load_n(&array, __ATOMIC_RELAXED);
+        __atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int64_t t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+        if (t > b) {
+            // empty
+            __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+            return T{};
+        }
+        T item = __atomic_load_n(&a->items[b & a->mask], __ATOMIC_RELAXED);
+        if (t == b) {
+            // last one, a thief might be after it too
+            if (!__atomic_compare_exchange_n(&top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                item = T{};
+            }
+            __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+        }
+        return item;
+    }
+
+    // any cpu, first pushed first. Nothing if empty or if another thief
+    // (or the owner) won the race for the item
+    T steal() {
+        int64_t t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int64_t const b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+        if (t >= b) {
+            return T{};
+        }
+        // consume, really: the array pointer carries the dependency
+        Array* const a = __atomic_load_n(&array, __ATOMIC_ACQUIRE);
+        T const item = __atomic_load_n(&a->items[t & a->mask], __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return T{};
+        }
+        return item;
+    }
+
+    // racy, for load balancing hints only
+    int64_t size() const {
+        int64_t const n = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - __atomic_load_n(&top, __ATOMIC_RELAXED);
+        return n > 0 ? n : 0;
+    }
+
+private:
+    struct Array {
+        uint64_t mask;
+        T* items;
+        Array* retired; // the array this one replaced
+    };
+
+    Array* grow(Array* old, int64_t t, int64_t b) {
+        uint64_t const capacity = (old->mask + 1) * 2;
+        auto a = static_cast<Array*>(kmalloc(sizeof(Array) + capacity * sizeof(T)));
+        if (!a) {
+            return nullptr;
+        }
+        a->mask = capacity - 1;
+        a->items = reinterpret_cast<T*>(a + 1);
+        a->retired = old;
+        for (int64_t i = t; i < b; i++) {
+            a->items[i & a->mask] = __atomic_load_n(&old->items[i & old->mask], __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&array, a, __ATOMIC_RELEASE);
+        return a;
+    }
+
+    // thieves hammer top, keep it away from the owner's bottom
+    alignas(64) int64_t top = 0;
+    alignas(64) int64_t bottom = 0;
+    Array* array = &initial;
+    Array initial{initial_capacity - 1, initial_items, nullptr};
+    T initial_items[initial_capacity] = {};
+};
+
+}
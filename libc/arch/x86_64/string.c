@@ -0,0 +1,286 @@
+#include <string.h>
+#include <stdint.h>
+
+// x86_64 versions of the string.h routines.
+// Up to 64 bytes, copies and fills are done inline by size class, with
+// overlapping unaligned loads and stores (everything is loaded before
+// anything is stored, so they are also good for memmove). Bigger ones go
+// through copy_large/fill_large, picked from cpuid the first time they are
+// needed: rep movsb/stosb when the cpu has fast strings, 16 byte SSE2 loops
+// otherwise. SSE2 is part of x86_64, no need to check for it.
+
+typedef unsigned char v16 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef unsigned char v16a __attribute__((vector_size(16), may_alias));
+typedef char v16qi __attribute__((vector_size(16)));
+typedef uint64_t u64 __attribute__((aligned(1), may_alias));
+typedef uint32_t u32 __attribute__((aligned(1), may_alias));
+typedef uint16_t u16 __attribute__((aligned(1), may_alias));
+
+#define LOAD(type, p) (*(const type*)(p))
+#define STORE(type, p, value) (*(type*)(p) = (value))
+
+// below this rep movsb/stosb startup cost is more than what they save
+#define ERMS_THRESHOLD 512
+
+static inline unsigned movemask(v16 value) {
+	return __builtin_ia32_pmovmskb128((v16qi) value);
+}
+
+enum {
+	cpu_erms = 1 << 0, // enhanced rep movsb/stosb
+	cpu_fsrm = 1 << 1, // fast short rep movsb
+};
+
+static unsigned cpu_string_features(void) {
+	uint32_t eax = 0, ebx, ecx = 0, edx;
+	__asm__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+	if (eax < 7)
+		return 0;
+	eax = 7;
+	ecx = 0;
+	__asm__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+	return (ebx & (1 << 9) ? cpu_erms : 0) | (edx & (1 << 4) ? cpu_fsrm : 0);
+}
+
+static inline void copy_upto64(unsigned char* d, const unsigned char* s, size_t n) {
+	if (n > 32) {
+		v16 a = LOAD(v16, s), b = LOAD(v16, s + 16);
+		v16 c = LOAD(v16, s + n - 32), e = LOAD(v16, s + n - 16);
+		STORE(v16, d, a);
+		STORE(v16, d + 16, b);
+		STORE(v16, d + n - 32, c);
+		STORE(v16, d + n - 16, e);
+	} else if (n > 16) {
+		v16 a = LOAD(v16, s), b = LOAD(v16, s + n - 16);
+		STORE(v16, d, a);
+		STORE(v16, d + n - 16, b);
+	} else if (n >= 8) {
+		uint64_t a = LOAD(u64, s), b = LOAD(u64, s + n - 8);
+		STORE(u64, d, a);
+		STORE(u64, d + n - 8, b);
+	} else if (n >= 4) {
+		uint32_t a = LOAD(u32, s), b = LOAD(u32, s + n - 4);
+		STORE(u32, d, a);
+		STORE(u32, d + n - 4, b);
+	} else if (n >= 2) {
+		uint16_t a = LOAD(u16, s), b = LOAD(u16, s + n - 2);
+		STORE(u16, d, a);
+		STORE(u16, d + n - 2, b);
+	} else if (n) {
+		*d = *s;
+	}
+}
+
+static inline void fill_upto64(unsigned char* d, unsigned char value, size_t n) {
+	if (n > 16) {
+		v16 v = (v16) {} + value;
+		STORE(v16, d, v);
+		STORE(v16, d + n - 16, v);
+		if (n > 32) {
+			STORE(v16, d + 16, v);
+			STORE(v16, d + n - 32, v);
+		}
+		return;
+	}
+	uint64_t v = 0x0101010101010101ull * value;
+	if (n >= 8) {
+		STORE(u64, d, v);
+		STORE(u64, d + n - 8, v);
+	} else if (n >= 4) {
+		STORE(u32, d, (uint32_t) v);
+		STORE(u32, d + n - 4, (uint32_t) v);
+	} else if (n >= 2) {
+		STORE(u16, d, (uint16_t) v);
+		STORE(u16, d + n - 2, (uint16_t) v);
+	} else if (n) {
+		*d = value;
+	}
+}
+
+// n > 64. Also fine for overlapping buffers when d < s
+static void copy_sse2(unsigned char* d, const unsigned char* s, size_t n) {
+	v16 head = LOAD(v16, s);
+	v16 t0 = LOAD(v16, s + n - 64), t1 = LOAD(v16, s + n - 48);
+	v16 t2 = LOAD(v16, s + n - 32), t3 = LOAD(v16, s + n - 16);
+	unsigned char* const start = d;
+	unsigned char* const end = d + n;
+	// the head covers the bytes skipped to align the destination
+	size_t skew = 16 - ((uintptr_t) d & 15);
+	d += skew;
+	s += skew;
+	for (; end - d > 64; d += 64, s += 64) {
+		v16 a = LOAD(v16, s), b = LOAD(v16, s + 16), c = LOAD(v16, s + 32), e = LOAD(v16, s + 48);
+		STORE(v16a, d, a);
+		STORE(v16a, d + 16, b);
+		STORE(v16a, d + 32, c);
+		STORE(v16a, d + 48, e);
+	}
+	STORE(v16, end - 64, t0);
+	STORE(v16, end - 48, t1);
+	STORE(v16, end - 32, t2);
+	STORE(v16, end - 16, t3);
+	STORE(v16, start, head);
+}
+
+// n > 64, d > s
+static void move_backward_sse2(unsigned char* d, const unsigned char* s, size_t n) {
+	v16 h0 = LOAD(v16, s), h1 = LOAD(v16, s + 16), h2 = LOAD(v16, s + 32), h3 = LOAD(v16, s + 48);
+	for (; n > 64; n -= 64) {
+		v16 a = LOAD(v16, s + n - 64), b = LOAD(v16, s + n - 48);
+		v16 c = LOAD(v16, s + n - 32), e = LOAD(v16, s + n - 16);
+		STORE(v16, d + n - 64, a);
+		STORE(v16, d + n - 48, b);
+		STORE(v16, d + n - 32, c);
+		STORE(v16, d + n - 16, e);
+	}
+	STORE(v16, d, h0);
+	STORE(v16, d + 16, h1);
+	STORE(v16, d + 32, h2);
+	STORE(v16, d + 48, h3);
+}
+
+static inline void rep_movsb(unsigned char* d, const unsigned char* s, size_t n) {
+	__asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+
+static void copy_erms(unsigned char* d, const unsigned char* s, size_t n) {
+	if (n < ERMS_THRESHOLD)
+		copy_sse2(d, s, n);
+	else
+		rep_movsb(d, s, n);
+}
+
+static void copy_fsrm(unsigned char* d, const unsigned char* s, size_t n) {
+	rep_movsb(d, s, n);
+}
+
+// n > 64
+static void fill_sse2(unsigned char* d, unsigned char value, size_t n) {
+	v16 v = (v16) {} + value;
+	unsigned char* const end = d + n;
+	STORE(v16, d, v);
+	d += 16 - ((uintptr_t) d & 15);
+	for (; end - d > 64; d += 64) {
+		STORE(v16a, d, v);
+		STORE(v16a, d + 16, v);
+		STORE(v16a, d + 32, v);
+		STORE(v16a, d + 48, v);
+	}
+	STORE(v16, end - 64, v);
+	STORE(v16, end - 48, v);
+	STORE(v16, end - 32, v);
+	STORE(v16, end - 16, v);
+}
+
+static void fill_erms(unsigned char* d, unsigned char value, size_t n) {
+	if (n < ERMS_THRESHOLD)
+		fill_sse2(d, value, n);
+	else
+		__asm__ volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(value) : "memory");
+}
+
+static void copy_resolve(unsigned char* d, const unsigned char* s, size_t n);
+static void fill_resolve(unsigned char* d, unsigned char value, size_t n);
+static void (*copy_large)(unsigned char*, const unsigned char*, size_t) = copy_resolve;
+static void (*fill_large)(unsigned char*, unsigned char, size_t) = fill_resolve;
+
+// runs once, on the first big copy or fill
+static void select_routines(void) {
+	unsigned features = cpu_string_features();
+	copy_large = features & cpu_fsrm ? copy_fsrm : features & cpu_erms ? copy_erms : copy_sse2;
+	fill_large = features & cpu_erms ? fill_erms : fill_sse2;
+}
+
+static void copy_resolve(unsigned char* d, const unsigned char* s, size_t n) {
+	select_routines();
+	copy_large(d, s, n);
+}
+
+static void fill_resolve(unsigned char* d, unsigned char value, size_t n) {
+	select_routines();
+	fill_large(d, value, n);
+}
+
+void* memcpy(void* restrict dstptr, const void* restrict srcptr, size_t size) {
+	if (size <= 64)
+		copy_upto64(dstptr, srcptr, size);
+	else
+		copy_large(dstptr, srcptr, size);
+	return dstptr;
+}
+
+void* memmove(void* dstptr, const void* srcptr, size_t size) {
+	if (size <= 64)
+		copy_upto64(dstptr, srcptr, size);
+	else if ((uintptr_t) dstptr - (uintptr_t) srcptr >= size)
+		// no overlap, or dst below src: forward copies (rep movsb included) are fine
+		copy_large(dstptr, srcptr, size);
+	else
+		move_backward_sse2(dstptr, srcptr, size);
+	return dstptr;
+}
+
+void* memset(void* bufptr, int value, size_t size) {
+	if (size <= 64)
+		fill_upto64(bufptr, (unsigned char) value, size);
+	else
+		fill_large(bufptr, (unsigned char) value, size);
+	return bufptr;
+}
+
+int memcmp(const void* aptr, const void* bptr, size_t size) {
+	const unsigned char* a = (const unsigned char*) aptr;
+	const unsigned char* b = (const unsigned char*) bptr;
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		unsigned equal = movemask(LOAD(v16, a + i) == LOAD(v16, b + i));
+		if (equal != 0xffff) {
+			i += __builtin_ctz(~equal);
+			return a[i] < b[i] ? -1 : 1;
+		}
+	}
+	if (size - i >= 8) {
+		// big endian makes the first different byte the most significant
+		uint64_t x = __builtin_bswap64(LOAD(u64, a + i)), y = __builtin_bswap64(LOAD(u64, b + i));
+		if (x != y)
+			return x < y ? -1 : 1;
+		i += 8;
+	}
+	for (; i < size; i++) {
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+void* memchr(const void* ptr, int value, size_t size) {
+	const unsigned char* p = (const unsigned char*) ptr;
+	v16 needle = (v16) {} + (unsigned char) value;
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		unsigned mask = movemask(LOAD(v16, p + i) == needle);
+		if (mask)
+			return (void*) (p + i + __builtin_ctz(mask));
+	}
+	for (; i < size; i++) {
+		if (p[i] == (unsigned char) value)
+			return (void*) (p + i);
+	}
+	return NULL;
+}
+ 
+size_t strlen(const char* str) {
+	// aligned loads never cross a page boundary, so reading around the
+	// string can't fault
+	uintptr_t p = (uintptr_t) str & ~(uintptr_t) 15;
+	v16 zero = {};
+	unsigned mask = movemask(LOAD(v16a, p) == zero) >> ((uintptr_t) str & 15);
+	if (mask)
+		return __builtin_ctz(mask);
+	for (;;) {
+		p += 16;
+		mask = movemask(LOAD(v16a, p) == zero);
+		if (mask)
+			return p + __builtin_ctz(mask) - (uintptr_t) str;
+	}
+}
@@ -3,15 +3,40 @@
  
 #include <sys/cdefs.h>
  
+#include <stdarg.h>
+#include <stddef.h>
+ 
 #define EOF (-1)
  
+#define BUFSIZ 1024
+ 
+/* buffering modes, for setvbuf */
+#define _IOFBF 0
+#define _IOLBF 1
+#define _IONBF 2
+ 
 #ifdef __cplusplus
 extern "C" {
 #endif
  
+typedef struct __FILE FILE;
+ 
+extern FILE* const stdout;
+extern FILE* const stderr;
+ 
 int printf(const char* __restrict, ...);
+int vprintf(const char* __restrict, va_list);
+int fprintf(FILE* __restrict, const char* __restrict, ...);
+int vfprintf(FILE* __restrict, const char* __restrict, va_list);
+int snprintf(char* __restrict, size_t, const char* __restrict, ...);
+int vsnprintf(char* __restrict, size_t, const char* __restrict, va_list);
 int putchar(int);
 int puts(const char*);
+int fputc(int, FILE*);
+int fputs(const char* __restrict, FILE* __restrict);
+size_t fwrite(const void* __restrict, size_t, size_t, FILE* __restrict);
+int fflush(FILE*);
+int setvbuf(FILE* __restrict, char* __restrict, int, size_t);
  
 #ifdef __cplusplus
 }
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+#include "file.h"
+ 
+#if defined(__is_libk)
+#include <kernel/tty.h>
+#endif
+ 
+static int terminal_stream_write(FILE* stream, const char* data, size_t length) {
+	(void) stream;
+#if defined(__is_libk)
+	terminal_write(data, length);
+	return 1;
+#else
+	// TODO: Implement the write system call.
+	(void) data;
+	(void) length;
+	return 0;
+#endif
+}
+ 
+static char stdout_buffer[BUFSIZ];
+ 
+static FILE stdout_file = {
+	.buffer = stdout_buffer,
+	.size = sizeof(stdout_buffer),
+	.mode = _IOLBF,
+	.write = terminal_stream_write,
+};
+ 
+static FILE stderr_file = {
+	.mode = _IONBF,
+	.write = terminal_stream_write,
+};
+ 
+FILE* const stdout = &stdout_file;
+FILE* const stderr = &stderr_file;
+ 
+int fflush(FILE* stream) {
+	if (!stream) {
+		fflush(stdout);
+		return fflush(stderr);
+	}
+	if (stream->length) {
+		size_t length = stream->length;
+		stream->length = 0;
+		if (!stream->write(stream, stream->buffer, length)) {
+			stream->error = 1;
+			return EOF;
+		}
+	}
+	return 0;
+}
+ 
+int __fwrite(FILE* stream, const char* data, size_t length) {
+	if (stream->mode == _IONBF || !stream->size) {
+		if (!stream->write(stream, data, length)) {
+			stream->error = 1;
+			return 0;
+		}
+		return 1;
+	}
+	int newline = stream->mode == _IOLBF && memchr(data, '\n', length);
+	while (length) {
+		size_t room = stream->size - stream->length;
+		if (!room) {
+			if (fflush(stream) == EOF)
+				return 0;
+			continue;
+		}
+		size_t chunk = length < room ? length : room;
+		memcpy(stream->buffer + stream->length, data, chunk);
+		stream->length += chunk;
+		data += chunk;
+		length -= chunk;
+	}
+	// line buffered: a complete line goes out now, along with anything after it
+	if (newline && fflush(stream) == EOF)
+		return 0;
+	return 1;
+}
+ 
+size_t fwrite(const void* restrict data, size_t size, size_t count, FILE* restrict stream) {
+	if (!size || !count)
+		return 0;
+	return __fwrite(stream, (const char*) data, size * count) ? count : 0;
+}
+ 
+int fputc(int ic, FILE* stream) {
+	char c = (char) ic;
+	if (stream->mode != _IONBF && stream->length < stream->size && c != '\n') {
+		stream->buffer[stream->length++] = c;
+		return (unsigned char) c;
+	}
+	return __fwrite(stream, &c, 1) ? (unsigned char) c : EOF;
+}
+ 
+int fputs(const char* restrict string, FILE* restrict stream) {
+	return __fwrite(stream, string, strlen(string)) ? 0 : EOF;
+}
+ 
+int setvbuf(FILE* restrict stream, char* restrict buffer, int mode, size_t size) {
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF)
+		return EOF;
+	if (fflush(stream) == EOF)
+		return EOF;
+	stream->mode = mode;
+	if (buffer) {
+		stream->buffer = buffer;
+		stream->size = size;
+	}
+	return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef _STDIO_FILE_H
+#define _STDIO_FILE_H 1
+ 
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+ 
+/* A stream: a buffer in front of a write function. */
+struct __FILE {
+	char* buffer;
+	size_t size;
+	size_t length;
+	int mode; /* _IOFBF, _IOLBF or _IONBF */
+	int error;
+	/* write all of data to the device, false on failure */
+	int (*write)(struct __FILE* stream, const char* data, size_t length);
+};
+ 
+/* buffered write, false on failure */
+int __fwrite(FILE* stream, const char* data, size_t length);
+ 
+/* Where formatted output goes: put is called with pieces of the output, and
+   returns false to stop formatting. */
+struct __printf_sink {
+	int (*put)(struct __printf_sink* sink, const char* data, size_t length);
+};
+ 
+/* Format into sink. Returns the length of the whole output, or -1 if the
+   sink gave up or the output is longer than INT_MAX. */
+int __vformat(struct __printf_sink* sink, const char* format, va_list parameters);
+ 
+#endif
@@ -1,80 +1,37 @@
-#include <limits.h>
-#include <stdbool.h>
 #include <stdarg.h>
 #include <stdio.h>
-#include <string.h>
+#include "file.h"
  
-static bool print(const char* data, size_t length) {
-	const unsigned char* bytes = (const unsigned char*) data;
-	for (size_t i = 0; i < length; i++)
-		if (putchar(bytes[i]) == EOF)
-			return false;
-	return true;
+struct file_sink {
+	struct __printf_sink sink;
+	FILE* stream;
+};
+ 
+static int file_put(struct __printf_sink* sink, const char* data, size_t length) {
+	return __fwrite(((struct file_sink*) sink)->stream, data, length);
 }
  
-int printf(const char* restrict format, ...) {
+int vfprintf(FILE* restrict stream, const char* restrict format, va_list parameters) {
+	struct file_sink sink = { { file_put }, stream };
+	return __vformat(&sink.sink, format, parameters);
+}
+ 
+int fprintf(FILE* restrict stream, const char* restrict format, ...) {
 	va_list parameters;
 	va_start(parameters, format);
+	int written = vfprintf(stream, format, parameters);
+	va_end(parameters);
+	return written;
+}
  
-	int written = 0;
- 
-	while (*format != '\0') {
-		size_t maxrem = INT_MAX - written;
- 
-		if (format[0] != '%' || format[1] == '%') {
-			if (format[0] == '%')
-				format++;
-			size_t amount = 1;
-			while (format[amount] && format[amount] != '%')
-				amount++;
-			if (maxrem < amount) {
-				// TODO: Set errno to EOVERFLOW.
-				return -1;
-			}
-			if (!print(format, amount))
-				return -1;
-			format += amount;
-			written += amount;
-			continue;
-		}
- 
-		const char* format_begun_at = format++;
- 
-		if (*format == 'c') {
-			format++;
-			char c = (char) va_arg(parameters, int /* char promotes to int */);
-			if (!maxrem) {
-				// TODO: Set errno to EOVERFLOW.
-				return -1;
-			}
-			if (!print(&c, sizeof(c)))
-				return -1;
-			written++;
-		} else if (*format == 's') {
-			format++;
-			const char* str = va_arg(parameters, const char*);
-			size_t len = strlen(str);
-			if (maxrem < len) {
-				// TODO: Set errno to EOVERFLOW.
-				return -1;
-			}
-			if (!print(str, len))
-				return -1;
-			written += len;
-		} else {
-			format = format_begun_at;
-			size_t len = strlen(format);
-			if (maxrem < len) {
-				// TODO: Set errno to EOVERFLOW.
-				return -1;
-			}
-			if (!print(format, len))
-				return -1;
-			written += len;
-			format += len;
-		}
-	}
+int vprintf(const char* restrict format, va_list parameters) {
+	return vfprintf(stdout, format, parameters);
+}
  
+int printf(const char* restrict format, ...) {
+	va_list parameters;
+	va_start(parameters, format);
+	int written = vfprintf(stdout, format, parameters);
 	va_end(parameters);
 	return written;
-}
\ No newline at end of file
+}
@@ -1,15 +1,5 @@
 #include <stdio.h>
  
-#if defined(__is_libk)
-#include <kernel/tty.h>
-#endif
- 
 int putchar(int ic) {
-#if defined(__is_libk)
-	char c = (char) ic;
-	terminal_write(&c, sizeof(c));
-#else
-	// TODO: Implement stdio and the write system call.
-#endif
-	return ic;
-}
\ No newline at end of file
+	return fputc(ic, stdout);
+}
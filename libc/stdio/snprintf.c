@@ -0,0 +1,38 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "file.h"
+ 
+/* Formats into memory, nothing else is touched. Output past size - 1 is
+   dropped, but still counted in the return value. */
+ 
+struct string_sink {
+	struct __printf_sink sink;
+	char* buffer;
+	size_t room; /* not counting the terminator */
+};
+ 
+static int string_put(struct __printf_sink* sink, const char* data, size_t length) {
+	struct string_sink* string = (struct string_sink*) sink;
+	size_t chunk = length < string->room ? length : string->room;
+	memcpy(string->buffer, data, chunk);
+	string->buffer += chunk;
+	string->room -= chunk;
+	return 1;
+}
+ 
+int vsnprintf(char* restrict buffer, size_t size, const char* restrict format, va_list parameters) {
+	struct string_sink sink = { { string_put }, buffer, size ? size - 1 : 0 };
+	int written = __vformat(&sink.sink, format, parameters);
+	if (size)
+		*sink.buffer = '\0';
+	return written;
+}
+ 
+int snprintf(char* restrict buffer, size_t size, const char* restrict format, ...) {
+	va_list parameters;
+	va_start(parameters, format);
+	int written = vsnprintf(buffer, size, format, parameters);
+	va_end(parameters);
+	return written;
+}
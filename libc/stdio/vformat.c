@@ -0,0 +1,166 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "file.h"
+ 
+/* Conversions: %c %s %d %i %u %x %X %p %%, flags '-' and '0', a width,
+   and the h, hh, l, ll, z, j, t length modifiers. */
+ 
+struct output {
+	struct __printf_sink* sink;
+	size_t written;
+	bool failed;
+};
+ 
+static void emit(struct output* out, const char* data, size_t length) {
+	if (!length || out->failed)
+		return;
+	if (!out->sink->put(out->sink, data, length))
+		out->failed = true;
+	out->written += length;
+}
+ 
+static void pad(struct output* out, char c, int count) {
+	static const char spaces[16] = "                ";
+	static const char zeros[16] = "0000000000000000";
+	while (count > 0) {
+		int chunk = count < 16 ? count : 16;
+		emit(out, c == '0' ? zeros : spaces, chunk);
+		count -= chunk;
+	}
+}
+ 
+static char* format_unsigned(char* end, uintmax_t value, unsigned base, bool upper) {
+	const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char* p = end;
+	do {
+		*--p = digits[value % base];
+		value /= base;
+	} while (value);
+	return p;
+}
+ 
+int __vformat(struct __printf_sink* sink, const char* format, va_list parameters) {
+	struct output out = { .sink = sink };
+	while (*format) {
+		if (*format != '%' || format[1] == '%') {
+			if (*format == '%')
+				format++;
+			size_t amount = 1;
+			while (format[amount] && format[amount] != '%')
+				amount++;
+			emit(&out, format, amount);
+			format += amount;
+			continue;
+		}
+		const char* format_begun_at = format++;
+		bool left = false, zero = false;
+		for (;; format++) {
+			if (*format == '-')
+				left = true;
+			else if (*format == '0')
+				zero = true;
+			else
+				break;
+		}
+		int width = 0;
+		if (*format == '*') {
+			width = va_arg(parameters, int);
+			if (width < 0) {
+				left = true;
+				width = -width;
+			}
+			format++;
+		}
+		while (*format >= '0' && *format <= '9')
+			width = width * 10 + *format++ - '0';
+		/* -2: char, -1: short, 0: int, 1: long, 2: long long / intmax_t / size_t */
+		int size = 0;
+		while (*format == 'h' || *format == 'l' || *format == 'z' || *format == 'j' || *format == 't') {
+			if (*format == 'l')
+				size++;
+			else if (*format == 'h')
+				size--;
+			else
+				size = 2;
+			format++;
+		}
+ 
+		char digits[24];
+		char* const end = digits + sizeof(digits);
+		const char* text = NULL;
+		size_t length = 0;
+		const char* prefix = "";
+		bool numeric = true;
+		uintmax_t value;
+		switch (*format) {
+		case 'c':
+			digits[0] = (char) va_arg(parameters, int /* char promotes to int */);
+			text = digits;
+			length = 1;
+			numeric = false;
+			break;
+		case 's':
+			text = va_arg(parameters, const char*);
+			if (!text)
+				text = "(null)";
+			length = strlen(text);
+			numeric = false;
+			break;
+		case 'd':
+		case 'i': {
+			intmax_t number = size <= 0 ? va_arg(parameters, int) :
+				size == 1 ? va_arg(parameters, long) : va_arg(parameters, long long);
+			/* short and char promote to int: back to what was passed */
+			if (size == -1)
+				number = (short) number;
+			else if (size < -1)
+				number = (signed char) number;
+			if (number < 0)
+				prefix = "-";
+			text = format_unsigned(end, number < 0 ? -(uintmax_t) number : (uintmax_t) number, 10, false);
+			break;
+		}
+		case 'u':
+		case 'x':
+		case 'X':
+			value = size <= 0 ? va_arg(parameters, unsigned int) :
+				size == 1 ? va_arg(parameters, unsigned long) : va_arg(parameters, unsigned long long);
+			if (size == -1)
+				value = (unsigned short) value;
+			else if (size < -1)
+				value = (unsigned char) value;
+			text = format_unsigned(end, value, *format == 'u' ? 10 : 16, *format == 'X');
+			break;
+		case 'p':
+			text = format_unsigned(end, (uintptr_t) va_arg(parameters, void*), 16, false);
+			prefix = "0x";
+			break;
+		default:
+			// unknown conversion: print the rest of the format as it is
+			format = format_begun_at;
+			length = strlen(format);
+			emit(&out, format, length);
+			format += length;
+			continue;
+		}
+		format++;
+		if (numeric)
+			length = end - text;
+		int padding = width - (int) (strlen(prefix) + length);
+		if (!left && !(zero && numeric))
+			pad(&out, ' ', padding);
+		emit(&out, prefix, strlen(prefix));
+		if (!left && zero && numeric)
+			pad(&out, '0', padding);
+		emit(&out, text, length);
+		if (left)
+			pad(&out, ' ', padding);
+	}
+	if (out.failed || out.written > INT_MAX) {
+		// TODO: Set errno to EOVERFLOW.
+		return -1;
+	}
+	return (int) out.written;
+}
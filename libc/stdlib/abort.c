@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
  
+#if defined(__is_libk)
+#include <kernel/tty.h>
+#endif
+ 
 #ifdef __cplusplus
 [[ noreturn ]]
 #else
@@ -10,6 +14,8 @@ void abort(void) {
 #if defined(__is_libk)
 	// TODO: Add proper kernel panic.
 	printf("kernel: panic: abort()\n");
+	fflush(NULL);
+	terminal_flush();
 #else
 	// TODO: Abnormally terminate the process as if by SIGABRT.
 	printf("abort()\n");
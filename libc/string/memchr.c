@@ -0,0 +1,9 @@
+#include <string.h>
+ 
+void* memchr(const void* ptr, int value, size_t size) {
+	const unsigned char* bytes = (const unsigned char*) ptr;
+	for (size_t i = 0; i < size; i++)
+		if (bytes[i] == (unsigned char) value)
+			return (void*) (bytes + i);
+	return NULL;
+}
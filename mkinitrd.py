@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+# Packs a directory into the initrd: a plain ustar archive, except that the
+# contents of every file start on a page boundary, so that the kernel can
+# map them into processes straight from the module (kernel/initrd.hpp).
+# The padding is a pax extended header holding a comment, which tar and
+# the kernel both skip.
+#
+# usage: mkinitrd.py output.tar [directory]
+
+import os
+import sys
+
+BLOCK = 512
+PAGE = 4096
+
+
+def header(name, size, kind, mode=0o644):
+    prefix = ''
+    if len(name) > 100:
+        split = name.rfind('/', 0, 156)
+        if split < 0 or len(name) - split - 1 > 100:
+            sys.exit('mkinitrd: path too long for ustar: ' + name)
+        prefix, name = name[:split], name[split + 1:]
+    fields = [
+        name.encode().ljust(100, b'\0'),
+        b'%07o\0' % mode,
+        b'%07o\0' % 0,
+        b'%07o\0' % 0,
+        b'%011o\0' % size,
+        b'%011o\0' % 0,
+        b' ' * 8,
+        kind,
+        b'\0' * 100,
+        b'ustar\0', b'00',
+        b'\0' * 32, b'\0' * 32,
+        b'%07o\0' % 0, b'%07o\0' % 0,
+        prefix.encode().ljust(155, b'\0'),
+        b'\0' * 12,
+    ]
+    block = bytearray(b''.join(fields))
+    block[148:156] = b'%06o\0 ' % sum(block)
+    return bytes(block)
+
+
+# a pax record, "<length> comment=<text>\n" with length counting itself,
+# of exactly size bytes. The sizes used here all have 3 or 4 digits
+def comment(size):
+    return (b'%d comment=' % size).ljust(size - 1, b'.') + b'\n'
+
+
+# what goes at offset so that the data after the next header is page aligned
+def padding(offset):
+    blocks = (PAGE - (offset + BLOCK) % PAGE) % PAGE // BLOCK
+    if not blocks:
+        return b''
+    size = (blocks - 1) * BLOCK
+    return header('pad', size, b'x') + (comment(size) if size else b'')
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit('usage: mkinitrd.py output.tar [directory]')
+    root = sys.argv[2] if len(sys.argv) == 3 else 'initrd'
+    out = bytearray()
+    if os.path.isdir(root):
+        for directory, subdirectories, files in os.walk(root):
+            subdirectories.sort()
+            for name in sorted(files):
+                path = os.path.join(directory, name)
+                with open(path, 'rb') as f:
+                    data = f.read()
+                out += padding(len(out))
+                mode = 0o755 if os.access(path, os.X_OK) else 0o644
+                out += header(os.path.relpath(path, root), len(data), b'0', mode)
+                assert len(out) % PAGE == 0
+                out += data.ljust((len(data) + BLOCK - 1) // BLOCK * BLOCK, b'\0')
+    out += b'\0' * (2 * BLOCK)
+    with open(sys.argv[1], 'wb') as f:
+        f.write(out)
+
+
+main()
@@ -2,4 +2,4 @@
 set -e
 . ./iso.sh
  
-qemu-system-$(./target-triplet-to-arch.sh $HOST) -cdrom boot.iso
\ No newline at end of file
+qemu-system-$(./target-triplet-to-arch.sh $HOST) -cdrom boot.iso -serial stdio
\ No newline at end of file